@@ -11,6 +11,7 @@
 #include "User.h"
 
 #ifdef MURMUR
+#include "ACLCache.h"
 #include "ServerUser.h"
 #endif
 
@@ -40,94 +41,19 @@ bool ChanACL::hasPermission(ServerUser *p, Channel *chan, QFlags<Perm> perm, ACL
 }
 
 // Return effective permissions.
+// The ACLs of the channel and its parents are compiled into an
+// ACLProgram; with a cache, both the program and the result are kept.
 QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan, ACLCache *cache) {
 	// Superuser
 	if (p->iId == 0) {
 		return static_cast<Permissions>(All &~ (Speak|Whisper));
 	}
 
-	Permissions granted = 0;
+	if (cache)
+		return cache->permissions(p, chan);
 
-	if (cache) {
-		QHash<Channel *, Permissions> *h = cache->value(p);
-		if (h)
-			granted = h->value(chan);
-	}
-
-	if (granted & Cached) {
-		return granted;
-	}
-
-	QStack<Channel *> chanstack;
-	Channel *ch = chan;
-
-	while (ch) {
-		chanstack.push(ch);
-		ch = ch->cParent;
-	}
-
-	// Default permissions
-	Permissions def = Traverse | Enter | Speak | Whisper | TextMessage;
-
-	granted = def;
-
-	bool traverse = true;
-	bool write = false;
-	ChanACL *acl;
-
-	while (! chanstack.isEmpty()) {
-		ch = chanstack.pop();
-		if (! ch->bInheritACL)
-			granted = def;
-
-		foreach(acl, ch->qlACL) {
-			bool matchUser = (acl->iUserId != -1) && (acl->iUserId == p->iId);
-			bool matchGroup = Group::isMember(chan, ch, acl->qsGroup, p);
-			if (matchUser || matchGroup) {
-				if (acl->pAllow & Traverse)
-					traverse = true;
-				if (acl->pDeny & Traverse)
-					traverse = false;
-				if (acl->pAllow & Write)
-					write = true;
-				if (acl->pDeny & Write)
-					write = false;
-				if (ch->iId == 0 && chan == ch && acl->bApplyHere) {
-					if (acl->pAllow & Kick)
-						granted |= Kick;
-					if (acl->pAllow & Ban)
-						granted |= Ban;
-					if (acl->pAllow & Register)
-						granted |= Register;
-					if (acl->pAllow & SelfRegister)
-						granted |= SelfRegister;
-				}
-				if ((ch==chan && acl->bApplyHere) || (ch!=chan && acl->bApplySubs)) {
-					granted |= (acl->pAllow & ~(Kick|Ban|Register|SelfRegister|Cached));
-					granted &= ~acl->pDeny;
-				}
-			}
-		}
-		if (! traverse && ! write) {
-			granted = None;
-			break;
-		}
-	}
-
-	if (granted & Write) {
-		granted |= Traverse|Enter|MuteDeafen|Move|MakeChannel|LinkChannel|TextMessage|MakeTempChannel;
-		if (chan->iId == 0)
-			granted |= Kick|Ban|Register|SelfRegister;
-	}
-
-	if (cache) {
-		if (! cache->contains(p))
-			cache->insert(p, new QHash<Channel *, Permissions>);
-
-		cache->value(p)->insert(chan, granted | Cached);
-	}
-
-	return granted;
+	ACLProgram prog(chan);
+	return prog.evaluate(p);
 }
 
 #else
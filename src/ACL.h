@@ -12,6 +12,7 @@
 class Channel;
 class User;
 class ServerUser;
+class ACLCache;
 
 class ChanACL : public QObject {
 	private:
@@ -44,9 +45,6 @@ class ChanACL : public QObject {
 
 		Q_DECLARE_FLAGS(Permissions, Perm)
 
-		typedef QHash<Channel *, Permissions> ChanCache;
-		typedef QHash<User *, ChanCache * > ACLCache;
-
 		Channel *c;
 		bool bApplyHere;
 		bool bApplySubs;
@@ -10,6 +10,10 @@
 #include "Group.h"
 #include "ACL.h"
 
+#ifdef MURMUR
+#include "ChannelIndex.h"
+#endif
+
 #ifdef MUMBLE
 QHash<int, Channel *> Channel::c_qhChannels;
 QReadWriteLock Channel::c_qrwlChannels;
@@ -22,6 +26,10 @@ Channel::Channel(int id, const QString &name, QObject *p) : QObject(p) {
 	bInheritACL = true;
 	uiMaxUsers = 0;
 	bTemporary = false;
+#ifdef MURMUR
+	ciIndex = NULL;
+	uiTourFirst = uiTourLast = 0;
+#endif
 	cParent = qobject_cast<Channel *>(p);
 	if (cParent)
 		cParent->addChannel(this);
@@ -47,6 +55,11 @@ Channel::~Channel() {
 
 	Q_ASSERT(qlChannels.count() == 0);
 	Q_ASSERT(children().count() == 0);
+
+#ifdef MURMUR
+	if (ciIndex && (ciIndex->root() == this))
+		delete ciIndex;
+#endif
 }
 
 #ifdef MUMBLE
@@ -90,6 +103,11 @@ void Channel::link(Channel *l) {
 	qhLinks[l]++;
 	l->qsPermLinks.insert(this);
 	l->qhLinks[this]++;
+#ifdef MURMUR
+	ChannelIndex *ci = ciIndex ? ciIndex : l->ciIndex;
+	if (ci)
+		ci->channelsLinked(this, l);
+#endif
 }
 
 void Channel::unlink(Channel *l) {
@@ -98,6 +116,11 @@ void Channel::unlink(Channel *l) {
 		qhLinks.remove(l);
 		l->qsPermLinks.remove(this);
 		l->qhLinks.remove(this);
+#ifdef MURMUR
+		ChannelIndex *ci = ciIndex ? ciIndex : l->ciIndex;
+		if (ci)
+			ci->channelsUnlinked(this, l);
+#endif
 	} else {
 		foreach(Channel *c, qhLinks.keys())
 			unlink(c);
@@ -110,6 +133,11 @@ QSet<Channel *> Channel::allLinks() {
 	if (qhLinks.isEmpty())
 		return seen;
 
+#ifdef MURMUR
+	if (ciIndex)
+		return ciIndex->links(this);
+#endif
+
 	QStack<Channel *> stack;
 	stack.push(this);
 
@@ -126,6 +154,11 @@ QSet<Channel *> Channel::allLinks() {
 }
 
 QSet<Channel *> Channel::allChildren() {
+#ifdef MURMUR
+	if (ciIndex)
+		return ciIndex->children(this);
+#endif
+
 	QSet<Channel *> seen;
 	if (! qlChannels.isEmpty()) {
 		QStack<Channel *> stack;
@@ -147,9 +180,17 @@ void Channel::addChannel(Channel *c) {
 	c->cParent = this;
 	c->setParent(this);
 	qlChannels << c;
+#ifdef MURMUR
+	if (ciIndex)
+		ciIndex->channelAdded(c);
+#endif
 }
 
 void Channel::removeChannel(Channel *c) {
+#ifdef MURMUR
+	if (c->ciIndex)
+		c->ciIndex->channelRemoved(c);
+#endif
 	c->cParent = NULL;
 	c->setParent(NULL);
 	qlChannels.removeAll(c);
@@ -159,13 +200,46 @@ void Channel::addUser(User *p) {
 	if (p->cChannel)
 		p->cChannel->removeUser(p);
 	p->cChannel = this;
+#ifdef MURMUR
+	qhUserPositions.insert(p, qlUsers.count());
+#endif
 	qlUsers << p;
 }
 
 void Channel::removeUser(User *p) {
+#ifdef MURMUR
+	// Move the last user into the gap, so removal doesn't depend on
+	// the number of users. The order of qlUsers carries no meaning.
+	QHash<User *, int>::iterator i = qhUserPositions.find(p);
+	if (i == qhUserPositions.end())
+		return;
+
+	const int pos = i.value();
+	qhUserPositions.erase(i);
+
+	User *last = qlUsers.last();
+	if (last != p) {
+		qlUsers[pos] = last;
+		qhUserPositions.insert(last, pos);
+	}
+	qlUsers.removeLast();
+#else
 	qlUsers.removeAll(p);
+#endif
 }
 
+#ifdef MURMUR
+bool Channel::contains(const Channel *c) const {
+	if (ciIndex)
+		return ciIndex->contains(this, c);
+
+	for (; c; c = c->cParent)
+		if (c == this)
+			return true;
+	return false;
+}
+#endif
+
 Channel::operator QString() const {
 	return QString::fromLatin1("%1[%2:%3%4]").arg(qsName,
 	        QString::number(iId),
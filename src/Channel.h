@@ -18,6 +18,7 @@ class Group;
 class ChanACL;
 
 class ClientUser;
+class ChannelIndex;
 
 class Channel : public QObject {
 	private:
@@ -65,6 +66,21 @@ class Channel : public QObject {
 
 		void addClientUser(ClientUser *p);
 #endif
+
+#ifdef MURMUR
+		/// Index of the tree the channel is in, or NULL while it
+		/// isn't in one.
+		ChannelIndex *ciIndex;
+		/// Numbers of the channel and its last descendant in ciIndex.
+		quint64 uiTourFirst, uiTourLast;
+		/// Positions of the users in qlUsers.
+		QHash<User *, int> qhUserPositions;
+
+		/// Whether c is this channel or one of its subchannels, at
+		/// any depth.
+		bool contains(const Channel *c) const;
+#endif
+
 		static bool lessThan(const Channel *, const Channel *);
 
 		size_t getLevel() const;
@@ -193,6 +193,10 @@ void Connection::forceFlush() {
 	setsockopt(static_cast<int>(qtsSocket->socketDescriptor()), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char *>(&nodelay), static_cast<socklen_t>(sizeof(nodelay)));
 }
 
+qint64 Connection::bytesToWrite() const {
+	return qtsSocket->bytesToWrite();
+}
+
 void Connection::disconnectSocket(bool force) {
 	if (qtsSocket->state() == QAbstractSocket::UnconnectedState) {
 		emit connectionClosed(QAbstractSocket::UnknownSocketError, QString());
@@ -65,6 +65,8 @@ class Connection : public QObject {
 		void sendMessage(const QByteArray &qbaMsg);
 		void disconnectSocket(bool force=false);
 		void forceFlush();
+		/// Number of bytes waiting to be written to the socket.
+		qint64 bytesToWrite() const;
 		qint64 activityTime() const;
 		void resetActivityTime();
 
@@ -10,6 +10,11 @@
  * Mumble is BSD (revised) licensed, meaning you can use the code in a
  * closed-source program. If you do, you'll have to either replace
  * OCB with something else or get yourself a license.
+ *
+ * On x86 CPUs with AES-NI, OCB is computed with the AES instructions,
+ * encrypting up to AESNI_PARALLEL blocks at once so that the rounds of
+ * independent blocks overlap in the pipeline. OpenSSL's AES_encrypt()
+ * is the fallback. Both produce identical output.
  */
 
 #include "murmur_pch.h"
@@ -18,6 +23,78 @@
 
 #include "ByteSwap.h"
 
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && \
+    (defined(_MSC_VER) || defined(__clang__) || (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define CRYPT_AESNI
+
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AESNI_TARGET
+#else
+#include <cpuid.h>
+// Compile the AES-NI code for AES-NI regardless of the target CPU;
+// it only runs if the CPU supports it.
+#define AESNI_TARGET __attribute__((target("sse2,ssse3,aes")))
+#endif
+
+// Number of blocks encrypted or decrypted at once.
+#define AESNI_PARALLEL 8
+
+static bool aesni_supported() {
+#ifdef _MSC_VER
+	int cpuinfo[4];
+	__cpuid(cpuinfo, 1);
+	return (cpuinfo[2] & (1 << 25)) && (cpuinfo[2] & (1 << 9)) && (cpuinfo[3] & (1 << 26));
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (! __get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & bit_AES) && (ecx & bit_SSSE3) && (edx & bit_SSE2);
+#endif
+}
+
+static const bool bHaveAESNI = aesni_supported();
+bool CryptState::bAESNI = bHaveAESNI;
+
+AESNI_TARGET static inline __m128i aesni_key_step(__m128i key, __m128i assist) {
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+// Expand a 128 bit key into encryption round keys, and the matching
+// round keys for the equivalent inverse cipher used by AESDEC.
+AESNI_TARGET static void aesni_expand_key(const unsigned char *raw, unsigned char *enc, unsigned char *dec) {
+	__m128i rk[11];
+
+	rk[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw));
+	rk[1] = aesni_key_step(rk[0], _mm_aeskeygenassist_si128(rk[0], 0x01));
+	rk[2] = aesni_key_step(rk[1], _mm_aeskeygenassist_si128(rk[1], 0x02));
+	rk[3] = aesni_key_step(rk[2], _mm_aeskeygenassist_si128(rk[2], 0x04));
+	rk[4] = aesni_key_step(rk[3], _mm_aeskeygenassist_si128(rk[3], 0x08));
+	rk[5] = aesni_key_step(rk[4], _mm_aeskeygenassist_si128(rk[4], 0x10));
+	rk[6] = aesni_key_step(rk[5], _mm_aeskeygenassist_si128(rk[5], 0x20));
+	rk[7] = aesni_key_step(rk[6], _mm_aeskeygenassist_si128(rk[6], 0x40));
+	rk[8] = aesni_key_step(rk[7], _mm_aeskeygenassist_si128(rk[7], 0x80));
+	rk[9] = aesni_key_step(rk[8], _mm_aeskeygenassist_si128(rk[8], 0x1b));
+	rk[10] = aesni_key_step(rk[9], _mm_aeskeygenassist_si128(rk[9], 0x36));
+
+	for (int i=0;i<11;i++) {
+		__m128i d = ((i == 0) || (i == 10)) ? rk[10 - i] : _mm_aesimc_si128(rk[10 - i]);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(enc + i * AES_BLOCK_SIZE), rk[i]);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dec + i * AES_BLOCK_SIZE), d);
+	}
+}
+#else
+bool CryptState::bAESNI = false;
+#endif
+
 CryptState::CryptState() {
 	for (int i=0;i<0x100;i++)
 		decrypt_history[i] = 0;
@@ -39,6 +116,10 @@ void CryptState::genKey() {
 	RAND_bytes(decrypt_iv, AES_BLOCK_SIZE);
 	AES_set_encrypt_key(raw_key, AES_KEY_SIZE_BITS, &encrypt_key);
 	AES_set_decrypt_key(raw_key, AES_KEY_SIZE_BITS, &decrypt_key);
+#ifdef CRYPT_AESNI
+	if (bHaveAESNI)
+		aesni_expand_key(raw_key, aesni_encrypt_key, aesni_decrypt_key);
+#endif
 	bInit = true;
 }
 
@@ -48,6 +129,10 @@ void CryptState::setKey(const unsigned char *rkey, const unsigned char *eiv, con
 	memcpy(decrypt_iv, div, AES_BLOCK_SIZE);
 	AES_set_encrypt_key(raw_key, AES_KEY_SIZE_BITS, &encrypt_key);
 	AES_set_decrypt_key(raw_key, AES_KEY_SIZE_BITS, &decrypt_key);
+#ifdef CRYPT_AESNI
+	if (bHaveAESNI)
+		aesni_expand_key(raw_key, aesni_encrypt_key, aesni_decrypt_key);
+#endif
 	bInit = true;
 }
 
@@ -55,13 +140,17 @@ void CryptState::setDecryptIV(const unsigned char *iv) {
 	memcpy(decrypt_iv, iv, AES_BLOCK_SIZE);
 }
 
+static inline void incrementIV(unsigned char *iv) {
+	for (int i=0;i<AES_BLOCK_SIZE;i++)
+		if (++iv[i])
+			break;
+}
+
 void CryptState::encrypt(const unsigned char *source, unsigned char *dst, unsigned int plain_length) {
 	unsigned char tag[AES_BLOCK_SIZE];
 
 	// First, increase our IV.
-	for (int i=0;i<AES_BLOCK_SIZE;i++)
-		if (++encrypt_iv[i])
-			break;
+	incrementIV(encrypt_iv);
 
 	ocb_encrypt(source, dst+4, plain_length, encrypt_iv, tag);
 
@@ -208,12 +297,233 @@ static void inline ZERO(keyblock &block) {
 		block[i]=0;
 }
 
+#ifdef CRYPT_AESNI
+AESNI_TARGET static inline void aesni_load_key(const unsigned char *key, __m128i *rk) {
+	for (int i=0;i<11;i++)
+		rk[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + i * AES_BLOCK_SIZE));
+}
+
+// The blocks are independent, so the CPU can work on the same round of
+// all of them at the same time.
+AESNI_TARGET static inline void aesni_encrypt(const __m128i *rk, __m128i *blocks, unsigned int n) {
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_xor_si128(blocks[i], rk[0]);
+	for (int r=1;r<10;r++)
+		for (unsigned int i=0;i<n;i++)
+			blocks[i] = _mm_aesenc_si128(blocks[i], rk[r]);
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_aesenclast_si128(blocks[i], rk[10]);
+}
+
+AESNI_TARGET static inline void aesni_decrypt(const __m128i *rk, __m128i *blocks, unsigned int n) {
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_xor_si128(blocks[i], rk[0]);
+	for (int r=1;r<10;r++)
+		for (unsigned int i=0;i<n;i++)
+			blocks[i] = _mm_aesdec_si128(blocks[i], rk[r]);
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_aesdeclast_si128(blocks[i], rk[10]);
+}
+
+// Encrypt blocks[i] with the round keys in keys[i].
+AESNI_TARGET static inline void aesni_encrypt_multi(const unsigned char * const *keys, __m128i *blocks, unsigned int n) {
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_xor_si128(blocks[i], _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys[i])));
+	for (int r=1;r<10;r++)
+		for (unsigned int i=0;i<n;i++)
+			blocks[i] = _mm_aesenc_si128(blocks[i], _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys[i] + r * AES_BLOCK_SIZE)));
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_aesenclast_si128(blocks[i], _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys[i] + 10 * AES_BLOCK_SIZE)));
+}
+
+/*
+ * The OCB offsets are kept byte swapped, as little endian 128 bit
+ * numbers, so that S2 and S3 are a few shifts in a register instead
+ * of 64 bit arithmetic on memory.
+ */
+
+AESNI_TARGET static inline __m128i aesni_swap(__m128i block) {
+	return _mm_shuffle_epi8(block, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+AESNI_TARGET static inline __m128i aesni_S2(__m128i block) {
+	__m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(block, 0xff), 31);
+	__m128i shifted = _mm_or_si128(_mm_slli_epi64(block, 1), _mm_slli_si128(_mm_srli_epi64(block, 63), 8));
+	return _mm_xor_si128(shifted, _mm_and_si128(carry, _mm_set_epi32(0, 0, 0, 0x87)));
+}
+
+AESNI_TARGET static inline __m128i aesni_S3(__m128i block) {
+	return _mm_xor_si128(block, aesni_S2(block));
+}
+
+#define LOAD(p) _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))
+#define STORE(p,v) _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v)
+
+// Same as CryptState::ocb_encrypt(), except that the offsets for up to
+// AESNI_PARALLEL blocks are computed first, and those blocks are then
+// encrypted together.
+AESNI_TARGET static void aesni_ocb_encrypt(const unsigned char *key, const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	__m128i rk[11], blocks[AESNI_PARALLEL], deltas[AESNI_PARALLEL];
+	__m128i checksum = _mm_setzero_si128();
+	__m128i delta;
+	unsigned char tmp[AES_BLOCK_SIZE], pad[AES_BLOCK_SIZE];
+
+	aesni_load_key(key, rk);
+
+	blocks[0] = LOAD(nonce);
+	aesni_encrypt(rk, blocks, 1);
+	delta = aesni_swap(blocks[0]);
+
+	while (len > AES_BLOCK_SIZE) {
+		unsigned int n = 0;
+		while ((len > AES_BLOCK_SIZE) && (n < AESNI_PARALLEL)) {
+			__m128i p = LOAD(plain);
+			delta = aesni_S2(delta);
+			deltas[n] = aesni_swap(delta);
+			blocks[n] = _mm_xor_si128(p, deltas[n]);
+			checksum = _mm_xor_si128(checksum, p);
+			len -= AES_BLOCK_SIZE;
+			plain += AES_BLOCK_SIZE;
+			++n;
+		}
+		aesni_encrypt(rk, blocks, n);
+		for (unsigned int i=0;i<n;i++) {
+			STORE(encrypted, _mm_xor_si128(blocks[i], deltas[i]));
+			encrypted += AES_BLOCK_SIZE;
+		}
+	}
+
+	delta = aesni_S2(delta);
+	blocks[0] = aesni_swap(_mm_xor_si128(delta, _mm_cvtsi32_si128(len * 8)));
+	aesni_encrypt(rk, blocks, 1);
+	STORE(pad, blocks[0]);
+	memcpy(tmp, plain, len);
+	memcpy(tmp + len, pad + len, AES_BLOCK_SIZE - len);
+	checksum = _mm_xor_si128(checksum, LOAD(tmp));
+	STORE(tmp, _mm_xor_si128(LOAD(tmp), blocks[0]));
+	memcpy(encrypted, tmp, len);
+
+	blocks[0] = _mm_xor_si128(aesni_swap(aesni_S3(delta)), checksum);
+	aesni_encrypt(rk, blocks, 1);
+	STORE(tag, blocks[0]);
+}
+
+AESNI_TARGET static void aesni_ocb_decrypt(const unsigned char *enckey, const unsigned char *deckey, const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	__m128i ek[11], dk[11], blocks[AESNI_PARALLEL], deltas[AESNI_PARALLEL];
+	__m128i checksum = _mm_setzero_si128();
+	__m128i delta;
+	unsigned char tmp[AES_BLOCK_SIZE];
+
+	aesni_load_key(enckey, ek);
+	aesni_load_key(deckey, dk);
+
+	blocks[0] = LOAD(nonce);
+	aesni_encrypt(ek, blocks, 1);
+	delta = aesni_swap(blocks[0]);
+
+	while (len > AES_BLOCK_SIZE) {
+		unsigned int n = 0;
+		while ((len > AES_BLOCK_SIZE) && (n < AESNI_PARALLEL)) {
+			delta = aesni_S2(delta);
+			deltas[n] = aesni_swap(delta);
+			blocks[n] = _mm_xor_si128(LOAD(encrypted), deltas[n]);
+			len -= AES_BLOCK_SIZE;
+			encrypted += AES_BLOCK_SIZE;
+			++n;
+		}
+		aesni_decrypt(dk, blocks, n);
+		for (unsigned int i=0;i<n;i++) {
+			__m128i p = _mm_xor_si128(blocks[i], deltas[i]);
+			checksum = _mm_xor_si128(checksum, p);
+			STORE(plain, p);
+			plain += AES_BLOCK_SIZE;
+		}
+	}
+
+	delta = aesni_S2(delta);
+	blocks[0] = aesni_swap(_mm_xor_si128(delta, _mm_cvtsi32_si128(len * 8)));
+	aesni_encrypt(ek, blocks, 1);
+	memset(tmp, 0, AES_BLOCK_SIZE);
+	memcpy(tmp, encrypted, len);
+	STORE(tmp, _mm_xor_si128(LOAD(tmp), blocks[0]));
+	checksum = _mm_xor_si128(checksum, LOAD(tmp));
+	memcpy(plain, tmp, len);
+
+	blocks[0] = _mm_xor_si128(aesni_swap(aesni_S3(delta)), checksum);
+	aesni_encrypt(ek, blocks, 1);
+	STORE(tag, blocks[0]);
+}
+
+// OCB-encrypt the same plaintext under n <= AESNI_PARALLEL different
+// keys and nonces. Every AES step is done for all keys at once.
+AESNI_TARGET static void aesni_ocb_encrypt_multi(const unsigned char * const *keys, const unsigned char *plain, unsigned char * const *encrypted, unsigned int len, const unsigned char * const *nonces, unsigned char * const *tags, unsigned int n) {
+	__m128i blocks[AESNI_PARALLEL], deltas[AESNI_PARALLEL], offsets[AESNI_PARALLEL];
+	__m128i checksum = _mm_setzero_si128();
+	unsigned char tmp[AES_BLOCK_SIZE], pad[AES_BLOCK_SIZE];
+	unsigned int offset = 0;
+
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = LOAD(nonces[i]);
+	aesni_encrypt_multi(keys, blocks, n);
+	for (unsigned int i=0;i<n;i++)
+		deltas[i] = aesni_swap(blocks[i]);
+
+	while (len > AES_BLOCK_SIZE) {
+		__m128i p = LOAD(plain);
+		for (unsigned int i=0;i<n;i++) {
+			deltas[i] = aesni_S2(deltas[i]);
+			offsets[i] = aesni_swap(deltas[i]);
+			blocks[i] = _mm_xor_si128(p, offsets[i]);
+		}
+		aesni_encrypt_multi(keys, blocks, n);
+		for (unsigned int i=0;i<n;i++)
+			STORE(encrypted[i] + offset, _mm_xor_si128(blocks[i], offsets[i]));
+		// The plaintext is shared, and so is its checksum.
+		checksum = _mm_xor_si128(checksum, p);
+		len -= AES_BLOCK_SIZE;
+		plain += AES_BLOCK_SIZE;
+		offset += AES_BLOCK_SIZE;
+	}
+
+	for (unsigned int i=0;i<n;i++) {
+		deltas[i] = aesni_S2(deltas[i]);
+		blocks[i] = aesni_swap(_mm_xor_si128(deltas[i], _mm_cvtsi32_si128(len * 8)));
+	}
+	aesni_encrypt_multi(keys, blocks, n);
+	memcpy(tmp, plain, len);
+	for (unsigned int i=0;i<n;i++) {
+		STORE(pad, blocks[i]);
+		memcpy(tmp + len, pad + len, AES_BLOCK_SIZE - len);
+		// offsets[] now holds the per-key checksums.
+		offsets[i] = _mm_xor_si128(checksum, LOAD(tmp));
+		STORE(pad, _mm_xor_si128(LOAD(tmp), blocks[i]));
+		memcpy(encrypted[i] + offset, pad, len);
+	}
+
+	for (unsigned int i=0;i<n;i++)
+		blocks[i] = _mm_xor_si128(aesni_swap(aesni_S3(deltas[i])), offsets[i]);
+	aesni_encrypt_multi(keys, blocks, n);
+	for (unsigned int i=0;i<n;i++)
+		STORE(tags[i], blocks[i]);
+}
+
+#undef LOAD
+#undef STORE
+#endif
+
 #define AESencrypt(src,dst,key) AES_encrypt(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), key);
 #define AESdecrypt(src,dst,key) AES_decrypt(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), key);
 
 void CryptState::ocb_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
 	keyblock checksum, delta, tmp, pad;
 
+#ifdef CRYPT_AESNI
+	if (bAESNI) {
+		aesni_ocb_encrypt(aesni_encrypt_key, plain, encrypted, len, nonce, tag);
+		return;
+	}
+#endif
+
 	// Initialize
 	AESencrypt(nonce, delta, &encrypt_key);
 	ZERO(checksum);
@@ -248,6 +558,13 @@ void CryptState::ocb_encrypt(const unsigned char *plain, unsigned char *encrypte
 void CryptState::ocb_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
 	keyblock checksum, delta, tmp, pad;
 
+#ifdef CRYPT_AESNI
+	if (bAESNI) {
+		aesni_ocb_decrypt(aesni_encrypt_key, aesni_decrypt_key, encrypted, plain, len, nonce, tag);
+		return;
+	}
+#endif
+
 	// Initialize
 	AESencrypt(nonce, delta, &encrypt_key);
 	ZERO(checksum);
@@ -278,3 +595,44 @@ void CryptState::ocb_decrypt(const unsigned char *encrypted, unsigned char *plai
 	XOR(tmp, delta, checksum);
 	AESencrypt(tmp, tag, &encrypt_key);
 }
+
+void CryptState::encrypt(CryptState * const *states, const unsigned char *source, unsigned char * const *dst, unsigned int plain_length, unsigned int n) {
+#ifdef CRYPT_AESNI
+	if (bAESNI) {
+		const unsigned char *keys[CRYPT_MULTI_BUFFERS];
+		const unsigned char *ivs[CRYPT_MULTI_BUFFERS];
+		unsigned char *out[CRYPT_MULTI_BUFFERS];
+		unsigned char tags[CRYPT_MULTI_BUFFERS][AES_BLOCK_SIZE];
+		unsigned char *tagptrs[CRYPT_MULTI_BUFFERS];
+
+		while (n > 0) {
+			unsigned int count = qMin(n, static_cast<unsigned int>(CRYPT_MULTI_BUFFERS));
+
+			for (unsigned int i=0;i<count;i++) {
+				CryptState *cs = states[i];
+				incrementIV(cs->encrypt_iv);
+				keys[i] = cs->aesni_encrypt_key;
+				ivs[i] = cs->encrypt_iv;
+				out[i] = dst[i] + 4;
+				tagptrs[i] = tags[i];
+			}
+
+			aesni_ocb_encrypt_multi(keys, source, out, plain_length, ivs, tagptrs, count);
+
+			for (unsigned int i=0;i<count;i++) {
+				dst[i][0] = states[i]->encrypt_iv[0];
+				dst[i][1] = tags[i][0];
+				dst[i][2] = tags[i][1];
+				dst[i][3] = tags[i][2];
+			}
+
+			states += count;
+			dst += count;
+			n -= count;
+		}
+		return;
+	}
+#endif
+	for (unsigned int i=0;i<n;i++)
+		states[i]->encrypt(source, dst[i], plain_length);
+}
@@ -11,6 +11,9 @@
 #define AES_KEY_SIZE_BITS   128
 #define AES_KEY_SIZE_BYTES  (AES_KEY_SIZE_BITS/8)
 
+/// Number of CryptStates the multi-buffer encrypt() works on at once.
+#define CRYPT_MULTI_BUFFERS 8
+
 #include "Timer.h"
 
 class CryptState {
@@ -34,9 +37,19 @@ class CryptState {
 
 		AES_KEY	encrypt_key;
 		AES_KEY decrypt_key;
+		/// AES-NI round keys, expanded from raw_key when the
+		/// CPU supports AES-NI. Unaligned; 11 rounds of 16 bytes.
+		unsigned char aesni_encrypt_key[11 * AES_BLOCK_SIZE];
+		unsigned char aesni_decrypt_key[11 * AES_BLOCK_SIZE];
 		Timer tLastGood;
 		Timer tLastRequest;
 		bool bInit;
+
+		/// True if ocb_encrypt() and ocb_decrypt() use AES-NI. Set at
+		/// startup if the CPU supports it; clear it to force the
+		/// portable implementation.
+		static bool bAESNI;
+
 		CryptState();
 
 		bool isValid() const;
@@ -49,6 +62,12 @@ class CryptState {
 
 		bool decrypt(const unsigned char *source, unsigned char *dst, unsigned int crypted_length);
 		void encrypt(const unsigned char *source, unsigned char *dst, unsigned int plain_length);
+
+		/// Encrypt the same plaintext once for each of the n states into
+		/// dst[i], exactly as if encrypt() were called on each of them.
+		/// With AES-NI, the OCB computations of up to CRYPT_MULTI_BUFFERS
+		/// states run interleaved. The caller must own all the states.
+		static void encrypt(CryptState * const *states, const unsigned char *source, unsigned char * const *dst, unsigned int plain_length, unsigned int n);
 };
 
 #endif
@@ -96,69 +96,52 @@ QSet<QString> Group::groupNames(Channel *chan) {
 	return m;
 }
 
-#define RET_FALSE (invert ? true : false)
-#define RET_TRUE (invert ? false : true)
-
-bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUser *pl) {
-	Channel *p;
-	Channel *c;
-	Group *g;
-
-	bool m = false;
-	bool invert = false;
+GroupRef::GroupRef(Channel *curChan, Channel *aclChan, const QString &group) : tType(None), bInvert(false), cContext(curChan), cNeeded(NULL), iMinDepth(0), iMaxDepth(0) {
 	bool token = false;
 	bool hash = false;
-	c = curChan;
-
-	while (true) {
-		if (name.isEmpty())
-			return false;
-
-		if (name.startsWith(QChar::fromLatin1('!'))) {
-			invert = true;
-			name = name.remove(0,1);
-			continue;
-		}
-
-		if (name.startsWith(QChar::fromLatin1('~'))) {
-			c = aclChan;
-			name = name.remove(0,1);
-			continue;
-		}
-
-		if (name.startsWith(QChar::fromLatin1('#'))) {
+	int i = 0;
+
+	for (; i < group.length(); ++i) {
+		const QChar ch = group.at(i);
+		if (ch == QLatin1Char('!'))
+			bInvert = true;
+		else if (ch == QLatin1Char('~'))
+			cContext = aclChan;
+		else if (ch == QLatin1Char('#'))
 			token = true;
-			name = name.remove(0,1);
-			continue;
-		}
-		if (name.startsWith(QChar::fromLatin1('$'))) {
+		else if (ch == QLatin1Char('$'))
 			hash = true;
-			name = name.remove(0,1);
-			continue;
-		}
+		else
+			break;
+	}
 
-		break;
+	// Nothing but prefixes never matches, inverted or not.
+	if (i >= group.length()) {
+		bInvert = false;
+		return;
 	}
 
-	if (token)
-		m = pl->qslAccessTokens.contains(name, Qt::CaseInsensitive);
-	else if (hash)
-		m = pl->qsHash == name;
-	else if (name == QLatin1String("none"))
-		m = false;
-	else if (name == QLatin1String("all"))
-		m = true;
-	else if (name == QLatin1String("auth"))
-		m = (pl->iId >= 0);
-	else if (name == QLatin1String("strong"))
-		m = pl->bVerified;
-	else if (name == QLatin1String("in"))
-		m = (pl->cChannel == c);
-	else if (name == QLatin1String("out"))
-		m = !(pl->cChannel == c);
-	else if (name == QLatin1String("sub")
-			|| name.startsWith(QLatin1String("sub,"))) {
-		
+	QString name = group.mid(i);
+
+	if (token) {
+		tType = Token;
+		qsName = name;
+	} else if (hash) {
+		tType = Hash;
+		qsName = name;
+	} else if (name == QLatin1String("none")) {
+		tType = None;
+	} else if (name == QLatin1String("all")) {
+		tType = All;
+	} else if (name == QLatin1String("auth")) {
+		tType = Auth;
+	} else if (name == QLatin1String("strong")) {
+		tType = Strong;
+	} else if (name == QLatin1String("in")) {
+		tType = In;
+	} else if (name == QLatin1String("out")) {
+		tType = Out;
+	} else if (name == QLatin1String("sub") || name.startsWith(QLatin1String("sub,"))) {
 		name = name.remove(0,4);
 		int mindesc = 1;
 		int maxdesc = 1000;
@@ -174,72 +157,105 @@ bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUse
 			minpath = args[0].isEmpty() ? minpath : args[0].toInt();
 		}
 
-		Channel *home = pl->cChannel;
-		QList<Channel *> playerChain;
 		QList<Channel *> groupChain;
-
-		p = home;
-		while (p) {
-			playerChain.prepend(p);
-			p = p->cParent;
-		}
-
-		p = curChan;
+		Channel *p = curChan;
 		while (p) {
 			groupChain.prepend(p);
 			p = p->cParent;
 		}
 
-		int cofs = groupChain.indexOf(c);
+		int cofs = groupChain.indexOf(cContext);
 		Q_ASSERT(cofs != -1);
 
 		cofs += minpath;
 
+		// Past the end of the chain, no user can match.
 		if (cofs >= groupChain.count()) {
-			return RET_FALSE;
+			tType = None;
+			return;
 		} else if (cofs < 0) {
 			cofs = 0;
 		}
 
-		Channel *needed = groupChain[cofs];
-		if (playerChain.indexOf(needed) == -1) {
-			return RET_FALSE;
-		}
-
-		int mindepth = cofs + mindesc;
-		int maxdepth = cofs + maxdesc;
-
-		int pdepth = playerChain.count() - 1;
-
-		m = (pdepth >= mindepth) && (pdepth <= maxdepth);
+		tType = Sub;
+		cNeeded = groupChain[cofs];
+		iMinDepth = cofs + mindesc;
+		iMaxDepth = cofs + maxdesc;
 	} else {
-		QStack<Group *> s;
-
-		p = c;
+		tType = Named;
+		qsName = name;
 
+		Channel *p = cContext;
 		while (p) {
-			g = p->qhGroups.value(name);
+			Group *g = p->qhGroups.value(name);
 
 			if (g) {
-				if ((p != c) && ! g->bInheritable)
+				if ((p != cContext) && ! g->bInheritable)
 					break;
-				s.push(g);
+				qvChannels.prepend(p);
 				if (! g->bInherit)
 					break;
 			}
 
 			p = p->cParent;
 		}
+	}
+}
 
-		while (! s.isEmpty()) {
-			g = s.pop();
-			if (g->qsAdd.contains(pl->iId) || g->qsTemporary.contains(pl->iId) || g->qsTemporary.contains(- static_cast<int>(pl->uiSession)))
-				m = true;
-			if (g->qsRemove.contains(pl->iId))
-				m = false;
-		}
+bool GroupRef::matches(ServerUser *pl) const {
+	bool m = false;
+
+	switch (tType) {
+		case None:
+			m = false;
+			break;
+		case All:
+			m = true;
+			break;
+		case Auth:
+			m = (pl->iId >= 0);
+			break;
+		case Strong:
+			m = pl->bVerified;
+			break;
+		case In:
+			m = (pl->cChannel == cContext);
+			break;
+		case Out:
+			m = !(pl->cChannel == cContext);
+			break;
+		case Token:
+			m = pl->qslAccessTokens.contains(qsName, Qt::CaseInsensitive);
+			break;
+		case Hash:
+			m = (pl->qsHash == qsName);
+			break;
+		case Sub:
+			if (pl->cChannel && cNeeded->contains(pl->cChannel)) {
+				const int pdepth = static_cast<int>(pl->cChannel->getLevel());
+				m = (pdepth >= iMinDepth) && (pdepth <= iMaxDepth);
+			}
+			break;
+		case Named: {
+				const int session = - static_cast<int>(pl->uiSession);
+				foreach(Channel *c, qvChannels) {
+					Group *g = c->qhGroups.value(qsName);
+					if (! g)
+						continue;
+					if (g->qsAdd.contains(pl->iId) || g->qsTemporary.contains(pl->iId) || g->qsTemporary.contains(session))
+						m = true;
+					if (g->qsRemove.contains(pl->iId))
+						m = false;
+				}
+			}
+			break;
 	}
-	return invert ? !m : m;
+
+	return bInvert ? !m : m;
+}
+
+bool Group::isMember(Channel *curChan, Channel *aclChan, const QString &name, ServerUser *pl) {
+	return GroupRef(curChan, aclChan, name).matches(pl);
 }
 
 #endif
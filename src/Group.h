@@ -7,6 +7,8 @@
 #define MUMBLE_GROUP_H_
 
 #include <QtCore/QSet>
+#include <QtCore/QString>
+#include <QtCore/QVector>
 
 class Channel;
 class User;
@@ -30,8 +32,37 @@ class Group {
 		static QSet<QString> groupNames(Channel *c);
 		static Group *getGroup(Channel *c, QString name);
 
-		static bool isMember(Channel *c, Channel *aclChan, QString name, ServerUser *);
+		static bool isMember(Channel *c, Channel *aclChan, const QString &name, ServerUser *);
 #endif
 };
 
+#ifdef MURMUR
+/// A group name as used in an ACL or whisper target, with its
+/// prefixes parsed and resolved in a channel, so it can be matched
+/// against many users. Only valid while the channel tree and its
+/// groups don't change.
+class GroupRef {
+	public:
+		enum Type { None, All, Auth, Strong, In, Out, Sub, Token, Hash, Named };
+
+		Type tType;
+		bool bInvert;
+		/// Token, certificate hash or group name.
+		QString qsName;
+		/// Channel "in" and "out" compare against.
+		Channel *cContext;
+		/// Channels defining the groups a named group is made of,
+		/// outermost first. The groups themselves are looked up when
+		/// matching, as ACL edits replace them.
+		QVector<Channel *> qvChannels;
+		/// For "sub": the channel users must be in or below, and the
+		/// range of depths their channel may have.
+		Channel *cNeeded;
+		int iMinDepth, iMaxDepth;
+
+		GroupRef(Channel *curChan, Channel *aclChan, const QString &name);
+		bool matches(ServerUser *p) const;
+};
+#endif
+
 #endif
@@ -45,7 +45,10 @@
 
 class MessageHandler {
 	public:
-		enum UDPMessageType { UDPVoiceCELTAlpha, UDPPing, UDPVoiceSpeex, UDPVoiceCELTBeta, UDPVoiceOpus };
+		/// UDPVoiceAggregate holds several voice packets, each prefixed by
+		/// its length, and is only sent by servers to clients that set
+		/// Version.udp_aggregate.
+		enum UDPMessageType { UDPVoiceCELTAlpha, UDPPing, UDPVoiceSpeex, UDPVoiceCELTBeta, UDPVoiceOpus, UDPVoiceAggregate };
 
 #define MUMBLE_MH_MSG(x) x,
 		enum MessageType {
@@ -64,11 +67,20 @@ inline bool UDPMessageTypeIsValidVoicePacket(MessageHandler::UDPMessageType umt)
 		case MessageHandler::UDPVoiceOpus:
 			return true;
 		case MessageHandler::UDPPing:
+		case MessageHandler::UDPVoiceAggregate:
 			return false;
 	}
 	return false;
 }
 
+/// A UDP association datagram is sent unencrypted by clients that got a
+/// token in CryptSetup.udp_token. It consists of 4 zero bytes (so it is
+/// never mistaken for a ping reply), UDP_ASSOCIATE_MAGIC in network byte
+/// order, and the token.
+#define UDP_ASSOCIATE_SIZE 16
+#define UDP_ASSOCIATE_MAGIC 0x61737363
+#define UDP_TOKEN_SIZE 8
+
 inline QString u8(const ::std::string &str) {
 	return QString::fromUtf8(str.data(), static_cast<int>(str.length()));
 }
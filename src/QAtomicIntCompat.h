@@ -16,4 +16,23 @@ inline int QAtomicIntLoad(const QAtomicInt &ai) {
 #endif
 }
 
+// Load the value of a QAtomicInt with acquire semantics.
+inline int QAtomicIntLoadAcquire(const QAtomicInt &ai) {
+#if QT_VERSION >= 0x050000
+	return ai.loadAcquire();
+#else
+	return const_cast<QAtomicInt &>(ai).fetchAndAddAcquire(0);
+#endif
+}
+
+// Load the value of a QAtomicPointer with acquire semantics.
+template <typename T>
+inline T *QAtomicPointerLoadAcquire(const QAtomicPointer<T> &ap) {
+#if QT_VERSION >= 0x050000
+	return ap.loadAcquire();
+#else
+	return const_cast<QAtomicPointer<T> &>(ap).fetchAndAddAcquire(0);
+#endif
+}
+
 #endif
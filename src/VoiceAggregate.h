@@ -0,0 +1,82 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_VOICEAGGREGATE_H_
+#define MUMBLE_VOICEAGGREGATE_H_
+
+#include "Message.h"
+#include "PacketDataStream.h"
+
+/// Largest UDPVoiceAggregate, which is the largest voice datagram.
+#define VOICE_AGGREGATE_SIZE 1024
+
+/// A UDPVoiceAggregate: its header byte, followed by voice packets each
+/// prefixed by its length as a PacketDataStream integer. Built by the
+/// server (see Server::aggregateBatch()) and split by the client (see
+/// ServerHandler::handleAggregatePacket()).
+struct VoiceAggregate {
+	int iFrames;
+	int iLength;
+	/// Length of the last voice packet added.
+	int iLastLength;
+	char data[VOICE_AGGREGATE_SIZE];
+
+	void clear() {
+		iFrames = 0;
+		iLength = 1;
+		iLastLength = 0;
+		data[0] = static_cast<char>(MessageHandler::UDPVoiceAggregate << 5);
+	}
+
+	/// Whether a voice packet of len bytes fits into an empty aggregate,
+	/// with the header byte and a 2 byte length.
+	static bool fits(int len) {
+		return len + 3 <= VOICE_AGGREGATE_SIZE;
+	}
+
+	/// Append the voice packet of len bytes at packet. Returns false, and
+	/// leaves the aggregate as it was, if it doesn't fit anymore.
+	bool add(const char *packet, int len) {
+		if (iLength + len + 2 > VOICE_AGGREGATE_SIZE)
+			return false;
+
+		PacketDataStream pds(data + iLength, VOICE_AGGREGATE_SIZE - iLength);
+		pds << len;
+		pds.append(packet, len);
+
+		iLength += pds.size();
+		iLastLength = len;
+		++iFrames;
+		return true;
+	}
+
+	/// The datagram to send, which is just the
+	/// voice packet if there is only one.
+	const char *datagram() const {
+		return (iFrames == 1) ? data + iLength - iLastLength : data;
+	}
+	int datagramLength() const {
+		return (iFrames == 1) ? iLastLength : iLength;
+	}
+
+	/// Read the next voice packet of a received aggregate from pds,
+	/// which starts after the header byte. Returns its length and points
+	/// packet at it, or returns 0 at the end or if the rest is malformed.
+	static int next(PacketDataStream &pds, const char *&packet) {
+		if (pds.left() == 0)
+			return 0;
+
+		unsigned int len;
+		pds >> len;
+		if (! pds.isValid() || (len < 1) || (len > pds.left()))
+			return 0;
+
+		packet = pds.charPtr();
+		pds.skip(len);
+		return static_cast<int>(len);
+	}
+};
+
+#endif
@@ -9,7 +9,7 @@ include(../qmake/rcc.pri)
 include(../qmake/pkgconfig.pri)
 
 VERSION		= 1.3.0
-DIST		= mumble.pri Message.h PacketDataStream.h CryptState.h Timer.h Version.h OSInfo.h SSL.h
+DIST		= mumble.pri Message.h PacketDataStream.h VoiceAggregate.h CryptState.h Timer.h Version.h OSInfo.h SSL.h
 CONFIG		+= qt thread debug_and_release warn_on
 DEFINES		*= MUMBLE_VERSION_STRING=$$VERSION
 INCLUDEPATH	+= $$PWD . ../mumble_proto
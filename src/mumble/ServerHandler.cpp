@@ -21,6 +21,7 @@
 #include "RichTextEditor.h"
 #include "SSL.h"
 #include "User.h"
+#include "VoiceAggregate.h"
 #include "Net.h"
 #include "HostAddress.h"
 #include "ServerResolver.h"
@@ -194,6 +195,9 @@ void ServerHandler::udpReady() {
 			case MessageHandler::UDPVoiceOpus:
 				handleVoicePacket(msgFlags, pds, msgType);
 				break;
+			case MessageHandler::UDPVoiceAggregate:
+				handleAggregatePacket(pds);
+				break;
 			default:
 				break;
 		}
@@ -216,6 +220,21 @@ void ServerHandler::handleVoicePacket(unsigned int msgFlags, PacketDataStream &p
 	}
 }
 
+void ServerHandler::handleAggregatePacket(PacketDataStream &pds) {
+	const char *data;
+	int len;
+
+	while ((len = VoiceAggregate::next(pds, data)) > 0) {
+		MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((data[0] >> 5) & 0x7);
+		unsigned int msgFlags = data[0] & 0x1f;
+
+		if (UDPMessageTypeIsValidVoicePacket(msgType)) {
+			PacketDataStream vpds(data + 1, len - 1);
+			handleVoicePacket(msgFlags, vpds, msgType);
+		}
+	}
+}
+
 void ServerHandler::sendMessage(const char *data, int len, bool force) {
 	STACKVAR(unsigned char, crypto, len+4);
 
@@ -244,6 +263,28 @@ void ServerHandler::sendMessage(const char *data, int len, bool force) {
 	}
 }
 
+void ServerHandler::setUdpToken(const QByteArray &token) {
+	{
+		QMutexLocker qml(&qmUdp);
+		qbaUdpToken = token;
+	}
+	sendUdpAssociation();
+}
+
+void ServerHandler::sendUdpAssociation() {
+	QMutexLocker qml(&qmUdp);
+
+	if (! qusUdp || (qbaUdpToken.size() != UDP_TOKEN_SIZE))
+		return;
+
+	char buffer[UDP_ASSOCIATE_SIZE];
+	memset(buffer, 0, 4);
+	qToBigEndian<quint32>(UDP_ASSOCIATE_MAGIC, reinterpret_cast<uchar *>(buffer + 4));
+	memcpy(buffer + 8, qbaUdpToken.constData(), UDP_TOKEN_SIZE);
+
+	qusUdp->writeDatagram(buffer, UDP_ASSOCIATE_SIZE, qhaRemote, usPort);
+}
+
 void ServerHandler::sendProtoMessage(const ::google::protobuf::Message &msg, unsigned int msgType) {
 	QByteArray qba;
 
@@ -383,6 +424,7 @@ void ServerHandler::run() {
 	#endif
 			delete qusUdp;
 			qusUdp = NULL;
+			qbaUdpToken.clear();
 		}
 
 		ticker->stop();
@@ -477,6 +519,10 @@ void ServerHandler::sendPingInternal() {
 	quint64 t = tTimestamp.elapsed();
 
 	if (qusUdp) {
+		// Repeated, so the server learns our new address
+		// if a NAT rebinds it.
+		sendUdpAssociation();
+
 		unsigned char buffer[256];
 		PacketDataStream pds(buffer + 1, 255);
 		buffer[0] = MessageHandler::UDPPing << 5;
@@ -659,6 +705,7 @@ void ServerHandler::serverConnectionConnected() {
 
 	MumbleProto::Version mpv;
 	mpv.set_release(u8(QLatin1String(MUMBLE_RELEASE)));
+	mpv.set_udp_aggregate(true);
 
 	unsigned int version = MumbleVersion::getRaw();
 	if (version) {
@@ -688,6 +735,7 @@ void ServerHandler::serverConnectionConnected() {
 #else
 	mpa.set_opus(false);
 #endif
+	mpa.set_udp_token(true);
 	sendMessage(mpa);
 
 	{
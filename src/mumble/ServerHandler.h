@@ -72,8 +72,16 @@ class ServerHandler : public QThread {
 		QHostAddress qhaLocal;
 		QUdpSocket *qusUdp;
 		QMutex qmUdp;
+		/// UDP association token from the server, if it sent one.
+		QByteArray qbaUdpToken;
+
+		/// Tell the server which user our UDP datagrams belong to.
+		void sendUdpAssociation();
 
 		void handleVoicePacket(unsigned int msgFlags, PacketDataStream &pds, MessageHandler::UDPMessageType type);
+		/// Split a UDPVoiceAggregate into its voice packets and
+		/// pass each of them to handleVoicePacket().
+		void handleAggregatePacket(PacketDataStream &pds);
 	public:
 		Timer tTimestamp;
 		int iInFlightTCPPings;
@@ -122,6 +130,7 @@ class ServerHandler : public QThread {
 		void setUserComment(unsigned int uiSession, const QString &comment);
 		void setUserTexture(unsigned int uiSession, const QByteArray &qba);
 		void setTokens(const QStringList &tokens);
+		void setUdpToken(const QByteArray &token);
 		void removeChannel(unsigned int channel);
 		void addChannelLink(unsigned int channel, unsigned int link);
 		void removeChannelLink(unsigned int channel, unsigned int link);
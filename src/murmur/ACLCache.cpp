@@ -0,0 +1,312 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "ACLCache.h"
+
+#include "Channel.h"
+#include "Group.h"
+#include "ServerUser.h"
+
+/// Signatures kept before the cache starts over, as long as most of
+/// them are no longer used by any user.
+#define ACL_MAX_SIGNATURES 4096
+
+static const ChanACL::Permissions rootOnly = ChanACL::Kick | ChanACL::Ban | ChanACL::Register | ChanACL::SelfRegister;
+
+ACLProgram::ACLProgram(Channel *c) : cChannel(c), iInputs(0) {
+	// Groups by name, and by the channel they are resolved in for
+	// names using the ACL's channel.
+	QHash<QPair<Channel *, QString>, int> groups;
+	QStack<Channel *> chanstack;
+	Channel *ch = c;
+
+	while (ch) {
+		chanstack.push(ch);
+		ch = ch->cParent;
+	}
+
+	while (! chanstack.isEmpty()) {
+		ch = chanstack.pop();
+
+		foreach(ChanACL *acl, ch->qlACL) {
+			Entry e;
+			e.iUserId = acl->iUserId;
+			e.iGroup = -1;
+			e.pAllow = acl->pAllow;
+			e.pDeny = acl->pDeny;
+			e.bApplies = (ch == c) ? acl->bApplyHere : acl->bApplySubs;
+			e.pRoot = ((ch->iId == 0) && (ch == c) && acl->bApplyHere) ? (acl->pAllow & rootOnly) : ChanACL::None;
+
+			const bool path = ((e.pAllow | e.pDeny) & (ChanACL::Traverse | ChanACL::Write));
+			const bool here = e.bApplies && (e.pAllow | e.pDeny);
+			if (! path && ! here && ! e.pRoot)
+				continue;
+			if (! acl->qsGroup.isEmpty()) {
+				const QPair<Channel *, QString> key(acl->qsGroup.contains(QLatin1Char('~')) ? ch : NULL, acl->qsGroup);
+				QHash<QPair<Channel *, QString>, int>::const_iterator i = groups.constFind(key);
+				if (i != groups.constEnd()) {
+					e.iGroup = i.value();
+				} else {
+					GroupRef *g = new GroupRef(c, ch, acl->qsGroup);
+					if ((g->tType == GroupRef::None) && ! g->bInvert) {
+						delete g;
+					} else {
+						e.iGroup = qvGroups.count();
+						qvGroups.append(g);
+						iInputs |= inputs(g);
+					}
+					groups.insert(key, e.iGroup);
+				}
+			}
+			if ((e.iUserId == -1) && (e.iGroup == -1))
+				continue;
+
+			qvEntries.append(e);
+		}
+
+		Level l;
+		l.iEnd = qvEntries.count();
+		l.bReset = ! ch->bInheritACL;
+		qvLevels.append(l);
+	}
+}
+
+ACLProgram::~ACLProgram() {
+	qDeleteAll(qvGroups);
+}
+
+int ACLProgram::inputs(const GroupRef *g) {
+	switch (g->tType) {
+		case GroupRef::Strong:
+			return InputStrong;
+		case GroupRef::In:
+		case GroupRef::Out:
+		case GroupRef::Sub:
+			return InputChannel;
+		case GroupRef::Token:
+			return InputToken;
+		case GroupRef::Hash:
+			return InputHash;
+		default:
+			return 0;
+	}
+}
+
+// Must give the same result as the walk ChanACL::effectivePermissions() used to do.
+ChanACL::Permissions ACLProgram::evaluate(ServerUser *p) const {
+	const ChanACL::Permissions def = ChanACL::Traverse | ChanACL::Enter | ChanACL::Speak | ChanACL::Whisper | ChanACL::TextMessage;
+
+	ChanACL::Permissions granted = def;
+	bool traverse = true;
+	bool write = false;
+
+	// Groups already matched against p, and the result.
+	const int words = (qvGroups.count() + 31) / 32;
+	QVarLengthArray<quint32, 4> known(words);
+	QVarLengthArray<quint32, 4> member(words);
+	for (int i = 0; i < words; ++i)
+		known[i] = member[i] = 0;
+
+	int idx = 0;
+	foreach(const Level &l, qvLevels) {
+		if (l.bReset)
+			granted = def;
+
+		for (; idx < l.iEnd; ++idx) {
+			const Entry &e = qvEntries.at(idx);
+			bool match = (e.iUserId != -1) && (e.iUserId == p->iId);
+			if (! match && (e.iGroup != -1)) {
+				const int w = e.iGroup / 32;
+				const quint32 bit = 1U << (e.iGroup % 32);
+				if (! (known[w] & bit)) {
+					known[w] |= bit;
+					if (qvGroups.at(e.iGroup)->matches(p))
+						member[w] |= bit;
+				}
+				match = (member[w] & bit);
+			}
+			if (! match)
+				continue;
+
+			if (e.pAllow & ChanACL::Traverse)
+				traverse = true;
+			if (e.pDeny & ChanACL::Traverse)
+				traverse = false;
+			if (e.pAllow & ChanACL::Write)
+				write = true;
+			if (e.pDeny & ChanACL::Write)
+				write = false;
+			granted |= e.pRoot;
+			if (e.bApplies) {
+				granted |= (e.pAllow & ~(rootOnly | ChanACL::Cached));
+				granted &= ~e.pDeny;
+			}
+		}
+		if (! traverse && ! write)
+			return ChanACL::None;
+	}
+
+	if (granted & ChanACL::Write) {
+		granted |= ChanACL::Traverse | ChanACL::Enter | ChanACL::MuteDeafen | ChanACL::Move | ChanACL::MakeChannel | ChanACL::LinkChannel | ChanACL::TextMessage | ChanACL::MakeTempChannel;
+		if (cChannel->iId == 0)
+			granted |= rootOnly;
+	}
+
+	return granted;
+}
+
+ACLCache::ACLCache() : iNextSignature(0), iInputs(0) {
+}
+
+ACLCache::~ACLCache() {
+	qDeleteAll(qhPrograms);
+}
+
+ACLProgram *ACLCache::program(Channel *c) {
+	ACLProgram *prog = qhPrograms.value(c);
+	if (prog)
+		return prog;
+
+	prog = new ACLProgram(c);
+	qhPrograms.insert(c, prog);
+
+	if ((prog->iInputs | iInputs) != iInputs) {
+		// Signatures made so far don't tell apart users this program does.
+		iInputs |= prog->iInputs;
+		qhUserSignatures.clear();
+	}
+	return prog;
+}
+
+int ACLCache::signature(ServerUser *p) {
+	Channel *c = (iInputs & ACLProgram::InputChannel) ? p->cChannel : NULL;
+
+	QHash<const ServerUser *, UserSignature>::const_iterator i = qhUserSignatures.constFind(p);
+	if ((i != qhUserSignatures.constEnd()) && (i->iId == p->iId) && (i->cChannel == c) && (i->bVerified == p->bVerified))
+		return i->iSignature;
+
+	QString key = QString::number(p->iId);
+	if (p->iId >= 0) {
+		const int epoch = qhUserEpoch.value(p->iId);
+		if (epoch)
+			key += QString::fromLatin1(".%1").arg(epoch);
+	}
+	if (c)
+		key += QString::fromLatin1("/c%1.%2").arg(c->iId).arg(qhChannelEpoch.value(c->iId));
+	if (iInputs & ACLProgram::InputStrong)
+		key += p->bVerified ? QLatin1String("/v") : QLatin1String("/u");
+	if (iInputs & ACLProgram::InputHash)
+		key += QLatin1String("/h") + p->qsHash;
+
+	const int priv = qhPrivate.value(p->uiSession);
+	if (priv)
+		key += QString::fromLatin1("/p%1.%2").arg(p->uiSession).arg(priv);
+
+	if (iInputs & ACLProgram::InputToken) {
+		// Tokens are compared case insensitively and are free form,
+		// so they go last and carry their length.
+		QStringList tokens;
+		foreach(const QString &t, p->qslAccessTokens)
+			tokens << t.toLower();
+		tokens.sort();
+		tokens.removeDuplicates();
+		foreach(const QString &t, tokens)
+			key += QString::fromLatin1("/t%1:").arg(t.length()) + t;
+	}
+
+	int sig;
+	QHash<QString, int>::const_iterator s = qhSignatures.constFind(key);
+	if (s != qhSignatures.constEnd()) {
+		sig = s.value();
+	} else {
+		if ((qhSignatures.count() >= ACL_MAX_SIGNATURES) && (qhSignatures.count() > 4 * qhUserSignatures.count())) {
+			qhPermissions.clear();
+			qhSignatures.clear();
+			qhUserSignatures.clear();
+		}
+		sig = iNextSignature++;
+		qhSignatures.insert(key, sig);
+	}
+
+	UserSignature us;
+	us.iId = p->iId;
+	us.cChannel = c;
+	us.bVerified = p->bVerified;
+	us.iSignature = sig;
+	qhUserSignatures.insert(p, us);
+	return sig;
+}
+
+ChanACL::Permissions ACLCache::permissions(ServerUser *p, Channel *c) {
+	// Compile first; it may make the signature of p finer.
+	ACLProgram *prog = program(c);
+	const int sig = signature(p);
+
+	QHash<int, ChanACL::Permissions> &h = qhPermissions[c];
+	QHash<int, ChanACL::Permissions>::const_iterator i = h.constFind(sig);
+	if (i != h.constEnd())
+		return i.value();
+
+	ChanACL::Permissions granted = prog->evaluate(p) | ChanACL::Cached;
+	h.insert(sig, granted);
+	return granted;
+}
+
+void ACLCache::clear() {
+	qDeleteAll(qhPrograms);
+	qhPrograms.clear();
+	qhPermissions.clear();
+	qhSignatures.clear();
+	qhUserSignatures.clear();
+	iInputs = 0;
+}
+
+void ACLCache::clearChannels(const QSet<Channel *> &channels) {
+	foreach(Channel *c, channels) {
+		delete qhPrograms.take(c);
+		qhPermissions.remove(c);
+	}
+}
+
+void ACLCache::removeChannel(Channel *c) {
+	delete qhPrograms.take(c);
+	qhPermissions.remove(c);
+	++qhChannelEpoch[c->iId];
+
+	QHash<const ServerUser *, UserSignature>::iterator i = qhUserSignatures.begin();
+	while (i != qhUserSignatures.end()) {
+		if (i->cChannel == c)
+			i = qhUserSignatures.erase(i);
+		else
+			++i;
+	}
+}
+
+void ACLCache::clearUser(ServerUser *p) {
+	++qhPrivate[p->uiSession];
+	qhUserSignatures.remove(p);
+
+	if (p->iId < 0)
+		return;
+
+	removeUserId(p->iId);
+}
+
+void ACLCache::forgetUser(const ServerUser *p) {
+	qhUserSignatures.remove(p);
+}
+
+void ACLCache::removeUserId(int id) {
+	++qhUserEpoch[id];
+	QHash<const ServerUser *, UserSignature>::iterator i = qhUserSignatures.begin();
+	while (i != qhUserSignatures.end()) {
+		if (i->iId == id)
+			i = qhUserSignatures.erase(i);
+		else
+			++i;
+	}
+}
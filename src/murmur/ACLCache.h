@@ -0,0 +1,141 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_ACLCACHE_H_
+#define MUMBLE_MURMUR_ACLCACHE_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "ACL.h"
+
+class Channel;
+class GroupRef;
+class ServerUser;
+
+/// The ACLs that apply in a channel, collected from the channel and
+/// its parents into a flat list that is evaluated from the root down.
+/// Entries that can't change the outcome are left out.
+///
+/// Group names are parsed once, and entries naming the same group
+/// share a GroupRef. While evaluating, whether the user is a member
+/// is kept in a bitset, so each group is matched at most once.
+class ACLProgram {
+	private:
+		Q_DISABLE_COPY(ACLProgram)
+	public:
+		struct Entry {
+			int iUserId;
+			/// Index into qvGroups, or -1.
+			int iGroup;
+			ChanACL::Permissions pAllow;
+			ChanACL::Permissions pDeny;
+			/// Whether the ACL grants and denies permissions in the
+			/// channel, and not only Traverse and Write on the way.
+			bool bApplies;
+			/// Root channel only permissions granted by the ACL.
+			ChanACL::Permissions pRoot;
+		};
+
+		/// Entries of one channel on the path.
+		struct Level {
+			/// Index of the first entry of the next level.
+			int iEnd;
+			/// The channel doesn't inherit ACLs.
+			bool bReset;
+		};
+
+		/// User state referenced by the groups of the entries,
+		/// besides the user id and temporary group memberships.
+		enum Input {
+			InputChannel = 0x1,
+			InputHash = 0x2,
+			InputToken = 0x4,
+			InputStrong = 0x8
+		};
+
+		Channel *cChannel;
+		QVector<Entry> qvEntries;
+		QVector<Level> qvLevels;
+		QVector<GroupRef *> qvGroups;
+		int iInputs;
+
+		ACLProgram(Channel *c);
+		~ACLProgram();
+		ChanACL::Permissions evaluate(ServerUser *p) const;
+
+		/// The Input flags matching a group depends on.
+		static int inputs(const GroupRef *g);
+};
+
+/// Cached permissions of users in channels, used by
+/// ChanACL::effectivePermissions(). All access must hold Server::qmCache.
+///
+/// Users are mapped to a signature made of the state the compiled ACLs
+/// actually look at. Users with the same signature have the same
+/// permissions everywhere, so e.g. all unregistered users in one
+/// channel share a single result per channel. Results and programs are
+/// kept per channel, which lets an ACL or group change drop just the
+/// channels below it.
+class ACLCache {
+	private:
+		Q_DISABLE_COPY(ACLCache)
+	protected:
+		struct UserSignature {
+			int iId;
+			Channel *cChannel;
+			bool bVerified;
+			int iSignature;
+		};
+
+		QHash<Channel *, ACLProgram *> qhPrograms;
+		/// Permissions by channel and signature, with Cached set.
+		QHash<Channel *, QHash<int, ChanACL::Permissions> > qhPermissions;
+		QHash<QString, int> qhSignatures;
+		int iNextSignature;
+		QHash<const ServerUser *, UserSignature> qhUserSignatures;
+		/// Union of the inputs of all compiled programs.
+		int iInputs;
+		/// Sessions and registered users that were added to or
+		/// removed from a temporary group, and how often. Those users
+		/// get signatures of their own.
+		QHash<unsigned int, int> qhPrivate;
+		QHash<int, int> qhUserEpoch;
+		/// Bumped when a channel is removed, so a new channel with
+		/// the same id doesn't inherit signatures.
+		QHash<int, int> qhChannelEpoch;
+
+		ACLProgram *program(Channel *c);
+		int signature(ServerUser *p);
+	public:
+		ACLCache();
+		~ACLCache();
+
+		ChanACL::Permissions permissions(ServerUser *p, Channel *c);
+
+		/// Forget everything.
+		void clear();
+		/// Forget the programs and permissions of channels, after
+		/// their ACLs or groups, or those of a parent, changed.
+		void clearChannels(const QSet<Channel *> &channels);
+		/// Forget a channel that is about to be deleted.
+		void removeChannel(Channel *c);
+		/// Give p, and any other session of the same registered
+		/// user, a fresh signature after their temporary groups changed.
+		void clearUser(ServerUser *p);
+		/// Work out the signature of p again on next use, after its
+		/// access tokens changed or it disconnected. Changes of the
+		/// channel, user id and certificate are noticed without this.
+		void forgetUser(const ServerUser *p);
+		/// Give registered user id a fresh signature, after it was
+		/// unregistered, so a user registered later with the same id
+		/// doesn't get its cached permissions. Whether the user is
+		/// online or not.
+		void removeUserId(int id);
+};
+
+#endif
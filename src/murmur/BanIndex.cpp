@@ -0,0 +1,175 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "BanIndex.h"
+
+#include <algorithm>
+#include <functional>
+
+typedef QPair<qint64, int> Expiry;
+
+static inline int addressBit(const HostAddress &ha, int bit) {
+	return (ha.qip6.c[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+BanIndex::BanIndex() {
+	rebuild(QList<Ban>());
+}
+
+void BanIndex::rebuild(const QList<Ban> &bans) {
+	qvNodes.clear();
+	qvNext.clear();
+	qmhHashes.clear();
+	qvExpiry.clear();
+
+	Node root;
+	root.iChild[0] = root.iChild[1] = -1;
+	root.iFirst = -1;
+	qvNodes.append(root);
+
+	for (int i=0;i<bans.count();++i)
+		add(bans.at(i), i);
+}
+
+void BanIndex::add(const Ban &b, int pos) {
+	if (qvNext.count() <= pos)
+		qvNext.resize(pos + 1);
+
+	// Masks outside 0..128 can only come in over RPC.
+	const int bits = qBound(0, b.iMask, 128);
+
+	int n = 0;
+	for (int d=0;d<bits;++d) {
+		const int dir = addressBit(b.haAddress, d);
+		int next = qvNodes.at(n).iChild[dir];
+		if (next == -1) {
+			Node child;
+			child.iChild[0] = child.iChild[1] = -1;
+			child.iFirst = -1;
+			next = qvNodes.count();
+			qvNodes.append(child);
+			qvNodes[n].iChild[dir] = next;
+		}
+		n = next;
+	}
+	qvNext[pos] = qvNodes.at(n).iFirst;
+	qvNodes[n].iFirst = pos;
+
+	if (! b.qsHash.isEmpty())
+		qmhHashes.insert(b.qsHash, pos);
+
+	const qint64 t = expiry(b);
+	if (t >= 0)
+		push(t, pos);
+}
+
+int BanIndex::node(const Ban &b) const {
+	const int bits = qBound(0, b.iMask, 128);
+
+	int n = 0;
+	for (int d=0;(d<bits) && (n != -1);++d)
+		n = qvNodes.at(n).iChild[addressBit(b.haAddress, d)];
+	return n;
+}
+
+void BanIndex::remove(const Ban &b, int pos) {
+	const int n = node(b);
+	if (n != -1) {
+		int *link = &qvNodes[n].iFirst;
+		while ((*link != -1) && (*link != pos))
+			link = &qvNext[*link];
+		if (*link == pos)
+			*link = qvNext.at(pos);
+	}
+
+	if (! b.qsHash.isEmpty())
+		qmhHashes.remove(b.qsHash, pos);
+}
+
+void BanIndex::push(qint64 t, int pos) {
+	qvExpiry.append(Expiry(t, pos));
+	std::push_heap(qvExpiry.begin(), qvExpiry.end(), std::greater<Expiry>());
+}
+
+int BanIndex::find(const QList<Ban> &bans, const HostAddress &ha) const {
+	int n = 0;
+	for (int d=0;;++d) {
+		for (int pos = qvNodes.at(n).iFirst; pos != -1; pos = qvNext.at(pos)) {
+			if (! bans.at(pos).isExpired())
+				return pos;
+		}
+		if (d == 128)
+			return -1;
+		n = qvNodes.at(n).iChild[addressBit(ha, d)];
+		if (n == -1)
+			return -1;
+	}
+}
+
+QList<int> BanIndex::findHash(const QString &hash) const {
+	if (hash.isEmpty())
+		return QList<int>();
+	return qmhHashes.values(hash);
+}
+
+QList<int> BanIndex::findNetwork(const QList<Ban> &bans, const Ban &b) const {
+	QList<int> ql;
+	const int n = node(b);
+	if (n == -1)
+		return ql;
+
+	// Other addresses in the same network sit on the node as well.
+	for (int pos = qvNodes.at(n).iFirst; pos != -1; pos = qvNext.at(pos)) {
+		const Ban &other = bans.at(pos);
+		if ((other.iMask == b.iMask) && (other.haAddress == b.haAddress))
+			ql << pos;
+	}
+	return ql;
+}
+
+qint64 BanIndex::nextExpiry() const {
+	return qvExpiry.isEmpty() ? -1 : qvExpiry.first().first;
+}
+
+QList<int> BanIndex::takeExpired(const QList<Ban> &bans, qint64 now) {
+	QList<int> ql;
+	QSet<int> seen;
+	QList<Expiry> early;
+
+	while (! qvExpiry.isEmpty() && (qvExpiry.first().first < now)) {
+		std::pop_heap(qvExpiry.begin(), qvExpiry.end(), std::greater<Expiry>());
+		const Expiry e = qvExpiry.last();
+		qvExpiry.removeLast();
+
+		// The ban may have been removed or moved since. Whatever is
+		// at its position now is only due if it expires by then.
+		if (e.second >= bans.count())
+			continue;
+		const qint64 t = expiry(bans.at(e.second));
+		if ((t < 0) || (t > e.first) || seen.contains(e.second))
+			continue;
+
+		// Ban::isExpired() counts whole seconds from a start that
+		// may have milliseconds; look again a second later.
+		if (bans.at(e.second).isExpired()) {
+			ql << e.second;
+			seen.insert(e.second);
+		} else {
+			early << Expiry(e.first + 1, e.second);
+		}
+	}
+
+	foreach(const Expiry &e, early)
+		push(e.first, e.second);
+	return ql;
+}
+
+qint64 BanIndex::expiry(const Ban &b) {
+	if (b.iDuration == 0)
+		return -1;
+	return static_cast<qint64>(b.qdtStart.toTime_t()) + static_cast<qint64>(b.iDuration);
+}
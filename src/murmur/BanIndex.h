@@ -0,0 +1,80 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_BANINDEX_H_
+#define MUMBLE_MURMUR_BANINDEX_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "Ban.h"
+
+/// Index of a server's ban list, referring to bans by their position
+/// in Server::qlBans.
+///
+/// Address bans are kept in a binary trie over the 128 bit address,
+/// IPv4 bans being in the v4-mapped part of it. A ban on a /n network
+/// sits on the node n bits deep, so the bans covering an address are
+/// found by following its bits down from the root, whatever the
+/// number of bans.
+///
+/// Bans that expire are kept in a min-heap by the time they do, so
+/// the server can purge them from a timer instead of looking at every
+/// ban for every connection.
+///
+/// Bans can be added and removed one at a time; replacing the list
+/// needs the index to be rebuilt. Heap entries are not taken out when
+/// a ban is removed or moved, but are checked against the list when
+/// they come up.
+class BanIndex {
+	protected:
+		struct Node {
+			int iChild[2];
+			/// Position of the first ban on the node, or -1.
+			int iFirst;
+		};
+
+		QVector<Node> qvNodes;
+		/// Position of the next ban on the same node, by position.
+		QVector<int> qvNext;
+		QMultiHash<QString, int> qmhHashes;
+		/// Expiry times, in seconds since the epoch, and positions.
+		QVector<QPair<qint64, int> > qvExpiry;
+
+		void push(qint64 t, int pos);
+		/// The node b sits on, or -1 if it isn't in the trie.
+		int node(const Ban &b) const;
+	public:
+		BanIndex();
+
+		void rebuild(const QList<Ban> &bans);
+		/// b was put in the list at pos, appended or to fill the place
+		/// of a removed ban.
+		void add(const Ban &b, int pos);
+		/// b, at pos, is about to be removed from the list or moved
+		/// to another position.
+		void remove(const Ban &b, int pos);
+
+		/// Position of a ban covering ha that hasn't expired, or -1.
+		int find(const QList<Ban> &bans, const HostAddress &ha) const;
+		/// Positions of the bans on a certificate hash.
+		QList<int> findHash(const QString &hash) const;
+		/// Positions of the bans with the same address and mask as b.
+		QList<int> findNetwork(const QList<Ban> &bans, const Ban &b) const;
+
+		/// When the next ban expires, or -1 if none does.
+		qint64 nextExpiry() const;
+		/// Take the bans that expired before now off the heap, and
+		/// return their positions, each once.
+		QList<int> takeExpired(const QList<Ban> &bans, qint64 now);
+
+		/// When b expires, or -1 for a permanent ban.
+		static qint64 expiry(const Ban &b);
+};
+
+#endif
@@ -0,0 +1,193 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "ChannelIndex.h"
+
+#include "Channel.h"
+
+/// Numbers are handed out below this.
+#define TOUR_LIMIT (Q_UINT64_C(1) << 62)
+/// Largest gap between two numbers. Channels are mostly added after
+/// the last one, and handing out half the remaining room every time
+/// would run out after a few dozen.
+#define TOUR_STEP (Q_UINT64_C(1) << 32)
+
+ChannelIndex::ChannelIndex(Channel *root) : cRoot(root), iNextLinkGroup(0) {
+	renumber();
+}
+
+Channel *ChannelIndex::root() const {
+	return cRoot;
+}
+
+static int subtreeSize(const Channel *c) {
+	int n = 1;
+	foreach(const Channel *chld, c->qlChannels)
+		n += subtreeSize(chld);
+	return n;
+}
+
+void ChannelIndex::number(Channel *c, quint64 &next, quint64 step) {
+	c->ciIndex = this;
+	c->uiTourFirst = next;
+	qmTour.insert(next, c);
+	next += step;
+
+	foreach(Channel *chld, c->qlChannels)
+		number(chld, next, step);
+
+	c->uiTourLast = next - step;
+}
+
+void ChannelIndex::renumber() {
+	qmTour.clear();
+
+	const quint64 step = qMin(TOUR_LIMIT / static_cast<quint64>(subtreeSize(cRoot) + 1), TOUR_STEP);
+	quint64 next = step;
+	number(cRoot, next, step);
+}
+
+void ChannelIndex::channelAdded(Channel *c) {
+	Channel *p = c->cParent;
+
+	// Number c and its subchannels between the last channel below p
+	// and the channel after it.
+	const quint64 after = p->uiTourLast;
+	QMap<quint64, Channel *>::const_iterator i = qmTour.constFind(after);
+	++i;
+	const quint64 before = (i == qmTour.constEnd()) ? TOUR_LIMIT : i.key();
+
+	const quint64 step = qMin((before - after) / static_cast<quint64>(subtreeSize(c) + 1), TOUR_STEP);
+	if (step == 0) {
+		renumber();
+		return;
+	}
+
+	quint64 next = after + step;
+	number(c, next, step);
+
+	for (Channel *a = p; a && (a->uiTourLast == after); a = a->cParent)
+		a->uiTourLast = c->uiTourLast;
+}
+
+void ChannelIndex::channelRemoved(Channel *c) {
+	Channel *p = c->cParent;
+	const quint64 first = c->uiTourFirst;
+	const quint64 last = c->uiTourLast;
+
+	{
+		QMutexLocker lock(&qmLinks);
+
+		QMap<quint64, Channel *>::iterator i = qmTour.find(first);
+		while ((i != qmTour.end()) && (i.key() <= last)) {
+			i.value()->ciIndex = NULL;
+			dropLinkGroup(i.value());
+			i = qmTour.erase(i);
+		}
+	}
+
+	// The parent range now ends at the channel just before c.
+	QMap<quint64, Channel *>::const_iterator i = qmTour.lowerBound(first);
+	--i;
+	const quint64 prev = i.key();
+
+	for (Channel *a = p; a && (a->uiTourLast == last); a = a->cParent)
+		a->uiTourLast = prev;
+}
+
+bool ChannelIndex::contains(const Channel *ancestor, const Channel *c) const {
+	return (ancestor->ciIndex == this) && (c->ciIndex == this) && (ancestor->uiTourFirst <= c->uiTourFirst) && (c->uiTourFirst <= ancestor->uiTourLast);
+}
+
+QSet<Channel *> ChannelIndex::children(const Channel *c) const {
+	QSet<Channel *> qs;
+	if (c->uiTourLast == c->uiTourFirst)
+		return qs;
+
+	QMap<quint64, Channel *>::const_iterator i = qmTour.constFind(c->uiTourFirst);
+	for (++i; (i != qmTour.constEnd()) && (i.key() <= c->uiTourLast); ++i)
+		qs.insert(i.value());
+	return qs;
+}
+
+void ChannelIndex::dropLinkGroup(Channel *c) {
+	QHash<Channel *, int>::iterator i = qhLinkGroup.find(c);
+	if (i == qhLinkGroup.end())
+		return;
+
+	const QSet<Channel *> group = qhLinkGroups.take(i.value());
+	foreach(Channel *l, group)
+		qhLinkGroup.remove(l);
+}
+
+void ChannelIndex::channelsLinked(Channel *a, Channel *b) {
+	QMutexLocker lock(&qmLinks);
+
+	const int ga = qhLinkGroup.value(a, -1);
+	const int gb = qhLinkGroup.value(b, -1);
+
+	if ((ga == -1) || (gb == -1)) {
+		// At least one of them hasn't been looked at since it last
+		// changed; find both groups again when needed.
+		dropLinkGroup(a);
+		dropLinkGroup(b);
+		return;
+	}
+	if (ga == gb)
+		return;
+
+	// Move the smaller group into the larger one.
+	int from = ga, to = gb;
+	if (qhLinkGroups.value(ga).count() > qhLinkGroups.value(gb).count()) {
+		from = gb;
+		to = ga;
+	}
+
+	const QSet<Channel *> moved = qhLinkGroups.take(from);
+	QSet<Channel *> &into = qhLinkGroups[to];
+	foreach(Channel *l, moved) {
+		qhLinkGroup.insert(l, to);
+		into.insert(l);
+	}
+}
+
+void ChannelIndex::channelsUnlinked(Channel *a, Channel *) {
+	QMutexLocker lock(&qmLinks);
+
+	// The group may or may not have been split.
+	dropLinkGroup(a);
+}
+
+QSet<Channel *> ChannelIndex::links(Channel *c) {
+	QMutexLocker lock(&qmLinks);
+
+	QHash<Channel *, int>::const_iterator i = qhLinkGroup.constFind(c);
+	if (i != qhLinkGroup.constEnd())
+		return qhLinkGroups.value(i.value());
+
+	QSet<Channel *> seen;
+	seen.insert(c);
+
+	QStack<Channel *> stack;
+	stack.push(c);
+
+	while (! stack.isEmpty()) {
+		Channel *lnk = stack.pop();
+		foreach(Channel *l, lnk->qhLinks.keys()) {
+			if (! seen.contains(l)) {
+				seen.insert(l);
+				stack.push(l);
+			}
+		}
+	}
+
+	const int g = iNextLinkGroup++;
+	foreach(Channel *l, seen)
+		qhLinkGroup.insert(l, g);
+	qhLinkGroups.insert(g, seen);
+	return seen;
+}
@@ -0,0 +1,72 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_CHANNELINDEX_H_
+#define MUMBLE_MURMUR_CHANNELINDEX_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
+
+class Channel;
+
+/// Index of a server's channel tree, owned by the root channel and
+/// kept up to date by Channel as channels are added, moved, removed
+/// and linked.
+///
+/// Channels are numbered in a pre-order walk of the tree, with gaps
+/// between the numbers. A subtree is then the range from a channel's
+/// own number to that of its last descendant, so telling whether a
+/// channel is below another takes two comparisons. A new or moved
+/// subtree is numbered within the gap after its new parent's range,
+/// and only when that gap is too small is the whole tree numbered
+/// again.
+///
+/// Channels linked to each other, directly or not, share a link group.
+/// Linking two channels merges their groups; unlinking drops the group,
+/// and it is found again on the next query.
+///
+/// The tree is changed with Server::qrwlVoiceThread locked for
+/// writing, and queried with it locked for reading. Link groups are
+/// filled in by queries, and so have a lock of their own.
+class ChannelIndex {
+	private:
+		Q_DISABLE_COPY(ChannelIndex)
+	protected:
+		Channel *cRoot;
+		/// Channels by number.
+		QMap<quint64, Channel *> qmTour;
+
+		QMutex qmLinks;
+		QHash<Channel *, int> qhLinkGroup;
+		QHash<int, QSet<Channel *> > qhLinkGroups;
+		int iNextLinkGroup;
+
+		void renumber();
+		void number(Channel *c, quint64 &next, quint64 step);
+		void dropLinkGroup(Channel *c);
+	public:
+		ChannelIndex(Channel *root);
+
+		Channel *root() const;
+
+		/// c, with its subchannels, was added below c->cParent.
+		void channelAdded(Channel *c);
+		/// c, with its subchannels, is about to be taken away from
+		/// c->cParent.
+		void channelRemoved(Channel *c);
+		void channelsLinked(Channel *a, Channel *b);
+		void channelsUnlinked(Channel *a, Channel *b);
+
+		/// Whether c is ancestor or one of its subchannels.
+		bool contains(const Channel *ancestor, const Channel *c) const;
+		/// The subchannels of c, at any depth.
+		QSet<Channel *> children(const Channel *c) const;
+		/// The channels c is linked to, directly or not, and c.
+		QSet<Channel *> links(Channel *c);
+};
+
+#endif
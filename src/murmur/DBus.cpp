@@ -519,7 +519,7 @@ void MurmurDBus::setACL(int id, const QList<ACLInfo> &acls, const QList<GroupInf
 		a->pAllow = static_cast<ChanACL::Permissions>(ai.allow) & ChanACL::All;
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(cChannel);
 	server->updateChannel(cChannel);
 }
 
@@ -10,12 +10,16 @@
 #include "ACL.h"
 #include "Group.h"
 #include "Message.h"
+#include "Meta.h"
+#include "PasswordHasher.h"
 #include "ServerDB.h"
 #include "Connection.h"
+#include "Relay.h"
 #include "Server.h"
 #include "ServerUser.h"
 #include "Version.h"
 #include "CryptState.h"
+#include "CryptographicRandom.h"
 
 #define MSG_SETUP(st) \
 	if (uSource->sState != st) { \
@@ -80,23 +84,206 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 			QMutexLocker qml(&qmCache);
 			uSource->qslAccessTokens = qsl;
 		}
-		clearACLCache(uSource);
+		refreshPermissions(uSource);
 	}
 	MSG_SETUP(ServerUser::Connected);
 
-	Channel *root = qhChannels.value(0);
-	Channel *c;
+	// Already waiting for the authenticators.
+	if (uSource->uiAuthRequest)
+		return;
 
 	uSource->qsName = u8(msg.username());
 
-	bool ok = false;
-	bool nameok = validateUserName(uSource->qsName);
-	QString pw = u8(msg.password());
+	beginAuthenticate(uSource, msg);
+}
+
+bool Server::hasAsyncAuthenticator() {
+	return receivers(SIGNAL(authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &))) > 0;
+}
+
+void Server::beginAuthenticate(ServerUser *uSource, const MumbleProto::Authenticate &msg) {
+	do {
+		++uiAuthRequest;
+	} while (! uiAuthRequest || qhPendingAuth.contains(uiAuthRequest));
+
+	const unsigned int request = uiAuthRequest;
+
+	PendingAuth *pa = new PendingAuth();
+	pa->uiSession = uSource->uiSession;
+	pa->msg = msg;
+	pa->iWaiting = 0;
+	pa->iResult = bForceExternalAuth ? -3 : -2;
+	pa->bAsked = false;
+	pa->iExternal = pa->iResult;
+	pa->iIterations = 0;
+	pa->bHashed = false;
+
+	uSource->uiAuthRequest = request;
+	qhPendingAuth.insert(request, pa);
+	iAuthPendingMax = qMax(iAuthPendingMax, qhPendingAuth.count());
+
+	if (! hasAsyncAuthenticator()) {
+		continueAuthenticate(request, pa->iResult);
+		return;
+	}
+
+	pa->iWaiting = receivers(SIGNAL(authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
+
+	if (! qtAuthDeadline->isActive())
+		qtAuthDeadline->start();
+
+	emit authenticateAsyncSig(request, uSource->qsName, uSource->uiSession, uSource->peerCertificateChain(), uSource->qsHash, uSource->bVerified, u8(msg.password()));
+}
+
+void Server::authenticateDone(unsigned int request, int res, const QString &name, const QStringList &groups) {
+	PendingAuth *pa = qhPendingAuth.value(request);
+
+	// Timed out, or the client is gone.
+	if (! pa || pa->iWaiting <= 0)
+		return;
+
+	// Answers that leave the result at its default, or fall through to
+	// the local database, wait for the other authenticators.
+	const int def = bForceExternalAuth ? -3 : -2;
+	if (res == def || res == -2) {
+		if (res == -2)
+			pa->iResult = -2;
+		if (--pa->iWaiting > 0)
+			return;
+		res = pa->iResult;
+	}
+	pa->iWaiting = 0;
+
+	const quint64 latency = pa->tStarted.elapsed();
+	++uiAuthRequests;
+	uiAuthLatencyTotal += latency;
+	uiAuthLatencyMax = qMax(uiAuthLatencyMax, latency);
+
+	ServerUser *u = qhUsers.value(pa->uiSession);
+	if (u && res >= 0) {
+		if (! name.isEmpty())
+			u->qsName = name;
+		if (! groups.isEmpty())
+			setTempGroups(res, u->uiSession, NULL, groups);
+	}
+	continueAuthenticate(request, res);
+
+	reportAuthenticate();
+}
+
+void Server::checkAuthDeadlines() {
+	const quint64 timeout = static_cast<quint64>(Meta::mp.iAuthTimeout) * 1000000ULL;
+
+	QList<unsigned int> expired;
+	QHash<unsigned int, PendingAuth *>::const_iterator i;
+	for (i = qhPendingAuth.constBegin(); i != qhPendingAuth.constEnd(); ++i) {
+		if (i.value()->iWaiting > 0 && i.value()->tStarted.isElapsed(timeout))
+			expired << i.key();
+	}
+
+	foreach(unsigned int request, expired) {
+		PendingAuth *pa = qhPendingAuth.value(request);
+		if (! pa)
+			continue;
+
+		pa->iWaiting = 0;
+		++uiAuthTimeouts;
+
+		ServerUser *u = qhUsers.value(pa->uiSession);
+		if (u)
+			log(u, QString("Authenticator did not answer within %1 seconds").arg(Meta::mp.iAuthTimeout));
+		continueAuthenticate(request, (Meta::mp.bAuthTimeoutReject || bForceExternalAuth) ? -3 : -2);
+	}
+
+	if (qhPendingAuth.isEmpty())
+		qtAuthDeadline->stop();
+
+	reportAuthenticate();
+}
+
+void Server::passwordHashed(unsigned int request, const QString &hash) {
+	PendingAuth *pa = qhPendingAuth.value(request);
+
+	// The client is gone.
+	if (! pa)
+		return;
+
+	pa->qsHash = hash;
+	pa->bHashed = true;
+	continueAuthenticate(request, pa->iExternal);
+}
+
+void Server::continueAuthenticate(unsigned int request, int external) {
+	PendingAuth *pa = qhPendingAuth.take(request);
+	if (! pa)
+		return;
+
+	ServerUser *u = qhUsers.value(pa->uiSession);
+	if (! u || u->uiAuthRequest != request) {
+		delete pa;
+		return;
+	}
+
+	const QString pw = u8(pa->msg.password());
 
 	// Fetch ID and stored username.
 	// Since this may call DBus, which may recall our dbus messages, this function needs
 	// to support re-entrancy, and also to support the fact that sessions may go away.
-	int id = authenticate(uSource->qsName, pw, uSource->uiSession, uSource->qslEmail, uSource->qsHash, uSource->bVerified, uSource->peerCertificateChain());
+	int id = authenticateWith(pa->bAsked ? pa->iExternal : external, u->qsName, pw, u->uiSession, u->qslEmail, u->qsHash, u->bVerified, u->peerCertificateChain(), pa);
+
+	if (qhUsers.value(pa->uiSession) != u) {
+		delete pa;
+		return;
+	}
+
+	if (id == -4) {
+		// The password has to be hashed first.
+		switch (meta->phHasher->hash(this, request, u->haAddress, pa->qsSalt, pw, pa->iIterations)) {
+			case PasswordHasher::Queued:
+				qhPendingAuth.insert(request, pa);
+				return;
+			case PasswordHasher::AddressLimit:
+				log(u, "Too many password checks in progress from this address");
+				id = -3;
+				break;
+			case PasswordHasher::Busy:
+				log(u, "Too many password checks in progress");
+				// Not an error code of authenticate(), only of finishAuthenticate().
+				id = -5;
+				break;
+		}
+	}
+
+	u->uiAuthRequest = 0;
+	finishAuthenticate(u, pa->msg, id);
+	delete pa;
+}
+
+void Server::reportAuthenticate() {
+	if (! tAuthReport.isElapsed(AUTH_REPORT_INTERVAL * 1000000ULL))
+		return;
+	tAuthReport.restart();
+
+	if (uiAuthRequests == 0 && uiAuthTimeouts == 0)
+		return;
+
+	const double n = static_cast<double>(qMax(uiAuthRequests, Q_UINT64_C(1))) * 1000.0;
+	log(QString("Authenticator: %1 answered, %2 timed out, %3 pending (max %4). Latency avg %5 ms, max %6 ms.")
+	    .arg(uiAuthRequests).arg(uiAuthTimeouts).arg(qhPendingAuth.count()).arg(iAuthPendingMax)
+	    .arg(static_cast<double>(uiAuthLatencyTotal) / n, 0, 'f', 1)
+	    .arg(static_cast<double>(uiAuthLatencyMax) / 1000.0, 0, 'f', 1));
+
+	uiAuthRequests = uiAuthTimeouts = 0;
+	uiAuthLatencyTotal = uiAuthLatencyMax = 0;
+	iAuthPendingMax = qhPendingAuth.count();
+}
+
+void Server::finishAuthenticate(ServerUser *uSource, const MumbleProto::Authenticate &msg, int id) {
+	Channel *root = qhChannels.value(0);
+
+	bool ok = false;
+	bool nameok = validateUserName(uSource->qsName);
+	QString pw = u8(msg.password());
 
 	uSource->iId = id >= 0 ? id : -1;
 
@@ -115,6 +302,9 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	} else if (id==-3) {
 		reason = "Your account information can not be verified currently. Please try again later";
 		rtType = MumbleProto::Reject_RejectType_AuthenticatorFail;
+	} else if (id==-5) {
+		reason = "Server is busy. Please try again later";
+		rtType = MumbleProto::Reject_RejectType_ServerFull;
 	} else {
 		ok = true;
 	}
@@ -194,6 +384,20 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		uOld->disconnectSocket(true);
 	}
 
+	// Clients that support it get a token to associate their UDP
+	// address with, instead of being found by trial decryption.
+	if (msg.udp_token()) {
+		QWriteLocker wl(&qrwlVoiceThread);
+
+		quint64 token = 0;
+		while (! token || qhTokenUsers.contains(token))
+			CryptographicRandom::fillBuffer(&token, sizeof(token));
+
+		uSource->uiUdpToken = token;
+		qhTokenUsers.insert(token, uSource);
+		qhHostUsers[uSource->haAddress].remove(uSource);
+	}
+
 	// Setup UDP encryption
 	{
 		QMutexLocker l(&uSource->qmCrypt);
@@ -204,6 +408,8 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		mpcrypt.set_key(std::string(reinterpret_cast<const char *>(uSource->csCrypt.raw_key), AES_KEY_SIZE_BYTES));
 		mpcrypt.set_server_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.encrypt_iv), AES_BLOCK_SIZE));
 		mpcrypt.set_client_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.decrypt_iv), AES_BLOCK_SIZE));
+		if (uSource->uiUdpToken)
+			mpcrypt.set_udp_token(std::string(reinterpret_cast<const char *>(&uSource->uiUdpToken), UDP_TOKEN_SIZE));
 		sendMessage(uSource, mpcrypt);
 	}
 
@@ -229,51 +435,12 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		sendTextMessage(NULL, uSource, false, QLatin1String("<strong>WARNING:</strong> Your client doesn't support the CELT codec, you won't be able to talk to or hear most clients. Please make sure your client was built with CELT support."));
 	}
 
-	// Transmit channel tree
-	QQueue<Channel *> q;
-	QSet<Channel *> chans;
-	q << root;
-	MumbleProto::ChannelState mpcs;
-	while (! q.isEmpty()) {
-		c = q.dequeue();
-		chans.insert(c);
-
-		mpcs.Clear();
-
-		mpcs.set_channel_id(c->iId);
-		if (c->cParent)
-			mpcs.set_parent(c->cParent->iId);
-		if (c->iId == 0)
-			mpcs.set_name(u8(qsRegName.isEmpty() ? QLatin1String("Root") : qsRegName));
-		else
-			mpcs.set_name(u8(c->qsName));
-
-		mpcs.set_position(c->iPosition);
-
-		if ((uSource->uiVersion >= 0x010202) && ! c->qbaDescHash.isEmpty())
-			mpcs.set_description_hash(blob(c->qbaDescHash));
-		else if (! c->qsDesc.isEmpty())
-			mpcs.set_description(u8(c->qsDesc));
-
-		mpcs.set_max_users(c->uiMaxUsers);
-
-		sendMessage(uSource, mpcs);
-
-		foreach(c, c->qlChannels)
-			q.enqueue(c);
-	}
-
-	// Transmit links
-	foreach(c, chans) {
-		if (c->qhLinks.count() > 0) {
-			mpcs.Clear();
-			mpcs.set_channel_id(c->iId);
+	// Transmit channel tree and links
+	const SyncVariant sync = (uSource->uiVersion >= 0x010202) ? SyncCurrent : SyncLegacy;
+	uSource->sendMessage(syncChannels(sync));
 
-			foreach(Channel *l, c->qhLinks.keys())
-				mpcs.add_links(l->iId);
-			sendMessage(uSource, mpcs);
-		}
-	}
+	// Taken before uSource is authenticated, so it isn't included.
+	QByteArray users = syncUsers(sync);
 
 	// Transmit user profile
 	MumbleProto::UserState mpus;
@@ -284,6 +451,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		QWriteLocker wl(&qrwlVoiceThread);
 		uSource->sState = ServerUser::Authenticated;
 	}
+	updateVoiceSnapshot();
 
 	mpus.set_session(uSource->uiSession);
 	mpus.set_name(u8(uSource->qsName));
@@ -320,51 +488,13 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	sendAll(mpus, ~ 0x010202);
 
 	// Transmit other users profiles
-	foreach(ServerUser *u, qhUsers) {
-		if (u->sState != ServerUser::Authenticated)
-			continue;
+	if ((sync == SyncLegacy) && (uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4))
+		users = syncUsers(SyncLegacyTextures, uSource);
+	uSource->sendMessage(users);
 
-		if (u == uSource)
-			continue;
-
-		mpus.Clear();
-		mpus.set_session(u->uiSession);
-		mpus.set_name(u8(u->qsName));
-		if (u->iId >= 0)
-			mpus.set_user_id(u->iId);
-		if (uSource->uiVersion >= 0x010202) {
-			if (! u->qbaTextureHash.isEmpty())
-				mpus.set_texture_hash(blob(u->qbaTextureHash));
-			else if (! u->qbaTexture.isEmpty())
-				mpus.set_texture(blob(u->qbaTexture));
-		} else if ((uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4)) {
-			mpus.set_texture(blob(u->qbaTexture));
-		}
-		if (u->cChannel->iId != 0)
-			mpus.set_channel_id(u->cChannel->iId);
-		if (u->bDeaf)
-			mpus.set_deaf(true);
-		else if (u->bMute)
-			mpus.set_mute(true);
-		if (u->bSuppress)
-			mpus.set_suppress(true);
-		if (u->bPrioritySpeaker)
-			mpus.set_priority_speaker(true);
-		if (u->bRecording)
-			mpus.set_recording(true);
-		if (u->bSelfDeaf)
-			mpus.set_self_deaf(true);
-		else if (u->bSelfMute)
-			mpus.set_self_mute(true);
-		if ((uSource->uiVersion >= 0x010202) && ! u->qbaCommentHash.isEmpty())
-			mpus.set_comment_hash(blob(u->qbaCommentHash));
-		else if (! u->qsComment.isEmpty())
-			mpus.set_comment(u8(u->qsComment));
-		if (! u->qsHash.isEmpty())
-			mpus.set_hash(u8(u->qsHash));
-
-		sendMessage(uSource, mpus);
-	}
+	// Transmit users on other nodes
+	if (rRelay)
+		rRelay->sendUsers(uSource);
 
 	// Send syncronisation packet
 	MumbleProto::ServerSync mpss;
@@ -377,8 +507,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		mpss.set_permissions(ChanACL::All);
 	} else {
 		QMutexLocker qml(&qmCache);
-		ChanACL::hasPermission(uSource, root, ChanACL::Enter, &acCache);
-		mpss.set_permissions(acCache.value(uSource)->value(root));
+		mpss.set_permissions(ChanACL::effectivePermissions(uSource, root, &acCache));
 	}
 
 	sendMessage(uSource, mpss);
@@ -429,8 +558,7 @@ void Server::msgBanList(ServerUser *uSource, MumbleProto::BanList &msg) {
 		}
 		sendMessage(uSource, msg);
 	} else {
-		previousBans = qlBans.toSet();
-		qlBans.clear();
+		QList<Ban> bans;
 		for (int i=0;i < msg.bans_size(); ++i) {
 			const MumbleProto::BanList_BanEntry &be = msg.bans(i);
 
@@ -448,10 +576,11 @@ void Server::msgBanList(ServerUser *uSource, MumbleProto::BanList &msg) {
 			}
 			b.iDuration = be.duration();
 			if (b.isValid()) {
-				qlBans << b;
+				bans << b;
 			}
 		}
-		newBans = qlBans.toSet();
+		previousBans = qlBans.toSet();
+		newBans = bans.toSet();
 		QSet<Ban> removed = previousBans - newBans;
 		QSet<Ban> added = newBans - previousBans;
 		foreach(const Ban &b, removed) {
@@ -460,7 +589,7 @@ void Server::msgBanList(ServerUser *uSource, MumbleProto::BanList &msg) {
 		foreach(const Ban &b, added) {
 			log(uSource, QString("New ban: %1").arg(b.toString()));
 		}
-		saveBans();
+		setBans(bans);
 		log(uSource, "Updated banlist");
 	}
 }
@@ -481,7 +610,6 @@ void Server::msgUDPTunnel(ServerUser *uSource, MumbleProto::UDPTunnel &msg) {
 	int len = static_cast<int>(str.length());
 	if (len < 1)
 		return;
-	QReadLocker rl(&qrwlVoiceThread);
 	processMsg(uSource, str.data(), len);
 }
 
@@ -625,6 +753,8 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 
 	// Writing to bSelfMute, bSelfDeaf and ssContext
 	// requires holding a write lock on qrwlVoiceThread.
+	bool selfState = false;
+	bool context = false;
 	{
 		QWriteLocker wl(&qrwlVoiceThread);
 
@@ -633,6 +763,7 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 			if (uSource->bSelfDeaf)
 				msg.set_self_mute(true);
 			bBroadcast = true;
+			selfState = true;
 		}
 
 		if (msg.has_self_mute()) {
@@ -642,16 +773,27 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 				uSource->bSelfDeaf = false;
 			}
 			bBroadcast = true;
+			selfState = true;
 		}
 
 		if (msg.has_plugin_context()) {
 			uSource->ssContext = msg.plugin_context();
+			// A position from another game means nothing in this one.
+			uSource->prPosition.clear();
+			context = true;
 
 			// Make sure to clear this from the packet so we don't broadcast it
 			msg.clear_plugin_context();
 		}
 	}
 
+	// Positional contexts are numbered across all users, so a new
+	// one needs the full snapshot.
+	if (context)
+		updateVoiceSnapshot();
+	else if (selfState)
+		patchVoiceSnapshot(uSource);
+
 	if (msg.has_plugin_identity()) {
 		uSource->qsIdentity = u8(msg.plugin_identity());
 		// Make sure to clear this from the packet so we don't broadcast it
@@ -694,6 +836,9 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 		if (msg.has_priority_speaker())
 			pDstServerUser->bPrioritySpeaker = msg.priority_speaker();
 
+		wl.unlock();
+		patchVoiceSnapshot(pDstServerUser);
+
 		log(uSource, QString("Changed speak-state of %1 (%2 %3 %4 %5)").arg(QString(*pDstServerUser),
 		        QString::number(pDstServerUser->bMute),
 		        QString::number(pDstServerUser->bDeaf),
@@ -776,7 +921,7 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 		sendAll(msg, 0x010202);
 
 		if (bDstAclChanged)
-			clearACLCache(pDstServerUser);
+			refreshPermissions(pDstServerUser);
 	}
 
 	emit userStateChanged(pDstServerUser);
@@ -807,8 +952,7 @@ void Server::msgUserRemove(ServerUser *uSource, MumbleProto::UserRemove &msg) {
 		b.qsHash = pDstServerUser->qsHash;
 		b.qdtStart = QDateTime::currentDateTime().toUTC();
 		b.iDuration = 0;
-		qlBans << b;
-		saveBans();
+		addBan(b);
 	}
 
 	sendAll(msg);
@@ -931,7 +1075,7 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 			a->pDeny=ChanACL::None;
 			a->pAllow=ChanACL::Write | ChanACL::Traverse;
 
-			clearACLCache();
+			clearACLCache(c);
 		}
 		updateChannel(c);
 
@@ -1058,6 +1202,9 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 				c->cParent->removeChannel(c);
 				p->addChannel(c);
 			}
+			// Inherited ACLs, and the channels sub groups match, change
+			// with the parent.
+			clearACLCache();
 		}
 		if (! qsName.isNull()) {
 			log(uSource, QString("Renamed channel %1 to %2").arg(QString(*c),
@@ -1370,7 +1517,7 @@ void Server::msgACL(ServerUser *uSource, MumbleProto::ACL &msg) {
 			}
 		}
 
-		clearACLCache();
+		clearACLCache(c);
 
 		if (! hasPermission(uSource, c, ChanACL::Write) && ((uSource->iId >= 0) || !uSource->qsHash.isEmpty())) {
 			{
@@ -1388,7 +1535,7 @@ void Server::msgACL(ServerUser *uSource, MumbleProto::ACL &msg) {
 				a->pAllow = ChanACL::Write | ChanACL::Traverse;
 			}
 
-			clearACLCache();
+			clearACLCache(c);
 		}
 
 
@@ -1501,6 +1648,11 @@ void Server::msgVersion(ServerUser *uSource, MumbleProto::Version &msg) {
 		if (msg.has_os_version())
 			uSource->qsOSVersion = u8(msg.os_version());
 	}
+	// The voice threads read the flag from the snapshot.
+	if (uSource->bUdpAggregate != msg.udp_aggregate()) {
+		uSource->bUdpAggregate = msg.udp_aggregate();
+		patchVoiceSnapshot(uSource);
+	}
 
 	log(uSource, QString("Client version %1 (%2: %3)").arg(MumbleVersion::toString(uSource->uiVersion)).arg(uSource->qsOS).arg(uSource->qsRelease));
 }
@@ -11,6 +11,9 @@
 #include "Net.h"
 #include "ServerDB.h"
 #include "Server.h"
+#include "SslSessions.h"
+#include "SslWorker.h"
+#include "PasswordHasher.h"
 #include "OSInfo.h"
 #include "Version.h"
 #include "SSL.h"
@@ -70,6 +73,20 @@ MetaParams::MetaParams() {
 
 	iChannelNestingLimit = 10;
 
+	iUdpBatchSize = 32;
+	iVoiceThreads = 1;
+	iSslThreads = 2;
+	iSslSessions = 20000;
+	bSslTickets = true;
+	iAuthTimeout = 5;
+	bAuthTimeoutReject = false;
+	iAuthThreads = 4;
+	iKdfThreads = 2;
+	iKdfPerIp = 2;
+	iKdfQueue = 64;
+	fAudibleRadius = 0.0f;
+	usRelayPort = 0;
+
 	qrUserName = QRegExp(QLatin1String("[-=\\w\\[\\]\\{\\}\\(\\)\\@\\|\\.]+"));
 	qrChannelName = QRegExp(QLatin1String("[ \\-=\\w\\#\\[\\]\\{\\}\\(\\)\\@\\|]+"));
 
@@ -342,6 +359,26 @@ void MetaParams::read(QString fname) {
 
 	iChannelNestingLimit = typeCheckedFromSettings("channelnestinglimit", iChannelNestingLimit);
 
+	iUdpBatchSize = qBound(1, typeCheckedFromSettings("udpbatchsize", iUdpBatchSize), 1024);
+	iVoiceThreads = qBound(1, typeCheckedFromSettings("voicethreads", iVoiceThreads), 64);
+	fAudibleRadius = qMax(0.0f, static_cast<float>(typeCheckedFromSettings("audibleradius", static_cast<double>(fAudibleRadius))));
+	qsMaxSpeakers = typeCheckedFromSettings("maxspeakers", qsMaxSpeakers);
+	usRelayPort = static_cast<unsigned short>(typeCheckedFromSettings("relayport", static_cast<uint>(usRelayPort)));
+	qsRelayPeers = typeCheckedFromSettings("relaypeers", qsRelayPeers);
+	qsRelayChannels = typeCheckedFromSettings("relaychannels", qsRelayChannels);
+	qsRelaySecret = typeCheckedFromSettings("relaysecret", qsRelaySecret);
+	qsVoiceCapture = typeCheckedFromSettings("voicecapture", qsVoiceCapture);
+	iSslThreads = qBound(0, typeCheckedFromSettings("sslthreads", iSslThreads), 64);
+	iSslSessions = qMax(0, typeCheckedFromSettings("sslsessions", iSslSessions));
+	bSslTickets = typeCheckedFromSettings("ssltickets", bSslTickets);
+	qsSslTicketKeys = typeCheckedFromSettings("sslticketkeys", qsSslTicketKeys);
+	iAuthTimeout = qBound(1, typeCheckedFromSettings("authtimeout", iAuthTimeout), 300);
+	bAuthTimeoutReject = typeCheckedFromSettings("authtimeoutreject", bAuthTimeoutReject);
+	iAuthThreads = qBound(1, typeCheckedFromSettings("auththreads", iAuthThreads), 64);
+	iKdfThreads = qBound(0, typeCheckedFromSettings("kdfthreads", iKdfThreads), 64);
+	iKdfPerIp = qMax(1, typeCheckedFromSettings("kdfperip", iKdfPerIp));
+	iKdfQueue = qMax(1, typeCheckedFromSettings("kdfqueue", iKdfQueue));
+
 #ifdef Q_OS_UNIX
 	qsName = qsSettings->value("uname").toString();
 	if (geteuid() == 0) {
@@ -617,6 +654,10 @@ bool MetaParams::loadSSLSettings() {
 }
 
 Meta::Meta() {
+	sscSessions = new SslSessionCache(this);
+	swpPool = new SslWorkerPool(mp.iSslThreads, this);
+	phHasher = new PasswordHasher(mp.iKdfThreads, this);
+
 #ifdef Q_OS_WIN
 	QOS_VERSION qvVer;
 	qvVer.MajorVersion = 1;
@@ -638,6 +679,11 @@ Meta::Meta() {
 }
 
 Meta::~Meta() {
+	delete phHasher;
+	delete swpPool;
+	delete sscSessions;
+	sscSessions = NULL;
+
 #ifdef Q_OS_WIN
 	if (hQoS) {
 		QOSCloseHandle(hQoS);
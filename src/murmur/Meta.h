@@ -21,6 +21,9 @@
 #include "Timer.h"
 
 class Server;
+class SslSessionCache;
+class SslWorkerPool;
+class PasswordHasher;
 class QSettings;
 
 class MetaParams {
@@ -39,6 +42,64 @@ public:
 	int iMaxImageMessageLength;
 	int iOpusThreshold;
 	int iChannelNestingLimit;
+	/// Maximum number of datagrams a voice thread receives
+	/// per system call using recvmmsg(). Datagrams generated
+	/// while processing a batch are sent using sendmmsg().
+	/// A value of 1 disables batched UDP I/O. (Linux only)
+	int iUdpBatchSize;
+	/// Number of threads forwarding voice for each virtual server.
+	/// Clients are spread over the threads by their UDP source
+	/// address using SO_REUSEPORT. (Linux only)
+	int iVoiceThreads;
+	/// Distance (in the game's position units) beyond which normal
+	/// speech with positional audio is not forwarded to listeners in
+	/// the same game. 0 disables positional culling.
+	float fAudibleRadius;
+	/// Channels where only the most active speakers are forwarded, as
+	/// whitespace separated "channel:speakers" pairs.
+	QString qsMaxSpeakers;
+	/// UDP port of the relay link to other murmur nodes, or 0 if
+	/// the server isn't part of a cluster.
+	unsigned short usRelayPort;
+	/// Relay links of the other nodes, as whitespace separated
+	/// "host:port" pairs.
+	QString qsRelayPeers;
+	/// IDs of the channels shared with the other nodes.
+	QString qsRelayChannels;
+	/// Key used to authenticate relay datagrams. Must be the
+	/// same on all nodes.
+	QString qsRelaySecret;
+	/// File the voice traffic of each server is captured to, for
+	/// replaying with -replay. Empty to disable.
+	QString qsVoiceCapture;
+	/// Number of threads doing the TLS handshakes of new connections
+	/// for all virtual servers. 0 does them on the main thread.
+	int iSslThreads;
+	/// Number of TLS sessions kept for resumption by session ID,
+	/// shared by all virtual servers. 0 disables session ID resumption.
+	int iSslSessions;
+	/// Whether clients may resume TLS sessions with session tickets.
+	bool bSslTickets;
+	/// File keeping the session ticket keys across restarts, or
+	/// empty to keep them in memory only.
+	QString qsSslTicketKeys;
+	/// Seconds the asynchronous authenticators have to answer.
+	int iAuthTimeout;
+	/// Whether users are rejected when the authenticators don't answer
+	/// in time, instead of being checked against the local database.
+	bool bAuthTimeoutReject;
+	/// Number of threads asking gRPC authenticators for all virtual
+	/// servers. Each server's authenticator is asked one request at a time.
+	int iAuthThreads;
+	/// Number of threads hashing the passwords of logging in users
+	/// for all virtual servers. 0 hashes them on the main thread.
+	int iKdfThreads;
+	/// Number of password hashes a client address may have queued or
+	/// in progress at a time.
+	int iKdfPerIp;
+	/// Number of password hashes that may be queued or in progress
+	/// at a time, for all virtual servers.
+	int iKdfQueue;
 	/// If true the old SHA1 password hashing is used instead of PBKDF2
 	bool legacyPasswordHash;
 	/// Contains the default number of PBKDF2 iterations to use
@@ -162,6 +223,9 @@ class Meta : public QObject {
 		QHash<QHostAddress, Timer> qhBans;
 		QString qsOS, qsOSVersion;
 		Timer tUptime;
+		SslSessionCache *sscSessions;
+		SslWorkerPool *swpPool;
+		PasswordHasher *phHasher;
 
 #ifdef Q_OS_WIN
 		static HANDLE hQoS;
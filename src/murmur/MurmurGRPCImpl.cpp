@@ -138,11 +138,14 @@ MurmurRPCImpl::MurmurRPCImpl(const QString &address, std::shared_ptr<::grpc::Ser
 	builder.RegisterService(&m_V1Service);
 	m_completionQueue = builder.AddCompletionQueue();
 	m_server = builder.BuildAndStart();
+	m_authenticatePool.setMaxThreadCount(Meta::mp.iAuthThreads);
 	meta->connectListener(this);
 	start();
 }
 
 MurmurRPCImpl::~MurmurRPCImpl() {
+	m_authenticatePool.waitForDone();
+	qDeleteAll(m_authenticatorLocks);
 }
 
 // ToRPC/FromRPC methods convert data to/from grpc protocol buffer messages.
@@ -380,12 +383,40 @@ void MurmurRPCImpl::removeTextMessageFilter(const ::Server *s) {
 
 // Removes a connected authenticator.
 void MurmurRPCImpl::removeAuthenticator(const ::Server *s) {
-	auto authenticator = m_authenticators.value(s->iServerNum);
+	removeAuthenticator(s->iServerNum);
+}
+
+void MurmurRPCImpl::removeAuthenticator(int server_id) {
+	auto authenticator = m_authenticators.value(server_id);
 	if (!authenticator) {
 		return;
 	}
 	authenticator->error(::grpc::Status(::grpc::CANCELLED, "authenticator detached"));
-	m_authenticators.remove(s->iServerNum);
+	m_authenticators.remove(server_id);
+}
+
+// Returns the lock of a server's authenticator stream.
+QMutex *MurmurRPCImpl::authenticatorLock(int server_id) {
+	QMutexLocker l(&qmAuthenticatorsLock);
+	auto &lock = m_authenticatorLocks[server_id];
+	if (!lock) {
+		lock = new QMutex();
+	}
+	return lock;
+}
+
+// Sends the request in authenticator->response and reads the answer into
+// authenticator->request. The caller holds authenticatorLock(server_id).
+// An authenticator whose stream failed is removed.
+bool MurmurRPCImpl::askAuthenticator(int server_id, ::MurmurRPC::Wrapper::V1_AuthenticatorStream *authenticator) {
+	if (authenticator->writeRead()) {
+		return true;
+	}
+	QMutexLocker l(&qmAuthenticatorsLock);
+	if (m_authenticators.value(server_id) == authenticator) {
+		removeAuthenticator(server_id);
+	}
+	return false;
 }
 
 // Called when a connecting user needs to be authenticated.
@@ -396,6 +427,8 @@ void MurmurRPCImpl::authenticateSlot(int &res, QString &uname, int sessionId, co
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_authenticate()->set_name(u8(uname));
@@ -411,13 +444,9 @@ void MurmurRPCImpl::authenticateSlot(int &res, QString &uname, int sessionId, co
 		request.mutable_authenticate()->set_strong_certificate(certstrong);
 	}
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			res = -1;
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		res = -1;
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -455,6 +484,148 @@ void MurmurRPCImpl::authenticateSlot(int &res, QString &uname, int sessionId, co
 	}
 }
 
+// Asks an authenticator on m_authenticatePool, and passes the answer to the
+// Server in the main thread.
+class AuthenticateRunnable : public QRunnable {
+public:
+	MurmurRPCImpl *rpc;
+	// Only compared against in the main thread; the server may be stopped
+	// while the request is out.
+	::Server *server;
+	int server_id;
+	// Started when the request was made, like the Server's own deadline.
+	Timer queued;
+	::MurmurRPC::Wrapper::V1_AuthenticatorStream *authenticator;
+	unsigned int request;
+	// The answer if the authenticator falls through.
+	int fallthrough;
+	QString uname, pw, certhash;
+	QList<QByteArray> certs;
+	bool certstrong;
+
+	void run() override;
+};
+
+void AuthenticateRunnable::run() {
+	int res = fallthrough;
+	QString name;
+	QStringList qsl;
+	bool failed = false;
+
+	// Server::checkAuthDeadlines() has already given up on requests that
+	// waited for a thread or for the stream longer than authtimeout; don't
+	// send those at all.
+	const quint64 timeout = static_cast<quint64>(Meta::mp.iAuthTimeout) * 1000000ULL;
+	if (queued.isElapsed(timeout)) {
+		authenticator->deref();
+		return;
+	}
+
+	{
+		QMutexLocker l(rpc->authenticatorLock(server_id));
+		if (queued.isElapsed(timeout)) {
+			l.unlock();
+			authenticator->deref();
+			return;
+		}
+
+		auto &request = authenticator->response;
+		request.Clear();
+		request.mutable_authenticate()->set_name(u8(uname));
+		if (!pw.isEmpty()) {
+			request.mutable_authenticate()->set_password(u8(pw));
+		}
+		foreach(const auto &data, certs) {
+			request.mutable_authenticate()->add_certificates(data.constData(), data.size());
+		}
+		if (!certhash.isEmpty()) {
+			request.mutable_authenticate()->set_certificate_hash(u8(certhash));
+			request.mutable_authenticate()->set_strong_certificate(certstrong);
+		}
+
+		if (!rpc->askAuthenticator(server_id, authenticator)) {
+			failed = true;
+		} else {
+			auto &response = authenticator->request;
+			switch (response.authenticate().status()) {
+			case ::MurmurRPC::Authenticator_Response_Status_Success:
+				if (!response.authenticate().has_id()) {
+					res = -3;
+					break;
+				}
+				res = response.authenticate().id();
+				if (response.authenticate().has_name()) {
+					name = u8(response.authenticate().name());
+				}
+				for (int i = 0; i < response.authenticate().groups_size(); i++) {
+					auto &group = response.authenticate().groups(i);
+					if (group.has_name()) {
+						qsl << u8(group.name());
+					}
+				}
+				break;
+			case ::MurmurRPC::Authenticator_Response_Status_TemporaryFailure:
+				res = -3;
+				break;
+			case ::MurmurRPC::Authenticator_Response_Status_Failure:
+				res = -1;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	authenticator->deref();
+
+	if (failed) {
+		res = -1;
+	}
+
+	// Posted to the long-lived MurmurRPCImpl, which looks the server up
+	// again, as it may have been stopped in the meantime.
+	auto s = server;
+	auto sid = server_id;
+	auto id = request;
+	::boost::function<void()> fn = [s, sid, id, res, name, qsl]() {
+		::Server *current = meta->qhServers.value(sid);
+		if (current && current == s) {
+			current->authenticateDone(id, res, name, qsl);
+		}
+	};
+	QCoreApplication::instance()->postEvent(rpc, new RPCExecEvent(fn, NULL));
+}
+
+// Called when a connecting user needs to be authenticated. The authenticator
+// is asked on m_authenticatePool; the Server waits for its answer.
+void MurmurRPCImpl::authenticateAsyncSlot(unsigned int request, const QString &uname, int, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
+	::Server *s = qobject_cast< ::Server *> (sender());
+	const int fallthrough = s->bForceExternalAuth ? -3 : -2;
+
+	auto authenticator = m_authenticators.value(s->iServerNum);
+	if (!authenticator || authenticator->context.IsCancelled()) {
+		s->authenticateDone(request, fallthrough, QString(), QStringList());
+		return;
+	}
+
+	auto runnable = new AuthenticateRunnable();
+	runnable->rpc = this;
+	runnable->server = s;
+	runnable->server_id = s->iServerNum;
+	runnable->authenticator = authenticator;
+	runnable->request = request;
+	runnable->fallthrough = fallthrough;
+	runnable->uname = uname;
+	runnable->pw = pw;
+	runnable->certhash = certhash;
+	runnable->certstrong = certstrong;
+	foreach(const auto &cert, certlist) {
+		runnable->certs << cert.toDer();
+	}
+
+	authenticator->ref();
+	m_authenticatePool.start(runnable);
+}
+
 // Called when a user is being registered on the server.
 void MurmurRPCImpl::registerUserSlot(int &res, const QMap<int, QString> &info) {
 	::Server *s = qobject_cast< ::Server *> (sender());
@@ -463,16 +634,14 @@ void MurmurRPCImpl::registerUserSlot(int &res, const QMap<int, QString> &info) {
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	ToRPC(s, info, QByteArray(), request.mutable_register_()->mutable_user());
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -500,17 +669,15 @@ void MurmurRPCImpl::unregisterUserSlot(int &res, int id) {
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_deregister()->mutable_user()->mutable_server()->set_id(s->iServerNum);
 	request.mutable_deregister()->mutable_user()->set_id(id);
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -528,18 +695,16 @@ void MurmurRPCImpl::getRegisteredUsersSlot(const QString &filter, QMap<int, QStr
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	if (!filter.isEmpty()) {
 		request.mutable_query()->set_filter(u8(filter));
 	}
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -561,18 +726,16 @@ void MurmurRPCImpl::getRegistrationSlot(int &res, int id, QMap<int, QString> &in
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_find()->set_id(id);
 
 	res = -1;
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -590,6 +753,8 @@ void MurmurRPCImpl::setInfoSlot(int &res, int id, const QMap<int, QString> &info
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_update()->mutable_user()->set_id(id);
@@ -597,12 +762,8 @@ void MurmurRPCImpl::setInfoSlot(int &res, int id, const QMap<int, QString> &info
 
 	res = 0;
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -626,17 +787,15 @@ void MurmurRPCImpl::setTextureSlot(int &res, int id, const QByteArray &texture)
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_update()->mutable_user()->set_id(id);
 	request.mutable_update()->mutable_user()->set_texture(texture.constData(), texture.size());
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -653,16 +812,14 @@ void MurmurRPCImpl::nameToIdSlot(int &res, const QString &name) {
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_find()->set_name(u8(name));
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -679,16 +836,14 @@ void MurmurRPCImpl::idToNameSlot(QString &res, int id) {
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_find()->set_id(id);
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -705,16 +860,14 @@ void MurmurRPCImpl::idToTextureSlot(QByteArray &res, int id) {
 		return;
 	}
 
+	QMutexLocker l(authenticatorLock(s->iServerNum));
+
 	auto &request = authenticator->response;
 	request.Clear();
 	request.mutable_find()->set_id(id);
 
-	{
-		QMutexLocker l(&qmAuthenticatorsLock);
-		if (!authenticator->writeRead()) {
-			removeAuthenticator(s);
-			return;
-		}
+	if (!askAuthenticator(s->iServerNum, authenticator)) {
+		return;
 	}
 
 	auto &response = authenticator->request;
@@ -1092,7 +1245,9 @@ void MurmurRPCImpl::customEvent(QEvent *evt) {
 		try {
 			event->execute();
 		} catch (::grpc::Status &ex) {
-			event->call->error(ex);
+			if (event->call) {
+				event->call->error(ex);
+			}
 		}
 	}
 }
@@ -1732,15 +1887,15 @@ void V1_BansGet::impl(bool) {
 
 void V1_BansSet::impl(bool) {
 	auto server = MustServer(request);
-	server->qlBans.clear();
+	QList< ::Ban> bans;
 
 	for (int i = 0; i < request.bans_size(); i++) {
 		const auto &rpcBan = request.bans(i);
 		::Ban ban;
 		FromRPC(server, rpcBan, ban);
-		server->qlBans << ban;
+		bans << ban;
 	}
-	server->saveBans();
+	server->setBans(bans);
 
 	end();
 }
@@ -1872,7 +2027,7 @@ void V1_ACLSet::impl(bool) {
 		}
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(channel);
 	server->updateChannel(channel);
 
 	end();
@@ -1960,6 +2115,7 @@ void V1_AuthenticatorStream::impl(bool) {
 			throw ::grpc::Status(::grpc::INVALID_ARGUMENT, "missing initialize");
 		}
 		auto server = MustServer(request.initialize());
+		QMutexLocker sl(rpc->authenticatorLock(server->iServerNum));
 		QMutexLocker l(&rpc->qmAuthenticatorsLock);
 		rpc->removeAuthenticator(server);
 		rpc->m_authenticators.insert(server->iServerNum, this);
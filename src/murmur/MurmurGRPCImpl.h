@@ -18,6 +18,7 @@
 #include <atomic>
 
 #include <QMultiHash>
+#include <QThreadPool>
 
 #include <grpc++/grpc++.h>
 
@@ -56,6 +57,13 @@ class MurmurRPCImpl : public QThread {
 
 		QMutex qmAuthenticatorsLock;
 		QHash<int, ::MurmurRPC::Wrapper::V1_AuthenticatorStream *> m_authenticators;
+		// Held while a server's authenticator stream is asked something, as
+		// the stream carries one request at a time. Created on first use.
+		QHash<int, QMutex *> m_authenticatorLocks;
+		// Threads asking the authenticators for authenticateAsyncSlot, sized
+		// by auththreads. Declared after the locks, so that it is stopped
+		// before they are destroyed.
+		QThreadPool m_authenticatePool;
 
 		QMutex qmTextMessageFilterLock;
 		QHash<int, ::MurmurRPC::Wrapper::V1_TextMessageFilter *> m_textMessageFilters;
@@ -71,6 +79,9 @@ class MurmurRPCImpl : public QThread {
 
 		void removeTextMessageFilter(const ::Server *s);
 		void removeAuthenticator(const ::Server *s);
+		void removeAuthenticator(int server_id);
+		QMutex *authenticatorLock(int server_id);
+		bool askAuthenticator(int server_id, ::MurmurRPC::Wrapper::V1_AuthenticatorStream *authenticator);
 		void sendMetaEvent(const ::MurmurRPC::Event &e);
 		void sendServerEvent(const ::Server *s, const ::MurmurRPC::Server_Event &e);
 
@@ -79,6 +90,7 @@ class MurmurRPCImpl : public QThread {
 		void stopped(Server *server);
 
 		void authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
+		void authenticateAsyncSlot(unsigned int request, const QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
 		void registerUserSlot(int &res, const QMap<int, QString> &);
 		void unregisterUserSlot(int &res, int id);
 		void getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &res);
@@ -698,6 +698,88 @@ void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const
 	}
 }
 
+/// Answer of an authenticator to an authenticateAsyncSlot() call, in an
+/// Ice client thread. Passed on to MurmurIce in the main thread, which
+/// looks the server up again, as it may have been stopped in the meantime.
+class AuthenticateCallback : public IceUtil::Shared {
+	protected:
+		/// Only compared against, never dereferenced outside the main
+		/// thread; a server restarted under the same id is a new one.
+		::Server *server;
+		int iServerNum;
+		unsigned int request;
+
+		static ::Server *lookup(::Server *s, int server_id);
+	public:
+		AuthenticateCallback(::Server *s, unsigned int r) : server(s), iServerNum(s->iServerNum), request(r) {}
+		void response(::Ice::Int res, const ::std::string &newname, const ::Murmur::GroupNameList &groups);
+		void exception(const ::Ice::Exception &);
+		static void done(::Server *s, int server_id, unsigned int request, int res, const QString &name, const QStringList &groups);
+		static void failed(::Server *s, int server_id, unsigned int request);
+};
+
+typedef IceUtil::Handle<AuthenticateCallback> AuthenticateCallbackPtr;
+
+::Server *AuthenticateCallback::lookup(::Server *s, int server_id) {
+	::Server *server = meta->qhServers.value(server_id);
+	return (server == s) ? server : NULL;
+}
+
+void AuthenticateCallback::done(::Server *s, int server_id, unsigned int request, int res, const QString &name, const QStringList &groups) {
+	::Server *server = lookup(s, server_id);
+	if (server)
+		server->authenticateDone(request, res, name, groups);
+}
+
+void AuthenticateCallback::failed(::Server *s, int server_id, unsigned int request) {
+	::Server *server = lookup(s, server_id);
+	if (! server)
+		return;
+	mi->badAuthenticator(server);
+	server->authenticateDone(request, server->bForceExternalAuth ? -3 : -2, QString(), QStringList());
+}
+
+void AuthenticateCallback::response(::Ice::Int res, const ::std::string &newname, const ::Murmur::GroupNameList &groups) {
+	QStringList qsl;
+	foreach(const ::std::string &str, groups) {
+		qsl << u8(str);
+	}
+
+	ExecEvent *ie = new ExecEvent(boost::bind(&AuthenticateCallback::done, server, iServerNum, request, static_cast<int>(res), u8(newname), qsl));
+	QCoreApplication::instance()->postEvent(mi, ie);
+}
+
+void AuthenticateCallback::exception(const ::Ice::Exception &) {
+	ExecEvent *ie = new ExecEvent(boost::bind(&AuthenticateCallback::failed, server, iServerNum, request));
+	QCoreApplication::instance()->postEvent(mi, ie);
+}
+
+void MurmurIce::authenticateAsyncSlot(unsigned int request, const QString &uname, int, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
+	::Server *server = qobject_cast< ::Server *> (sender());
+
+	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
+	::Murmur::CertificateList certs;
+
+	certs.resize(certlist.size());
+	for (int i=0;i<certlist.size();++i) {
+		::Murmur::CertificateDer der;
+		QByteArray qba = certlist.at(i).toDer();
+		der.resize(qba.size());
+		const char *ptr = qba.constData();
+		for (int j=0;j<qba.size();++j)
+			der[j] = ptr[j];
+		certs[i] = der;
+	}
+
+	AuthenticateCallbackPtr cb = new AuthenticateCallback(server, request);
+	try {
+		prx->begin_authenticate(iceString(uname), iceString(pw), certs, iceString(certhash), certstrong,
+		                        ::Murmur::newCallback_ServerAuthenticator_authenticate(cb, &AuthenticateCallback::response, &AuthenticateCallback::exception));
+	} catch (...) {
+		AuthenticateCallback::failed(server, server->iServerNum, request);
+	}
+}
+
 void MurmurIce::registerUserSlot(int &res, const QMap<int, QString> &info) {
 	::Server *server = qobject_cast< ::Server *> (sender());
 
@@ -1100,13 +1182,13 @@ static void impl_Server_getBans(const ::Murmur::AMD_Server_getBansPtr cb, int se
 
 static void impl_Server_setBans(const ::Murmur::AMD_Server_setBansPtr cb, int server_id,  const ::Murmur::BanList& bans) {
 	NEED_SERVER;
-	server->qlBans.clear();
+	QList< ::Ban> ql;
 	foreach(const ::Murmur::Ban &mb, bans) {
 		::Ban ban;
 		banToBan(mb, ban);
-		server->qlBans << ban;
+		ql << ban;
 	}
-	server->saveBans();
+	server->setBans(ql);
 	cb->ice_response();
 }
 
@@ -1417,7 +1499,7 @@ static void impl_Server_setACL(const ::Murmur::AMD_Server_setACLPtr cb, int serv
 		acl->pAllow = static_cast<ChanACL::Permissions>(ai.allow) & ChanACL::All;
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(channel);
 	server->updateChannel(channel);
 	cb->ice_response();
 }
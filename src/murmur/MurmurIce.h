@@ -23,6 +23,7 @@ struct TextMessage;
 
 class MurmurIce : public QObject {
 		friend class MurmurLocker;
+		friend class AuthenticateCallback;
 		Q_OBJECT;
 	protected:
 		int count;
@@ -63,6 +64,7 @@ class MurmurIce : public QObject {
 		void stopped(Server *);
 
 		void authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
+		void authenticateAsyncSlot(unsigned int request, const QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
 		void registerUserSlot(int &res, const QMap<int, QString> &);
 		void unregisterUserSlot(int &res, int id);
 		void getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &res);
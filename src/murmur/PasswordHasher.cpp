@@ -0,0 +1,137 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "PasswordHasher.h"
+
+#include "Meta.h"
+#include "PBKDF2.h"
+#include "Server.h"
+
+/// Computes the hash of one HashJob on the PasswordHasher's pool.
+class HashRunnable : public QRunnable {
+	protected:
+		PasswordHasher *phHasher;
+		HashJob *job;
+	public:
+		HashRunnable(PasswordHasher *hasher, HashJob *j) : phHasher(hasher), job(j) {}
+		void run() Q_DECL_OVERRIDE;
+};
+
+void HashRunnable::run() {
+	job->uiQueueWait = job->tStage.restart();
+	job->qsHash = PBKDF2::getHash(job->qsSalt, job->qsPassword, job->iIterations);
+	job->uiHash = job->tStage.restart();
+	phHasher->handover(job);
+}
+
+PasswordHasher::PasswordHasher(int threads, QObject *p) : QObject(p), iThreads(threads) {
+	iInFlight = iInFlightMax = 0;
+	uiHashes = uiRejected = uiBusy = 0;
+	uiQueueWaitTotal = uiQueueWaitMax = 0;
+	uiHashTotal = uiHashMax = 0;
+
+	qtpPool = new QThreadPool(this);
+	qtpPool->setMaxThreadCount(qMax(threads, 1));
+
+	qtReport = new QTimer(this);
+	connect(qtReport, SIGNAL(timeout()), this, SLOT(report()));
+	if (threads > 0)
+		qtReport->start(KDF_REPORT_INTERVAL * 1000);
+}
+
+PasswordHasher::~PasswordHasher() {
+	qtpPool->waitForDone();
+
+	foreach(HashJob *job, qlDone)
+		delete job;
+}
+
+bool PasswordHasher::isEnabled() const {
+	return iThreads > 0;
+}
+
+PasswordHasher::Result PasswordHasher::hash(Server *s, unsigned int request, const HostAddress &address, const QString &salt, const QString &password, int iterations) {
+	if (iInFlight >= Meta::mp.iKdfQueue) {
+		++uiBusy;
+		return Busy;
+	}
+
+	int &n = qhInFlight[address];
+	if (n >= Meta::mp.iKdfPerIp) {
+		++uiRejected;
+		return AddressLimit;
+	}
+	++n;
+	++iInFlight;
+	iInFlightMax = qMax(iInFlightMax, iInFlight);
+
+	HashJob *job = new HashJob();
+	job->s = s;
+	job->iServerNum = s->iServerNum;
+	job->uiRequest = request;
+	job->haAddress = address;
+	job->qsSalt = salt;
+	job->qsPassword = password;
+	job->iIterations = iterations;
+	job->uiQueueWait = job->uiHash = 0;
+
+	qtpPool->start(new HashRunnable(this, job));
+	return Queued;
+}
+
+void PasswordHasher::handover(HashJob *job) {
+	bool wake;
+	{
+		QMutexLocker lock(&qmDone);
+		wake = qlDone.isEmpty();
+		qlDone.append(job);
+	}
+	if (wake)
+		QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+}
+
+void PasswordHasher::deliver() {
+	QList<HashJob *> ql;
+	{
+		QMutexLocker lock(&qmDone);
+		ql.swap(qlDone);
+	}
+
+	foreach(HashJob *job, ql) {
+		--iInFlight;
+		if (--qhInFlight[job->haAddress] <= 0)
+			qhInFlight.remove(job->haAddress);
+
+		++uiHashes;
+		uiQueueWaitTotal += job->uiQueueWait;
+		uiQueueWaitMax = qMax(uiQueueWaitMax, job->uiQueueWait);
+		uiHashTotal += job->uiHash;
+		uiHashMax = qMax(uiHashMax, job->uiHash);
+
+		// The server may have been stopped while the hash was computed.
+		Server *s = meta->qhServers.value(job->iServerNum);
+		if (s == job->s)
+			s->passwordHashed(job->uiRequest, job->qsHash);
+		delete job;
+	}
+}
+
+void PasswordHasher::report() {
+	if (uiHashes == 0 && uiRejected == 0 && uiBusy == 0)
+		return;
+
+	const double n = static_cast<double>(qMax(uiHashes, Q_UINT64_C(1))) * 1000.0;
+	qWarning("PBKDF2: %llu hashes, %llu rejected by kdfperip, %llu by kdfqueue, %d in flight (max %d). Queue wait avg %.1f ms, max %.1f ms. Hash avg %.1f ms, max %.1f ms.",
+	         uiHashes, uiRejected, uiBusy, iInFlight, iInFlightMax,
+	         static_cast<double>(uiQueueWaitTotal) / n, static_cast<double>(uiQueueWaitMax) / 1000.0,
+	         static_cast<double>(uiHashTotal) / n, static_cast<double>(uiHashMax) / 1000.0);
+
+	uiHashes = uiRejected = uiBusy = 0;
+	iInFlightMax = iInFlight;
+	uiQueueWaitTotal = uiQueueWaitMax = 0;
+	uiHashTotal = uiHashMax = 0;
+}
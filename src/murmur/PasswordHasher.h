@@ -0,0 +1,97 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_PASSWORDHASHER_H_
+#define MUMBLE_MURMUR_PASSWORDHASHER_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QString>
+
+#include "HostAddress.h"
+#include "Timer.h"
+
+class QThreadPool;
+class QTimer;
+class Server;
+
+/// Seconds between the hashing statistics logged by PasswordHasher.
+#define KDF_REPORT_INTERVAL 60
+
+/// A PBKDF2 hash computed by the PasswordHasher on behalf of a Server.
+struct HashJob {
+	Server *s;
+	int iServerNum;
+	/// Authentication request of the Server waiting for the hash.
+	unsigned int uiRequest;
+	/// Address of the client, counted against kdfperip.
+	HostAddress haAddress;
+	QString qsSalt;
+	QString qsPassword;
+	int iIterations;
+	QString qsHash;
+	/// Restarted as the job moves from one stage to the next.
+	Timer tStage;
+	/// Time spent waiting for a thread, in microseconds.
+	quint64 uiQueueWait;
+	/// Time spent hashing, in microseconds.
+	quint64 uiHash;
+};
+
+/// Threads computing the PBKDF2 hashes of the passwords users log in
+/// with, for all virtual servers. The iteration count is chosen so
+/// that a hash takes a noticeable amount of time, and a burst of
+/// password logins would otherwise stall the main thread.
+///
+/// Each client address may only have kdfperip hashes queued or in
+/// progress, and all of them together kdfqueue. Finished hashes are queued back to the main thread and
+/// handed to Server::passwordHashed(). Queue depth, queue wait and
+/// hashing times are logged once per KDF_REPORT_INTERVAL.
+class PasswordHasher : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(PasswordHasher);
+	public:
+		enum Result { Queued, AddressLimit, Busy };
+	protected:
+		int iThreads;
+		QThreadPool *qtpPool;
+		QTimer *qtReport;
+		/// Guards qlDone.
+		QMutex qmDone;
+		QList<HashJob *> qlDone;
+		/// Jobs queued or in progress, by client address. Main thread only.
+		QHash<HostAddress, int> qhInFlight;
+		int iInFlight;
+
+		/// Statistics since the last report, in microseconds.
+		/// Main thread only.
+		quint64 uiHashes, uiRejected, uiBusy;
+		int iInFlightMax;
+		quint64 uiQueueWaitTotal, uiQueueWaitMax;
+		quint64 uiHashTotal, uiHashMax;
+	public:
+		PasswordHasher(int threads, QObject *p = NULL);
+		~PasswordHasher();
+
+		/// Whether hashes are computed by worker threads. If not,
+		/// servers compute them on the main thread.
+		bool isEnabled() const;
+		/// Start computing the hash of password for request of s.
+		/// Fails with AddressLimit if address already has kdfperip
+		/// hashes in flight, and with Busy if kdfqueue hashes are.
+		/// Main thread only.
+		Result hash(Server *s, unsigned int request, const HostAddress &address, const QString &salt, const QString &password, int iterations);
+		/// Queue a computed hash for delivery to its server.
+		/// Called by the worker threads.
+		void handover(HashJob *job);
+	public slots:
+		void deliver();
+		void report();
+};
+
+#endif
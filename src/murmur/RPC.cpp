@@ -59,8 +59,9 @@ void Server::setUserState(User *pUser, Channel *cChannel, bool mute, bool deaf,
 		pUser->bMute = mute;
 		pUser->bSuppress = suppressed;
 	}
-
 	pUser->bPrioritySpeaker = prioritySpeaker;
+	patchVoiceSnapshot(pUser);
+
 	pUser->qsName = name;
 	hashAssign(pUser->qsComment, pUser->qbaCommentHash, comment);
 
@@ -137,6 +138,7 @@ bool Server::setChannelStateGRPC(const MumbleProto::ChannelState &cs, QString &e
 				channel->cParent->removeChannel(channel);
 				parent->addChannel(channel);
 			}
+			clearACLCache();
 
 			mpcs.set_parent(parent->iId);
 
@@ -243,6 +245,7 @@ bool Server::setChannelState(Channel *cChannel, Channel *cParent, const QString
 			cChannel->cParent->removeChannel(cChannel);
 			cParent->addChannel(cChannel);
 		}
+		clearACLCache();
 
 		mpcs.set_parent(cParent->iId);
 
@@ -463,12 +466,22 @@ void Server::clearTempGroups(User *user, Channel *cChannel, bool recurse) {
 	clearACLCache(user);
 }
 
+/// Authenticators with an authenticateAsyncSlot() answer through
+/// Server::authenticateDone() instead of blocking authenticateSig.
+static bool hasAuthenticateAsyncSlot(QObject *obj) {
+	static const QByteArray slot = QMetaObject::normalizedSignature("authenticateAsyncSlot(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)");
+	return obj->metaObject()->indexOfSlot(slot.constData()) >= 0;
+}
+
 void Server::connectAuthenticator(QObject *obj) {
 	connect(this, SIGNAL(registerUserSig(int &, const QMap<int, QString> &)), obj, SLOT(registerUserSlot(int &, const QMap<int, QString> &)));
 	connect(this, SIGNAL(unregisterUserSig(int &, int)), obj, SLOT(unregisterUserSlot(int &, int)));
 	connect(this, SIGNAL(getRegisteredUsersSig(const QString &, QMap<int, QString> &)), obj, SLOT(getRegisteredUsersSlot(const QString &, QMap<int, QString> &)));
 	connect(this, SIGNAL(getRegistrationSig(int &, int, QMap<int, QString> &)), obj, SLOT(getRegistrationSlot(int &, int, QMap<int, QString> &)));
-	connect(this, SIGNAL(authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateSlot(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
+	if (hasAuthenticateAsyncSlot(obj))
+		connect(this, SIGNAL(authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateAsyncSlot(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
+	else
+		connect(this, SIGNAL(authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateSlot(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
 	connect(this, SIGNAL(setInfoSig(int &, int, const QMap<int, QString> &)), obj, SLOT(setInfoSlot(int &, int, const QMap<int, QString> &)));
 	connect(this, SIGNAL(setTextureSig(int &, int, const QByteArray &)), obj, SLOT(setTextureSlot(int &, int, const QByteArray &)));
 	connect(this, SIGNAL(idToNameSig(QString &, int)), obj, SLOT(idToNameSlot(QString &, int)));
@@ -481,7 +494,10 @@ void Server::disconnectAuthenticator(QObject *obj) {
 	disconnect(this, SIGNAL(unregisterUserSig(int &, int)), obj, SLOT(unregisterUserSlot(int &, int)));
 	disconnect(this, SIGNAL(getRegisteredUsersSig(const QString &, QMap<int, QString> &)), obj, SLOT(getRegisteredUsersSlot(const QString &, QMap<int, QString> &)));
 	disconnect(this, SIGNAL(getRegistrationSig(int &, int, QMap<int, QString> &)), obj, SLOT(getRegistrationSlot(int &, int, QMap<int, QString> &)));
-	disconnect(this, SIGNAL(authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateSlot(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
+	if (hasAuthenticateAsyncSlot(obj))
+		disconnect(this, SIGNAL(authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateAsyncSlot(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
+	else
+		disconnect(this, SIGNAL(authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateSlot(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
 	disconnect(this, SIGNAL(setInfoSig(int &, int, const QMap<int, QString> &)), obj, SLOT(setInfoSlot(int &, int, const QMap<int, QString> &)));
 	disconnect(this, SIGNAL(setTextureSig(int &, int, const QByteArray &)), obj, SLOT(setTextureSlot(int &, int, const QByteArray &)));
 	disconnect(this, SIGNAL(idToNameSig(QString &, int)), obj, SLOT(idToNameSlot(QString &, int)));
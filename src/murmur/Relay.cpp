@@ -0,0 +1,404 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "Relay.h"
+
+#include "Channel.h"
+#include "Message.h"
+#include "PacketDataStream.h"
+#include "Server.h"
+#include "ServerUser.h"
+#include "VoiceSnapshot.h"
+
+/// Seconds since the epoch, as relay datagrams are stamped.
+static quint64 relayClock() {
+	return static_cast<quint64>(QDateTime::currentMSecsSinceEpoch() / 1000);
+}
+
+Relay::Relay(Server *srv) : QObject(srv), s(srv), rcCodec(srv->qbaRelaySecret), bValid(false) {
+	aiSocket[0] = aiSocket[1] = INVALID_SOCKET;
+
+	foreach(const QString &peer, s->qsRelayPeers.split(QRegExp(QLatin1String("\\s+")), QString::SkipEmptyParts)) {
+		const int colon = peer.lastIndexOf(QLatin1Char(':'));
+		QString host = peer.left(colon);
+		if (host.startsWith(QLatin1Char('[')) && host.endsWith(QLatin1Char(']')))
+			host = host.mid(1, host.length() - 2);
+
+		bool ok = false;
+		const uint port = peer.mid(colon + 1).toUInt(&ok);
+		QHostAddress qha;
+		if ((colon <= 0) || ! ok || (port == 0) || (port > 65535) || ! qha.setAddress(host)) {
+			s->log(QString("Relay: Ignoring invalid peer \"%1\"").arg(peer));
+			continue;
+		}
+
+		Peer p;
+		p.haAddress = HostAddress(qha);
+		p.usPort = static_cast<quint16>(port);
+		qvPeers << p;
+	}
+
+	// One socket for each address family used by the peers.
+	for (int f = 0; f < 2; ++f) {
+		bool needed = false;
+		foreach(const Peer &p, qvPeers)
+			needed = needed || (p.haAddress.isV6() == (f == 1));
+		if (! needed)
+			continue;
+
+		sockaddr_storage addr;
+		memset(&addr, 0, sizeof(addr));
+		int len;
+		if (f == 0) {
+			sockaddr_in *in = reinterpret_cast<sockaddr_in *>(&addr);
+			in->sin_family = AF_INET;
+			in->sin_port = htons(s->usRelayPort);
+			len = sizeof(sockaddr_in);
+		} else {
+			sockaddr_in6 *in6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = htons(s->usRelayPort);
+			len = sizeof(sockaddr_in6);
+		}
+
+		aiSocket[f] = ::socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+		if (aiSocket[f] == INVALID_SOCKET) {
+			s->log("Relay: Failed to create UDP socket");
+			continue;
+		}
+		if (f == 1) {
+			// The IPv4 socket binds the same port.
+			int ipv6only = 1;
+			::setsockopt(aiSocket[f], IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&ipv6only), sizeof(ipv6only));
+		}
+		if (::bind(aiSocket[f], reinterpret_cast<sockaddr *>(&addr), len) == SOCKET_ERROR) {
+			s->log(QString("Relay: Failed to bind UDP socket to port %1").arg(s->usRelayPort));
+#ifdef Q_OS_UNIX
+			close(aiSocket[f]);
+#else
+			closesocket(aiSocket[f]);
+#endif
+			aiSocket[f] = INVALID_SOCKET;
+			continue;
+		}
+
+		bValid = true;
+	}
+
+	if (s->qbaRelaySecret.isEmpty()) {
+		s->log("Relay: relaysecret is not set");
+		bValid = false;
+	}
+
+	qtAnnounce = new QTimer(this);
+	connect(qtAnnounce, SIGNAL(timeout()), this, SLOT(announce()));
+	if (bValid) {
+		s->log(QString("Relay: Listening on port %1 for %2 peers").arg(s->usRelayPort).arg(qvPeers.count()));
+		qtAnnounce->start(RELAY_ANNOUNCE_INTERVAL);
+	}
+}
+
+Relay::~Relay() {
+	// The voice threads are stopped by now, so the stand-ins can go
+	// right away. Remote users go away with the Server's connections.
+	foreach(const RemoteUser &ru, qhRemoteUsers) {
+		s->qqIds.enqueue(ru.su->uiSession);
+		{
+			QMutexLocker qml(&s->qmCache);
+			s->acCache.forgetUser(ru.su);
+		}
+		delete ru.su;
+	}
+
+	for (int f = 0; f < 2; ++f) {
+		if (aiSocket[f] == INVALID_SOCKET)
+			continue;
+#ifdef Q_OS_UNIX
+		close(aiSocket[f]);
+#else
+		closesocket(aiSocket[f]);
+#endif
+	}
+}
+
+int Relay::peerIndex(const HostAddress &ha, quint16 port) const {
+	for (int i = 0; i < qvPeers.count(); ++i)
+		if ((qvPeers.at(i).haAddress == ha) && (qvPeers.at(i).usPort == port))
+			return i;
+	return -1;
+}
+
+#ifdef Q_OS_UNIX
+QList<int> Relay::sockets() const {
+	QList<int> ql;
+#else
+QList<SOCKET> Relay::sockets() const {
+	QList<SOCKET> ql;
+#endif
+	for (int f = 0; f < 2; ++f)
+		if (aiSocket[f] != INVALID_SOCKET)
+			ql << aiSocket[f];
+	return ql;
+}
+
+#ifdef Q_OS_UNIX
+bool Relay::ownsSocket(int sock) const {
+#else
+bool Relay::ownsSocket(SOCKET sock) const {
+#endif
+	return (sock != INVALID_SOCKET) && ((sock == aiSocket[0]) || (sock == aiSocket[1]));
+}
+
+void Relay::sendTo(int peer, const char *data, int len) const {
+	const Peer &p = qvPeers.at(peer);
+	sockaddr_storage addr;
+	int addrlen;
+
+	p.haAddress.toSockaddr(&addr);
+	if (addr.ss_family == AF_INET6) {
+		reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port = htons(p.usPort);
+		addrlen = sizeof(sockaddr_in6);
+	} else {
+		reinterpret_cast<sockaddr_in *>(&addr)->sin_port = htons(p.usPort);
+		addrlen = sizeof(sockaddr_in);
+	}
+
+	const int f = p.haAddress.isV6() ? 1 : 0;
+	if (aiSocket[f] != INVALID_SOCKET)
+		::sendto(aiSocket[f], data, len, 0, reinterpret_cast<sockaddr *>(&addr), addrlen);
+}
+
+void Relay::announce() {
+	expire();
+
+	const quint64 now = relayClock();
+	char buffer[RELAY_MAX_DATAGRAM];
+	PacketDataStream pds(buffer, RELAY_MAX_DATAGRAM - RELAY_TAG_LENGTH);
+	rcCodec.begin(pds, RelayCodec::Announce, now);
+	const quint32 header = pds.size();
+	bool sent = false;
+
+	foreach(ServerUser *u, s->qhUsers) {
+		if ((u->sState != ServerUser::Authenticated) || ! u->cChannel || ! s->qsRelayChannels.contains(u->cChannel->iId))
+			continue;
+
+		// A user name is at most 512 characters, so another entry
+		// always fits after a quarter of the buffer.
+		if (pds.size() > RELAY_MAX_DATAGRAM / 4) {
+			const int len = rcCodec.seal(buffer, pds.size());
+			for (int i = 0; i < qvPeers.count(); ++i)
+				sendTo(i, buffer, len);
+			sent = true;
+
+			pds.rewind();
+			rcCodec.begin(pds, RelayCodec::Announce, now);
+		}
+		pds << u->uiSession << u->cChannel->iId << u->qsName;
+	}
+
+	// An empty announcement still tells the peers we are alive.
+	if (pds.isValid() && ((pds.size() > header) || ! sent)) {
+		const int len = rcCodec.seal(buffer, pds.size());
+		for (int i = 0; i < qvPeers.count(); ++i)
+			sendTo(i, buffer, len);
+	}
+}
+
+#ifdef Q_OS_UNIX
+void Relay::datagram(int sock, UDPBatch *batch) {
+#else
+void Relay::datagram(SOCKET sock, UDPBatch *batch) {
+#endif
+	char buffer[RELAY_MAX_DATAGRAM];
+	sockaddr_storage from;
+#ifdef Q_OS_UNIX
+	socklen_t fromlen = sizeof(from);
+	int len = static_cast<int>(::recvfrom(sock, buffer, RELAY_MAX_DATAGRAM, MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&from), &fromlen));
+#else
+	int fromlen = sizeof(from);
+	int len = ::recvfrom(sock, buffer, RELAY_MAX_DATAGRAM, 0, reinterpret_cast<sockaddr *>(&from), &fromlen);
+#endif
+
+	if (len <= RELAY_TAG_LENGTH)
+		return;
+
+	quint16 port;
+	if (from.ss_family == AF_INET6)
+		port = ntohs(reinterpret_cast<sockaddr_in6 *>(&from)->sin6_port);
+	else
+		port = ntohs(reinterpret_cast<sockaddr_in *>(&from)->sin_port);
+
+	const int peer = peerIndex(HostAddress(from), port);
+	if (peer < 0)
+		return;
+
+	RelayCodec::Type type;
+	quint32 node;
+	const int offset = rcCodec.open(buffer, len, relayClock(), type, node);
+	if (offset < 0)
+		return;
+
+	const int size = len - RELAY_TAG_LENGTH - offset;
+	if (type == RelayCodec::Voice)
+		handleVoice(node, buffer + offset, size, batch);
+	else
+		QMetaObject::invokeMethod(this, "announced", Qt::QueuedConnection, Q_ARG(int, peer), Q_ARG(unsigned int, node), Q_ARG(QByteArray, QByteArray(buffer + offset, size)));
+}
+
+void Relay::announced(int peer, unsigned int node, const QByteArray &payload) {
+	const quint64 now = tClock.elapsed() / 1000ULL;
+	bool changed = false;
+	PacketDataStream pds(payload);
+
+	while (pds.isValid() && (pds.left() > 0)) {
+		unsigned int session;
+		int channel;
+		QString name;
+		pds >> session >> channel >> name;
+		if (! pds.isValid())
+			break;
+		if (! s->qsRelayChannels.contains(channel) || ! s->qhChannels.contains(channel))
+			continue;
+
+		const RemoteKey key(node, session);
+		QHash<RemoteKey, RemoteUser>::iterator i = qhRemoteUsers.find(key);
+		if (i == qhRemoteUsers.end()) {
+			if (s->qqIds.isEmpty())
+				continue;
+
+			RemoteUser ru;
+			ru.iPeer = peer;
+			ru.su = new ServerUser(s, new QSslSocket());
+			ru.su->uiSession = s->qqIds.dequeue();
+			ru.su->sState = ServerUser::Authenticated;
+			ru.iChannel = -1;
+			i = qhRemoteUsers.insert(key, ru);
+		}
+
+		RemoteUser &ru = i.value();
+		ru.iPeer = peer;
+		ru.uiSeen = now;
+		if ((ru.iChannel != channel) || (ru.su->qsName != name)) {
+			changed = changed || (ru.iChannel != channel);
+			ru.iChannel = channel;
+			ru.su->qsName = name;
+
+			MumbleProto::UserState mpus;
+			mpus.set_session(ru.su->uiSession);
+			mpus.set_name(u8(ru.su->qsName));
+			mpus.set_channel_id(ru.iChannel);
+			s->sendAll(mpus);
+		}
+	}
+
+	// Which peers listen in which channels is part of the snapshot.
+	if (changed)
+		s->updateVoiceSnapshot();
+}
+
+void Relay::handleVoice(quint32 node, const char *data, int len, UDPBatch *batch) {
+	PacketDataStream pds(data, len);
+	int channel;
+	unsigned int session;
+	pds >> channel >> session;
+	if (! pds.isValid() || (pds.left() < 2))
+		return;
+
+	// The rest is the packet as the speaker sent it to its node.
+	// Only normal speech is relayed.
+	const char *packet = pds.charPtr();
+	const unsigned int type = (packet[0] >> 5) & 0x7;
+	if (((packet[0] & 0x1f) != 0) || (type == MessageHandler::UDPPing))
+		return;
+
+	const VoiceSnapshot *vs = s->vsdVoice.current();
+	const VoiceSnapshot::Member *m = vs->relayed(qMakePair(node, session));
+	if (! m || (m->iChannel < 0) || (vs->qvChannelIds.at(m->iChannel) != channel))
+		return;
+
+	s->processMsg(m->su, packet, static_cast<int>(pds.left()), batch);
+}
+
+void Relay::removeUser(const RemoteUser &ru) {
+	MumbleProto::UserRemove mpur;
+	mpur.set_session(ru.su->uiSession);
+	s->sendAll(mpur);
+	s->qqIds.enqueue(ru.su->uiSession);
+
+	{
+		QMutexLocker qml(&s->qmCache);
+		s->acCache.forgetUser(ru.su);
+	}
+	// Voice threads may still be processing its speech.
+	s->qlVoiceRetiredUsers << ru.su;
+}
+
+void Relay::expire() {
+	const quint64 now = tClock.elapsed() / 1000ULL;
+	bool changed = false;
+
+	QHash<RemoteKey, RemoteUser>::iterator i = qhRemoteUsers.begin();
+	while (i != qhRemoteUsers.end()) {
+		if (now - i.value().uiSeen > RELAY_USER_EXPIRY) {
+			removeUser(i.value());
+			i = qhRemoteUsers.erase(i);
+			changed = true;
+		} else {
+			++i;
+		}
+	}
+
+	if (changed)
+		s->updateVoiceSnapshot();
+}
+
+bool Relay::ownsSession(unsigned int session) const {
+	foreach(const RemoteUser &ru, qhRemoteUsers)
+		if (ru.su->uiSession == session)
+			return true;
+	return false;
+}
+
+const QHash<Relay::RemoteKey, Relay::RemoteUser> &Relay::remoteUsers() const {
+	return qhRemoteUsers;
+}
+
+QHash<int, QVector<int> > Relay::listeningPeers() const {
+	QHash<int, QVector<int> > qh;
+
+	foreach(const RemoteUser &ru, qhRemoteUsers) {
+		QVector<int> &peers = qh[ru.iChannel];
+		if (! peers.contains(ru.iPeer))
+			peers.append(ru.iPeer);
+	}
+	return qh;
+}
+
+void Relay::sendUsers(ServerUser *u) {
+	foreach(const RemoteUser &ru, qhRemoteUsers) {
+		MumbleProto::UserState mpus;
+		mpus.set_session(ru.su->uiSession);
+		mpus.set_name(u8(ru.su->qsName));
+		mpus.set_channel_id(ru.iChannel);
+		s->sendMessage(u, mpus);
+	}
+}
+
+void Relay::sendVoice(const QVector<int> &peers, int channel, unsigned int session, const char *data, int len) const {
+	char buffer[RELAY_MAX_DATAGRAM];
+	PacketDataStream pds(buffer, RELAY_MAX_DATAGRAM - RELAY_TAG_LENGTH);
+
+	rcCodec.begin(pds, RelayCodec::Voice, relayClock());
+	pds << channel << session;
+	pds.append(data, len);
+	if (! pds.isValid())
+		return;
+
+	const int sealed = rcCodec.seal(buffer, pds.size());
+	foreach(int peer, peers)
+		sendTo(peer, buffer, sealed);
+}
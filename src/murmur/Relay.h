@@ -0,0 +1,134 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_RELAY_H_
+#define MUMBLE_MURMUR_RELAY_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtCore/QVector>
+
+#include "HostAddress.h"
+#include "RelayCodec.h"
+#include "Timer.h"
+
+class QTimer;
+class Server;
+class ServerUser;
+struct UDPBatch;
+
+/// Milliseconds between membership announcements to each peer.
+#define RELAY_ANNOUNCE_INTERVAL 1000
+/// Remote users missing from announcements for this many
+/// milliseconds are removed.
+#define RELAY_USER_EXPIRY 3500
+
+/// Link between murmur nodes serving the same channels, which lets one
+/// logical server span several hosts.
+///
+/// Each node announces the local users in the shared channels
+/// (relaychannels) to its peers once per RELAY_ANNOUNCE_INTERVAL. A
+/// node shows the remote users to its own clients under local session
+/// IDs, and forwards the normal speech of local users in a shared
+/// channel once to each peer with users in that channel, which then
+/// fans it out to its own listeners. Only voice of local users is
+/// forwarded, so every node must peer with every other node.
+///
+/// Each remote user is backed by a ServerUser that is not in qhUsers
+/// or in any channel, but is a member of the voice snapshot that may
+/// only speak. The relay sockets are read by the Server's own voice
+/// thread, and relayed speech goes through Server::processMsg() like
+/// local speech, so links, speaker limits and batching apply to it.
+/// Whispers stay on the node they were sent to.
+///
+/// The peers are trusted: datagrams are authenticated with the shared
+/// relaysecret and protected against replay (see RelayCodec), but not
+/// encrypted.
+class Relay : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(Relay);
+	public:
+		struct RemoteUser {
+			/// Index of the peer in qvPeers.
+			int iPeer;
+			/// Stand-in for the user on this node.
+			ServerUser *su;
+			int iChannel;
+			quint64 uiSeen;
+		};
+		typedef QPair<quint32, unsigned int> RemoteKey;
+	protected:
+		struct Peer {
+			HostAddress haAddress;
+			quint16 usPort;
+		};
+
+		Server *s;
+		RelayCodec rcCodec;
+		QVector<Peer> qvPeers;
+#ifdef Q_OS_UNIX
+		/// Relay sockets for IPv4 and IPv6, or -1.
+		int aiSocket[2];
+#else
+		SOCKET aiSocket[2];
+#endif
+		QTimer *qtAnnounce;
+		Timer tClock;
+		/// Remote users by node and their session ID on that node.
+		QHash<RemoteKey, RemoteUser> qhRemoteUsers;
+
+		int peerIndex(const HostAddress &ha, quint16 port) const;
+		/// Send len bytes of sealed data to peer.
+		void sendTo(int peer, const char *data, int len) const;
+		void handleVoice(quint32 node, const char *data, int len, UDPBatch *batch);
+		void removeUser(const RemoteUser &ru);
+		void expire();
+	public:
+		bool bValid;
+
+		Relay(Server *srv);
+		~Relay();
+
+		/// The relay sockets, for the Server's voice thread to wait on.
+#ifdef Q_OS_UNIX
+		QList<int> sockets() const;
+		bool ownsSocket(int sock) const;
+#else
+		QList<SOCKET> sockets() const;
+		bool ownsSocket(SOCKET sock) const;
+#endif
+		/// Read a datagram from sock, one of sockets(). Relayed voice is
+		/// processed right away, so this must be called from the
+		/// Server's voice thread inside its vsdVoice section.
+#ifdef Q_OS_UNIX
+		void datagram(int sock, UDPBatch *batch);
+#else
+		void datagram(SOCKET sock, UDPBatch *batch);
+#endif
+
+		/// Whether session is the local session ID of a remote user.
+		bool ownsSession(unsigned int session) const;
+		/// The remote users, for the voice snapshot. Main thread only.
+		const QHash<RemoteKey, RemoteUser> &remoteUsers() const;
+		/// Peers with users in each channel, by channel ID, as
+		/// indices for sendVoice(). Main thread only.
+		QHash<int, QVector<int> > listeningPeers() const;
+		/// Tell u, which just authenticated, about the remote users.
+		void sendUsers(ServerUser *u);
+		/// Forward the voice packet of local user session in channel, as
+		/// the client sent it and without positional audio, to peers.
+		/// Thread-safe.
+		void sendVoice(const QVector<int> &peers, int channel, unsigned int session, const char *data, int len) const;
+	public slots:
+		void announce();
+		/// An announcement from node, passed on by the voice thread.
+		void announced(int peer, unsigned int node, const QByteArray &payload);
+};
+
+#endif
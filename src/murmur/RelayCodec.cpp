@@ -0,0 +1,116 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "RelayCodec.h"
+
+#include "PacketDataStream.h"
+#include "QAtomicIntCompat.h"
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+RelayCodec::RelayCodec(const QByteArray &secret) : qbaSecret(secret), uiNode(0), aiSequence(0), aiSequenceHigh(0), uiExpired(0) {
+	RAND_bytes(reinterpret_cast<unsigned char *>(&uiNode), sizeof(uiNode));
+}
+
+quint32 RelayCodec::node() const {
+	return uiNode;
+}
+
+quint64 RelayCodec::nextSequence() const {
+	const quint32 low = static_cast<quint32>(aiSequence.fetchAndAddOrdered(1));
+	if (low == 0xffffffffU)
+		aiSequenceHigh.fetchAndAddOrdered(1);
+
+	// A sender racing the one that wrapped may pair a new low half
+	// with the old high half. The receiver drops that datagram as
+	// old; no number is ever accepted twice.
+	const quint32 high = static_cast<quint32>(QAtomicIntLoad(aiSequenceHigh));
+	return (static_cast<quint64>(high) << 32) | low;
+}
+
+void RelayCodec::begin(PacketDataStream &pds, Type t, quint64 now) const {
+	pds << static_cast<unsigned int>(t) << uiNode << now << nextSequence();
+}
+
+int RelayCodec::seal(char *data, int len) const {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+
+	HMAC(EVP_sha256(), qbaSecret.constData(), qbaSecret.size(), reinterpret_cast<const unsigned char *>(data), len, md, &mdlen);
+	memcpy(data + len, md, RELAY_TAG_LENGTH);
+	return len + RELAY_TAG_LENGTH;
+}
+
+void RelayCodec::expire(quint64 now) {
+	if (now == uiExpired)
+		return;
+	uiExpired = now;
+
+	// Everything a node sent before its newest timestamp is stale
+	// RELAY_MAX_SKEW after it, and would be dropped as such.
+	QHash<quint32, Window>::iterator i = qhWindows.begin();
+	while (i != qhWindows.end()) {
+		if (i.value().uiStamp + RELAY_MAX_SKEW < now)
+			i = qhWindows.erase(i);
+		else
+			++i;
+	}
+}
+
+int RelayCodec::open(const char *data, int len, quint64 now, Type &type, quint32 &node) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+
+	const int body = len - RELAY_TAG_LENGTH;
+	if (body <= 0)
+		return -1;
+
+	HMAC(EVP_sha256(), qbaSecret.constData(), qbaSecret.size(), reinterpret_cast<const unsigned char *>(data), body, md, &mdlen);
+	if (CRYPTO_memcmp(md, data + body, RELAY_TAG_LENGTH) != 0)
+		return -1;
+
+	PacketDataStream pds(data, body);
+	unsigned int t;
+	quint64 stamp, seq;
+	pds >> t >> node >> stamp >> seq;
+	if (! pds.isValid() || (t > Voice) || (node == uiNode))
+		return -1;
+	if ((stamp + RELAY_MAX_SKEW < now) || (stamp > now + RELAY_MAX_SKEW))
+		return -1;
+
+	expire(now);
+
+	QHash<quint32, Window>::iterator i = qhWindows.find(node);
+	if (i == qhWindows.end()) {
+		Window w;
+		w.uiHighest = seq;
+		w.uiSeen = 1;
+		w.uiStamp = stamp;
+		qhWindows.insert(node, w);
+	} else {
+		Window &w = i.value();
+		if (seq > w.uiHighest) {
+			const quint64 shift = seq - w.uiHighest;
+			w.uiSeen = (shift >= RELAY_REPLAY_WINDOW) ? 1 : ((w.uiSeen << shift) | 1);
+			w.uiHighest = seq;
+		} else {
+			const quint64 back = w.uiHighest - seq;
+			if (back >= RELAY_REPLAY_WINDOW)
+				return -1;
+			const quint64 bit = Q_UINT64_C(1) << back;
+			if (w.uiSeen & bit)
+				return -1;
+			w.uiSeen |= bit;
+		}
+		w.uiStamp = qMax(w.uiStamp, stamp);
+	}
+
+	type = static_cast<Type>(t);
+	return static_cast<int>(pds.size());
+}
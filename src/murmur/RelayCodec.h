@@ -0,0 +1,86 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_RELAYCODEC_H_
+#define MUMBLE_MURMUR_RELAYCODEC_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+
+class PacketDataStream;
+
+/// Bytes of HMAC-SHA256 kept as the tag of a relay datagram.
+#define RELAY_TAG_LENGTH 16
+/// Largest relay datagram. Announcements are split well below it.
+#define RELAY_MAX_DATAGRAM 4096
+/// Sequence numbers a datagram may be behind the newest one seen from
+/// its node and still be accepted, as UDP may reorder.
+#define RELAY_REPLAY_WINDOW 64
+/// Seconds the clocks of two nodes may differ by. Datagrams stamped
+/// further away from the receiver's clock are dropped.
+#define RELAY_MAX_SKEW 30
+
+/// Wire format of the relay link between murmur nodes.
+///
+/// A datagram is its type, the sending node's ID, a timestamp in
+/// seconds since the epoch, a sequence number and the payload, followed
+/// by a truncated HMAC-SHA256 of all of that keyed with the shared
+/// secret.
+///
+/// Each node numbers its datagrams from a random ID picked at startup,
+/// and the receiver accepts every number once, within the last
+/// RELAY_REPLAY_WINDOW. The timestamp bounds how long a captured
+/// datagram can be replayed at all: once a node has been quiet for
+/// RELAY_MAX_SKEW its window can go, as anything it sent is then
+/// stale, and so the datagrams of a node that restarted under a new
+/// ID can't be played back either.
+class RelayCodec {
+	private:
+		Q_DISABLE_COPY(RelayCodec);
+	public:
+		enum Type { Announce = 0, Voice = 1 };
+	protected:
+		struct Window {
+			/// Newest sequence number accepted.
+			quint64 uiHighest;
+			/// Bit n is set if uiHighest - n was accepted.
+			quint64 uiSeen;
+			/// Newest timestamp accepted.
+			quint64 uiStamp;
+		};
+
+		QByteArray qbaSecret;
+		quint32 uiNode;
+		/// Low and high half of the next sequence number. The high
+		/// half is bumped by the sender that wraps the low one.
+		mutable QAtomicInt aiSequence;
+		mutable QAtomicInt aiSequenceHigh;
+		/// Receive windows by node.
+		QHash<quint32, Window> qhWindows;
+		/// When windows were last looked at for expiry.
+		quint64 uiExpired;
+
+		quint64 nextSequence() const;
+		void expire(quint64 now);
+	public:
+		RelayCodec(const QByteArray &secret);
+
+		quint32 node() const;
+		/// Start a datagram of type t in pds, which the payload is then
+		/// appended to. Thread-safe.
+		void begin(PacketDataStream &pds, Type t, quint64 now) const;
+		/// Append the tag to the len bytes of datagram at data, which must
+		/// have room for it, and return the length with the tag.
+		/// Thread-safe.
+		int seal(char *data, int len) const;
+		/// Check the len bytes of datagram at data, received at now, and
+		/// return the offset of its payload, or -1 if it is forged,
+		/// stale, a replay or from this node. The payload ends before
+		/// the tag. Not thread-safe, as it keeps the receive windows.
+		int open(const char *data, int len, quint64 now, Type &type, quint32 &node);
+};
+
+#endif
@@ -15,9 +15,13 @@
 #include "Message.h"
 #include "Meta.h"
 #include "PacketDataStream.h"
+#include "Relay.h"
 #include "ServerDB.h"
 #include "ServerUser.h"
+#include "SslWorker.h"
 #include "Version.h"
+#include "VoiceCapture.h"
+#include "VoiceAggregate.h"
 #include "HTMLFilter.h"
 #include "HostAddress.h"
 
@@ -32,6 +36,11 @@
 
 #define UDP_PACKET_SIZE 1024
 
+// Positional culling: a listener who was within the audible radius
+// keeps hearing the speaker until they are this fraction farther
+// away, so speech doesn't cut in and out at the edge.
+#define AUDIBLE_HYSTERESIS 0.1f
+
 ExecEvent::ExecEvent(boost::function<void ()> f) : QEvent(static_cast<QEvent::Type>(EXEC_QEVENT)) {
 	func = f;
 }
@@ -109,6 +118,15 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = NULL;
 #endif
 	qtTimeout = new QTimer(this);
+	qtAuthDeadline = new QTimer(this);
+	qtAuthDeadline->setInterval(250);
+	qtBanExpiry = new QTimer(this);
+	qtBanExpiry->setSingleShot(true);
+
+	uiAuthRequest = 0;
+	uiAuthRequests = uiAuthTimeouts = 0;
+	uiAuthLatencyTotal = uiAuthLatencyMax = 0;
+	iAuthPendingMax = 0;
 
 	iCodecAlpha = iCodecBeta = 0;
 	bPreferAlpha = false;
@@ -116,6 +134,11 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 
 	qnamNetwork = NULL;
 
+	ubBatch = NULL;
+	rRelay = NULL;
+	vcCapture = new VoiceCapture(this);
+	syncReset();
+
 	readParams();
 	initialize();
 
@@ -136,6 +159,23 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	if (! bValid)
 		return;
 
+#ifdef Q_OS_LINUX
+	iVoiceThreads = qBound(1, iVoiceThreads, 64);
+#else
+	// Sharding voice traffic between threads needs SO_REUSEPORT steering.
+	iVoiceThreads = 1;
+#endif
+	for (int w = 1; w < iVoiceThreads; ++w) {
+		VoiceWorker *vw = new VoiceWorker(this, w);
+		if (! vw->bValid) {
+			log("Failed to create notify socket for voice worker");
+			delete vw;
+			bValid = false;
+			return;
+		}
+		qlVoiceWorkers << vw;
+	}
+
 	foreach(SslServer *ss, qlServer) {
 		sockaddr_storage addr;
 #ifdef Q_OS_UNIX
@@ -147,75 +187,95 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 #endif
 		memset(&addr, 0, sizeof(addr));
 		getsockname(tcpsock, reinterpret_cast<struct sockaddr *>(&addr), &len);
+		for (int w = 0; w < iVoiceThreads; ++w) {
 #ifdef Q_OS_UNIX
-		int sock = ::socket(addr.ss_family, SOCK_DGRAM, 0);
+			int sock = ::socket(addr.ss_family, SOCK_DGRAM, 0);
 #ifdef Q_OS_LINUX
-		int sockopt = 1;
-		if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &sockopt, sizeof(sockopt)))
-			log(QString("Failed to set IP_PKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
-		sockopt = 1;
-		if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &sockopt, sizeof(sockopt)))
-			log(QString("Failed to set IPV6_RECVPKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
+			int sockopt = 1;
+			if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &sockopt, sizeof(sockopt)))
+				log(QString("Failed to set IP_PKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
+			sockopt = 1;
+			if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &sockopt, sizeof(sockopt)))
+				log(QString("Failed to set IPV6_RECVPKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
 #endif
 #else
 #ifndef SIO_UDP_CONNRESET
 #define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR,12)
 #endif
-		SOCKET sock = ::WSASocket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
-		DWORD dwBytesReturned = 0;
-		BOOL bNewBehaviour = FALSE;
-		if (WSAIoctl(sock, SIO_UDP_CONNRESET, &bNewBehaviour, sizeof(bNewBehaviour), NULL, 0, &dwBytesReturned, NULL, NULL) == SOCKET_ERROR) {
-			log(QString("Failed to set SIO_UDP_CONNRESET: %1").arg(WSAGetLastError()));
-		}
+			SOCKET sock = ::WSASocket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+			DWORD dwBytesReturned = 0;
+			BOOL bNewBehaviour = FALSE;
+			if (WSAIoctl(sock, SIO_UDP_CONNRESET, &bNewBehaviour, sizeof(bNewBehaviour), NULL, 0, &dwBytesReturned, NULL, NULL) == SOCKET_ERROR) {
+				log(QString("Failed to set SIO_UDP_CONNRESET: %1").arg(WSAGetLastError()));
+			}
 #endif
-		if (sock == INVALID_SOCKET) {
-			log("Failed to create UDP Socket");
-			bValid = false;
-			return;
-		} else {
-			if (addr.ss_family == AF_INET6) {
-				// Copy IPV6_V6ONLY attribute from tcp socket, it defaults to nonzero on Windows
-				// See https://msdn.microsoft.com/en-us/library/windows/desktop/ms738574%28v=vs.85%29.aspx
-				// This will fail for WindowsXP which is ok. Our TCP code will have split that up
-				// into two sockets.
-				int ipv6only = 0;
-				socklen_t optlen = sizeof(ipv6only);
-				if (::getsockopt(tcpsock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&ipv6only), &optlen) == 0) {
-					if (::setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&ipv6only), optlen) == SOCKET_ERROR) {
-						log(QString("Failed to copy IPV6_V6ONLY socket attribute from tcp to udp socket"));
+			if (sock == INVALID_SOCKET) {
+				log("Failed to create UDP Socket");
+				bValid = false;
+				return;
+			} else {
+				if (addr.ss_family == AF_INET6) {
+					// Copy IPV6_V6ONLY attribute from tcp socket, it defaults to nonzero on Windows
+					// See https://msdn.microsoft.com/en-us/library/windows/desktop/ms738574%28v=vs.85%29.aspx
+					// This will fail for WindowsXP which is ok. Our TCP code will have split that up
+					// into two sockets.
+					int ipv6only = 0;
+					socklen_t optlen = sizeof(ipv6only);
+					if (::getsockopt(tcpsock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&ipv6only), &optlen) == 0) {
+						if (::setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&ipv6only), optlen) == SOCKET_ERROR) {
+							log(QString("Failed to copy IPV6_V6ONLY socket attribute from tcp to udp socket"));
+						}
 					}
 				}
-			}
 
-			if (::bind(sock, reinterpret_cast<sockaddr *>(&addr), len) == SOCKET_ERROR) {
-				log(QString("Failed to bind UDP Socket to %1").arg(addressToString(ss->serverAddress(), usPort)));
-			} else {
-#ifdef Q_OS_UNIX
-				int val = 0xe0;
-				if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val))) {
-					val = 0x80;
-					if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val)))
-						log("Server: Failed to set TOS for UDP Socket");
+#ifdef Q_OS_LINUX
+				if (iVoiceThreads > 1) {
+					// All voice workers' sockets for this address share the port.
+					// Sockets join the reuseport group in bind order, so socket w
+					// has index w in the group, matching the steering program.
+					int reuse = 1;
+					if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)))
+						log(QString("Failed to set SO_REUSEPORT for %1").arg(addressToString(ss->serverAddress(), usPort)));
+					if ((w == 0) && ! attachVoiceSteering(sock, iVoiceThreads))
+						log(QString("Failed to attach voice worker steering program for %1, using kernel's default hashing").arg(addressToString(ss->serverAddress(), usPort)));
 				}
+#endif
+
+				if (::bind(sock, reinterpret_cast<sockaddr *>(&addr), len) == SOCKET_ERROR) {
+					log(QString("Failed to bind UDP Socket to %1").arg(addressToString(ss->serverAddress(), usPort)));
+				} else {
+#ifdef Q_OS_UNIX
+					int val = 0xe0;
+					if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val))) {
+						val = 0x80;
+						if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val)))
+							log("Server: Failed to set TOS for UDP Socket");
+					}
 #if defined(SO_PRIORITY)
-				socklen_t optlen = sizeof(val);
-				if (getsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, &optlen) == 0) {
-					if (val == 0) {
-						val = 6;
-						setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val));
+					socklen_t optlen = sizeof(val);
+					if (getsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, &optlen) == 0) {
+						if (val == 0) {
+							val = 6;
+							setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val));
+						}
 					}
-				}
 #endif
 #endif
+				}
+				QSocketNotifier *qsn = new QSocketNotifier(sock, QSocketNotifier::Read, this);
+				connect(qsn, SIGNAL(activated(int)), this, SLOT(udpActivated(int)));
+				if (w == 0)
+					qlUdpSocket << sock;
+				else
+					qlVoiceWorkers.at(w - 1)->qlUdpSocket << sock;
+				qlUdpNotifier << qsn;
 			}
-			QSocketNotifier *qsn = new QSocketNotifier(sock, QSocketNotifier::Read, this);
-			connect(qsn, SIGNAL(activated(int)), this, SLOT(udpActivated(int)));
-			qlUdpSocket << sock;
-			qlUdpNotifier << qsn;
 		}
 	}
 
 	bValid = bValid && (qlServer.count() == qlBind.count()) && (qlUdpSocket.count() == qlBind.count());
+	foreach(VoiceWorker *vw, qlVoiceWorkers)
+		bValid = bValid && (vw->qlUdpSocket.count() == qlBind.count());
 	if (! bValid)
 		return;
 
@@ -229,19 +289,36 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = CreateEvent(NULL, FALSE, FALSE, NULL);
 #endif
 
-	connect(this, SIGNAL(tcpTransmit(QByteArray, unsigned int)), this, SLOT(tcpTransmitData(QByteArray, unsigned int)), Qt::QueuedConnection);
+	connect(this, SIGNAL(tcpTransmit(unsigned int)), this, SLOT(tcpTransmitData(unsigned int)), Qt::QueuedConnection);
 	connect(this, SIGNAL(reqSync(unsigned int)), this, SLOT(doSync(unsigned int)));
 
 	for (int i=1;i<iMaxUsers*2;++i)
 		qqIds.enqueue(i);
 
 	connect(qtTimeout, SIGNAL(timeout()), this, SLOT(checkTimeout()));
+	connect(qtAuthDeadline, SIGNAL(timeout()), this, SLOT(checkAuthDeadlines()));
+	connect(qtBanExpiry, SIGNAL(timeout()), this, SLOT(purgeBans()));
 
 	getBans();
+	biBans.rebuild(qlBans);
+	scheduleBanPurge();
 	readChannels();
 	readLinks();
 	initializeCert();
 
+	if (bValid && (usRelayPort != 0)) {
+		rRelay = new Relay(this);
+		if (! rRelay->bValid) {
+			delete rRelay;
+			rRelay = NULL;
+		}
+	}
+
+	publishVoiceSnapshot();
+
+	if (! qsVoiceCapture.isEmpty())
+		vcCapture->start(qsVoiceCapture);
+
 	int major, minor, patch;
 	QString release;
 	Meta::getVersion(major, minor, patch, release);
@@ -263,9 +340,19 @@ void Server::startThread() {
 		log("Starting voice thread");
 		bRunning = true;
 
+#ifdef Q_OS_LINUX
+		if (iUdpBatchSize > 1) {
+			ubBatch = new UDPBatch(iUdpBatchSize);
+			foreach(VoiceWorker *vw, qlVoiceWorkers)
+				vw->ubBatch = new UDPBatch(iUdpBatchSize);
+		}
+#endif
+
 		foreach(QSocketNotifier *qsn, qlUdpNotifier)
 			qsn->setEnabled(false);
 		start(QThread::HighestPriority);
+		foreach(VoiceWorker *vw, qlVoiceWorkers)
+			vw->start(QThread::HighestPriority);
 #ifdef Q_OS_LINUX
 		// QThread::HighestPriority == Same as everything else...
 		int policy;
@@ -295,7 +382,41 @@ void Server::stopThread() {
 #else
 		SetEvent(hNotify);
 #endif
+		foreach(VoiceWorker *vw, qlVoiceWorkers)
+			vw->notify();
+
 		wait();
+		foreach(VoiceWorker *vw, qlVoiceWorkers)
+			vw->wait();
+
+		vsdVoice.reclaim();
+
+#ifdef Q_OS_LINUX
+		QList<UDPBatch *> batches;
+		batches << ubBatch;
+		foreach(VoiceWorker *vw, qlVoiceWorkers) {
+			batches << vw->ubBatch;
+			vw->ubBatch = NULL;
+		}
+		ubBatch = NULL;
+
+		quint64 recvBatches = 0, recvPackets = 0, sendBatches = 0, sendPackets = 0;
+		foreach(UDPBatch *b, batches) {
+			if (! b)
+				continue;
+			recvBatches += b->uiRecvBatches;
+			recvPackets += b->uiRecvPackets;
+			sendBatches += b->uiSendBatches;
+			sendPackets += b->uiSendPackets;
+			delete b;
+		}
+
+		if (recvBatches > 0) {
+			log(QString("Voice threads received %1 datagrams in %2 batches (%3 per batch), sent %4 datagrams in %5 batches (%6 per batch)")
+			    .arg(recvPackets).arg(recvBatches).arg(static_cast<double>(recvPackets) / static_cast<double>(recvBatches), 0, 'f', 2)
+			    .arg(sendPackets).arg(sendBatches).arg(sendBatches ? static_cast<double>(sendPackets) / static_cast<double>(sendBatches) : 0.0, 0, 'f', 2));
+		}
+#endif
 
 		foreach(QSocketNotifier *qsn, qlUdpNotifier)
 			qsn->setEnabled(true);
@@ -313,6 +434,14 @@ Server::~Server() {
 	foreach(QSocketNotifier *qsn, qlUdpNotifier)
 		delete qsn;
 
+	foreach(VoiceWorker *vw, qlVoiceWorkers)
+		delete vw;
+
+	qDeleteAll(qhSpeakerSelections);
+	qDeleteAll(qhPendingAuth);
+	delete rRelay;
+	delete vcCapture;
+
 #ifdef Q_OS_UNIX
 	foreach(int s, qlUdpSocket)
 		close(s);
@@ -367,6 +496,28 @@ static QVariant normalizeSuggestVersion(QVariant suggestVersion) {
 	return QVariant();
 }
 
+/// Parse a "maxspeakers" value: whitespace separated
+/// "channel:speakers" pairs.
+static QHash<int, int> parseMaxSpeakers(const QString &value) {
+	QHash<int, int> qh;
+
+	foreach(const QString &pair, value.split(QRegExp(QLatin1String("\\s+")), QString::SkipEmptyParts)) {
+		const QStringList parts = pair.split(QLatin1Char(':'));
+		bool okid = false, okn = false;
+		int id = 0, n = 0;
+		if (parts.count() == 2) {
+			id = parts.at(0).toInt(&okid);
+			n = parts.at(1).toInt(&okn);
+		}
+		if (okid && okn && (n > 0))
+			qh.insert(id, n);
+		else
+			qWarning("Server: Ignoring invalid maxspeakers entry \"%s\"", qPrintable(pair));
+	}
+
+	return qh;
+}
+
 void Server::readParams() {
 	qsPassword = Meta::mp.qsPassword;
 	usPort = static_cast<unsigned short>(Meta::mp.usPort + iServerNum - 1);
@@ -396,6 +547,10 @@ void Server::readParams() {
 	qvSuggestPositional = Meta::mp.qvSuggestPositional;
 	qvSuggestPushToTalk = Meta::mp.qvSuggestPushToTalk;
 	iOpusThreshold = Meta::mp.iOpusThreshold;
+	iUdpBatchSize = Meta::mp.iUdpBatchSize;
+	iVoiceThreads = Meta::mp.iVoiceThreads;
+	fAudibleRadius = Meta::mp.fAudibleRadius;
+	usRelayPort = Meta::mp.usRelayPort ? static_cast<unsigned short>(Meta::mp.usRelayPort + iServerNum - 1) : 0;
 	iChannelNestingLimit = Meta::mp.iChannelNestingLimit;
 
 	QString qsHost = getConf("host", QString()).toString();
@@ -463,6 +618,24 @@ void Server::readParams() {
 	iOpusThreshold = getConf("opusthreshold", iOpusThreshold).toInt();
 
 	iChannelNestingLimit = getConf("channelnestinglimit", iChannelNestingLimit).toInt();
+	iVoiceThreads = getConf("voicethreads", iVoiceThreads).toInt();
+	fAudibleRadius = qMax(0.0f, static_cast<float>(getConf("audibleradius", static_cast<double>(fAudibleRadius)).toDouble()));
+	qhMaxSpeakers = parseMaxSpeakers(getConf("maxspeakers", Meta::mp.qsMaxSpeakers).toString());
+
+	usRelayPort = static_cast<unsigned short>(getConf("relayport", usRelayPort).toUInt());
+	qsRelayPeers = getConf("relaypeers", Meta::mp.qsRelayPeers).toString();
+	qbaRelaySecret = getConf("relaysecret", Meta::mp.qsRelaySecret).toString().toUtf8();
+	qsRelayChannels.clear();
+	foreach(const QString &id, getConf("relaychannels", Meta::mp.qsRelayChannels).toString().split(QRegExp(QLatin1String("\\s+")), QString::SkipEmptyParts)) {
+		bool ok = false;
+		const int cid = id.toInt(&ok);
+		if (ok)
+			qsRelayChannels.insert(cid);
+		else
+			log(QString("Ignoring invalid relaychannels entry \"%1\"").arg(id));
+	}
+
+	qsVoiceCapture = getConf("voicecapture", Meta::mp.qsVoiceCapture).toString();
 
 	qrUserName=QRegExp(getConf("username", qrUserName.pattern()).toString());
 	qrChannelName=QRegExp(getConf("channelname", qrChannelName.pattern()).toString());
@@ -491,7 +664,7 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		iMaxUsers = newmax;
 		qqIds.clear();
 		for (int id = 1; id < iMaxUsers * 2; ++id)
-			if (!qhUsers.contains(id))
+			if (!qhUsers.contains(id) && !(rRelay && rRelay->ownsSession(id)))
 				qqIds.enqueue(id);
 
 		MumbleProto::ServerConfig mpsc;
@@ -539,6 +712,9 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		QString text = !v.isNull() ? v : Meta::mp.qsRegName;
 		if (text != qsRegName) {
 			qsRegName = text;
+			qhSyncChannels[SyncCurrent].remove(0);
+			qhSyncChannels[SyncLegacy].remove(0);
+			bSyncChannels[SyncCurrent] = bSyncChannels[SyncLegacy] = false;
 			if (! qsRegName.isEmpty()) {
 				MumbleProto::ChannelState mpcs;
 				mpcs.set_channel_id(0);
@@ -582,6 +758,18 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		iOpusThreshold = (i >= 0 && !v.isNull()) ? qBound(0, i, 100) : Meta::mp.iOpusThreshold;
 	else if (key == "channelnestinglimit")
 		iChannelNestingLimit = (i >= 0 && !v.isNull()) ? i : Meta::mp.iChannelNestingLimit;
+	else if (key == "audibleradius") {
+		fAudibleRadius = ! v.isNull() ? qMax(0.0f, static_cast<float>(v.toDouble())) : Meta::mp.fAudibleRadius;
+		updateVoiceSnapshot();
+	} else if (key == "maxspeakers") {
+		qhMaxSpeakers = parseMaxSpeakers(! v.isNull() ? v : Meta::mp.qsMaxSpeakers);
+		updateVoiceSnapshot();
+	} else if (key == "voicecapture") {
+		qsVoiceCapture = ! v.isNull() ? v : Meta::mp.qsVoiceCapture;
+		vcCapture->stop();
+		if (! qsVoiceCapture.isEmpty())
+			vcCapture->start(qsVoiceCapture);
+	}
 }
 
 #ifdef USE_BONJOUR
@@ -662,7 +850,259 @@ void Server::udpActivated(int socket) {
 	}
 }
 
+#ifdef Q_OS_LINUX
+/// Number of outgoing datagrams the voice thread can queue
+/// before they are flushed with a single sendmmsg() call.
+#define UDP_SEND_BATCH_SIZE 256
+// Number of users a voice thread collects aggregates for
+// at a time, and the size of the hash table indexing them.
+#define UDP_AGGREGATE_COUNT 64
+#define UDP_AGGREGATE_HASH 128
+
+#define UDP_CONTROL_SIZE CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))
+
+/// Buffers used by the voice thread for batched UDP I/O
+/// with recvmmsg() and sendmmsg().
+struct UDPBatch {
+	struct Slot {
+		/// Packet data. The 4 byte crypt header starts at
+		/// data + 4, so the payload following it is 8 byte
+		/// aligned, just like in the unbatched code paths.
+		/// (data is the first member, and the Slot is aligned
+		/// by its sockaddr_storage.)
+		char data[UDP_PACKET_SIZE + 8];
+		u_char control[UDP_CONTROL_SIZE];
+		struct sockaddr_storage addr;
+		struct iovec iov;
+	};
+
+	int iRecvSize;
+	struct mmsghdr *recvMsgs;
+	Slot *recvSlots;
+
+	/// Statistics used to report the average batch sizes.
+	quint64 uiRecvBatches, uiRecvPackets;
+	quint64 uiSendBatches, uiSendPackets;
+
+	int iSendCount;
+	int sendSockets[UDP_SEND_BATCH_SIZE];
+	struct mmsghdr sendMsgs[UDP_SEND_BATCH_SIZE];
+	Slot sendSlots[UDP_SEND_BATCH_SIZE];
+
+	/// Plain text UDPVoiceAggregate being collected for a user.
+	struct Aggregate : public VoiceAggregate {
+		ServerUser *u;
+	};
+
+	int iAggregateCount;
+	Aggregate aggregates[UDP_AGGREGATE_COUNT];
+	/// Open addressing hash of aggregates by user, holding
+	/// indices into aggregates plus one, or 0 if empty.
+	int aggregateIndex[UDP_AGGREGATE_HASH];
+
+	UDPBatch(int recvsize);
+	~UDPBatch();
+	/// The aggregate for u, added if needed. NULL if
+	/// there is no room for another one.
+	Aggregate *aggregate(ServerUser *u);
+	void clearAggregates();
+};
+
+UDPBatch::UDPBatch(int recvsize) {
+	iRecvSize = recvsize;
+	recvMsgs = new struct mmsghdr[recvsize];
+	recvSlots = new Slot[recvsize];
+	iSendCount = 0;
+	uiRecvBatches = uiRecvPackets = 0;
+	uiSendBatches = uiSendPackets = 0;
+	clearAggregates();
+}
+
+UDPBatch::~UDPBatch() {
+	delete [] recvMsgs;
+	delete [] recvSlots;
+}
+
+UDPBatch::Aggregate *UDPBatch::aggregate(ServerUser *u) {
+	unsigned int h = static_cast<unsigned int>(reinterpret_cast<quintptr>(u) >> 4) % UDP_AGGREGATE_HASH;
+
+	while (aggregateIndex[h]) {
+		Aggregate *a = &aggregates[aggregateIndex[h] - 1];
+		if (a->u == u)
+			return a;
+		h = (h + 1) % UDP_AGGREGATE_HASH;
+	}
+
+	if (iAggregateCount == UDP_AGGREGATE_COUNT)
+		return NULL;
+
+	Aggregate *a = &aggregates[iAggregateCount++];
+	aggregateIndex[h] = iAggregateCount;
+
+	a->u = u;
+	a->clear();
+	return a;
+}
+
+void UDPBatch::clearAggregates() {
+	iAggregateCount = 0;
+	memset(aggregateIndex, 0, sizeof(aggregateIndex));
+}
+
+/// Set up msg for sending iov to addr, using the local address of u's
+/// TCP connection as the source address, so that voice leaves from the
+/// address the client connected to.
+/// Returns false if no usable source address exists.
+static bool prepareUdpMessage(ServerUser *u, struct msghdr *msg, struct iovec *iov, u_char *controldata, struct sockaddr_storage *addr) {
+	memset(controldata, 0, UDP_CONTROL_SIZE);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = reinterpret_cast<struct sockaddr *>(addr);
+	msg->msg_namelen = static_cast<socklen_t>((addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_control = controldata;
+	msg->msg_controllen = CMSG_SPACE((addr->ss_family == AF_INET6) ? sizeof(struct in6_pktinfo) : sizeof(struct in_pktinfo));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	HostAddress tcpha(u->saiTcpLocalAddress);
+	if (addr->ss_family == AF_INET6) {
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+		struct in6_pktinfo *pktinfo = reinterpret_cast<struct in6_pktinfo *>(CMSG_DATA(cmsg));
+		memset(pktinfo, 0, sizeof(*pktinfo));
+		memcpy(&pktinfo->ipi6_addr.s6_addr[0], &tcpha.qip6.c[0], sizeof(pktinfo->ipi6_addr.s6_addr));
+	} else {
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		struct in_pktinfo *pktinfo = reinterpret_cast<struct in_pktinfo *>(CMSG_DATA(cmsg));
+		memset(pktinfo, 0, sizeof(*pktinfo));
+		if (tcpha.isV6())
+			return false;
+		pktinfo->ipi_spec_dst.s_addr = tcpha.hash[3];
+	}
+	return true;
+}
+
+/// Attach a classic BPF program to the SO_REUSEPORT group of sock,
+/// which picks the voice worker for a datagram by hashing its source
+/// address and port. This keeps each client on a single worker.
+static bool attachVoiceSteering(int sock, int workers) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[] = {
+		// A = IP version
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 5, 0),
+		// IPv4: X = source port, A = source address
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		BPF_JUMP(BPF_JMP | BPF_JA, 3, 0, 0),
+		// IPv6: X = source port, A = low 32 bits of source address
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 40),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+		// return ((A ^ X) * golden ratio >> 16) % workers
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<unsigned int>(workers)),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+
+	struct sock_fprog prog;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	return (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0);
+#else
+	Q_UNUSED(sock);
+	Q_UNUSED(workers);
+	return false;
+#endif
+}
+#endif
+
+VoiceWorker::VoiceWorker(Server *srv, int worker) : QThread(srv), s(srv), iWorker(worker), ubBatch(NULL) {
+	bValid = true;
+#ifdef Q_OS_UNIX
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, aiNotify) != 0) {
+		aiNotify[0] = aiNotify[1] = -1;
+		bValid = false;
+	}
+#else
+	hNotify = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+}
+
+VoiceWorker::~VoiceWorker() {
+#ifdef Q_OS_UNIX
+	foreach(int sock, qlUdpSocket)
+		close(sock);
+
+	if (aiNotify[0] >= 0)
+		close(aiNotify[0]);
+	if (aiNotify[1] >= 0)
+		close(aiNotify[1]);
+#else
+	foreach(SOCKET sock, qlUdpSocket)
+		closesocket(sock);
+	if (hNotify)
+		CloseHandle(hNotify);
+#endif
+}
+
+void VoiceWorker::run() {
+#ifdef Q_OS_UNIX
+	s->voiceLoop(qlUdpSocket, aiNotify[0], ubBatch, iWorker);
+#else
+	s->voiceLoop(qlUdpSocket, hNotify, ubBatch, iWorker);
+#endif
+}
+
+void VoiceWorker::notify() {
+#ifdef Q_OS_UNIX
+	unsigned char val = 0;
+	if (::write(aiNotify[1], &val, 1) != 1)
+		s->log(QString("Failed to signal voice worker %1").arg(iWorker));
+#else
+	SetEvent(hNotify);
+#endif
+}
+
+void Server::fillPingReply(quint32 *ping) {
+	ping[0] = uiVersionBlob;
+	// 1 and 2 will be the timestamp, which we return unmodified.
+	ping[3] = qToBigEndian(static_cast<quint32>(vsdVoice.current()->qhSessions.count()));
+	ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
+	ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+}
+
 void Server::run() {
+	// This thread also reads the relay link, so relayed speech is
+	// processed like local speech.
+#ifdef Q_OS_UNIX
+	QList<int> sockets = qlUdpSocket;
+	if (rRelay)
+		sockets << rRelay->sockets();
+	voiceLoop(sockets, aiNotify[0], ubBatch, 0);
+#else
+	QList<SOCKET> sockets = qlUdpSocket;
+	if (rRelay)
+		sockets << rRelay->sockets();
+	voiceLoop(sockets, hNotify, ubBatch, 0);
+#endif
+}
+
+#ifdef Q_OS_UNIX
+void Server::voiceLoop(const QList<int> &sockets, int notify, UDPBatch *batch, int reader) {
+#else
+void Server::voiceLoop(const QList<SOCKET> &sockets, HANDLE notify, UDPBatch *batch, int reader) {
+#endif
 	qint32 len;
 #if defined(__LP64__)
 	char encbuff[UDP_PACKET_SIZE+8];
@@ -673,19 +1113,19 @@ void Server::run() {
 	char buffer[UDP_PACKET_SIZE];
 
 	sockaddr_storage from;
-	int nfds = qlUdpSocket.count();
+	int nfds = sockets.count();
 
 #ifdef Q_OS_UNIX
 	socklen_t fromlen;
 	STACKVAR(struct pollfd, fds, nfds+1);
 
 	for (int i=0;i<nfds;++i) {
-		fds[i].fd = qlUdpSocket.at(i);
+		fds[i].fd = sockets.at(i);
 		fds[i].events = POLLIN;
 		fds[i].revents = 0;
 	}
 
-	fds[nfds].fd=aiNotify[0];
+	fds[nfds].fd=notify;
 	fds[nfds].events = POLLIN;
 	fds[nfds].revents = 0;
 #else
@@ -693,11 +1133,11 @@ void Server::run() {
 	STACKVAR(SOCKET, fds, nfds);
 	STACKVAR(HANDLE, events, nfds+1);
 	for (int i=0;i<nfds;++i) {
-		fds[i] = qlUdpSocket.at(i);
+		fds[i] = sockets.at(i);
 		events[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
 		::WSAEventSelect(fds[i], events[i], FD_READ);
 	}
-	events[nfds] = hNotify;
+	events[nfds] = notify;
 #endif
 
 	++nfds;
@@ -713,10 +1153,14 @@ void Server::run() {
 			break;
 		}
 
+		// Everything read from vsdVoice stays valid until the
+		// next wakeup, when this section ends.
+		VoiceSnapshotReader vsr(vsdVoice, reader);
+
 		if (fds[nfds - 1].revents) {
 			// Drain pipe
 			unsigned char val;
-			while (::recv(aiNotify[0], &val, 1, MSG_DONTWAIT) == 1) {};
+			while (::recv(notify, &val, 1, MSG_DONTWAIT) == 1) {};
 			break;
 		}
 
@@ -729,6 +1173,18 @@ void Server::run() {
 				}
 
 				int sock = fds[i].fd;
+				if (rRelay && rRelay->ownsSocket(sock)) {
+					rRelay->datagram(sock, batch);
+					fds[i].revents = 0;
+					continue;
+				}
+#ifdef Q_OS_LINUX
+				if (batch) {
+					receiveBatch(sock, buffer, batch);
+					fds[i].revents = 0;
+					continue;
+				}
+#endif
 #else
 		for (int i=0;i<1;++i) {
 			{
@@ -741,7 +1197,12 @@ void Server::run() {
 					bRunning = false;
 					break;
 				}
+				VoiceSnapshotReader vsr(vsdVoice, reader);
 				SOCKET sock = fds[ret - WAIT_OBJECT_0];
+				if (rRelay && rRelay->ownsSocket(sock)) {
+					rRelay->datagram(sock, batch);
+					continue;
+				}
 #endif
 
 				fromlen = sizeof(from);
@@ -755,7 +1216,7 @@ void Server::run() {
 				iov[0].iov_base = encrypt;
 				iov[0].iov_len = UDP_PACKET_SIZE;
 
-				u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
+				u_char controldata[UDP_CONTROL_SIZE];
 
 				memset(&msg, 0, sizeof(msg));
 				msg.msg_name = reinterpret_cast<struct sockaddr *>(&from);
@@ -782,16 +1243,10 @@ void Server::run() {
 					continue;
 				}
 
-				QReadLocker rl(&qrwlVoiceThread);
-
 				quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
 
 				if ((len == 12) && (*ping == 0) && bAllowPing) {
-					ping[0] = uiVersionBlob;
-					// 1 and 2 will be the timestamp, which we return unmodified.
-					ping[3] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
-					ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
-					ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+					fillPingReply(ping);
 
 #ifdef Q_OS_LINUX
 					iov[0].iov_len = 6 * sizeof(quint32);
@@ -802,68 +1257,7 @@ void Server::run() {
 					continue;
 				}
 
-
-				quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&from)->sin_port);
-				const HostAddress &ha = HostAddress(from);
-
-				const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
-
-				ServerUser *u = qhPeerUsers.value(key);
-				if (u) {
-					if (! checkDecrypt(u, encrypt, buffer, len)) {
-						continue;
-					}
-				} else {
-					// Unknown peer
-					foreach(ServerUser *usr, qhHostUsers.value(ha)) {
-						if (checkDecrypt(usr, encrypt, buffer, len)) { // checkDecrypt takes the User's qrwlCrypt lock.
-							// Every time we relock, reverify users' existance.
-							// The main thread might delete the user while the lock isn't held.
-							unsigned int uiSession = usr->uiSession;
-							rl.unlock();
-							qrwlVoiceThread.lockForWrite();
-							if (qhUsers.contains(uiSession)) {
-								u = usr;
-								u->sUdpSocket = sock;
-								memcpy(& u->saiUdpAddress, &from, sizeof(from));
-								qhHostUsers[from].remove(u);
-								qhPeerUsers.insert(key, u);
-							}
-							qrwlVoiceThread.unlock();
-							rl.relock();
-							if (u != NULL && !qhUsers.contains(uiSession))
-								u = NULL;
-							break;
-						}
-					}
-					if (! u) {
-						continue;
-					}
-				}
-				len -= 4;
-
-				MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
-
-				if (msgType == MessageHandler::UDPVoiceSpeex ||
-				    msgType == MessageHandler::UDPVoiceCELTAlpha ||
-				    msgType == MessageHandler::UDPVoiceCELTBeta ||
-				    msgType == MessageHandler::UDPVoiceOpus) {
-
-					// Allow all voice packets through by default.
-					bool ok = true;
-					// ...Unless we're in Opus mode. In Opus mode, only Opus packets are allowed.
-					if (bOpus && msgType != MessageHandler::UDPVoiceOpus) {
-						ok = false;
-					}
-
-					if (ok) {
-						u->aiUdpFlag = 1;
-						processMsg(u, buffer, len);
-					}
-				} else if (msgType == MessageHandler::UDPPing) {
-					QByteArray qba;
-					sendMessage(u, buffer, len, qba, true);
-				}
+				handleUdpPacket(sock, encrypt, buffer, len, from, batch);
 #ifdef Q_OS_UNIX
 				fds[i].revents = 0;
 #endif
@@ -875,149 +1269,546 @@ void Server::run() {
 		::WSAEventSelect(fds[i], NULL, 0);
 		CloseHandle(events[i]);
 	}
+#else
+	Q_UNUSED(batch);
 #endif
 }
 
-bool Server::checkDecrypt(ServerUser *u, const char *encrypt, char *plain, unsigned int len) {
-	QMutexLocker l(&u->qmCrypt);
-
-	if (u->csCrypt.isValid() && u->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt), reinterpret_cast<unsigned char *>(plain), len))
-		return true;
-
-	if (u->csCrypt.tLastGood.elapsed() > 5000000ULL) {
-		if (u->csCrypt.tLastRequest.elapsed() > 5000000ULL) {
-			u->csCrypt.tLastRequest.restart();
-			emit reqSync(u->uiSession);
-		}
-	}
-	return false;
+/// The port of addr, in network byte order.
+static quint16 sockaddrPort(const sockaddr_storage &addr) {
+	return (addr.ss_family == AF_INET6) ? (reinterpret_cast<const sockaddr_in6 *>(&addr)->sin6_port) : (reinterpret_cast<const sockaddr_in *>(&addr)->sin_port);
 }
 
-void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &cache, bool force) {
-	if ((QAtomicIntLoad(u->aiUdpFlag) == 1 || force) && (u->sUdpSocket != INVALID_SOCKET)) {
-#if defined(__LP64__)
-		STACKVAR(char, ebuffer, len+4+16);
-		char *buffer = reinterpret_cast<char *>(((reinterpret_cast<quint64>(ebuffer) + 8) & ~7) + 4);
+#ifdef Q_OS_UNIX
+void Server::handleUdpPacket(int sock, const char *encrypt, char *buffer, int len, const sockaddr_storage &from, UDPBatch *batch) {
 #else
-		STACKVAR(char, buffer, len+4);
+void Server::handleUdpPacket(SOCKET sock, const char *encrypt, char *buffer, int len, const sockaddr_storage &from, UDPBatch *batch) {
 #endif
-		{
-			QMutexLocker wl(&u->qmCrypt);
+	quint16 port = sockaddrPort(from);
+	const HostAddress &ha = HostAddress(from);
+
+	const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
+
+	// Users found here stay allocated until the voice thread's
+	// snapshot section ends, even if the main thread removes them.
+	const VoiceSnapshot::Member *m = vsdVoice.current()->peer(key);
+	ServerUser *u = m ? m->su : NULL;
+
+	if (len == UDP_ASSOCIATE_SIZE) {
+		const quint32 *words = reinterpret_cast<const quint32 *>(encrypt);
+		if ((words[0] == 0) && (qFromBigEndian<quint32>(reinterpret_cast<const unsigned char *>(encrypt + 4)) == UDP_ASSOCIATE_MAGIC)) {
+			// Clients repeat these; from an associated peer there is nothing to do.
+			if (! u)
+				handleUdpAssociation(key, encrypt);
+			return;
+		}
+	}
 
-			if (!u->csCrypt.isValid()) {
+	if (u) {
+		if (! checkDecrypt(u, encrypt, buffer, len)) {
+			return;
+		}
+	} else {
+		// Unknown peer, or one that was associated after the
+		// current snapshot was published.
+		QReadLocker rl(&qrwlVoiceThread);
+
+		u = qhPeerUsers.value(key);
+		if (u) {
+			rl.unlock();
+			if (! checkDecrypt(u, encrypt, buffer, len)) {
 				return;
 			}
+		} else {
+			// A client with a UDP token has announced which user it is,
+			// so only that key needs to be tried. Users of older clients
+			// can only be found by trying each of their keys.
+			QSet<ServerUser *> candidates;
+			ServerUser *pending = qhPendingPeerUsers.value(key);
+			if (pending)
+				candidates.insert(pending);
+			else
+				candidates = qhHostUsers.value(ha);
+
+			foreach(ServerUser *usr, candidates) {
+				if (checkDecrypt(usr, encrypt, buffer, len)) { // checkDecrypt takes the User's qrwlCrypt lock.
+					// Every time we relock, reverify users' existance.
+					// The main thread might remove the user while the lock isn't held.
+					unsigned int uiSession = usr->uiSession;
+					rl.unlock();
+					qrwlVoiceThread.lockForWrite();
+					if (qhUsers.contains(uiSession)) {
+						u = usr;
+
+						// A token user may move to a new port, e.g.
+						// when a NAT rebinds it.
+						const QPair<HostAddress, quint16> &oldkey = QPair<HostAddress, quint16>(u->haAddress, sockaddrPort(u->saiUdpAddress));
+						if (qhPeerUsers.value(oldkey) == u)
+							qhPeerUsers.remove(oldkey);
+						if (u->usUdpPendingPort == port) {
+							qhPendingPeerUsers.remove(key);
+							u->usUdpPendingPort = 0;
+						}
 
-			u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer),
-							   len);
+						{
+							QMutexLocker l(&u->qmCrypt);
+							u->sUdpSocket = sock;
+							memcpy(& u->saiUdpAddress, &from, sizeof(from));
+						}
+						qhHostUsers[from].remove(u);
+						qhPeerUsers.insert(key, u);
+					}
+					qrwlVoiceThread.unlock();
+					if (u)
+						updateVoiceSnapshot();
+					break;
+				}
+			}
+			if (! u) {
+				return;
+			}
 		}
-#ifdef Q_OS_WIN
-		DWORD dwFlow = 0;
-		if (Meta::hQoS)
-			QOSAddSocketToFlow(Meta::hQoS, u->sUdpSocket, reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress), QOSTrafficTypeVoice, QOS_NON_ADAPTIVE_FLOW, reinterpret_cast<PQOS_FLOWID>(&dwFlow));
-#endif
-#ifdef Q_OS_LINUX
-		struct msghdr msg;
-		struct iovec iov[1];
+	}
+	len -= 4;
 
-		iov[0].iov_base = buffer;
-		iov[0].iov_len = len+4;
+	MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
 
-		u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
-		memset(controldata, 0, sizeof(controldata));
+	if (msgType == MessageHandler::UDPVoiceSpeex ||
+	    msgType == MessageHandler::UDPVoiceCELTAlpha ||
+	    msgType == MessageHandler::UDPVoiceCELTBeta ||
+	    msgType == MessageHandler::UDPVoiceOpus) {
 
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_name = reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress);
-		msg.msg_namelen = static_cast<socklen_t>((u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
-		msg.msg_iov = iov;
-		msg.msg_iovlen = 1;
-		msg.msg_control = controldata;
-		msg.msg_controllen = CMSG_SPACE((u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct in6_pktinfo) : sizeof(struct in_pktinfo));
-
-		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-		HostAddress tcpha(u->saiTcpLocalAddress);
-		if (u->saiUdpAddress.ss_family == AF_INET6) {
-			cmsg->cmsg_level = IPPROTO_IPV6;
-			cmsg->cmsg_type = IPV6_PKTINFO;
-			cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-			struct in6_pktinfo *pktinfo = reinterpret_cast<struct in6_pktinfo *>(CMSG_DATA(cmsg));
-			memset(pktinfo, 0, sizeof(*pktinfo));
-			memcpy(&pktinfo->ipi6_addr.s6_addr[0], &tcpha.qip6.c[0], sizeof(pktinfo->ipi6_addr.s6_addr));
-		} else {
-			cmsg->cmsg_level = IPPROTO_IP;
-			cmsg->cmsg_type = IP_PKTINFO;
-			cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-			struct in_pktinfo *pktinfo = reinterpret_cast<struct in_pktinfo *>(CMSG_DATA(cmsg));
-			memset(pktinfo, 0, sizeof(*pktinfo));
-			if (tcpha.isV6())
-				return;
-			pktinfo->ipi_spec_dst.s_addr = tcpha.hash[3];
+		// Allow all voice packets through by default.
+		bool ok = true;
+		// ...Unless we're in Opus mode. In Opus mode, only Opus packets are allowed.
+		if (bOpus && msgType != MessageHandler::UDPVoiceOpus) {
+			ok = false;
 		}
 
-
-		::sendmsg(u->sUdpSocket, &msg, 0);
-#else
-		::sendto(u->sUdpSocket, buffer, len+4, 0, reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress), (u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
-#endif
-#ifdef Q_OS_WIN
-		if (Meta::hQoS && dwFlow)
-			QOSRemoveSocketFromFlow(Meta::hQoS, 0, dwFlow, 0);
-#else
-#endif
-	} else {
-		if (cache.isEmpty())
-			cache = QByteArray(data, len);
-		emit tcpTransmit(cache,u->uiSession);
+		if (ok) {
+			u->aiUdpFlag = 1;
+			processMsg(u, buffer, len, batch);
+		}
+	} else if (msgType == MessageHandler::UDPPing) {
+		sendMessage(u, buffer, len, true, batch);
 	}
 }
 
-#define SENDTO \
-		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u)) { \
-			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) \
-				sendMessage(pDst, buffer, len, qba); \
-			else \
-				sendMessage(pDst, buffer, len - poslen, qba_npos); \
-		}
-
-void Server::processMsg(ServerUser *u, const char *data, int len) {
-	if (u->sState != ServerUser::Authenticated || u->bMute || u->bSuppress || u->bSelfMute)
-		return;
-
-	QByteArray qba, qba_npos;
-	unsigned int counter;
-	char buffer[UDP_PACKET_SIZE];
-	PacketDataStream pdi(data + 1, len - 1);
-	PacketDataStream pds(buffer+1, UDP_PACKET_SIZE-1);
-	unsigned int type = data[0] & 0xe0;
-	unsigned int target = data[0] & 0x1f;
-	unsigned int poslen;
+void Server::handleUdpAssociation(const QPair<HostAddress, quint16> &key, const char *data) {
+	quint64 token;
+	memcpy(&token, data + 8, UDP_TOKEN_SIZE);
 
-	// Check the voice data rate limit.
 	{
-		BandwidthRecord *bw = &u->bwr;
-
-		// IP + UDP + Crypt + Data
-		const int packetsize = 20 + 8 + 4 + len;
+		QReadLocker rl(&qrwlVoiceThread);
 
-		if (! bw->addFrame(packetsize, iMaxBandwidth / 8)) {
-			// Suppress packet.
-			 return;
-		}
+		// Tokens are only valid from the host the user connected
+		// from; anything else, including junk, costs one lookup.
+		ServerUser *u = qhTokenUsers.value(token);
+		if (! u || (u->haAddress != key.first) || (u->usUdpPendingPort == key.second) || (qhPeerUsers.value(key) == u))
+			return;
 	}
 
-	// Read the sequence number.
-	pdi >> counter;
+	QWriteLocker wl(&qrwlVoiceThread);
 
-	// Skip to the end of the voice data.
-	if ((type >> 5) != MessageHandler::UDPVoiceOpus) {
+	ServerUser *u = qhTokenUsers.value(token);
+	if (! u || (u->haAddress != key.first))
+		return;
+
+	// Only remember the latest address of each user. The association
+	// is made by the first datagram from there that u's key decrypts.
+	if (u->usUdpPendingPort)
+		qhPendingPeerUsers.remove(QPair<HostAddress, quint16>(u->haAddress, u->usUdpPendingPort));
+	u->usUdpPendingPort = key.second;
+	qhPendingPeerUsers.insert(key, u);
+}
+
+#ifdef Q_OS_LINUX
+void Server::receiveBatch(int sock, char *buffer, UDPBatch *b) {
+	for (int i=0;i<b->iRecvSize;++i) {
+		UDPBatch::Slot &s = b->recvSlots[i];
+		struct msghdr &msg = b->recvMsgs[i].msg_hdr;
+
+		s.iov.iov_base = s.data + 4;
+		s.iov.iov_len = UDP_PACKET_SIZE;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = reinterpret_cast<struct sockaddr *>(&s.addr);
+		msg.msg_namelen = sizeof(s.addr);
+		msg.msg_iov = &s.iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = s.control;
+		msg.msg_controllen = sizeof(s.control);
+	}
+
+	int n = ::recvmmsg(sock, b->recvMsgs, b->iRecvSize, MSG_DONTWAIT | MSG_TRUNC, NULL);
+	if (n <= 0)
+		return;
+
+	++b->uiRecvBatches;
+	b->uiRecvPackets += n;
+
+	for (int i=0;i<n;++i) {
+		UDPBatch::Slot &s = b->recvSlots[i];
+		qint32 len = static_cast<qint32>(b->recvMsgs[i].msg_len);
+
+		if ((len < 5) || (len > UDP_PACKET_SIZE))
+			continue;
+
+		char *encrypt = s.data + 4;
+		quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
+
+		if ((len == 12) && (*ping == 0) && bAllowPing) {
+			fillPingReply(ping);
+
+			// Reply using the received header, so the pong leaves
+			// from the local address the ping arrived on.
+			s.iov.iov_len = 6 * sizeof(quint32);
+			::sendmsg(sock, &b->recvMsgs[i].msg_hdr, 0);
+			continue;
+		}
+
+		handleUdpPacket(sock, encrypt, buffer, len, s.addr, b);
+	}
+
+	flushBatch(b);
+}
+
+void Server::queueBatch(UDPBatch *b, ServerUser * const *users, int count, const char *data, int len) {
+	if (b->iSendCount + count > UDP_SEND_BATCH_SIZE)
+		sendBatch(b);
+
+	// Lock the users' crypt states in address order, so that voice
+	// threads encrypting for overlapping sets of users can't deadlock.
+	ServerUser *locked[CRYPT_MULTI_BUFFERS];
+	int nlocked = 0;
+
+	qCopy(users, users + count, locked);
+	qSort(locked, locked + count);
+	for (int i=0;i<count;++i)
+		if ((nlocked == 0) || (locked[nlocked - 1] != locked[i]))
+			locked[nlocked++] = locked[i];
+
+	for (int i=0;i<nlocked;++i)
+		locked[i]->qmCrypt.lock();
+
+	CryptState *states[CRYPT_MULTI_BUFFERS];
+	unsigned char *dst[CRYPT_MULTI_BUFFERS];
+	int n = 0;
+
+	for (int i=0;i<nlocked;++i) {
+		ServerUser *u = locked[i];
+		const int idx = b->iSendCount + n;
+		UDPBatch::Slot &s = b->sendSlots[idx];
+
+		if (! u->csCrypt.isValid())
+			continue;
+
+		// The user may be gone by the time the batch is flushed,
+		// so the destination address is copied into the slot.
+		memcpy(&s.addr, &u->saiUdpAddress, sizeof(s.addr));
+		b->sendSockets[idx] = u->sUdpSocket;
+
+		s.iov.iov_base = s.data + 4;
+		s.iov.iov_len = len + 4;
+
+		if (! prepareUdpMessage(u, &b->sendMsgs[idx].msg_hdr, &s.iov, s.control, &s.addr))
+			continue;
+
+		states[n] = &u->csCrypt;
+		dst[n] = reinterpret_cast<unsigned char *>(s.data + 4);
+		++n;
+	}
+
+	CryptState::encrypt(states, reinterpret_cast<const unsigned char *>(data), dst, len, n);
+
+	for (int i=0;i<nlocked;++i)
+		locked[i]->qmCrypt.unlock();
+
+	b->iSendCount += n;
+}
+
+void Server::aggregateBatch(UDPBatch *b, ServerUser *u, const char *data, int len) {
+	if (! VoiceAggregate::fits(len)) {
+		queueBatch(b, &u, 1, data, len);
+		return;
+	}
+
+	UDPBatch::Aggregate *a = b->aggregate(u);
+	if (! a) {
+		flushAggregates(b);
+		a = b->aggregate(u);
+	}
+
+	if (! a->add(data, len)) {
+		queueBatch(b, &u, 1, a->datagram(), a->datagramLength());
+		a->clear();
+		a->add(data, len);
+	}
+}
+
+void Server::flushAggregates(UDPBatch *b) {
+	for (int i=0;i<b->iAggregateCount;++i) {
+		const UDPBatch::Aggregate &a = b->aggregates[i];
+		if (a.iFrames > 0)
+			queueBatch(b, &a.u, 1, a.datagram(), a.datagramLength());
+	}
+
+	b->clearAggregates();
+}
+
+void Server::flushBatch(UDPBatch *b) {
+	flushAggregates(b);
+	sendBatch(b);
+}
+
+void Server::sendBatch(UDPBatch *b) {
+	int start = 0;
+
+	while (start < b->iSendCount) {
+		// sendmmsg() works on a single socket, so send each
+		// run of datagrams for the same socket separately.
+		int sock = b->sendSockets[start];
+		int end = start + 1;
+		while ((end < b->iSendCount) && (b->sendSockets[end] == sock))
+			++end;
+
+		while (start < end) {
+			int sent = ::sendmmsg(sock, &b->sendMsgs[start], end - start, 0);
+			++b->uiSendBatches;
+			if (sent <= 0) {
+				if (errno == EINTR)
+					continue;
+				// Drop the datagram that failed, just like the
+				// unbatched path ignores sendmsg() errors.
+				sent = 1;
+			} else {
+				b->uiSendPackets += sent;
+			}
+			start += sent;
+		}
+	}
+
+	b->iSendCount = 0;
+}
+#endif
+
+bool Server::checkDecrypt(ServerUser *u, const char *encrypt, char *plain, unsigned int len) {
+	QMutexLocker l(&u->qmCrypt);
+
+	if (u->csCrypt.isValid() && u->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt), reinterpret_cast<unsigned char *>(plain), len))
+		return true;
+
+	if (u->csCrypt.tLastGood.elapsed() > 5000000ULL) {
+		if (u->csCrypt.tLastRequest.elapsed() > 5000000ULL) {
+			u->csCrypt.tLastRequest.restart();
+			emit reqSync(u->uiSession);
+		}
+	}
+	return false;
+}
+
+void Server::sendMessage(ServerUser *u, const char *data, int len, bool force, UDPBatch *batch, bool aggregate) {
+	if ((QAtomicIntLoad(u->aiUdpFlag) == 1 || force) && (u->sUdpSocket != INVALID_SOCKET)) {
+#ifdef Q_OS_LINUX
+		// While a voice thread is processing a batch of received
+		// datagrams, outgoing ones are queued and sent with sendmmsg().
+		if (batch) {
+			if (aggregate && ! force)
+				aggregateBatch(batch, u, data, len);
+			else
+				queueBatch(batch, &u, 1, data, len);
+			return;
+		}
+#else
+		Q_UNUSED(batch);
+		Q_UNUSED(aggregate);
+#endif
+#if defined(__LP64__)
+		STACKVAR(char, ebuffer, len+4+16);
+		char *buffer = reinterpret_cast<char *>(((reinterpret_cast<quint64>(ebuffer) + 8) & ~7) + 4);
+#else
+		STACKVAR(char, buffer, len+4);
+#endif
+		sockaddr_storage addr;
+#ifdef Q_OS_UNIX
+		int sock;
+#else
+		SOCKET sock;
+#endif
+		{
+			QMutexLocker wl(&u->qmCrypt);
+
+			if (!u->csCrypt.isValid()) {
+				return;
+			}
+
+			u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer),
+							   len);
+
+			// A voice thread may re-associate the user with a new
+			// address at any time, so use a consistent copy.
+			memcpy(&addr, &u->saiUdpAddress, sizeof(addr));
+			sock = u->sUdpSocket;
+		}
+#ifdef Q_OS_WIN
+		DWORD dwFlow = 0;
+		if (Meta::hQoS)
+			QOSAddSocketToFlow(Meta::hQoS, sock, reinterpret_cast<struct sockaddr *>(& addr), QOSTrafficTypeVoice, QOS_NON_ADAPTIVE_FLOW, reinterpret_cast<PQOS_FLOWID>(&dwFlow));
+#endif
+#ifdef Q_OS_LINUX
+		struct msghdr msg;
+		struct iovec iov[1];
+
+		iov[0].iov_base = buffer;
+		iov[0].iov_len = len+4;
+
+		u_char controldata[UDP_CONTROL_SIZE];
+
+		if (! prepareUdpMessage(u, &msg, iov, controldata, & addr))
+			return;
+
+		::sendmsg(sock, &msg, 0);
+#else
+		::sendto(sock, buffer, len+4, 0, reinterpret_cast<struct sockaddr *>(& addr), (addr.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+#endif
+#ifdef Q_OS_WIN
+		if (Meta::hQoS && dwFlow)
+			QOSRemoveSocketFromFlow(Meta::hQoS, 0, dwFlow, 0);
+#else
+#endif
+	} else {
+		// Queue the packet for the main thread, which owns the TLS
+		// socket, and schedule a drain unless one is already pending.
+		if (! u->tunnelRing()->push(data, len))
+			return;
+		if (u->aiTunnelScheduled.fetchAndStoreOrdered(1) == 0)
+			emit tcpTransmit(u->uiSession);
+	}
+}
+
+void Server::sendMessages(ServerUser * const *users, const bool *aggregate, int count, const char *data, int len, UDPBatch *batch) {
+#ifdef Q_OS_LINUX
+	if (batch) {
+		ServerUser *udp[CRYPT_MULTI_BUFFERS];
+		int n = 0;
+
+		for (int i=0;i<count;++i) {
+			ServerUser *u = users[i];
+			if ((QAtomicIntLoad(u->aiUdpFlag) == 1) && (u->sUdpSocket != INVALID_SOCKET) && ! aggregate[i]) {
+				udp[n++] = u;
+				if (n == CRYPT_MULTI_BUFFERS) {
+					queueBatch(batch, udp, n, data, len);
+					n = 0;
+				}
+			} else {
+				sendMessage(u, data, len, false, batch, aggregate[i]);
+			}
+		}
+		if (n)
+			queueBatch(batch, udp, n, data, len);
+		return;
+	}
+#endif
+	for (int i=0;i<count;++i)
+		sendMessage(users[i], data, len, false, batch, aggregate[i]);
+}
+
+int Server::cullInaudible(const VoiceSnapshot::FanOut *fo, float radius, const float *pos, ServerUser **audible, bool *aggregate) {
+	// Compare squared distances.
+	const float inner = radius * radius;
+	const float outer = inner * (1.0f + AUDIBLE_HYSTERESIS) * (1.0f + AUDIBLE_HYSTERESIS);
+	int n = 0;
+
+	for (int i=0;i<fo->iSameContext;++i) {
+		ServerUser *dst = fo->qvTargets.at(i);
+		float lpos[3];
+		bool hear = true;
+
+		// Clients only send their position while talking, so the
+		// last one is all there is for a listener.
+		if (dst->prPosition.get(lpos)) {
+			const float dx = lpos[0] - pos[0];
+			const float dy = lpos[1] - pos[1];
+			const float dz = lpos[2] - pos[2];
+			const float dist = dx * dx + dy * dy + dz * dz;
+
+			hear = (dist <= (QAtomicIntLoad(fo->aiAudible[i]) ? outer : inner));
+			fo->aiAudible[i].fetchAndStoreRelaxed(hear ? 1 : 0);
+		}
+		if (hear) {
+			audible[n] = dst;
+			aggregate[n++] = fo->qvAggregate.at(i);
+		}
+	}
+
+	return n;
+}
+
+#define SENDTO \
+		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u)) { \
+			const VoiceSnapshot::Member *dm = vs->member(pDst->uiSession); \
+			const bool aggregate = dm && dm->bUdpAggregate; \
+			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) \
+				sendMessage(pDst, buffer, len, false, batch, aggregate); \
+			else \
+				sendMessage(pDst, buffer, len - poslen, false, batch, aggregate); \
+		}
+
+/// Forward a voice packet from u. May be called from a voice thread inside
+/// its vsdVoice section, or from the main thread. Neither may hold
+/// qrwlVoiceThread.
+void Server::processMsg(ServerUser *u, const char *data, int len, UDPBatch *batch) {
+	if (vcCapture->isActive())
+		vcCapture->packet(u->uiSession, data, len);
+
+	const VoiceSnapshot *vs = vsdVoice.current();
+	const VoiceSnapshot::Member *m = vs->member(u->uiSession);
+
+	if (! m || ! m->bSpeak)
+		return;
+
+	const int inlen = len;
+	unsigned int counter;
+	char buffer[UDP_PACKET_SIZE];
+	PacketDataStream pdi(data + 1, len - 1);
+	PacketDataStream pds(buffer+1, UDP_PACKET_SIZE-1);
+	unsigned int type = data[0] & 0xe0;
+	unsigned int target = data[0] & 0x1f;
+	unsigned int poslen;
+	int audiolen = 0;
+	bool terminator = false;
+
+	// Check the voice data rate limit.
+	{
+		BandwidthRecord *bw = &u->bwr;
+
+		// IP + UDP + Crypt + Data
+		const int packetsize = 20 + 8 + 4 + len;
+
+		if (! bw->addFrame(packetsize, iMaxBandwidth / 8)) {
+			// Suppress packet.
+			 return;
+		}
+	}
+
+	// Read the sequence number.
+	pdi >> counter;
+
+	// Skip to the end of the voice data.
+	if ((type >> 5) != MessageHandler::UDPVoiceOpus) {
 		do {
 			counter = pdi.next8();
 			pdi.skip(counter & 0x7f);
+			audiolen += counter & 0x7f;
 		} while ((counter & 0x80) && pdi.isValid());
+		// An empty frame ends the transmission.
+		terminator = ((counter & 0x7f) == 0);
 	} else {
 		int size;
 		pdi >> size;
 		pdi.skip(size & 0x1fff);
+		audiolen = size & 0x1fff;
+		terminator = ((size & 0x2000) != 0);
 	}
 
 	// Save location of the positional audio data.
@@ -1032,41 +1823,76 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 
 	if (target == 0x1f) { // Server loopback
 		buffer[0] = static_cast<char>(type | 0);
-		sendMessage(u, buffer, len, qba);
+		sendMessage(u, buffer, len, false, batch, m->bUdpAggregate);
 		return;
 	} else if (target == 0) { // Normal speech
-		Channel *c = u->cChannel;
-
-		buffer[0] = static_cast<char>(type | 0);
-		foreach(User *p, c->qlUsers) {
-			ServerUser *pDst = static_cast<ServerUser *>(p);
-			SENDTO;
-		}
+		SpeakerSelection *ss = (m->iChannel >= 0) ? vs->qvSelections.at(m->iChannel) : NULL;
+		if (ss && ! ss->forward(u->uiSession, audiolen, terminator, m->bPrioritySpeaker))
+			return;
 
-		if (! c->qhLinks.isEmpty()) {
-			QSet<Channel *> chans = c->allLinks();
-			chans.remove(c);
+		// Each peer node gets the packet once and fans it out itself.
+		// Speech that came over the relay is not passed on again.
+		if (rRelay && ! m->bRelayed && (m->iChannel >= 0) && ! vs->qvRelayPeers.at(m->iChannel).isEmpty())
+			rRelay->sendVoice(vs->qvRelayPeers.at(m->iChannel), vs->qvChannelIds.at(m->iChannel), u->uiSession, data, inlen - poslen);
 
-			QMutexLocker qml(&qmCache);
+		const VoiceSnapshot::FanOut *fo = vs->fanOut(*m);
+		ServerUser * const *targets = fo->qvTargets.constData();
+		const bool *aggregate = fo->qvAggregate.constData();
+		const int count = fo->qvTargets.count();
+		int i = 0;
 
-			foreach(Channel *l, chans) {
-				if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache)) {
-					foreach(User *p, l->qlUsers) {
-						ServerUser *pDst = static_cast<ServerUser *>(p);
-						SENDTO;
-					}
+		buffer[0] = static_cast<char>(type | 0);
+		if (poslen > 0) {
+			float pos[3];
+			bool cull = false;
+
+			if (vs->fAudibleRadius > 0.0f) {
+				PacketDataStream pdp(buffer + len - poslen, poslen);
+				pdp >> pos[0] >> pos[1] >> pos[2];
+				if (pdp.isValid() && qIsFinite(pos[0]) && qIsFinite(pos[1]) && qIsFinite(pos[2])) {
+					u->prPosition.set(pos);
+					cull = (fo->iSameContext > 0);
 				}
 			}
+
+			if (cull) {
+				STACKVAR(ServerUser *, audible, fo->iSameContext);
+				STACKVAR(bool, audibleAggregate, fo->iSameContext);
+				const int n = cullInaudible(fo, vs->fAudibleRadius, pos, audible, audibleAggregate);
+				sendMessages(audible, audibleAggregate, n, buffer, len, batch);
+			} else {
+				sendMessages(targets, aggregate, fo->iSameContext, buffer, len, batch);
+			}
+			i = fo->iSameContext;
 		}
-	} else if (u->qmTargets.contains(target)) { // Whisper
+		sendMessages(targets + i, aggregate + i, count - i, buffer, len - poslen, batch);
+		return;
+	}
+
+	// Whispers are rare enough to resolve their targets with
+	// the live state instead of the snapshot.
+	QReadLocker rl(&qrwlVoiceThread);
+
+	if (! qhUsers.contains(u->uiSession))
+		return;
+
+	if (u->qmTargets.contains(target)) { // Whisper
 		QSet<ServerUser *> channel;
 		QSet<ServerUser *> direct;
+		bool cached = false;
 
-		if (u->qmTargetCache.contains(target)) {
-			const ServerUser::TargetCache &cache = u->qmTargetCache.value(target);
-			channel = cache.first;
-			direct = cache.second;
-		} else {
+		{
+			// qmCache guards the target cache against other voice threads.
+			QMutexLocker qml(&qmCache);
+			if (u->qmTargetCache.contains(target)) {
+				const ServerUser::TargetCache &cache = u->qmTargetCache.value(target);
+				channel = cache.first;
+				direct = cache.second;
+				cached = true;
+			}
+		}
+
+		if (! cached) {
 			const WhisperTarget &wt = u->qmTargets.value(target);
 			if (! wt.qlChannels.isEmpty()) {
 				QMutexLocker qml(&qmCache);
@@ -1096,9 +1922,10 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 							const QString &qsg = redirect.isEmpty() ? wtc.qsGroup : redirect;
 							foreach(Channel *tc, channels) {
 								if (ChanACL::hasPermission(u, tc, ChanACL::Whisper, &acCache)) {
+									const GroupRef gr(tc, tc, qsg);
 									foreach(User *p, tc->qlUsers) {
 										ServerUser *su = static_cast<ServerUser *>(p);
-										if (! group || Group::isMember(tc, tc, qsg, su)) {
+										if (! group || gr.matches(su)) {
 											channel.insert(su);
 										}
 									}
@@ -1117,28 +1944,15 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 					if (pDst && ChanACL::hasPermission(u, pDst->cChannel, ChanACL::Whisper, &acCache) && !channel.contains(pDst))
 						direct.insert(pDst);
 				}
-			}
-
-			int uiSession = u->uiSession;
-			qrwlVoiceThread.unlock();
-			qrwlVoiceThread.lockForWrite();
 
-			if (qhUsers.contains(uiSession))
 				u->qmTargetCache.insert(target, ServerUser::TargetCache(channel, direct));
-			qrwlVoiceThread.unlock();
-			qrwlVoiceThread.lockForRead();
-			if (! qhUsers.contains(uiSession))
-				return;
+			}
 		}
 		if (! channel.isEmpty()) {
 			buffer[0] = static_cast<char>(type | 1);
 			foreach(ServerUser *pDst, channel) {
 				SENDTO;
 			}
-			if (! direct.isEmpty()) {
-				qba.clear();
-				qba_npos.clear();
-			}
 		}
 		if (! direct.isEmpty()) {
 			buffer[0] = static_cast<char>(type | 2);
@@ -1182,23 +1996,13 @@ void Server::newClient() {
 
 		HostAddress ha(adr);
 
-		QList<Ban> tmpBans = qlBans;
-		foreach(const Ban &ban, qlBans) {
-			if (ban.isExpired())
-				tmpBans.removeOne(ban);
-		}
-		if (qlBans.count() != tmpBans.count()) {
-			qlBans = tmpBans;
-			saveBans();
-		}
-
-		foreach(const Ban &ban, qlBans) {
-			if (ban.haAddress.match(ha, ban.iMask)) {
-				log(QString("Ignoring connection: %1, Reason: %2, Username: %3, Hash: %4 (Server ban)").arg(addressToString(sock->peerAddress(), sock->peerPort()), ban.qsReason, ban.qsUsername, ban.qsHash));
-				sock->disconnectFromHost();
-				sock->deleteLater();
-				return;
-			}
+		const int banned = biBans.find(qlBans, ha);
+		if (banned != -1) {
+			const Ban &ban = qlBans.at(banned);
+			log(QString("Ignoring connection: %1, Reason: %2, Username: %3, Hash: %4 (Server ban)").arg(addressToString(sock->peerAddress(), sock->peerPort()), ban.qsReason, ban.qsUsername, ban.qsHash));
+			sock->disconnectFromHost();
+			sock->deleteLater();
+			return;
 		}
 
 		sock->setPrivateKey(qskKey);
@@ -1227,33 +2031,6 @@ void Server::newClient() {
 		sock->setSslConfiguration(cfg);
 #endif
 
-		if (qqIds.isEmpty()) {
-			log(QString("Session ID pool (%1) empty, rejecting connection").arg(iMaxUsers));
-			sock->disconnectFromHost();
-			sock->deleteLater();
-			return;
-		}
-
-		ServerUser *u = new ServerUser(this, sock);
-		u->uiSession = qqIds.dequeue();
-		u->haAddress = ha;
-		HostAddress(sock->localAddress()).toSockaddr(& u->saiTcpLocalAddress);
-
-		{
-			QWriteLocker wl(&qrwlVoiceThread);
-			qhUsers.insert(u->uiSession, u);
-			qhHostUsers[ha].insert(u);
-		}
-
-		connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
-		connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
-		connect(u, SIGNAL(handleSslErrors(const QList<QSslError> &)), this, SLOT(sslError(const QList<QSslError> &)));
-		connect(u, SIGNAL(encrypted()), this, SLOT(encrypted()));
-
-		log(u, QString("New connection: %1").arg(addressToString(sock->peerAddress(), sock->peerPort())));
-
-		u->setToS();
-
 #if QT_VERSION >= 0x050500
 		sock->setProtocol(QSsl::TlsV1_0OrLater);
 #elif QT_VERSION >= 0x050400
@@ -1265,12 +2042,81 @@ void Server::newClient() {
 #else
 		sock->setProtocol(QSsl::TlsV1);
 #endif
+
+		if (meta->swpPool->isEnabled()) {
+			meta->swpPool->handshake(this, sock);
+			continue;
+		}
+
+		ServerUser *u = addConnection(sock);
+		if (! u)
+			return;
+
 		sock->startServerEncryption();
 	}
 }
 
+ServerUser *Server::addConnection(QSslSocket *sock) {
+	if (qqIds.isEmpty()) {
+		log(QString("Session ID pool (%1) empty, rejecting connection").arg(iMaxUsers));
+		sock->disconnectFromHost();
+		sock->deleteLater();
+		return NULL;
+	}
+
+	HostAddress ha(sock->peerAddress());
+
+	ServerUser *u = new ServerUser(this, sock);
+	u->uiSession = qqIds.dequeue();
+	u->haAddress = ha;
+	HostAddress(sock->localAddress()).toSockaddr(& u->saiTcpLocalAddress);
+
+	{
+		QWriteLocker wl(&qrwlVoiceThread);
+		qhUsers.insert(u->uiSession, u);
+		qhHostUsers[ha].insert(u);
+	}
+	updateVoiceSnapshot();
+
+	connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
+	connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
+	connect(u, SIGNAL(handleSslErrors(const QList<QSslError> &)), this, SLOT(sslError(const QList<QSslError> &)));
+	connect(u, SIGNAL(encrypted()), this, SLOT(encrypted()));
+
+	log(u, QString("New connection: %1").arg(addressToString(sock->peerAddress(), sock->peerPort())));
+
+	u->setToS();
+
+	return u;
+}
+
+void Server::adoptConnection(QSslSocket *sock, bool verified) {
+	// The client may have left while the socket was handed over.
+	if (sock->state() != QAbstractSocket::ConnectedState) {
+		delete sock;
+		return;
+	}
+
+	ServerUser *u = addConnection(sock);
+	if (! u)
+		return;
+
+	u->bVerified = verified;
+	startSession(u);
+
+	// Anything the client sent right after the handshake was
+	// buffered by the socket without a readyRead() we saw.
+	if (sock->bytesAvailable() > 0)
+		QMetaObject::invokeMethod(u, "socketRead", Qt::QueuedConnection);
+}
+
 void Server::encrypted() {
 	ServerUser *uSource = qobject_cast<ServerUser *>(sender());
+	if (uSource)
+		startSession(uSource);
+}
+
+void Server::startSession(ServerUser *uSource) {
 	int major, minor, patch;
 	QString release;
 
@@ -1315,20 +2161,18 @@ void Server::encrypted() {
 			log(uSource, QString::fromUtf8("Strong certificate for %1 <%2> (signed by %3)").arg(subject).arg(uSource->qslEmail.join(", ")).arg(issuer));
 		}
 
-		foreach(const Ban &ban, qlBans) {
-			if (ban.qsHash == uSource->qsHash) {
-				log(uSource, QString("Certificate hash is banned: %1, Username: %2, Reason: %3.").arg(ban.qsHash, ban.qsUsername, ban.qsReason));
-				uSource->disconnectSocket();
-			}
+		foreach(int pos, biBans.findHash(uSource->qsHash)) {
+			const Ban &ban = qlBans.at(pos);
+			if (ban.isExpired())
+				continue;
+			log(uSource, QString("Certificate hash is banned: %1, Username: %2, Reason: %3.").arg(ban.qsHash, ban.qsUsername, ban.qsReason));
+			uSource->disconnectSocket();
+			break;
 		}
 	}
 }
 
-void Server::sslError(const QList<QSslError> &errors) {
-	ServerUser *u = qobject_cast<ServerUser *>(sender());
-	if (!u)
-		return;
-
+bool Server::acceptSslErrors(const QList<QSslError> &errors, bool &verified, QStringList &fatal) {
 	bool ok = true;
 	foreach(QSslError e, errors) {
 		switch (e.error()) {
@@ -1342,13 +2186,25 @@ void Server::sslError(const QList<QSslError> &errors) {
 			case QSslError::HostNameMismatch:
 			case QSslError::CertificateNotYetValid:
 			case QSslError::CertificateExpired:
-				u->bVerified = false;
+				verified = false;
 				break;
 			default:
-				log(u, QString("SSL Error: %1").arg(e.errorString()));
+				fatal << e.errorString();
 				ok = false;
 		}
 	}
+	return ok;
+}
+
+void Server::sslError(const QList<QSslError> &errors) {
+	ServerUser *u = qobject_cast<ServerUser *>(sender());
+	if (!u)
+		return;
+
+	QStringList fatal;
+	bool ok = acceptSslErrors(errors, u->bVerified, fatal);
+	foreach(const QString &error, fatal)
+		log(u, QString("SSL Error: %1").arg(error));
 
 	if (ok) {
 		u->proceedAnyway();
@@ -1405,6 +2261,14 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 
 	log(u, QString("Connection closed: %1 [%2]").arg(reason).arg(err));
 
+	if (u->uiAuthRequest)
+		delete qhPendingAuth.take(u->uiAuthRequest);
+
+	{
+		QMutexLocker qml(&qmCache);
+		acCache.forgetUser(u);
+	}
+
 	if (u->sState == ServerUser::Authenticated) {
 		MumbleProto::UserRemove mpur;
 		mpur.set_session(u->uiSession);
@@ -1420,9 +2284,12 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 
 		qhUsers.remove(u->uiSession);
 		qhHostUsers[u->haAddress].remove(u);
+		if (u->uiUdpToken)
+			qhTokenUsers.remove(u->uiUdpToken);
+		if (u->usUdpPendingPort)
+			qhPendingPeerUsers.remove(QPair<HostAddress, quint16>(u->haAddress, u->usUdpPendingPort));
 
-		quint16 port = (u->saiUdpAddress.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&u->saiUdpAddress)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&u->saiUdpAddress)->sin_port);
-		const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(u->haAddress, port);
+		const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(u->haAddress, sockaddrPort(u->saiUdpAddress));
 		qhPeerUsers.remove(key);
 
 		if (old)
@@ -1440,7 +2307,9 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 		recheckCodecVersions(); // Maybe can choose a better codec now
 	}
 
-	u->deleteLater();
+	// The voice threads may still be using u.
+	qlVoiceRetiredUsers << u;
+	patchVoiceSnapshot(u);
 
 	if (qhUsers.isEmpty())
 		stopThread();
@@ -1460,8 +2329,6 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 		if (len < 2)
 			return;
 
-		QReadLocker rl(&qrwlVoiceThread);
-
 		u->aiUdpFlag = 0;
 
 		const char *buffer = qbaMsg.constData();
@@ -1530,23 +2397,88 @@ void Server::checkTimeout() {
 	qrwlVoiceThread.unlock();
 	foreach(ServerUser *u, qlClose)
 		u->disconnectSocket(true);
+
+	vsdVoice.reclaim();
 }
 
-void Server::tcpTransmitData(QByteArray a, unsigned int id) {
-	Connection *c = qhUsers.value(id);
-	if (c) {
-		QByteArray qba;
-		int len = a.size();
+void Server::setBans(const QList<Ban> &bans) {
+	const QList<Ban> previous = qlBans;
+	qlBans = bans;
+	biBans.rebuild(qlBans);
+	saveBans(previous);
+	scheduleBanPurge();
+}
+
+void Server::addBan(const Ban &b) {
+	qlBans << b;
+	biBans.add(b, qlBans.count() - 1);
+	writeBans(QList<QPair<QByteArray, int> >(), QList<Ban>() << b);
+	scheduleBanPurge();
+}
+
+void Server::purgeBans() {
+	const qint64 now = static_cast<qint64>(QDateTime::currentDateTime().toUTC().toTime_t());
+	QList<int> expired = biBans.takeExpired(qlBans, now);
+
+	if (! expired.isEmpty()) {
+		QList<Ban> removed;
+
+		// The last ban fills the place of each expired one. Going
+		// from the highest position down, it is never expired itself.
+		qSort(expired.begin(), expired.end(), qGreater<int>());
+		foreach(int pos, expired) {
+			const int last = qlBans.count() - 1;
+			removed << qlBans.at(pos);
+			biBans.remove(qlBans.at(pos), pos);
+			if (pos != last) {
+				biBans.remove(qlBans.at(last), last);
+				qlBans[pos] = qlBans.at(last);
+				biBans.add(qlBans.at(pos), pos);
+			}
+			qlBans.removeLast();
+		}
+		removeBans(removed);
+	}
 
-		qba.resize(len + 6);
-		unsigned char *uc = reinterpret_cast<unsigned char *>(qba.data());
-		* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(MessageHandler::UDPTunnel));
-		* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
-		memcpy(uc + 6, a.constData(), len);
+	scheduleBanPurge();
+}
 
-		c->sendMessage(qba);
-		c->forceFlush();
+void Server::scheduleBanPurge() {
+	const qint64 next = biBans.nextExpiry();
+	if (next < 0) {
+		qtBanExpiry->stop();
+		return;
 	}
+
+	// Look again at least daily, in case the clock jumped.
+	const qint64 now = static_cast<qint64>(QDateTime::currentDateTime().toUTC().toTime_t());
+	const qint64 secs = qBound(Q_INT64_C(0), next - now + 1, Q_INT64_C(86400));
+	qtBanExpiry->start(static_cast<int>(secs * 1000));
+}
+
+void Server::tcpTransmitData(unsigned int id) {
+	ServerUser *u = qhUsers.value(id);
+	if (! u)
+		return;
+
+	// Clear the flag first, so packets queued from
+	// now on schedule another drain.
+	u->aiTunnelScheduled.fetchAndStoreOrdered(0);
+
+	TunnelRing *tr = QAtomicPointerLoadAcquire(u->qapTunnel);
+	if (! tr)
+		return;
+
+	QByteArray qba;
+	tr->drain(qba, TUNNEL_MAX_AGE);
+
+	// Rather than let voice pile up behind a slow connection,
+	// drop it; the client is better off with fresh audio.
+	if (qba.isEmpty() || (u->bytesToWrite() > TUNNEL_MAX_BACKLOG))
+		return;
+
+	u->sendMessage(qba);
+	u->forceFlush();
 }
 
 void Server::doSync(unsigned int id) {
@@ -1568,6 +2500,8 @@ void Server::sendProtoAll(const ::google::protobuf::Message &msg, unsigned int m
 }
 
 void Server::sendProtoExcept(ServerUser *u, const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int version) {
+	syncChanged(msg, msgType);
+
 	QByteArray cache;
 	foreach(ServerUser *usr, qhUsers)
 		if ((usr != u) && (usr->sState == ServerUser::Authenticated))
@@ -1575,6 +2509,193 @@ void Server::sendProtoExcept(ServerUser *u, const ::google::protobuf::Message &m
 				usr->sendMessage(msg, msgType, cache);
 }
 
+void Server::syncChanged(const ::google::protobuf::Message &msg, unsigned int msgType) {
+	switch (msgType) {
+		case MessageHandler::ChannelState:
+		case MessageHandler::ChannelRemove: {
+			const int id = (msgType == MessageHandler::ChannelState)
+			               ? static_cast<int>(static_cast<const MumbleProto::ChannelState &>(msg).channel_id())
+			               : static_cast<int>(static_cast<const MumbleProto::ChannelRemove &>(msg).channel_id());
+			for (int i = 0; i < 2; ++i) {
+				qhSyncChannels[i].remove(id);
+				bSyncChannels[i] = false;
+			}
+			break;
+		}
+		case MessageHandler::UserState:
+		case MessageHandler::UserRemove: {
+			const unsigned int session = (msgType == MessageHandler::UserState)
+			                             ? static_cast<const MumbleProto::UserState &>(msg).session()
+			                             : static_cast<const MumbleProto::UserRemove &>(msg).session();
+			for (int i = 0; i < 2; ++i) {
+				qhSyncUsers[i].remove(session);
+				bSyncUsers[i] = false;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void Server::syncReset() {
+	for (int i = 0; i < 2; ++i) {
+		qhSyncChannels[i].clear();
+		qhSyncUsers[i].clear();
+		qbaSyncChannels[i].clear();
+		qbaSyncUsers[i].clear();
+		bSyncChannels[i] = false;
+		bSyncUsers[i] = false;
+	}
+}
+
+void Server::syncChannelState(Channel *c, SyncVariant variant, MumbleProto::ChannelState &mpcs) {
+	mpcs.Clear();
+
+	mpcs.set_channel_id(c->iId);
+	if (c->cParent)
+		mpcs.set_parent(c->cParent->iId);
+	if (c->iId == 0)
+		mpcs.set_name(u8(qsRegName.isEmpty() ? QLatin1String("Root") : qsRegName));
+	else
+		mpcs.set_name(u8(c->qsName));
+
+	mpcs.set_position(c->iPosition);
+
+	if ((variant == SyncCurrent) && ! c->qbaDescHash.isEmpty())
+		mpcs.set_description_hash(blob(c->qbaDescHash));
+	else if (! c->qsDesc.isEmpty())
+		mpcs.set_description(u8(c->qsDesc));
+
+	mpcs.set_max_users(c->uiMaxUsers);
+}
+
+void Server::syncUserState(ServerUser *u, SyncVariant variant, MumbleProto::UserState &mpus) {
+	mpus.Clear();
+
+	mpus.set_session(u->uiSession);
+	mpus.set_name(u8(u->qsName));
+	if (u->iId >= 0)
+		mpus.set_user_id(u->iId);
+	if (variant == SyncCurrent) {
+		if (! u->qbaTextureHash.isEmpty())
+			mpus.set_texture_hash(blob(u->qbaTextureHash));
+		else if (! u->qbaTexture.isEmpty())
+			mpus.set_texture(blob(u->qbaTexture));
+	} else if (variant == SyncLegacyTextures) {
+		mpus.set_texture(blob(u->qbaTexture));
+	}
+	if (u->cChannel->iId != 0)
+		mpus.set_channel_id(u->cChannel->iId);
+	if (u->bDeaf)
+		mpus.set_deaf(true);
+	else if (u->bMute)
+		mpus.set_mute(true);
+	if (u->bSuppress)
+		mpus.set_suppress(true);
+	if (u->bPrioritySpeaker)
+		mpus.set_priority_speaker(true);
+	if (u->bRecording)
+		mpus.set_recording(true);
+	if (u->bSelfDeaf)
+		mpus.set_self_deaf(true);
+	else if (u->bSelfMute)
+		mpus.set_self_mute(true);
+	if ((variant == SyncCurrent) && ! u->qbaCommentHash.isEmpty())
+		mpus.set_comment_hash(blob(u->qbaCommentHash));
+	else if (! u->qsComment.isEmpty())
+		mpus.set_comment(u8(u->qsComment));
+	if (! u->qsHash.isEmpty())
+		mpus.set_hash(u8(u->qsHash));
+}
+
+QByteArray Server::syncChannels(SyncVariant variant) {
+	if (bSyncChannels[variant])
+		return qbaSyncChannels[variant];
+
+	QByteArray &sync = qbaSyncChannels[variant];
+	QHash<int, QByteArray> &cache = qhSyncChannels[variant];
+	MumbleProto::ChannelState mpcs;
+
+	sync.clear();
+
+	QList<Channel *> chans;
+	QQueue<Channel *> q;
+	q << qhChannels.value(0);
+	while (! q.isEmpty()) {
+		Channel *c = q.dequeue();
+		chans << c;
+
+		QHash<int, QByteArray>::const_iterator i = cache.constFind(c->iId);
+		if (i == cache.constEnd()) {
+			QByteArray msg;
+			syncChannelState(c, variant, mpcs);
+			Connection::messageToNetwork(mpcs, MessageHandler::ChannelState, msg);
+			i = cache.insert(c->iId, msg);
+		}
+		sync.append(i.value());
+
+		foreach(Channel *child, c->qlChannels)
+			q.enqueue(child);
+	}
+
+	// Links change along with either end, so they aren't cached
+	// per channel. Few channels have any.
+	foreach(Channel *c, chans) {
+		if (c->qhLinks.count() > 0) {
+			mpcs.Clear();
+			mpcs.set_channel_id(c->iId);
+
+			foreach(Channel *l, c->qhLinks.keys())
+				mpcs.add_links(l->iId);
+
+			QByteArray msg;
+			Connection::messageToNetwork(mpcs, MessageHandler::ChannelState, msg);
+			sync.append(msg);
+		}
+	}
+
+	bSyncChannels[variant] = true;
+	return sync;
+}
+
+QByteArray Server::syncUsers(SyncVariant variant, ServerUser *except) {
+	if ((variant != SyncLegacyTextures) && bSyncUsers[variant])
+		return qbaSyncUsers[variant];
+
+	QByteArray sync;
+	MumbleProto::UserState mpus;
+
+	foreach(ServerUser *u, qhUsers) {
+		if ((u->sState != ServerUser::Authenticated) || (u == except))
+			continue;
+
+		if (variant == SyncLegacyTextures) {
+			QByteArray msg;
+			syncUserState(u, variant, mpus);
+			Connection::messageToNetwork(mpus, MessageHandler::UserState, msg);
+			sync.append(msg);
+			continue;
+		}
+
+		QHash<unsigned int, QByteArray> &cache = qhSyncUsers[variant];
+		QHash<unsigned int, QByteArray>::const_iterator i = cache.constFind(u->uiSession);
+		if (i == cache.constEnd()) {
+			QByteArray msg;
+			syncUserState(u, variant, mpus);
+			Connection::messageToNetwork(mpus, MessageHandler::UserState, msg);
+			i = cache.insert(u->uiSession, msg);
+		}
+		sync.append(i.value());
+	}
+
+	if (variant != SyncLegacyTextures) {
+		qbaSyncUsers[variant] = sync;
+		bSyncUsers[variant] = true;
+	}
+	return sync;
+}
+
 void Server::removeChannel(int id) {
 	Channel *c = qhChannels.value(id);
 	if (c)
@@ -1592,6 +2713,7 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 		QWriteLocker wl(&qrwlVoiceThread);
 		chan->unlink(NULL);
 	}
+	updateVoiceSnapshot();
 
 	foreach(c, chan->qlChannels) {
 		removeChannel(c, dest);
@@ -1627,6 +2749,11 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 		chan->cParent->removeChannel(chan);
 	}
 
+	{
+		QMutexLocker qml(&qmCache);
+		acCache.removeChannel(chan);
+	}
+
 	delete chan;
 }
 
@@ -1634,6 +2761,9 @@ bool Server::unregisterUser(int id) {
 	if (! unregisterUserDB(id))
 		return false;
 
+	// Channels whose ACLs or groups named the user.
+	QList<Channel *> changed;
+
 	{
 		QMutexLocker lock(&qmCache);
 
@@ -1652,11 +2782,22 @@ bool Server::unregisterUser(int id) {
 				bool remrem = g->qsRemove.remove(id);
 				write = write || addrem || remrem;
 			}
-			if (write)
+			if (write) {
 				updateChannel(c);
+				changed << c;
+			}
 		}
+
+		// The ID is handed out again to the next user registering,
+		// who mustn't inherit what was cached for this one.
+		acCache.removeUserId(id);
 	}
 
+	// The compiled ACLs of these channels and those below still
+	// grant the user's permissions and group memberships.
+	foreach(Channel *c, changed)
+		clearACLCache(c);
+
 	foreach(ServerUser *u, qhUsers) {
 		if (u->iId == id) {
 			clearACLCache(u);
@@ -1692,7 +2833,7 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 		}
 	}
 
-	clearACLCache(p);
+	refreshPermissions(static_cast<ServerUser *>(p));
 	setLastChannel(p);
 
 	if (old && old->bTemporary && old->qlUsers.isEmpty()) {
@@ -1722,8 +2863,7 @@ void Server::sendClientPermission(ServerUser *u, Channel *c, bool forceupdate) {
 
 	{
 		QMutexLocker qml(&qmCache);
-		ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
-		perm = acCache.value(u)->value(c);
+		perm = ChanACL::effectivePermissions(u, c, &acCache);
 	}
 
 	if (forceupdate)
@@ -1756,8 +2896,7 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 		if (! c) {
 			match = false;
 		} else {
-			ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
-			unsigned int perm = acCache.value(u)->value(c);
+			unsigned int perm = ChanACL::effectivePermissions(u, c, &acCache);
 			if (perm != i.value())
 				match = false;
 		}
@@ -1774,8 +2913,7 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 		u->iLastPermissionCheck = c->iId;
 	}
 
-	ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
-	unsigned int perm = acCache.value(u)->value(c);
+	unsigned int perm = ChanACL::effectivePermissions(u, c, &acCache);
 	u->qmPermissionSent.insert(c->iId, perm);
 
 	mppq.Clear();
@@ -1793,13 +2931,9 @@ void Server::clearACLCache(User *p) {
 		QMutexLocker qml(&qmCache);
 
 		if (p) {
-			ChanACL::ChanCache *h = acCache.take(p);
-			delete h;
-
+			acCache.clearUser(static_cast<ServerUser *>(p));
 			flushClientPermissionCache(static_cast<ServerUser *>(p), mppq);
 		} else {
-			foreach(ChanACL::ChanCache *h, acCache)
-				delete h;
 			acCache.clear();
 
 			foreach(ServerUser *u, qhUsers)
@@ -1808,12 +2942,290 @@ void Server::clearACLCache(User *p) {
 		}
 	}
 
+	clearTargetCache();
+}
+
+void Server::clearACLCache(Channel *c) {
+	MumbleProto::PermissionQuery mppq;
+
+	{
+		QMutexLocker qml(&qmCache);
+
+		QSet<Channel *> channels = c->allChildren();
+		channels.insert(c);
+		acCache.clearChannels(channels);
+
+		QSet<int> ids;
+		foreach(Channel *sc, channels)
+			ids.insert(sc->iId);
+
+		// Only clients that were told about a channel in the subtree
+		// can have been sent permissions that are now wrong.
+		foreach(ServerUser *u, qhUsers) {
+			if (u->sState != ServerUser::Authenticated)
+				continue;
+			QMap<int, unsigned int>::const_iterator i;
+			for (i = u->qmPermissionSent.constBegin(); i != u->qmPermissionSent.constEnd(); ++i) {
+				if (ids.contains(i.key())) {
+					flushClientPermissionCache(u, mppq);
+					break;
+				}
+			}
+		}
+	}
+
+	clearTargetCache();
+}
+
+void Server::refreshPermissions(ServerUser *p) {
+	MumbleProto::PermissionQuery mppq;
+
 	{
-		QWriteLocker lock(&qrwlVoiceThread);
+		QMutexLocker qml(&qmCache);
+		acCache.forgetUser(p);
+		flushClientPermissionCache(p, mppq);
+	}
+
+	// Only the channel and links of p changed in the snapshot.
+	clearWhisperTargets();
+	patchVoiceSnapshot(p);
+}
+
+void Server::clearTargetCache() {
+	clearWhisperTargets();
+
+	// Speak permissions into linked channels are part of the snapshot.
+	updateVoiceSnapshot();
+}
+
+void Server::clearWhisperTargets() {
+	QWriteLocker lock(&qrwlVoiceThread);
 
-		foreach(ServerUser *u, qhUsers)
-			u->qmTargetCache.clear();
+	foreach(ServerUser *u, qhUsers)
+		u->qmTargetCache.clear();
+}
+
+void Server::updateVoiceSnapshot() {
+	if (aiVoiceSnapshotPending.testAndSetOrdered(0, 1))
+		QMetaObject::invokeMethod(this, "publishVoiceSnapshot", Qt::QueuedConnection);
+}
+
+void Server::patchVoiceSnapshot(ServerUser *u) {
+	// Only this thread publishes, so the current snapshot stays put.
+	const VoiceSnapshot *cur = vsdVoice.current();
+	const int idx = cur->qhSessions.value(u->uiSession, -1);
+	if ((idx < 0) || (cur->qvMembers.at(idx).su != u)) {
+		// u isn't in a snapshot yet; the queued one adds it.
+		updateVoiceSnapshot();
+		return;
+	}
+
+	VoiceSnapshot *vs = cur->clone();
+	const bool gone = (qhUsers.value(u->uiSession) != u);
+	const int channel = (! gone && u->cChannel) ? patchVoiceChannel(vs, u->cChannel) : -1;
+	const bool listen = ! gone && ! u->bDeaf && ! u->bSelfDeaf;
+	VoiceSnapshot::Member &m = vs->qvMembers[idx];
+
+	if ((m.iChannel >= 0) && m.bListen && (! listen || (channel != m.iChannel))) {
+		QVector<int> &listeners = vs->qvChannels[m.iChannel];
+		listeners.remove(listeners.indexOf(idx));
+	}
+	if ((channel >= 0) && listen && (! m.bListen || (channel != m.iChannel)))
+		vs->qvChannels[channel].append(idx);
+
+	m.iChannel = channel;
+	m.bListen = listen;
+	m.bSpeak = ! gone && (u->sState == ServerUser::Authenticated) && ! u->bMute && ! u->bSuppress && ! u->bSelfMute;
+	m.bPrioritySpeaker = u->bPrioritySpeaker;
+	m.bUdpAggregate = u->bUdpAggregate;
+
+	// Links are only worked out for speakers.
+	QVector<int> links;
+	if (m.bSpeak && u->cChannel && ! u->cChannel->qhLinks.isEmpty()) {
+		QSet<Channel *> chans = u->cChannel->allLinks();
+		chans.remove(u->cChannel);
+
+		foreach(Channel *l, chans)
+			if (hasPermission(u, l, ChanACL::Speak))
+				links.append(patchVoiceChannel(vs, l));
+	}
+	m.qvLinks = links;
+
+	if (gone) {
+		// The entry stays, but nothing leads to it anymore.
+		m.iChannel = -1;
+		vs->qhSessions.remove(u->uiSession);
+		QHash<QPair<HostAddress, quint16>, int>::iterator i = vs->qhPeers.begin();
+		while (i != vs->qhPeers.end()) {
+			if (i.value() == idx)
+				i = vs->qhPeers.erase(i);
+			else
+				++i;
+		}
 	}
+
+	vsdVoice.publish(vs, qlVoiceRetiredUsers);
+	qlVoiceRetiredUsers.clear();
+
+	if (vcCapture->isActive())
+		vcCapture->topology();
+}
+
+int Server::patchVoiceChannel(VoiceSnapshot *vs, Channel *c) {
+	QHash<int, int>::const_iterator i = vs->qhChannelIds.constFind(c->iId);
+	if (i != vs->qhChannelIds.constEnd())
+		return i.value();
+
+	// The same as publishVoiceSnapshot() sets up for each channel.
+	const int idx = vs->qvChannels.count();
+	vs->qvChannels.append(QVector<int>());
+	vs->qvChannelIds.append(c->iId);
+	vs->qhChannelIds.insert(c->iId, idx);
+	vs->qvRelayPeers.append(rRelay ? rRelay->listeningPeers().value(c->iId) : QVector<int>());
+
+	SpeakerSelection *ss = NULL;
+	const int n = qhMaxSpeakers.value(c->iId);
+	if (n > 0) {
+		SpeakerSelection *&sel = qhSpeakerSelections[c->iId];
+		if (! sel)
+			sel = new SpeakerSelection();
+		sel->setMaxSpeakers(n);
+		ss = sel;
+	}
+	vs->qvSelections.append(ss);
+	return idx;
+}
+
+/// Return the index of channel c in the snapshot being built, adding it if needed.
+static int voiceChannelIndex(VoiceSnapshot *vs, QHash<Channel *, int> &channels, Channel *c) {
+	QHash<Channel *, int>::const_iterator i = channels.constFind(c);
+	if (i != channels.constEnd())
+		return i.value();
+
+	int idx = vs->qvChannels.count();
+	vs->qvChannels.append(QVector<int>());
+	channels.insert(c, idx);
+	return idx;
+}
+
+void Server::publishVoiceSnapshot() {
+	// Changes made from here on need another snapshot.
+	aiVoiceSnapshotPending.fetchAndStoreOrdered(0);
+
+	VoiceSnapshot *vs = new VoiceSnapshot();
+	vs->fAudibleRadius = fAudibleRadius;
+	QHash<Channel *, int> channels;
+	QHash<ServerUser *, int> members;
+	QHash<QByteArray, int> contexts;
+
+	vs->qvMembers.reserve(qhUsers.count());
+	foreach(ServerUser *u, qhUsers) {
+		VoiceSnapshot::Member m;
+		m.su = u;
+		m.uiSession = u->uiSession;
+		m.iChannel = u->cChannel ? voiceChannelIndex(vs, channels, u->cChannel) : -1;
+		m.bSpeak = (u->sState == ServerUser::Authenticated) && ! u->bMute && ! u->bSuppress && ! u->bSelfMute;
+		m.bListen = ! u->bDeaf && ! u->bSelfDeaf;
+		m.bPrioritySpeaker = u->bPrioritySpeaker;
+		m.bUdpAggregate = u->bUdpAggregate;
+		m.bRelayed = false;
+
+		const QByteArray context(u->ssContext.data(), static_cast<int>(u->ssContext.size()));
+		m.iContext = contexts.value(context, contexts.count());
+		contexts.insert(context, m.iContext);
+
+		if (m.bSpeak && u->cChannel && ! u->cChannel->qhLinks.isEmpty()) {
+			QSet<Channel *> chans = u->cChannel->allLinks();
+			chans.remove(u->cChannel);
+
+			foreach(Channel *l, chans)
+				if (hasPermission(u, l, ChanACL::Speak))
+					m.qvLinks.append(voiceChannelIndex(vs, channels, l));
+		}
+
+		int idx = vs->qvMembers.count();
+		if ((m.iChannel >= 0) && m.bListen)
+			vs->qvChannels[m.iChannel].append(idx);
+		vs->qvMembers.append(m);
+		vs->qhSessions.insert(u->uiSession, idx);
+		members.insert(u, idx);
+	}
+
+	// Remote users may speak into their channel and its links here,
+	// and listen on their own node.
+	if (rRelay) {
+		const QHash<Relay::RemoteKey, Relay::RemoteUser> &remote = rRelay->remoteUsers();
+		QHash<Relay::RemoteKey, Relay::RemoteUser>::const_iterator ri;
+		for (ri = remote.constBegin(); ri != remote.constEnd(); ++ri) {
+			ServerUser *u = ri.value().su;
+			u->cChannel = qhChannels.value(ri.value().iChannel);
+			if (! u->cChannel)
+				continue;
+
+			VoiceSnapshot::Member m;
+			m.su = u;
+			m.uiSession = u->uiSession;
+			m.iChannel = voiceChannelIndex(vs, channels, u->cChannel);
+			m.bSpeak = true;
+			m.bListen = false;
+			m.bPrioritySpeaker = false;
+			m.bUdpAggregate = false;
+			m.bRelayed = true;
+			// Positional audio is not relayed.
+			m.iContext = -1;
+
+			if (! u->cChannel->qhLinks.isEmpty()) {
+				QSet<Channel *> chans = u->cChannel->allLinks();
+				chans.remove(u->cChannel);
+
+				foreach(Channel *l, chans)
+					if (hasPermission(u, l, ChanACL::Speak))
+						m.qvLinks.append(voiceChannelIndex(vs, channels, l));
+			}
+
+			int idx = vs->qvMembers.count();
+			vs->qvMembers.append(m);
+			vs->qhSessions.insert(u->uiSession, idx);
+			vs->qhRelayUsers.insert(ri.key(), idx);
+		}
+	}
+
+	vs->qvSelections.fill(NULL, vs->qvChannels.count());
+	vs->qvChannelIds.resize(vs->qvChannels.count());
+	vs->qvRelayPeers.resize(vs->qvChannels.count());
+	const QHash<int, QVector<int> > relayPeers = rRelay ? rRelay->listeningPeers() : QHash<int, QVector<int> >();
+	QHash<Channel *, int>::const_iterator ci;
+	for (ci = channels.constBegin(); ci != channels.constEnd(); ++ci) {
+		vs->qvChannelIds[ci.value()] = ci.key()->iId;
+		vs->qhChannelIds.insert(ci.key()->iId, ci.value());
+		vs->qvRelayPeers[ci.value()] = relayPeers.value(ci.key()->iId);
+
+		const int n = qhMaxSpeakers.value(ci.key()->iId);
+		if (n > 0) {
+			SpeakerSelection *&ss = qhSpeakerSelections[ci.key()->iId];
+			if (! ss)
+				ss = new SpeakerSelection();
+			ss->setMaxSpeakers(n);
+			vs->qvSelections[ci.value()] = ss;
+		}
+	}
+
+	// The voice threads write qhPeerUsers, everything else copied
+	// here is owned by this thread and needs no lock.
+	QReadLocker rl(&qrwlVoiceThread);
+	QHash<QPair<HostAddress, quint16>, ServerUser *>::const_iterator i;
+	for (i = qhPeerUsers.constBegin(); i != qhPeerUsers.constEnd(); ++i) {
+		QHash<ServerUser *, int>::const_iterator mi = members.constFind(i.value());
+		if (mi != members.constEnd())
+			vs->qhPeers.insert(i.key(), mi.value());
+	}
+	rl.unlock();
+
+	vsdVoice.publish(vs, qlVoiceRetiredUsers);
+	qlVoiceRetiredUsers.clear();
+
+	if (vcCapture->isActive())
+		vcCapture->topology();
 }
 
 QString Server::addressToString(const QHostAddress &adr, unsigned short port) {
@@ -31,19 +31,28 @@
 #endif
 
 #include "ACL.h"
+#include "ACLCache.h"
 #include "Message.h"
 #include "Mumble.pb.h"
 #include "User.h"
 #include "Timer.h"
 #include "HostAddress.h"
 #include "Ban.h"
+#include "BanIndex.h"
+#include "VoiceSnapshot.h"
+#include "SpeakerSelection.h"
 
 class BonjourServer;
 class Channel;
 class PacketDataStream;
+class Relay;
+class VoiceCapture;
 class ServerUser;
 class User;
 class QNetworkAccessManager;
+class Server;
+struct sockaddr_storage;
+struct UDPBatch;
 
 struct TextMessage {
 	QList<unsigned int> qlSessions;
@@ -52,6 +61,32 @@ struct TextMessage {
 	QString qsText;
 };
 
+/// Seconds between the authentication statistics logged by a Server.
+#define AUTH_REPORT_INTERVAL 60
+
+/// An Authenticate message waiting for the asynchronous authenticators,
+/// or for the PasswordHasher.
+struct PendingAuth {
+	unsigned int uiSession;
+	MumbleProto::Authenticate msg;
+	/// Asynchronous authenticators that haven't answered yet.
+	int iWaiting;
+	/// Result if none of them decides: the default, or -2 once one
+	/// of them has fallen through to the local database.
+	int iResult;
+	Timer tStarted;
+	/// Whether the synchronous authenticators have been asked, and the
+	/// result they left.
+	bool bAsked;
+	int iExternal;
+	/// Salt and iteration count of the stored password hash, and the
+	/// hash of the given password once the PasswordHasher is done.
+	QString qsSalt;
+	int iIterations;
+	QString qsHash;
+	bool bHashed;
+};
+
 class SslServer : public QTcpServer {
 	private:
 		Q_OBJECT;
@@ -82,6 +117,36 @@ class ExecEvent : public QEvent {
 		void execute();
 };
 
+/// Additional voice thread of a Server. When voicethreads is
+/// larger than 1, each worker owns one UDP socket per bound
+/// address, sharing the port with the Server's own sockets
+/// through SO_REUSEPORT, and runs Server::voiceLoop() on them.
+class VoiceWorker : public QThread {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(VoiceWorker);
+	protected:
+		Server *s;
+	public:
+		int iWorker;
+		bool bValid;
+#ifdef Q_OS_UNIX
+		int aiNotify[2];
+		QList<int> qlUdpSocket;
+#else
+		HANDLE hNotify;
+		QList<SOCKET> qlUdpSocket;
+#endif
+		/// Buffers for batched UDP I/O, see Server::ubBatch.
+		UDPBatch *ubBatch;
+
+		VoiceWorker(Server *srv, int worker);
+		~VoiceWorker();
+		void run() Q_DECL_OVERRIDE;
+		/// Wake the worker up, so it notices that the server is stopping.
+		void notify();
+};
+
 class Server : public QThread {
 	private:
 		Q_OBJECT;
@@ -111,6 +176,26 @@ class Server : public QThread {
 		int iMaxTextMessageLength;
 		int iMaxImageMessageLength;
 		int iOpusThreshold;
+		/// Maximum number of datagrams the voice thread
+		/// receives per recvmmsg() call. If 1, batched
+		/// UDP I/O is disabled. (Linux only)
+		int iUdpBatchSize;
+		/// Number of voice threads, including the Server's own.
+		/// Always 1 on platforms other than Linux.
+		int iVoiceThreads;
+		/// Radius for positional culling, or 0 if disabled. The voice
+		/// threads use the copy in the VoiceSnapshot.
+		float fAudibleRadius;
+		/// Number of speakers forwarded at a time, by channel ID.
+		QHash<int, int> qhMaxSpeakers;
+		/// UDP port of the relay link to other nodes, or 0 if disabled.
+		unsigned short usRelayPort;
+		QString qsRelayPeers;
+		/// IDs of the channels shared with other nodes.
+		QSet<int> qsRelayChannels;
+		QByteArray qbaRelaySecret;
+		/// File voice traffic is captured to, or empty.
+		QString qsVoiceCapture;
 		bool bAllowHTML;
 		QString qsPassword;
 		QString qsWelcomeText;
@@ -188,19 +273,73 @@ class Server : public QThread {
 		void initializeCert();
 		const QString getDigest() const;
 
+		/// Sort the errors of a client's handshake into those that only
+		/// mean the client is unverified, which clear verified, and those
+		/// that end the connection, which are added to fatal. Returns
+		/// false if any error is fatal.
+		static bool acceptSslErrors(const QList<QSslError> &errors, bool &verified, QStringList &fatal);
+		/// Take over a connection whose handshake was done by an SslWorker.
+		void adoptConnection(QSslSocket *sock, bool verified);
+	protected:
+		/// Create the user for a newly accepted connection, or return
+		/// NULL if the session ID pool is empty.
+		ServerUser *addConnection(QSslSocket *sock);
+		/// Greet a client once its handshake is complete.
+		void startSession(ServerUser *u);
+		/// Start qtBanExpiry for the next ban to expire.
+		void scheduleBanPurge();
+
+		/// Authentications waiting for the asynchronous authenticators,
+		/// by request number, and the last request number handed out.
+		QHash<unsigned int, PendingAuth *> qhPendingAuth;
+		unsigned int uiAuthRequest;
+		/// Runs while authentications are pending, to enforce authtimeout.
+		QTimer *qtAuthDeadline;
+		/// Fires when the next ban expires.
+		QTimer *qtBanExpiry;
+		/// Statistics since the last report, latencies in microseconds.
+		quint64 uiAuthRequests, uiAuthTimeouts;
+		quint64 uiAuthLatencyTotal, uiAuthLatencyMax;
+		int iAuthPendingMax;
+		Timer tAuthReport;
+
+		/// Whether an authenticator answers authenticateAsyncSig.
+		bool hasAsyncAuthenticator();
+		/// Park u until the asynchronous authenticators have answered msg.
+		void beginAuthenticate(ServerUser *u, const MumbleProto::Authenticate &msg);
+		/// Check request against the synchronous authenticators and the
+		/// local database, once the asynchronous authenticators have
+		/// answered with external, or without any. Parks the user again
+		/// while the PasswordHasher hashes the password.
+		void continueAuthenticate(unsigned int request, int external);
+		/// The rest of msgAuthenticate(), with the user ID or error
+		/// code authenticate() returned, or -5 if the PasswordHasher
+		/// was too busy to take the password.
+		void finishAuthenticate(ServerUser *u, const MumbleProto::Authenticate &msg, int id);
+		void reportAuthenticate();
+	public:
+		/// Answer of an asynchronous authenticator to the request
+		/// number it got with authenticateAsyncSig. Main thread only.
+		void authenticateDone(unsigned int request, int res, const QString &name, const QStringList &groups);
+		/// The hash of the password of request, from the PasswordHasher.
+		void passwordHashed(unsigned int request, const QString &hash);
+
 	public slots:
 		void newClient();
 		void connectionClosed(QAbstractSocket::SocketError, const QString &);
 		void sslError(const QList<QSslError> &);
 		void message(unsigned int, const QByteArray &, ServerUser *cCon = NULL);
 		void checkTimeout();
-		void tcpTransmitData(QByteArray, unsigned int);
+		void checkAuthDeadlines();
+		void purgeBans();
+		void tcpTransmitData(unsigned int);
 		void doSync(unsigned int);
 		void encrypted();
 		void udpActivated(int);
+		void publishVoiceSnapshot();
 	signals:
 		void reqSync(unsigned int);
-		void tcpTransmit(QByteArray, unsigned int id);
+		void tcpTransmit(unsigned int id);
 	public:
 		int iServerNum;
 		QQueue<int> qqIds;
@@ -216,13 +355,17 @@ class Server : public QThread {
 #endif
 		quint32 uiVersionBlob;
 		QList<QSocketNotifier *> qlUdpNotifier;
+		QList<VoiceWorker *> qlVoiceWorkers;
 
 		/// This lock provides synchronization between the
 		/// main thread (where control channel messages and
 		/// RPC happens), and the Server's voice thread.
 		///
-		/// These are the only two threads in Murmur that
-		/// access a Server's data.
+		/// These are the only threads in Murmur that access a
+		/// Server's data. If voicethreads is larger than 1, the
+		/// Server has several voice threads (see VoiceWorker);
+		/// everything said about "the voice thread" below
+		/// applies to each of them.
 		///
 		/// The easiest way to understand the locking strategy
 		/// and synchronization between the main thread and the
@@ -262,24 +405,147 @@ class Server : public QThread {
 		///    by itself, it DOES NOT hold a lock on qrwlVoiceThread.
 		///    That is because ownership of data guarantees that no
 		///    other thread can write to that data.
+		///
+		///  - A voice thread associating a UDP address with a user
+		///    (qhPeerUsers) holds a write lock, which also excludes
+		///    the other voice threads.
+		///
+		/// Per-user voice state that is written by the voice thread
+		/// (bandwidth record, whisper target cache) belongs to the
+		/// voice thread the user's UDP address is steered to. The
+		/// crypt state and UDP address are shared and always guarded
+		/// by qmCrypt.
+		///
+		/// Forwarding normal speech does not use qrwlVoiceThread at
+		/// all: the voice threads route it using a VoiceSnapshot
+		/// (see vsdVoice), and only fall back to the lock for new
+		/// UDP peers and whispers.
 		QReadWriteLock qrwlVoiceThread;
+
+		/// Snapshots of the routing state, read by the voice threads
+		/// without locking. Reader 0 is the Server's own voice thread,
+		/// reader n is VoiceWorker n.
+		VoiceSnapshotDomain vsdVoice;
+		/// Set while a call to publishVoiceSnapshot() is queued.
+		QAtomicInt aiVoiceSnapshotPending;
+		/// Users removed since the last snapshot was published. They are
+		/// deleted once no voice thread can see them anymore.
+		QList<ServerUser *> qlVoiceRetiredUsers;
+		/// Speaker selections of the channels in qhMaxSpeakers, by
+		/// channel ID. Kept for the lifetime of the Server, since the
+		/// voice threads may use them at any time.
+		QHash<int, SpeakerSelection *> qhSpeakerSelections;
+		/// Link to the other nodes sharing qsRelayChannels, or NULL.
+		/// Created before the voice threads start and deleted after
+		/// they stop.
+		Relay *rRelay;
+		/// Records the voice traffic while qsVoiceCapture is set.
+		VoiceCapture *vcCapture;
+		/// Queue a publishVoiceSnapshot(). Must be called after changing
+		/// any state copied into a VoiceSnapshot. Thread-safe.
+		void updateVoiceSnapshot();
+		/// Publish a copy of the current snapshot with the mute, deaf
+		/// and priority speaker state, channel and links of u updated,
+		/// or without u if it was removed, so the change applies to the
+		/// very next packet. Cheaper than a full publishVoiceSnapshot(),
+		/// which it queues only when it can't patch. Main thread only.
+		void patchVoiceSnapshot(ServerUser *u);
+		/// Index of c in vs, which is being patched, adding it if needed.
+		int patchVoiceChannel(VoiceSnapshot *vs, Channel *c);
 		QHash<unsigned int, ServerUser *> qhUsers;
 		QHash<QPair<HostAddress, quint16>, ServerUser *> qhPeerUsers;
+		/// Users without a UDP address yet, by host. Unless their client
+		/// uses a UDP token, the only way to find which of them sent a
+		/// datagram is to try their keys.
 		QHash<HostAddress, QSet<ServerUser *> > qhHostUsers;
+		/// Users by UDP association token.
+		QHash<quint64, ServerUser *> qhTokenUsers;
+		/// Addresses announced by UDP association datagrams, and the
+		/// user whose key the next datagram from there is tried with.
+		QHash<QPair<HostAddress, quint16>, ServerUser *> qhPendingPeerUsers;
 		QHash<unsigned int, Channel *> qhChannels;
 
 		QMutex qmCache;
-		ChanACL::ACLCache acCache;
+		ACLCache acCache;
 
 		QHash<int, QString> qhUserNameCache;
 		QHash<QString, int> qhUserIDCache;
 
 		QList<Ban> qlBans;
-
-		void processMsg(ServerUser *u, const char *data, int len);
-		void sendMessage(ServerUser *u, const char *data, int len, QByteArray &cache, bool force = false);
+		BanIndex biBans;
+		/// Replace the ban list, writing only what changed to the database.
+		void setBans(const QList<Ban> &bans);
+		void addBan(const Ban &b);
+
+		void processMsg(ServerUser *u, const char *data, int len, UDPBatch *batch = NULL);
+		/// Send data to u over UDP, or TCP if u has no working UDP. In a
+		/// voice thread's batch, data is merged into a UDPVoiceAggregate
+		/// if aggregate is set, which the voice path takes from the
+		/// VoiceSnapshot.
+		void sendMessage(ServerUser *u, const char *data, int len, bool force = false, UDPBatch *batch = NULL, bool aggregate = false);
+		/// Send data to each of the count users, like sendMessage(), with
+		/// aggregate giving the flag for each. In a voice thread's batch,
+		/// the other UDP recipients are encrypted CRYPT_MULTI_BUFFERS at
+		/// a time with the multi-buffer CryptState::encrypt().
+		void sendMessages(ServerUser * const *users, const bool *aggregate, int count, const char *data, int len, UDPBatch *batch);
+		/// Store in audible those of the first fo->iSameContext targets
+		/// of fo within radius of pos, with their qvAggregate flags in
+		/// aggregate, and return how many there are. Listeners are
+		/// placed at the last position they sent; those who never sent
+		/// one are kept.
+		static int cullInaudible(const VoiceSnapshot::FanOut *fo, float radius, const float *pos, ServerUser **audible, bool *aggregate);
 		void run();
 
+		/// Main loop of a voice thread: wait for datagrams on sockets
+		/// until notify becomes readable and bRunning is false.
+		/// batch is the thread's UDPBatch, or NULL if batching is disabled.
+		/// reader is the thread's reader number in vsdVoice.
+#ifdef Q_OS_UNIX
+		void voiceLoop(const QList<int> &sockets, int notify, UDPBatch *batch, int reader);
+#else
+		void voiceLoop(const QList<SOCKET> &sockets, HANDLE notify, UDPBatch *batch, int reader);
+#endif
+
+		/// Fill in the reply to a 12 byte UDP ping (version, user count and limits).
+		void fillPingReply(quint32 *ping);
+
+		/// Decrypt and dispatch a single datagram received by the voice thread.
+		/// buffer is scratch space of at least UDP_PACKET_SIZE bytes.
+#ifdef Q_OS_UNIX
+		void handleUdpPacket(int sock, const char *encrypt, char *buffer, int len, const sockaddr_storage &from, UDPBatch *batch);
+#else
+		void handleUdpPacket(SOCKET sock, const char *encrypt, char *buffer, int len, const sockaddr_storage &from, UDPBatch *batch);
+#endif
+
+		/// Handle a UDP association datagram from key.
+		void handleUdpAssociation(const QPair<HostAddress, quint16> &key, const char *data);
+
+		/// Buffers for batched UDP I/O of the Server's own voice thread.
+		/// Allocated by startThread() and freed by stopThread(); only
+		/// accessed by the voice thread while it is running.
+		UDPBatch *ubBatch;
+
+#ifdef Q_OS_LINUX
+		/// Receive up to iUdpBatchSize datagrams from sock with a single
+		/// recvmmsg(), process them, and send the resulting datagrams with
+		/// sendmmsg().
+		void receiveBatch(int sock, char *buffer, UDPBatch *batch);
+		/// Encrypt data for each of the count (at most CRYPT_MULTI_BUFFERS)
+		/// users and queue it for the next flushBatch().
+		void queueBatch(UDPBatch *batch, ServerUser * const *users, int count, const char *data, int len);
+		/// Add data to the UDPVoiceAggregate for u, which is encrypted
+		/// and queued by the next flushBatch(). This merges all voice for
+		/// a user produced while processing one batch into as few
+		/// datagrams as possible.
+		void aggregateBatch(UDPBatch *batch, ServerUser *u, const char *data, int len);
+		/// Encrypt and queue all aggregates of the batch.
+		void flushAggregates(UDPBatch *batch);
+		/// Send all datagrams queued in the batch.
+		void sendBatch(UDPBatch *batch);
+		/// Flush the aggregates, and send everything queued.
+		void flushBatch(UDPBatch *batch);
+#endif
+
 		bool validateChannelName(const QString &name);
 		bool validateUserName(const QString &name);
 
@@ -289,7 +555,58 @@ class Server : public QThread {
 		QFlags<ChanACL::Perm> effectivePermissions(ServerUser *p, Channel *c);
 		void sendClientPermission(ServerUser *u, Channel *c, bool updatelast = false);
 		void flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQuery &mpqq);
+		/// Forget cached permissions, of everyone or of p after its
+		/// temporary groups changed, and send clients what changed.
 		void clearACLCache(User *p = NULL);
+		/// Forget the cached permissions in c and its subchannels,
+		/// after the ACLs or groups of c changed.
+		void clearACLCache(Channel *c);
+		/// Work out the permissions of p again after its channel,
+		/// user id or access tokens changed.
+		void refreshPermissions(ServerUser *p);
+		void clearTargetCache();
+		/// Clear the whisper target caches only, for changes that
+		/// don't need a new VoiceSnapshot.
+		void clearWhisperTargets();
+
+		/// Versions of the channel and user state sent to joining clients.
+		enum SyncVariant {
+			/// Clients since 1.2.2, which get hashes of descriptions,
+			/// comments and textures.
+			SyncCurrent,
+			/// Older clients, which get descriptions and comments.
+			SyncLegacy,
+			/// Older clients that also get all textures. Not cached.
+			SyncLegacyTextures
+		};
+
+		/// Serialized ChannelState and UserState messages of the join
+		/// sync, per channel ID and session, for SyncCurrent and SyncLegacy.
+		/// Stale entries are removed by syncChanged().
+		QHash<int, QByteArray> qhSyncChannels[2];
+		QHash<unsigned int, QByteArray> qhSyncUsers[2];
+		/// The assembled sync of the channel tree and links, and of the
+		/// authenticated users, and whether they are up to date.
+		QByteArray qbaSyncChannels[2];
+		QByteArray qbaSyncUsers[2];
+		bool bSyncChannels[2];
+		bool bSyncUsers[2];
+
+		/// Drop the cached sync messages of the channel or user a
+		/// broadcast ChannelState, ChannelRemove, UserState or UserRemove
+		/// is about. Called by sendProtoExcept() for every broadcast.
+		void syncChanged(const ::google::protobuf::Message &msg, unsigned int msgType);
+		/// Drop all cached sync messages.
+		void syncReset();
+		/// The ChannelState messages of the whole channel tree, followed
+		/// by those of the links, for a client of variant.
+		QByteArray syncChannels(SyncVariant variant);
+		/// The UserState messages of all authenticated users but except.
+		/// Only SyncLegacyTextures is built anew for each call; the cached
+		/// variants are taken before the joining user is authenticated.
+		QByteArray syncUsers(SyncVariant variant, ServerUser *except = NULL);
+		void syncChannelState(Channel *c, SyncVariant variant, MumbleProto::ChannelState &mpcs);
+		void syncUserState(ServerUser *u, SyncVariant variant, MumbleProto::UserState &mpus);
 
 		void sendProtoAll(const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int minversion);
 		void sendProtoExcept(ServerUser *, const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int minversion);
@@ -339,6 +656,9 @@ class Server : public QThread {
 		void getRegisteredUsersSig(const QString &, QMap<int, QString > &);
 		void getRegistrationSig(int &, int, QMap<int, QString> &);
 		void authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &);
+		/// Like authenticateSig, for authenticators that answer later
+		/// through authenticateDone().
+		void authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &);
 		void setInfoSig(int &, int, const QMap<int, QString> &);
 		void setTextureSig(int &, int, const QByteArray &);
 		void idToNameSig(QString &, int);
@@ -391,6 +711,12 @@ class Server : public QThread {
 		// Database / DBus functions. Implementation in ServerDB.cpp
 		void initialize();
 		int authenticate(QString &name, const QString &pw, int sessionId = 0, const QStringList &emails = QStringList(), const QString &certhash = QString(), bool bStrongCert = false, const QList<QSslCertificate> & = QList<QSslCertificate>());
+		/// authenticate(), with res as the result of the asynchronous
+		/// authenticators instead of the default. If pa is given and
+		/// the PasswordHasher is enabled, returns -4 instead of hashing
+		/// the password on this thread, with the salt and iteration
+		/// count stored in pa. Call again with the hash in pa.
+		int authenticateWith(int res, QString &name, const QString &pw, int sessionId, const QStringList &emails, const QString &certhash, bool bStrongCert, const QList<QSslCertificate> &certs, PendingAuth *pa = NULL);
 		Channel *addChannel(Channel *c, const QString &name, bool temporary = false, int position = 0, unsigned int maxUsers = 0);
 		void removeChannelDB(const Channel *c);
 		void readChannels(Channel *p = NULL);
@@ -414,7 +740,11 @@ class Server : public QThread {
 		void addLink(Channel *c, Channel *l);
 		void removeLink(Channel *c, Channel *l);
 		void getBans();
-		void saveBans();
+		void saveBans(const QList<Ban> &previous);
+		/// Write the removal of bans, which are no longer in qlBans
+		/// and biBans, to the database.
+		void removeBans(const QList<Ban> &removed);
+		void writeBans(const QList<QPair<QByteArray, int> > &networks, const QList<Ban> &bans);
 		QVariant getConf(const QString &key, QVariant def);
 		void setConf(const QString &key, const QVariant &value);
 		void dblog(const QString &str) const;
@@ -9,10 +9,12 @@
 
 #include "ACL.h"
 #include "Channel.h"
+#include "ChannelIndex.h"
 #include "Connection.h"
 #include "DBus.h"
 #include "Group.h"
 #include "Meta.h"
+#include "PasswordHasher.h"
 #include "Server.h"
 #include "ServerUser.h"
 #include "User.h"
@@ -1042,11 +1044,20 @@ QMap<int, QString> Server::getRegistration(int id) {
 }
 
 /// @return UserID of authenticated user, -1 for authentication failures, -2 for unknown user (fallthrough),
-///         -3 for authentication failures where the data could (temporarily) not be verified.
+///         -3 for authentication failures where the data could (temporarily) not be verified,
+///         -4 if authenticateWith() left the password to the PasswordHasher.
 int Server::authenticate(QString &name, const QString &password, int sessionId, const QStringList &emails, const QString &certhash, bool bStrongCert, const QList<QSslCertificate> &certs) {
-	int res = bForceExternalAuth ? -3 : -2;
+	return authenticateWith(bForceExternalAuth ? -3 : -2, name, password, sessionId, emails, certhash, bStrongCert, certs);
+}
 
-	emit authenticateSig(res, name, sessionId, certs, certhash, bStrongCert, password);
+int Server::authenticateWith(int res, QString &name, const QString &password, int sessionId, const QStringList &emails, const QString &certhash, bool bStrongCert, const QList<QSslCertificate> &certs, PendingAuth *pa) {
+	if (! pa || ! pa->bAsked) {
+		emit authenticateSig(res, name, sessionId, certs, certhash, bStrongCert, password);
+		if (pa) {
+			pa->bAsked = true;
+			pa->iExternal = res;
+		}
+	}
 
 	if (res != -2) {
 		// External authentication handled it. Ignore certificate completely.
@@ -1122,7 +1133,21 @@ int Server::authenticate(QString &name, const QString &password, int sessionId,
 					}
 				}
 			} else {
-				if (PBKDF2::getHash(storedSalt, password, storedKdfIterations) == storedPasswordHash) {
+				QString passwordHash;
+				if (pa && pa->bHashed && pa->qsSalt == storedSalt && pa->iIterations == storedKdfIterations) {
+					passwordHash = pa->qsHash;
+				} else if (pa && meta->phHasher->isEnabled()) {
+					// Leave the hashing to the PasswordHasher, and check
+					// again once it is done.
+					pa->qsSalt = storedSalt;
+					pa->iIterations = storedKdfIterations;
+					pa->bHashed = false;
+					return -4;
+				} else {
+					passwordHash = PBKDF2::getHash(storedSalt, password, storedKdfIterations);
+				}
+
+				if (passwordHash == storedPasswordHash) {
 					name = query.value(1).toString();
 					res = query.value(0).toInt();
 					
@@ -1503,6 +1528,7 @@ void Server::addLink(Channel *c, Channel *l) {
 		QWriteLocker wl(&qrwlVoiceThread);
 		c->link(l);
 	}
+	updateVoiceSnapshot();
 
 	if (c->bTemporary || l->bTemporary)
 		return;
@@ -1526,6 +1552,7 @@ void Server::removeLink(Channel *c, Channel *l) {
 		QWriteLocker wl(&qrwlVoiceThread);
 		c->unlink(l);
 	}
+	updateVoiceSnapshot();
 
 	if (c->bTemporary || l->bTemporary)
 		return;
@@ -1591,7 +1618,11 @@ Channel *Server::addChannel(Channel *p, const QString &name, bool temporary, int
 		SQLEXEC();
 	}
 
-	Channel *c = new Channel(id, name, p);
+	Channel *c;
+	{
+		QWriteLocker wl(&qrwlVoiceThread);
+		c = new Channel(id, name, p);
+	}
 	c->bTemporary = temporary;
 	c->iPosition = position;
 	c->uiMaxUsers = maxUsers;
@@ -1851,8 +1882,10 @@ void Server::readChannels(Channel *p) {
 
 		while (query.next()) {
 			c = new Channel(query.value(0).toInt(), query.value(1).toString(), p);
-			if (! p)
+			if (! p) {
 				c->setParent(this);
+				c->ciIndex = new ChannelIndex(c);
+			}
 			qhChannels.insert(c->iId, c);
 			c->bInheritACL = query.value(2).toBool();
 			kids << c;
@@ -1884,6 +1917,7 @@ void Server::readLinks() {
 			c->link(l);
 		}
 	}
+	updateVoiceSnapshot();
 }
 
 void Server::setLastChannel(const User *p) {
@@ -1984,25 +2018,114 @@ void Server::getBans() {
 	}
 }
 
-void Server::saveBans() {
-	TransactionHolder th;
+static QPair<QByteArray, int> banNetwork(const Ban &ban) {
+	return QPair<QByteArray, int>(ban.haAddress.toByteArray(), ban.iMask);
+}
+
+static bool sameBans(const QList<Ban> &a, const QList<Ban> &b) {
+	if (a.count() != b.count())
+		return false;
+	foreach(const Ban &ban, a)
+		if (a.count(ban) != b.count(ban))
+			return false;
+	return true;
+}
 
+// Ban rows have no key of their own, and the start time may not
+// come back from the database exactly as it was stored. Rows are
+// therefore matched on network only, and when any ban on a network
+// changed, all of that network's rows are written again.
+void Server::saveBans(const QList<Ban> &previous) {
+	typedef QPair<QByteArray, int> Network;
+	QHash<Network, QList<Ban> > before, after;
+
+	foreach(const Ban &ban, previous)
+		before[banNetwork(ban)] << ban;
+	foreach(const Ban &ban, qlBans)
+		after[banNetwork(ban)] << ban;
+
+	QList<Network> changed;
+	QList<Ban> added;
+
+	QHash<Network, QList<Ban> >::const_iterator i;
+	for (i = before.constBegin(); i != before.constEnd(); ++i) {
+		const QList<Ban> now = after.value(i.key());
+		if (! sameBans(i.value(), now)) {
+			changed << i.key();
+			added << now;
+		}
+	}
+	for (i = after.constBegin(); i != after.constEnd(); ++i) {
+		if (! before.contains(i.key()))
+			added << i.value();
+	}
+
+	writeBans(changed, added);
+}
+
+void Server::removeBans(const QList<Ban> &removed) {
+	typedef QPair<QByteArray, int> Network;
+	QSet<Network> changed;
+	QList<Ban> kept;
+
+	foreach(const Ban &ban, removed) {
+		const Network n = banNetwork(ban);
+		if (changed.contains(n))
+			continue;
+		changed.insert(n);
+		foreach(int pos, biBans.findNetwork(qlBans, ban))
+			kept << qlBans.at(pos);
+	}
+
+	writeBans(changed.toList(), kept);
+}
+
+void Server::writeBans(const QList<QPair<QByteArray, int> > &networks, const QList<Ban> &bans) {
+	if (networks.isEmpty() && bans.isEmpty())
+		return;
+
+	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
-	SQLPREP("DELETE FROM `%1bans` WHERE `server_id` = ? ");
-	query.addBindValue(iServerNum);
-	SQLEXEC();
 
-	SQLPREP("INSERT INTO `%1bans` (`server_id`, `base`,`mask`,`name`,`hash`,`reason`,`start`,`duration`) VALUES (?,?,?,?,?,?,?,?)");
-	foreach(const Ban &ban, qlBans) {
-		query.addBindValue(iServerNum);
-		query.addBindValue(ban.haAddress.toByteArray());
-		query.addBindValue(ban.iMask);
-		query.addBindValue(ban.qsUsername);
-		query.addBindValue(ban.qsHash);
-		query.addBindValue(ban.qsReason);
-		query.addBindValue(ban.qdtStart);
-		query.addBindValue(ban.iDuration);
-		SQLEXEC();
+	if (! networks.isEmpty()) {
+		QVariantList serverids, bases, masks;
+		typedef QPair<QByteArray, int> Network;
+		foreach(const Network &n, networks) {
+			serverids << iServerNum;
+			bases << n.first;
+			masks << n.second;
+		}
+
+		SQLPREP("DELETE FROM `%1bans` WHERE `server_id` = ? AND `base` = ? AND `mask` = ?");
+		query.addBindValue(serverids);
+		query.addBindValue(bases);
+		query.addBindValue(masks);
+		SQLEXECBATCH();
+	}
+
+	if (! bans.isEmpty()) {
+		QVariantList serverids, bases, masks, names, hashes, reasons, starts, durations;
+		foreach(const Ban &ban, bans) {
+			serverids << iServerNum;
+			bases << ban.haAddress.toByteArray();
+			masks << ban.iMask;
+			names << ban.qsUsername;
+			hashes << ban.qsHash;
+			reasons << ban.qsReason;
+			starts << ban.qdtStart;
+			durations << ban.iDuration;
+		}
+
+		SQLPREP("INSERT INTO `%1bans` (`server_id`, `base`,`mask`,`name`,`hash`,`reason`,`start`,`duration`) VALUES (?,?,?,?,?,?,?,?)");
+		query.addBindValue(serverids);
+		query.addBindValue(bases);
+		query.addBindValue(masks);
+		query.addBindValue(names);
+		query.addBindValue(hashes);
+		query.addBindValue(reasons);
+		query.addBindValue(starts);
+		query.addBindValue(durations);
+		SQLEXECBATCH();
 	}
 }
 
@@ -8,10 +8,14 @@
 #include "Server.h"
 #include "ServerUser.h"
 #include "Meta.h"
+#include "QAtomicIntCompat.h"
 
 ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), User(), s(NULL) {
 	sState = ServerUser::Connected;
 	sUdpSocket = INVALID_SOCKET;
+	uiUdpToken = 0;
+	uiAuthRequest = 0;
+	usUdpPendingPort = 0;
 
 	memset(&saiUdpAddress, 0, sizeof(saiUdpAddress));
 	memset(&saiTcpLocalAddress, 0, sizeof(saiTcpLocalAddress));
@@ -21,94 +25,138 @@ ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), U
 	uiUDPPackets = uiTCPPackets = 0;
 
 	aiUdpFlag = 1;
+	aiTunnelScheduled = 0;
 	uiVersion = 0;
 	bVerified = true;
 	iLastPermissionCheck = -1;
 	
 	bOpus = false;
+	bUdpAggregate = false;
+}
+
+ServerUser::~ServerUser() {
+	delete QAtomicPointerLoadAcquire(qapTunnel);
+}
+
+TunnelRing *ServerUser::tunnelRing() {
+	TunnelRing *tr = QAtomicPointerLoadAcquire(qapTunnel);
+	if (tr)
+		return tr;
+
+	tr = new TunnelRing();
+
+	// Another voice thread may have created one meanwhile.
+	if (! qapTunnel.testAndSetOrdered(NULL, tr)) {
+		delete tr;
+		tr = QAtomicPointerLoadAcquire(qapTunnel);
+	}
+	return tr;
 }
 
 
 ServerUser::operator QString() const {
 	return QString::fromLatin1("%1:%2(%3)").arg(qsName).arg(uiSession).arg(iId);
 }
-BandwidthRecord::BandwidthRecord() {
-	iRecNum = 0;
-	iSum = 0;
-	for (int i=0;i<N_BANDWIDTH_SLOTS;i++)
-		a_iBW[i] = 0;
+BandwidthRecord::BandwidthRecord() : aiTAT(0), aiSecond(0), aiBytes(0), aiLastBytes(0), aiLastFrame(0), aiIdleReset(0) {
 }
 
 bool BandwidthRecord::addFrame(int size, int maxpersec) {
-	QMutexLocker ml(&qmMutex);
-
-	quint64 elapsed = a_qtWhen[iRecNum].elapsed();
-
-	if (elapsed == 0)
-		return false;
-
-	int nsum = iSum-a_iBW[iRecNum]+size;
-	int bw = static_cast<int>((nsum * 1000000LL) / elapsed);
-
-	if (bw > maxpersec)
+	if (maxpersec <= 0)
 		return false;
 
-	a_iBW[iRecNum] = static_cast<unsigned short>(size);
-	a_qtWhen[iRecNum].restart();
-
-	iSum = nsum;
-
-	iRecNum++;
-	if (iRecNum == N_BANDWIDTH_SLOTS)
-		iRecNum = 0;
+	const quint64 elapsed = tFirst.elapsed();
+	const quint32 now = static_cast<quint32>(elapsed);
+	const quint32 cost = static_cast<quint32>((size * 1000000LL) / maxpersec);
+
+	// The arithmetic is unsigned, as the clock wraps around.
+	int tat;
+	quint32 ahead;
+	do {
+		tat = QAtomicIntLoad(aiTAT);
+		ahead = static_cast<quint32>(tat) - now;
+		// Behind means the bucket is full. Far ahead can only be a
+		// wrapped clock after a long pause, so it is full as well.
+		if (ahead > BANDWIDTH_BURST_USEC)
+			ahead = 0;
+		if (ahead + cost > BANDWIDTH_BURST_USEC)
+			return false;
+	} while (! aiTAT.testAndSetOrdered(tat, static_cast<int>(now + ahead + cost)));
+
+	const int second = static_cast<int>(elapsed / 1000000ULL);
+	const int current = QAtomicIntLoad(aiSecond);
+
+	// Whoever sees a new second first moves the counters along. A
+	// concurrent frame may be counted in the wrong second, which is
+	// good enough for statistics.
+	if ((current != second) && aiSecond.testAndSetOrdered(current, second)) {
+		int bytes = aiBytes.fetchAndStoreOrdered(0);
+		aiLastBytes.fetchAndStoreOrdered((second == current + 1) ? bytes : 0);
+	}
+	aiBytes.fetchAndAddOrdered(size);
+	aiLastFrame.fetchAndStoreOrdered(second);
 
 	return true;
 }
 
 int BandwidthRecord::onlineSeconds() const {
-	QMutexLocker ml(&qmMutex);
-
 	return static_cast<int>(tFirst.elapsed() / 1000000LL);
 }
 
 int BandwidthRecord::idleSeconds() const {
-	QMutexLocker ml(&qmMutex);
+	const int second = static_cast<int>(tFirst.elapsed() / 1000000LL);
 
-	quint64 iIdle = a_qtWhen[(iRecNum + N_BANDWIDTH_SLOTS - 1) % N_BANDWIDTH_SLOTS].elapsed();
-	if (tIdleControl.elapsed() < iIdle)
-		iIdle = tIdleControl.elapsed();
-
-	return static_cast<int>(iIdle / 1000000LL);
+	return second - qMax(QAtomicIntLoad(aiLastFrame), QAtomicIntLoad(aiIdleReset));
 }
 
 void BandwidthRecord::resetIdleSeconds() {
-	QMutexLocker ml(&qmMutex);
-
-	tIdleControl.restart();
+	aiIdleReset.fetchAndStoreOrdered(static_cast<int>(tFirst.elapsed() / 1000000LL));
 }
 
 int BandwidthRecord::bandwidth() const {
-	QMutexLocker ml(&qmMutex);
-
-	int sum = 0;
-	int records = 0;
-	quint64 elapsed = 0ULL;
-
-	for (int i=1;i<N_BANDWIDTH_SLOTS;++i) {
-		int idx = (iRecNum + N_BANDWIDTH_SLOTS - i) % N_BANDWIDTH_SLOTS;
-		quint64 e = a_qtWhen[idx].elapsed();
-		if (e > 1000000ULL) {
-			break;
-		} else {
-			++records;
-			sum += a_iBW[idx];
-			elapsed = e;
-		}
+	const quint64 elapsed = tFirst.elapsed();
+	const int second = static_cast<int>(elapsed / 1000000ULL);
+	const int current = QAtomicIntLoad(aiSecond);
+	quint64 bytes, last;
+
+	if (current == second) {
+		bytes = QAtomicIntLoad(aiBytes);
+		last = QAtomicIntLoad(aiLastBytes);
+	} else if (current == second - 1) {
+		bytes = 0;
+		last = QAtomicIntLoad(aiBytes);
+	} else {
+		return 0;
 	}
 
-	if (elapsed < 250000ULL)
-		return 0;
+	// Bytes in the last second, assuming the previous
+	// second's were spread evenly across it.
+	const quint64 remaining = 1000000ULL - (elapsed % 1000000ULL);
+	return static_cast<int>(bytes + (last * remaining) / 1000000ULL);
+}
+
+PositionRecord::PositionRecord() : aiKnown(0) {
+}
 
-	return static_cast<int>((sum * 1000000ULL) / elapsed);
+void PositionRecord::set(const float *pos) {
+	for (int i=0;i<3;++i) {
+		int bits;
+		memcpy(&bits, &pos[i], sizeof(bits));
+		aiPosition[i].fetchAndStoreRelaxed(bits);
+	}
+	aiKnown.fetchAndStoreRelease(1);
 }
 
+void PositionRecord::clear() {
+	aiKnown.fetchAndStoreRelease(0);
+}
+
+bool PositionRecord::get(float *pos) const {
+	if (! QAtomicIntLoadAcquire(aiKnown))
+		return false;
+
+	for (int i=0;i<3;++i) {
+		const int bits = QAtomicIntLoad(aiPosition[i]);
+		memcpy(&pos[i], &bits, sizeof(bits));
+	}
+	return true;
+}
@@ -6,6 +6,8 @@
 #ifndef MUMBLE_MURMUR_SERVERUSER_H_
 #define MUMBLE_MURMUR_SERVERUSER_H_
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicPointer>
 #include <QtCore/QStringList>
 
 #ifdef Q_OS_UNIX
@@ -18,21 +20,36 @@
 #include "Timer.h"
 #include "User.h"
 #include "HostAddress.h"
-
-// Unfortunately, this needs to be "large enough" to hold
-// enough frames to account for both short-term and
-// long-term "maladjustments".
-
-#define N_BANDWIDTH_SLOTS 360
-
+#include "TunnelRing.h"
+
+// How far a user may get ahead of the bandwidth limit. This
+// needs to be large enough to absorb both jitter and short
+// bursts, such as a client catching up after a network stall.
+#define BANDWIDTH_BURST_USEC 2000000
+
+/// Voice rate limit and statistics of a user. All members are
+/// lock-free, so voice threads and the main thread can use them
+/// concurrently.
+///
+/// The limit is a token bucket, implemented as a generic cell rate
+/// algorithm: aiTAT is the time at which the bucket is full again. Each
+/// frame moves it forward by the time its size takes at the limit, and
+/// a frame that would move it more than BANDWIDTH_BURST_USEC into the
+/// future is dropped.
 struct BandwidthRecord {
-	int iRecNum;
-	int iSum;
 	Timer tFirst;
-	Timer tIdleControl;
-	unsigned short a_iBW[N_BANDWIDTH_SLOTS];
-	Timer a_qtWhen[N_BANDWIDTH_SLOTS];
-	mutable QMutex qmMutex;
+	/// When the bucket is full again, in microseconds since tFirst.
+	/// Wraps around after about 71 minutes.
+	QAtomicInt aiTAT;
+	/// Bytes accepted in second aiSecond since tFirst,
+	/// and in the second before it.
+	QAtomicInt aiSecond;
+	QAtomicInt aiBytes;
+	QAtomicInt aiLastBytes;
+	/// Second since tFirst of the last accepted frame,
+	/// and of the last resetIdleSeconds().
+	QAtomicInt aiLastFrame;
+	QAtomicInt aiIdleReset;
 
 	BandwidthRecord();
 	bool addFrame(int size, int maxpersec);
@@ -42,6 +59,24 @@ struct BandwidthRecord {
 	int bandwidth() const;
 };
 
+/// Last position a user sent with positional audio. Written by the
+/// thread handling the user's voice and read by the threads handling
+/// everyone else's, so it is kept in atomics. A reader may see
+/// coordinates from two consecutive packets, which is harmless.
+struct PositionRecord {
+	/// Bit patterns of the x, y and z coordinates.
+	QAtomicInt aiPosition[3];
+	/// Set once a position was received.
+	QAtomicInt aiKnown;
+
+	PositionRecord();
+	void set(const float *pos);
+	void clear();
+	/// Retrieve the last position into pos, unless none
+	/// was ever received.
+	bool get(float *pos) const;
+};
+
 struct WhisperTarget {
 	struct Channel {
 		int iId;
@@ -95,6 +130,9 @@ class ServerUser : public Connection, public User {
 
 		QList<int> qlCodecs;
 		bool bOpus;
+		/// The client accepts UDPVoiceAggregate datagrams. Main thread
+		/// only; the voice threads use VoiceSnapshot::Member::bUdpAggregate.
+		bool bUdpAggregate;
 
 		QStringList qslAccessTokens;
 
@@ -111,9 +149,30 @@ class ServerUser : public Connection, public User {
 		SOCKET sUdpSocket;
 #endif
 		BandwidthRecord bwr;
+		PositionRecord prPosition;
+		/// Token the user's client associates its UDP address with,
+		/// or 0 for clients that don't support it.
+		quint64 uiUdpToken;
+		/// Authentication request waiting for the asynchronous
+		/// authenticators, or 0.
+		unsigned int uiAuthRequest;
+		/// Port of the last UDP association datagram not yet
+		/// confirmed by an encrypted packet, or 0.
+		quint16 usUdpPendingPort;
 		struct sockaddr_storage saiUdpAddress;
 		struct sockaddr_storage saiTcpLocalAddress;
+
+		/// Voice waiting to be sent over TCP. Created by
+		/// tunnelRing() when the user first needs it.
+		QAtomicPointer<TunnelRing> qapTunnel;
+		/// Set while a drain of qapTunnel is scheduled
+		/// on the main thread.
+		QAtomicInt aiTunnelScheduled;
+
 		ServerUser(Server *parent, QSslSocket *socket);
+		~ServerUser();
+		/// The user's TunnelRing, created on first use. Thread-safe.
+		TunnelRing *tunnelRing();
 };
 
 #endif
@@ -0,0 +1,180 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "SpeakerSelection.h"
+
+#include "QAtomicIntCompat.h"
+
+static inline float decay(float activity, quint32 dt) {
+	return activity * expf(- static_cast<float>(dt) / SPEAKER_ACTIVITY_TAU);
+}
+
+SpeakerSelection::SpeakerSelection() {
+}
+
+quint32 SpeakerSelection::now() const {
+	return static_cast<quint32>(tTime.elapsed() / 1000ULL);
+}
+
+void SpeakerSelection::setMaxSpeakers(int n) {
+	n = qBound(0, n, SPEAKER_MAX_SLOTS);
+	if (n == QAtomicIntLoad(aiMaxSpeakers))
+		return;
+
+	QMutexLocker l(&qmMutex);
+
+	for (int i=n;i<SPEAKER_MAX_SLOTS;++i)
+		release(i);
+	aiMaxSpeakers.fetchAndStoreOrdered(n);
+}
+
+int SpeakerSelection::waiting(unsigned int session, quint32 t) {
+	for (int i=0;i<qvSpeakers.count();++i)
+		if (qvSpeakers.at(i).uiSession == session)
+			return i;
+
+	Speaker sp;
+	sp.uiSession = session;
+	sp.fActivity = 0.0f;
+	sp.uiLastPacket = t;
+	sp.uiLastVoiced = t - SPEAKER_HANGOVER - 1;
+	qvSpeakers.append(sp);
+	return qvSpeakers.count() - 1;
+}
+
+void SpeakerSelection::release(int slot) {
+	Slot &sl = sSlots[slot];
+	const unsigned int holder = static_cast<unsigned int>(QAtomicIntLoadAcquire(sl.aiSession));
+	if (! holder)
+		return;
+
+	// The holder keeps its activity while it waits for a slot again.
+	Speaker &sp = qvSpeakers[waiting(holder, QAtomicIntLoad(sl.aiLastPacket))];
+	sp.fActivity = static_cast<float>(QAtomicIntLoad(sl.aiActivity));
+	sp.uiLastPacket = QAtomicIntLoad(sl.aiLastPacket);
+	sp.uiLastVoiced = QAtomicIntLoad(sl.aiLastVoiced);
+
+	sl.aiSession.fetchAndStoreOrdered(0);
+}
+
+bool SpeakerSelection::forward(unsigned int session, int bytes, bool terminator, bool priority) {
+	const int max = QAtomicIntLoad(aiMaxSpeakers);
+	if (max <= 0)
+		return true;
+
+	const quint32 t = now();
+	const bool voiced = (bytes > SPEAKER_SILENCE_BYTES);
+
+	for (int i=0;i<max;++i) {
+		Slot &sl = sSlots[i];
+		if (static_cast<unsigned int>(QAtomicIntLoadAcquire(sl.aiSession)) != session)
+			continue;
+
+		// Past the hangover the slot is up for grabs, and the
+		// speaker has to win it again like everyone waiting.
+		if (t - static_cast<quint32>(QAtomicIntLoad(sl.aiLastVoiced)) > SPEAKER_HANGOVER)
+			break;
+
+		// Should the slot be given away meanwhile, these stores may
+		// land on the new holder's numbers; that only skews its
+		// activity until its next packet.
+		const quint32 last = QAtomicIntLoad(sl.aiLastPacket);
+		sl.aiActivity.fetchAndStoreRelaxed(qRound(decay(static_cast<float>(QAtomicIntLoad(sl.aiActivity)), t - last) + static_cast<float>(bytes)));
+		sl.aiLastPacket.fetchAndStoreRelaxed(static_cast<int>(t));
+		sl.aiPriority.fetchAndStoreRelaxed(priority ? 1 : 0);
+		if (voiced)
+			sl.aiLastVoiced.fetchAndStoreRelaxed(static_cast<int>(t));
+
+		// Free the slot right away at the end of a transmission.
+		if (terminator) {
+			QMutexLocker l(&qmMutex);
+			if (static_cast<unsigned int>(QAtomicIntLoad(sl.aiSession)) == session)
+				release(i);
+		}
+		return true;
+	}
+
+	return forwardWaiting(session, bytes, terminator, priority, t);
+}
+
+bool SpeakerSelection::forwardWaiting(unsigned int session, int bytes, bool terminator, bool priority, quint32 t) {
+	QMutexLocker l(&qmMutex);
+
+	const int max = QAtomicIntLoad(aiMaxSpeakers);
+
+	// Forget speakers that have been quiet for a while.
+	for (int i=qvSpeakers.count()-1;i>=0;--i) {
+		const Speaker &sp = qvSpeakers.at(i);
+		if ((sp.uiSession != session) && (t - sp.uiLastPacket > SPEAKER_EXPIRY))
+			qvSpeakers.remove(i);
+	}
+
+	// Release the slots of speakers that stopped talking, and find the
+	// least active holder a priority speaker may take over from.
+	int held = 0;
+	int free = -1;
+	int weakest = -1;
+	for (int i=0;i<max;++i) {
+		Slot &sl = sSlots[i];
+		const unsigned int holder = static_cast<unsigned int>(QAtomicIntLoadAcquire(sl.aiSession));
+		if (holder && (holder != session) && (t - static_cast<quint32>(QAtomicIntLoad(sl.aiLastVoiced)) <= SPEAKER_HANGOVER)) {
+			++held;
+			if (! QAtomicIntLoad(sl.aiPriority) && ((weakest < 0) || (QAtomicIntLoad(sl.aiActivity) < QAtomicIntLoad(sSlots[weakest].aiActivity))))
+				weakest = i;
+			continue;
+		}
+		release(i);
+		if (free < 0)
+			free = i;
+	}
+
+	// Only appending to qvSpeakers from here on, so the index holds.
+	const int idx = waiting(session, t);
+	Speaker &s = qvSpeakers[idx];
+
+	s.fActivity = decay(s.fActivity, t - s.uiLastPacket) + static_cast<float>(bytes);
+	s.uiLastPacket = t;
+	if (bytes <= SPEAKER_SILENCE_BYTES)
+		return false;
+	s.uiLastVoiced = t;
+
+	int louder = 0;
+	if (! priority) {
+		for (int i=0;i<qvSpeakers.count();++i) {
+			const Speaker &sp = qvSpeakers.at(i);
+			// A more active speaker is waiting as well,
+			// and gets the next free slot.
+			if ((i != idx) && (t - sp.uiLastVoiced <= SPEAKER_HANGOVER) && (sp.fActivity > s.fActivity))
+				++louder;
+		}
+	}
+
+	int slot = -1;
+	if ((free >= 0) && (held + louder < max))
+		slot = free;
+	else if (priority && (weakest >= 0))
+		slot = weakest;
+
+	if (slot < 0)
+		return false;
+	// The transmission ends with this packet, so don't hold a slot.
+	if (terminator)
+		return true;
+
+	release(slot);
+
+	const Speaker &sp = qvSpeakers.at(idx);
+	Slot &sl = sSlots[slot];
+	sl.aiActivity.fetchAndStoreRelaxed(qRound(sp.fActivity));
+	sl.aiLastPacket.fetchAndStoreRelaxed(static_cast<int>(t));
+	sl.aiLastVoiced.fetchAndStoreRelaxed(static_cast<int>(t));
+	sl.aiPriority.fetchAndStoreRelaxed(priority ? 1 : 0);
+	sl.aiSession.fetchAndStoreRelease(static_cast<int>(session));
+
+	qvSpeakers.remove(idx);
+	return true;
+}
@@ -0,0 +1,98 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_SPEAKERSELECTION_H_
+#define MUMBLE_MURMUR_SPEAKERSELECTION_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QVector>
+
+#include "Timer.h"
+
+/// Milliseconds a forwarded speaker keeps its slot after its
+/// last voiced packet, so pauses between words don't lose it.
+#define SPEAKER_HANGOVER 400
+/// Speakers not heard from for this many milliseconds are forgotten.
+#define SPEAKER_EXPIRY 5000
+/// Time constant of the activity estimate, in milliseconds.
+#define SPEAKER_ACTIVITY_TAU 250.0f
+/// Audio payloads of at most this many bytes count as silence, such
+/// as an Opus frame that is little more than its TOC byte.
+#define SPEAKER_SILENCE_BYTES 2
+/// Most speakers a channel can be limited to.
+#define SPEAKER_MAX_SLOTS 32
+
+/// Picks which speakers in a channel have their normal speech
+/// forwarded, when the channel is limited to a number of
+/// simultaneous speakers (see Server::qhMaxSpeakers).
+///
+/// Speakers are ranked by activity: audio payload bytes, decaying
+/// exponentially over time, which grows with packet rate and frame
+/// size. A speaker holds its slot until SPEAKER_HANGOVER passes
+/// without a voiced packet, or until it sends a terminator, so nobody
+/// is cut off mid-sentence. Free slots go to the most active waiting
+/// speakers. Priority speakers may take the slot of the least active
+/// other speaker.
+///
+/// Used by the voice threads of a Server, which share one
+/// SpeakerSelection per limited channel. A forwarded speaker only
+/// looks at the slots and writes its own, without locking; the mutex
+/// is taken by speakers waiting for a slot, so it is only contended
+/// while more people talk than the channel allows.
+class SpeakerSelection {
+	private:
+		Q_DISABLE_COPY(SpeakerSelection);
+	protected:
+		/// Times are milliseconds since tTime, wrapping at 32 bits.
+		/// Only its holder writes a slot, except for giving it to
+		/// someone else, which happens under qmMutex.
+		struct Slot {
+			/// Session of the forwarded speaker, or 0 if free.
+			QAtomicInt aiSession;
+			QAtomicInt aiLastPacket;
+			QAtomicInt aiLastVoiced;
+			/// Activity, in bytes.
+			QAtomicInt aiActivity;
+			QAtomicInt aiPriority;
+			/// Keep holders from sharing a cache line.
+			char cPad[64 - 5 * sizeof(QAtomicInt)];
+		};
+
+		struct Speaker {
+			unsigned int uiSession;
+			float fActivity;
+			quint32 uiLastPacket;
+			quint32 uiLastVoiced;
+		};
+
+		Timer tTime;
+		QAtomicInt aiMaxSpeakers;
+		Slot sSlots[SPEAKER_MAX_SLOTS];
+
+		/// Guards qvSpeakers and handing out slots.
+		QMutex qmMutex;
+		/// Recent speakers without a slot.
+		QVector<Speaker> qvSpeakers;
+
+		quint32 now() const;
+		/// Index of session in qvSpeakers, adding it if needed.
+		int waiting(unsigned int session, quint32 t);
+		/// Free a slot, moving its holder back to qvSpeakers.
+		void release(int slot);
+		bool forwardWaiting(unsigned int session, int bytes, bool terminator, bool priority, quint32 t);
+	public:
+		SpeakerSelection();
+
+		/// Set the number of speakers forwarded at a time, at most
+		/// SPEAKER_MAX_SLOTS.
+		void setMaxSpeakers(int n);
+		/// Account for a voice packet from session carrying bytes of
+		/// audio, and return whether it should be forwarded.
+		/// terminator is set on the last packet of a transmission.
+		bool forward(unsigned int session, int bytes, bool terminator, bool priority);
+};
+
+#endif
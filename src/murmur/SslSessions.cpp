@@ -0,0 +1,396 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "SslSessions.h"
+
+#include "Meta.h"
+#include "SslWorker.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+static const unsigned char sidContext[] = "Murmur";
+
+SslSessionCache::SslSessionCache(QObject *p) : QObject(p), uiSerial(0) {
+	iExIndex = SSL_get_ex_new_index(0, NULL, exNew, NULL, NULL);
+
+	loadKeys();
+	rotate();
+
+	qtRotate = new QTimer(this);
+	connect(qtRotate, SIGNAL(timeout()), this, SLOT(rotate()));
+	qtRotate->start(60000);
+}
+
+SslSessionCache::~SslSessionCache() {
+}
+
+void SslSessionCache::begin(SslHandshake *h) {
+	QMutexLocker lock(&qmSessions);
+	qhStarting.insert(QThread::currentThread(), h);
+}
+
+void SslSessionCache::end(SslHandshake *h) {
+	{
+		QMutexLocker lock(&qmSessions);
+		qhStarting.remove(QThread::currentThread());
+	}
+
+	// This happens if Qt loaded another OpenSSL library than the
+	// one murmur is linked against.
+	if (! h->ssl && aiUnbound.testAndSetOrdered(0, 1))
+		qWarning("SslSessionCache: Qt's SSL objects can't be reached, TLS sessions won't be resumed");
+}
+
+void SslSessionCache::release(SslHandshake *h) {
+	if (h->ssl) {
+		SSL_set_ex_data(h->ssl, iExIndex, NULL);
+		h->ssl = NULL;
+	}
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+void SslSessionCache::exNew(void *parent, void *, CRYPTO_EX_DATA *ad, int idx, long, void *) {
+#else
+int SslSessionCache::exNew(void *parent, void *, CRYPTO_EX_DATA *ad, int idx, long, void *) {
+#endif
+	SslSessionCache *c = meta ? meta->sscSessions : NULL;
+	SslHandshake *h = NULL;
+	if (c) {
+		QMutexLocker lock(&c->qmSessions);
+		h = c->qhStarting.value(QThread::currentThread());
+	}
+
+	if (h) {
+		SSL *ssl = static_cast<SSL *>(parent);
+		SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+
+		CRYPTO_set_ex_data(ad, idx, h);
+		h->ssl = ssl;
+
+		// Qt made this context for this socket alone, so it can be
+		// given callbacks without affecting any other connection.
+		if (Meta::mp.iSslSessions > 0) {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+			SSL_CTX_sess_set_new_cb(ctx, newSession);
+			SSL_CTX_sess_set_get_cb(ctx, getSession);
+			SSL_CTX_sess_set_remove_cb(ctx, removeSession);
+		} else {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		}
+		SSL_CTX_set_timeout(ctx, SSL_SESSION_LIFETIME);
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticketKey);
+		SSL_CTX_set_session_id_context(ctx, sidContext, sizeof(sidContext) - 1);
+
+		// SSL_new() has already copied these from the context.
+		SSL_set_session_id_context(ssl, sidContext, sizeof(sidContext) - 1);
+		if (! Meta::mp.bSslTickets)
+			SSL_set_options(ssl, SSL_OP_NO_TICKET);
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	return 1;
+#endif
+}
+
+SslHandshake *SslSessionCache::handshake(SSL *ssl) {
+	SslSessionCache *c = meta ? meta->sscSessions : NULL;
+	if (! c)
+		return NULL;
+	return static_cast<SslHandshake *>(SSL_get_ex_data(ssl, c->iExIndex));
+}
+
+QByteArray SslSessionCache::certificateDigest(SSL *ssl) {
+	X509 *cert = SSL_get_certificate(ssl);
+	if (! cert)
+		return QByteArray();
+
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	if (X509_digest(cert, EVP_sha256(), digest, &len) != 1)
+		return QByteArray();
+	return QByteArray(reinterpret_cast<const char *>(digest), static_cast<int>(len));
+}
+
+bool SslSessionCache::deriveKey(SSL *ssl, const TicketKey &key, unsigned char *aes, unsigned char *hmac) {
+	const QByteArray cert = certificateDigest(ssl);
+	if (cert.isEmpty())
+		return false;
+
+	unsigned char out[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	if (! HMAC(EVP_sha512(), key.secret, sizeof(key.secret), reinterpret_cast<const unsigned char *>(cert.constData()), static_cast<size_t>(cert.size()), out, &len) || len < 64)
+		return false;
+
+	memcpy(aes, out, 32);
+	memcpy(hmac, out + 32, 32);
+	return true;
+}
+
+/// Clients that sent intermediate certificates are not resumed: the
+/// chain isn't kept with the session, and Server::startSession() would
+/// see a different certificate chain than on the full handshake.
+static bool hasPeerChain(SSL *ssl) {
+	STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
+	return chain && sk_X509_num(chain) > 0;
+}
+
+int SslSessionCache::newSession(SSL *ssl, SSL_SESSION *session) {
+	SslSessionCache *c = meta->sscSessions;
+	if (! handshake(ssl) || hasPeerChain(ssl))
+		return 0;
+
+	unsigned int idlen = 0;
+	const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+	if (idlen == 0)
+		return 0;
+
+	const int len = i2d_SSL_SESSION(session, NULL);
+	if (len <= 0)
+		return 0;
+
+	Session s;
+	s.qbaCert = certificateDigest(ssl);
+	s.qbaData.resize(len);
+	unsigned char *p = reinterpret_cast<unsigned char *>(s.qbaData.data());
+	i2d_SSL_SESSION(session, &p);
+
+	const QByteArray key(reinterpret_cast<const char *>(id), static_cast<int>(idlen));
+
+	QMutexLocker lock(&c->qmSessions);
+	s.uiSerial = ++c->uiSerial;
+	c->qhSessions.insert(key, s);
+	c->qqSessionIds.enqueue(qMakePair(key, s.uiSerial));
+	c->evict();
+
+	// The session is serialized, OpenSSL keeps ownership.
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+SSL_SESSION *SslSessionCache::getSession(SSL *ssl, const unsigned char *id, int len, int *copy) {
+#else
+SSL_SESSION *SslSessionCache::getSession(SSL *ssl, unsigned char *id, int len, int *copy) {
+#endif
+	SslSessionCache *c = meta->sscSessions;
+	*copy = 0;
+
+	if (! handshake(ssl))
+		return NULL;
+
+	const QByteArray key(reinterpret_cast<const char *>(id), len);
+	Session s;
+	bool found;
+	{
+		QMutexLocker lock(&c->qmSessions);
+		found = c->qhSessions.contains(key);
+		if (found)
+			s = c->qhSessions.value(key);
+	}
+
+	SSL_SESSION *session = NULL;
+	if (found && s.qbaCert == certificateDigest(ssl)) {
+		const unsigned char *p = reinterpret_cast<const unsigned char *>(s.qbaData.constData());
+		session = d2i_SSL_SESSION(NULL, &p, s.qbaData.size());
+	}
+
+	if (session)
+		c->aiSessionHits.ref();
+	else
+		c->aiSessionMisses.ref();
+	return session;
+}
+
+void SslSessionCache::removeSession(SSL_CTX *, SSL_SESSION *session) {
+	SslSessionCache *c = meta ? meta->sscSessions : NULL;
+	if (! c)
+		return;
+
+	unsigned int idlen = 0;
+	const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+
+	QMutexLocker lock(&c->qmSessions);
+	c->qhSessions.remove(QByteArray(reinterpret_cast<const char *>(id), static_cast<int>(idlen)));
+	c->evict();
+}
+
+void SslSessionCache::evict() {
+	const int max = Meta::mp.iSslSessions;
+
+	while (! qqSessionIds.isEmpty()) {
+		const QPair<QByteArray, quint64> &head = qqSessionIds.head();
+		QHash<QByteArray, Session>::iterator i = qhSessions.find(head.first);
+		const bool live = (i != qhSessions.end()) && (i.value().uiSerial == head.second);
+		if (live) {
+			if (qhSessions.count() <= max)
+				break;
+			qhSessions.erase(i);
+		}
+		qqSessionIds.dequeue();
+	}
+
+	// Stale entries behind a live one stay until they reach the head.
+	// Weed them out once they make up half of the queue.
+	if (qqSessionIds.count() > 2 * max) {
+		QQueue<QPair<QByteArray, quint64> > ids;
+		while (! qqSessionIds.isEmpty()) {
+			const QPair<QByteArray, quint64> id = qqSessionIds.dequeue();
+			QHash<QByteArray, Session>::const_iterator i = qhSessions.constFind(id.first);
+			if ((i != qhSessions.constEnd()) && (i.value().uiSerial == id.second))
+				ids.enqueue(id);
+		}
+		qqSessionIds = ids;
+	}
+}
+
+int SslSessionCache::ticketKey(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+	SslSessionCache *c = meta->sscSessions;
+	unsigned char aes[32], hmac[32];
+
+	if (enc) {
+		TicketKey key;
+		{
+			QMutexLocker lock(&c->qmSessions);
+			if (c->qlKeys.isEmpty())
+				return -1;
+			key = c->qlKeys.first();
+		}
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 || ! deriveKey(ssl, key, aes, hmac))
+			return -1;
+
+		// A ticket that mustn't be resumed is named after no key.
+		if (handshake(ssl) && ! hasPeerChain(ssl))
+			memcpy(name, key.name, sizeof(key.name));
+		else
+			memset(name, 0, sizeof(key.name));
+
+		EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+		HMAC_Init_ex(hctx, hmac, sizeof(hmac), EVP_sha256(), NULL);
+		return 1;
+	}
+
+	TicketKey key;
+	int index = -1;
+	if (handshake(ssl)) {
+		QMutexLocker lock(&c->qmSessions);
+		for (int i = 0; i < c->qlKeys.count(); ++i) {
+			if (memcmp(c->qlKeys.at(i).name, name, sizeof(key.name)) == 0) {
+				key = c->qlKeys.at(i);
+				index = i;
+				break;
+			}
+		}
+	}
+
+	if (index < 0 || ! deriveKey(ssl, key, aes, hmac)) {
+		c->aiTicketMisses.ref();
+		return 0;
+	}
+
+	HMAC_Init_ex(hctx, hmac, sizeof(hmac), EVP_sha256(), NULL);
+	EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+	c->aiTicketHits.ref();
+
+	// Tickets of older keys are replaced by one of the current key.
+	return (index == 0) ? 1 : 2;
+}
+
+void SslSessionCache::rotate() {
+	const qint64 now = static_cast<qint64>(QDateTime::currentDateTime().toTime_t());
+	bool changed = false;
+
+	{
+		QMutexLocker lock(&qmSessions);
+		while (! qlKeys.isEmpty() && qlKeys.last().created + SSL_TICKET_ROTATION + SSL_SESSION_LIFETIME <= now) {
+			qlKeys.removeLast();
+			changed = true;
+		}
+
+		if (qlKeys.isEmpty() || qlKeys.first().created + SSL_TICKET_ROTATION <= now) {
+			TicketKey key;
+			if (RAND_bytes(key.name, sizeof(key.name)) == 1 && RAND_bytes(key.secret, sizeof(key.secret)) == 1) {
+				key.created = now;
+				qlKeys.prepend(key);
+				changed = true;
+			} else {
+				qWarning("SslSessionCache: Failed to generate session ticket key");
+			}
+		}
+	}
+
+	if (changed)
+		saveKeys();
+}
+
+void SslSessionCache::loadKeys() {
+	if (Meta::mp.qsSslTicketKeys.isEmpty())
+		return;
+
+	QFile f(Meta::mp.qsSslTicketKeys);
+	if (! f.exists())
+		return;
+	if (! f.open(QIODevice::ReadOnly)) {
+		qWarning("SslSessionCache: Failed to open %s", qPrintable(f.fileName()));
+		return;
+	}
+
+	QDataStream ds(&f);
+	quint32 magic = 0, count = 0;
+	ds >> magic >> count;
+	if (magic != SSL_TICKET_KEYS_MAGIC) {
+		qWarning("SslSessionCache: %s holds no session ticket keys", qPrintable(f.fileName()));
+		return;
+	}
+
+	QList<TicketKey> keys;
+	bool ok = true;
+	for (quint32 i = 0; i < count && ok; ++i) {
+		TicketKey key;
+		ok = ds.readRawData(reinterpret_cast<char *>(key.name), sizeof(key.name)) == sizeof(key.name)
+		     && ds.readRawData(reinterpret_cast<char *>(key.secret), sizeof(key.secret)) == sizeof(key.secret);
+		ds >> key.created;
+		ok = ok && ds.status() == QDataStream::Ok;
+		keys << key;
+	}
+
+	if (! ok) {
+		qWarning("SslSessionCache: %s is truncated", qPrintable(f.fileName()));
+		return;
+	}
+
+	QMutexLocker lock(&qmSessions);
+	qlKeys = keys;
+}
+
+void SslSessionCache::saveKeys() {
+	if (Meta::mp.qsSslTicketKeys.isEmpty())
+		return;
+
+	QList<TicketKey> keys;
+	{
+		QMutexLocker lock(&qmSessions);
+		keys = qlKeys;
+	}
+
+	QFile f(Meta::mp.qsSslTicketKeys);
+	if (! f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qWarning("SslSessionCache: Failed to write %s", qPrintable(f.fileName()));
+		return;
+	}
+	f.setPermissions(QFile::ReadOwner | QFile::WriteOwner);
+
+	QDataStream ds(&f);
+	ds << static_cast<quint32>(SSL_TICKET_KEYS_MAGIC) << static_cast<quint32>(keys.count());
+	foreach(const TicketKey &key, keys) {
+		ds.writeRawData(reinterpret_cast<const char *>(key.name), sizeof(key.name));
+		ds.writeRawData(reinterpret_cast<const char *>(key.secret), sizeof(key.secret));
+		ds << key.created;
+	}
+}
@@ -0,0 +1,123 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_SSLSESSIONS_H_
+#define MUMBLE_MURMUR_SSLSESSIONS_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtCore/QQueue>
+
+#include <openssl/ssl.h>
+
+class QThread;
+class QTimer;
+struct SslHandshake;
+
+/// Seconds a TLS session can be resumed after its full handshake.
+#define SSL_SESSION_LIFETIME 86400
+/// Seconds between new session ticket keys. Old keys are kept until
+/// the tickets they encrypted have expired.
+#define SSL_TICKET_ROTATION 43200
+/// First four bytes of a session ticket key file ("MSTK").
+#define SSL_TICKET_KEYS_MAGIC 0x4d53544b
+
+/// Lets clients resume TLS sessions with abbreviated handshakes, by
+/// session ID and by session ticket.
+///
+/// QSslSocket creates an SSL_CTX for every socket, so OpenSSL's own
+/// session cache and ticket keys never outlive a connection. When an
+/// SslWorker starts a handshake, the SSL object Qt creates for it is
+/// caught through OpenSSL's ex_data hooks and given callbacks backed by
+/// this class: one session cache and one set of ticket keys for all
+/// virtual servers. Both are keyed by the server certificate, so
+/// servers share sessions exactly when they share a certificate.
+///
+/// Ticket keys are rotated every SSL_TICKET_ROTATION and can be kept in
+/// a file so that clients resume their sessions after a restart.
+class SslSessionCache : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(SslSessionCache);
+	protected:
+		struct TicketKey {
+			unsigned char name[16];
+			unsigned char secret[32];
+			qint64 created;
+		};
+
+		struct Session {
+			QByteArray qbaCert;
+			QByteArray qbaData;
+			/// Tells this session's entry in qqSessionIds from those
+			/// of sessions stored under the same ID before.
+			quint64 uiSerial;
+		};
+
+		int iExIndex;
+		QTimer *qtRotate;
+
+		/// Guards the members below.
+		QMutex qmSessions;
+		/// Handshakes being started, by the worker thread starting them.
+		QHash<QThread *, SslHandshake *> qhStarting;
+		/// Serialized sessions by session ID, and their IDs and serials
+		/// from oldest to newest. Entries of sessions that have been
+		/// removed or replaced since are stale, and are skipped.
+		QHash<QByteArray, Session> qhSessions;
+		QQueue<QPair<QByteArray, quint64> > qqSessionIds;
+		quint64 uiSerial;
+		/// Ticket keys, newest first.
+		QList<TicketKey> qlKeys;
+
+		/// Drop the oldest sessions beyond Meta::mp.iSslSessions, and
+		/// stale entries of qqSessionIds. qmSessions must be held.
+		void evict();
+		void loadKeys();
+		void saveKeys();
+		/// Derive the AES and HMAC keys of key for the certificate of ssl.
+		static bool deriveKey(SSL *ssl, const TicketKey &key, unsigned char *aes, unsigned char *hmac);
+		static QByteArray certificateDigest(SSL *ssl);
+		static SslHandshake *handshake(SSL *ssl);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		static void exNew(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp);
+#else
+		static int exNew(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp);
+#endif
+		static int newSession(SSL *ssl, SSL_SESSION *session);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		static SSL_SESSION *getSession(SSL *ssl, const unsigned char *id, int len, int *copy);
+#else
+		static SSL_SESSION *getSession(SSL *ssl, unsigned char *id, int len, int *copy);
+#endif
+		static void removeSession(SSL_CTX *ctx, SSL_SESSION *session);
+		static int ticketKey(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc);
+	public:
+		/// Resumption attempts since the last SslWorkerPool report.
+		QAtomicInt aiSessionHits, aiSessionMisses;
+		QAtomicInt aiTicketHits, aiTicketMisses;
+		/// Set once it has been logged that SSL objects can't be caught.
+		QAtomicInt aiUnbound;
+
+		SslSessionCache(QObject *p = NULL);
+		~SslSessionCache();
+
+		/// Mark the calling thread as starting the handshake h, until
+		/// end(). The SSL object created in between is bound to h.
+		void begin(SslHandshake *h);
+		void end(SslHandshake *h);
+		/// Unbind h from its SSL object. Worker thread only.
+		void release(SslHandshake *h);
+	public slots:
+		void rotate();
+};
+
+#endif
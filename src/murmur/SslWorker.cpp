@@ -0,0 +1,315 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "SslWorker.h"
+
+#include "Meta.h"
+#include "QAtomicIntCompat.h"
+#include "Server.h"
+#include "SslSessions.h"
+
+SslWorker::SslWorker(SslWorkerPool *pool) : QObject(), swpPool(pool) {
+	qtThread = new QThread();
+	qtTimeout = new QTimer(this);
+	qtTimeout->setInterval(1000);
+	connect(qtTimeout, SIGNAL(timeout()), this, SLOT(checkTimeout()));
+
+	moveToThread(qtThread);
+	qtThread->start();
+}
+
+SslWorker::~SslWorker() {
+	delete qtThread;
+}
+
+QThread *SslWorker::workerThread() const {
+	return qtThread;
+}
+
+void SslWorker::enqueue(SslHandshake *h) {
+	aiLoad.ref();
+
+	bool wake;
+	{
+		QMutexLocker lock(&qmQueue);
+		wake = qlQueue.isEmpty();
+		qlQueue.append(h);
+	}
+	if (wake)
+		QMetaObject::invokeMethod(this, "process", Qt::QueuedConnection);
+}
+
+void SslWorker::process() {
+	QList<SslHandshake *> ql;
+	{
+		QMutexLocker lock(&qmQueue);
+		ql.swap(qlQueue);
+	}
+
+	if (! qtTimeout->isActive())
+		qtTimeout->start();
+
+	foreach(SslHandshake *h, ql) {
+		h->uiQueueWait = h->tStage.restart();
+
+		QSslSocket *sock = h->qssSocket;
+		if (sock->state() != QAbstractSocket::ConnectedState) {
+			finish(h, false);
+			continue;
+		}
+
+		qhActive.insert(sock, h);
+
+		connect(sock, SIGNAL(encrypted()), this, SLOT(encrypted()));
+		connect(sock, SIGNAL(sslErrors(const QList<QSslError> &)), this, SLOT(sslErrors(const QList<QSslError> &)));
+		connect(sock, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(failed()));
+		connect(sock, SIGNAL(disconnected()), this, SLOT(failed()));
+
+		meta->sscSessions->begin(h);
+		sock->startServerEncryption();
+		meta->sscSessions->end(h);
+	}
+}
+
+void SslWorker::encrypted() {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	SslHandshake *h = qhActive.take(sock);
+	if (! h)
+		return;
+
+	h->uiHandshake = h->tStage.restart();
+
+	if (h->ssl && SSL_session_reused(h->ssl)) {
+		h->bResumed = true;
+
+		// Certificate errors aren't reported again for a resumed session,
+		// but the result of the original verification is kept with it.
+		const long result = SSL_get_verify_result(h->ssl);
+		if (result != X509_V_OK && result != X509_V_ERR_INVALID_PURPOSE)
+			h->bVerified = false;
+	}
+
+	finish(h, true);
+}
+
+void SslWorker::sslErrors(const QList<QSslError> &errors) {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	SslHandshake *h = qhActive.value(sock);
+	if (! h)
+		return;
+
+	if (Server::acceptSslErrors(errors, h->bVerified, h->qslErrors)) {
+		sock->ignoreSslErrors();
+	} else {
+		// See Server::sslError() for why Qt 5 can't abort here.
+#if QT_VERSION >= 0x050000
+		sock->disconnectFromHost();
+#else
+		sock->abort();
+#endif
+	}
+}
+
+void SslWorker::failed() {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	SslHandshake *h = qhActive.take(sock);
+	if (h)
+		finish(h, false);
+}
+
+void SslWorker::checkTimeout() {
+	QList<SslHandshake *> ql;
+	foreach(SslHandshake *h, qhActive) {
+		if (h->tStage.isElapsed(static_cast<quint64>(h->iTimeout) * 1000000ULL))
+			ql << h;
+	}
+
+	foreach(SslHandshake *h, ql) {
+		qhActive.remove(h->qssSocket);
+		h->qssSocket->abort();
+		finish(h, false);
+	}
+
+	if (qhActive.isEmpty() && QAtomicIntLoad(aiLoad) == 0)
+		qtTimeout->stop();
+}
+
+void SslWorker::abortAll() {
+	process();
+
+	foreach(SslHandshake *h, qhActive) {
+		meta->sscSessions->release(h);
+		h->qssSocket->disconnect(this);
+		h->qssSocket->abort();
+		delete h->qssSocket;
+		delete h;
+		aiLoad.deref();
+	}
+	qhActive.clear();
+	qtTimeout->stop();
+
+	moveToThread(swpPool->thread());
+	qtThread->quit();
+}
+
+void SslWorker::finish(SslHandshake *h, bool ok) {
+	QSslSocket *sock = h->qssSocket;
+	sock->disconnect(this);
+	meta->sscSessions->release(h);
+
+	if (ok) {
+		sock->moveToThread(swpPool->thread());
+	} else {
+		sock->deleteLater();
+		h->qssSocket = NULL;
+	}
+
+	aiLoad.deref();
+	swpPool->handover(h);
+}
+
+SslWorkerPool::SslWorkerPool(int threads, QObject *p) : QObject(p) {
+	uiHandshakes = uiFailed = uiResumed = 0;
+	uiQueueWaitTotal = uiQueueWaitMax = 0;
+	uiHandshakeTotal = uiHandshakeMax = 0;
+	uiHandoverTotal = uiHandoverMax = 0;
+
+	for (int i = 0; i < threads; ++i)
+		qlWorkers << new SslWorker(this);
+
+	qtReport = new QTimer(this);
+	connect(qtReport, SIGNAL(timeout()), this, SLOT(report()));
+	if (! qlWorkers.isEmpty())
+		qtReport->start(SSL_POOL_REPORT_INTERVAL * 1000);
+}
+
+SslWorkerPool::~SslWorkerPool() {
+	foreach(SslWorker *w, qlWorkers) {
+		QMetaObject::invokeMethod(w, "abortAll", Qt::BlockingQueuedConnection);
+		w->workerThread()->wait();
+		delete w;
+	}
+
+	foreach(SslHandshake *h, qlDone) {
+		delete h->qssSocket;
+		delete h;
+	}
+}
+
+bool SslWorkerPool::isEnabled() const {
+	return ! qlWorkers.isEmpty();
+}
+
+void SslWorkerPool::handshake(Server *s, QSslSocket *sock) {
+	SslWorker *w = qlWorkers.first();
+	int load = QAtomicIntLoad(w->aiLoad);
+	foreach(SslWorker *other, qlWorkers) {
+		const int l = QAtomicIntLoad(other->aiLoad);
+		if (l < load) {
+			w = other;
+			load = l;
+		}
+	}
+
+	SslHandshake *h = new SslHandshake();
+	h->qssSocket = sock;
+	h->ssl = NULL;
+	h->s = s;
+	h->iServerNum = s->iServerNum;
+	h->iTimeout = s->iTimeout;
+	h->bVerified = true;
+	h->bResumed = false;
+	h->qsPeer = s->addressToString(sock->peerAddress(), sock->peerPort());
+	h->uiQueueWait = h->uiHandshake = 0;
+
+	sock->setParent(NULL);
+	sock->moveToThread(w->workerThread());
+	w->enqueue(h);
+}
+
+void SslWorkerPool::handover(SslHandshake *h) {
+	h->tStage.restart();
+
+	bool wake;
+	{
+		QMutexLocker lock(&qmDone);
+		wake = qlDone.isEmpty();
+		qlDone.append(h);
+	}
+	if (wake)
+		QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+}
+
+void SslWorkerPool::deliver() {
+	QList<SslHandshake *> ql;
+	{
+		QMutexLocker lock(&qmDone);
+		ql.swap(qlDone);
+	}
+
+	foreach(SslHandshake *h, ql) {
+		// The server may have been stopped during the handshake.
+		Server *s = meta->qhServers.value(h->iServerNum);
+		if (s != h->s)
+			s = NULL;
+
+		if (h->qssSocket) {
+			const quint64 handover = h->tStage.elapsed();
+
+			++uiHandshakes;
+			if (h->bResumed)
+				++uiResumed;
+			uiQueueWaitTotal += h->uiQueueWait;
+			uiQueueWaitMax = qMax(uiQueueWaitMax, h->uiQueueWait);
+			uiHandshakeTotal += h->uiHandshake;
+			uiHandshakeMax = qMax(uiHandshakeMax, h->uiHandshake);
+			uiHandoverTotal += handover;
+			uiHandoverMax = qMax(uiHandoverMax, handover);
+
+			if (s) {
+				s->adoptConnection(h->qssSocket, h->bVerified);
+			} else {
+				h->qssSocket->abort();
+				delete h->qssSocket;
+			}
+		} else {
+			++uiFailed;
+			if (s) {
+				foreach(const QString &error, h->qslErrors)
+					s->log(QString("SSL Error: %1 (%2)").arg(error, h->qsPeer));
+			}
+		}
+		delete h;
+	}
+}
+
+void SslWorkerPool::report() {
+	if (uiHandshakes == 0 && uiFailed == 0)
+		return;
+
+	int load = 0;
+	foreach(SslWorker *w, qlWorkers)
+		load += QAtomicIntLoad(w->aiLoad);
+
+	const double n = static_cast<double>(qMax(uiHandshakes, Q_UINT64_C(1))) * 1000.0;
+	qWarning("SSL: %llu handshakes, %llu failed, %d in progress. Queue wait avg %.1f ms, max %.1f ms. Handshake avg %.1f ms, max %.1f ms. Handover avg %.1f ms, max %.1f ms.",
+	         uiHandshakes, uiFailed, load,
+	         static_cast<double>(uiQueueWaitTotal) / n, static_cast<double>(uiQueueWaitMax) / 1000.0,
+	         static_cast<double>(uiHandshakeTotal) / n, static_cast<double>(uiHandshakeMax) / 1000.0,
+	         static_cast<double>(uiHandoverTotal) / n, static_cast<double>(uiHandoverMax) / 1000.0);
+
+	SslSessionCache *c = meta->sscSessions;
+	qWarning("SSL: %llu handshakes resumed. Session ID hits %d, misses %d. Ticket hits %d, misses %d.",
+	         uiResumed,
+	         c->aiSessionHits.fetchAndStoreOrdered(0), c->aiSessionMisses.fetchAndStoreOrdered(0),
+	         c->aiTicketHits.fetchAndStoreOrdered(0), c->aiTicketMisses.fetchAndStoreOrdered(0));
+
+	uiHandshakes = uiFailed = uiResumed = 0;
+	uiQueueWaitTotal = uiQueueWaitMax = 0;
+	uiHandshakeTotal = uiHandshakeMax = 0;
+	uiHandoverTotal = uiHandoverMax = 0;
+}
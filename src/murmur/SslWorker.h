@@ -0,0 +1,136 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_SSLWORKER_H_
+#define MUMBLE_MURMUR_SSLWORKER_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QStringList>
+#include <QtNetwork/QSslError>
+
+#include <openssl/ssl.h>
+
+#include "Timer.h"
+
+class QSslSocket;
+class QThread;
+class QTimer;
+class Server;
+class SslWorkerPool;
+
+/// Seconds between the handshake statistics logged by SslWorkerPool.
+#define SSL_POOL_REPORT_INTERVAL 60
+
+/// A TLS handshake done by an SslWorker on behalf of a Server.
+struct SslHandshake {
+	/// The client's socket, or NULL once the handshake has failed.
+	QSslSocket *qssSocket;
+	/// The OpenSSL object of the socket, if SslSessionCache caught it.
+	SSL *ssl;
+	Server *s;
+	int iServerNum;
+	/// Seconds the client has to complete the handshake.
+	int iTimeout;
+	/// False if the client's certificate couldn't be verified.
+	bool bVerified;
+	/// Whether a previous session was resumed.
+	bool bResumed;
+	/// Errors that ended the handshake, for the server's log.
+	QStringList qslErrors;
+	QString qsPeer;
+	/// Restarted as the handshake moves from one stage to the next.
+	Timer tStage;
+	/// Time spent waiting for the worker, in microseconds.
+	quint64 uiQueueWait;
+	/// Time from the start to the end of the handshake, in microseconds.
+	quint64 uiHandshake;
+};
+
+/// A thread doing TLS handshakes. Sockets are moved to the thread
+/// for the handshake and back to the main thread once it succeeds.
+class SslWorker : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(SslWorker);
+	protected:
+		SslWorkerPool *swpPool;
+		QThread *qtThread;
+		QTimer *qtTimeout;
+		/// Guards qlQueue.
+		QMutex qmQueue;
+		QList<SslHandshake *> qlQueue;
+		/// Handshakes in progress. Worker thread only.
+		QHash<QSslSocket *, SslHandshake *> qhActive;
+
+		/// Hand h back to the pool. The socket is deleted unless
+		/// the handshake succeeded.
+		void finish(SslHandshake *h, bool ok);
+	public:
+		/// Handshakes queued for or in progress on this worker.
+		QAtomicInt aiLoad;
+
+		SslWorker(SslWorkerPool *pool);
+		~SslWorker();
+
+		/// Queue a handshake. The socket must already belong to
+		/// this worker's thread.
+		void enqueue(SslHandshake *h);
+		QThread *workerThread() const;
+	public slots:
+		void process();
+		void encrypted();
+		void sslErrors(const QList<QSslError> &);
+		void failed();
+		void checkTimeout();
+		void abortAll();
+};
+
+/// Threads doing the TLS handshakes of all virtual servers, so that
+/// a storm of connecting clients doesn't stall the main thread.
+///
+/// Server::newClient() passes accepted sockets to the least loaded
+/// worker. Completed handshakes are queued back to the main thread,
+/// where the Server takes over the connection. Queue wait, handshake
+/// and handover times are logged once per SSL_POOL_REPORT_INTERVAL.
+class SslWorkerPool : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(SslWorkerPool);
+	protected:
+		QList<SslWorker *> qlWorkers;
+		QTimer *qtReport;
+		/// Guards qlDone.
+		QMutex qmDone;
+		QList<SslHandshake *> qlDone;
+
+		/// Statistics since the last report, in microseconds.
+		/// Main thread only.
+		quint64 uiHandshakes, uiFailed, uiResumed;
+		quint64 uiQueueWaitTotal, uiQueueWaitMax;
+		quint64 uiHandshakeTotal, uiHandshakeMax;
+		quint64 uiHandoverTotal, uiHandoverMax;
+	public:
+		SslWorkerPool(int threads, QObject *p = NULL);
+		~SslWorkerPool();
+
+		/// Whether handshakes are done by worker threads. If not,
+		/// servers do them on the main thread.
+		bool isEnabled() const;
+		/// Start the handshake of sock, accepted by s, on a worker.
+		/// Main thread only.
+		void handshake(Server *s, QSslSocket *sock);
+		/// Queue a finished handshake for delivery to its server.
+		/// Called by the workers.
+		void handover(SslHandshake *h);
+	public slots:
+		void deliver();
+		void report();
+};
+
+#endif
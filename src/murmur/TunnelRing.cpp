@@ -0,0 +1,76 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "TunnelRing.h"
+
+#include "Message.h"
+#include "QAtomicIntCompat.h"
+
+TunnelRing::TunnelRing() : aiHead(0), uiTail(0) {
+	for (int i=0;i<TUNNEL_RING_SLOTS;++i) {
+		sSlots[i].aiSequence = i;
+		sSlots[i].iLength = 0;
+		sSlots[i].uiQueued = 0;
+	}
+}
+
+bool TunnelRing::push(const char *data, int len) {
+	if ((len < 0) || (len > TUNNEL_MAX_PACKET))
+		return false;
+
+	// Positions wrap around, so all arithmetic on them is unsigned.
+	unsigned int pos = static_cast<unsigned int>(QAtomicIntLoad(aiHead));
+	Slot *s;
+
+	forever {
+		s = &sSlots[pos % TUNNEL_RING_SLOTS];
+		const int diff = static_cast<int>(static_cast<unsigned int>(QAtomicIntLoadAcquire(s->aiSequence)) - pos);
+
+		if (diff == 0) {
+			if (aiHead.testAndSetOrdered(static_cast<int>(pos), static_cast<int>(pos + 1)))
+				break;
+		} else if (diff < 0) {
+			// The slot still holds a packet from the previous lap.
+			return false;
+		}
+		pos = static_cast<unsigned int>(QAtomicIntLoad(aiHead));
+	}
+
+	unsigned char *uc = reinterpret_cast<unsigned char *>(s->cRecord);
+	qToBigEndian<quint16>(static_cast<quint16>(MessageHandler::UDPTunnel), & uc[0]);
+	qToBigEndian<quint32>(static_cast<quint32>(len), & uc[2]);
+	memcpy(uc + 6, data, len);
+	s->iLength = len + 6;
+	s->uiQueued = tCreated.elapsed();
+
+	s->aiSequence.fetchAndStoreRelease(static_cast<int>(pos + 1));
+	return true;
+}
+
+int TunnelRing::drain(QByteArray &out, quint64 maxage) {
+	const quint64 now = tCreated.elapsed();
+	int dropped = 0;
+
+	forever {
+		Slot *s = &sSlots[uiTail % TUNNEL_RING_SLOTS];
+
+		// Stop at the first slot that is empty or still being
+		// written; its producer schedules another drain.
+		if (static_cast<unsigned int>(QAtomicIntLoadAcquire(s->aiSequence)) != uiTail + 1)
+			break;
+
+		if (s->uiQueued + maxage >= now)
+			out.append(s->cRecord, s->iLength);
+		else
+			++dropped;
+
+		s->aiSequence.fetchAndStoreRelease(static_cast<int>(uiTail + TUNNEL_RING_SLOTS));
+		++uiTail;
+	}
+
+	return dropped;
+}
@@ -0,0 +1,64 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_TUNNELRING_H_
+#define MUMBLE_MURMUR_TUNNELRING_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+
+#include "Timer.h"
+
+/// Number of voice packets a TunnelRing holds. Packets
+/// arriving while it is full are dropped.
+#define TUNNEL_RING_SLOTS 32
+/// Largest voice packet a TunnelRing accepts.
+#define TUNNEL_MAX_PACKET 1024
+/// Queued voice older than this (in microseconds) is dropped
+/// instead of being sent.
+#define TUNNEL_MAX_AGE 500000
+/// Voice is dropped while more than this many bytes are waiting
+/// in the TLS socket's write buffer.
+#define TUNNEL_MAX_BACKLOG 65536
+
+/// Outbound voice packets of a user that receives voice over the TLS
+/// connection instead of UDP.
+///
+/// Voice threads append packets already framed as UDPTunnel messages,
+/// and the main thread drains them into a single write. This is a
+/// bounded multi-producer, single-consumer queue: each slot carries a
+/// sequence number that says whether it is free for position n
+/// (sequence n) or holds the packet for position n (sequence n+1), so
+/// neither side needs a lock.
+class TunnelRing {
+	private:
+		Q_DISABLE_COPY(TunnelRing);
+	protected:
+		struct Slot {
+			QAtomicInt aiSequence;
+			int iLength;
+			quint64 uiQueued;
+			char cRecord[6 + TUNNEL_MAX_PACKET];
+		};
+
+		Timer tCreated;
+		/// Next position to be claimed by a producer.
+		QAtomicInt aiHead;
+		/// Next position to be drained. Consumer only.
+		unsigned int uiTail;
+		Slot sSlots[TUNNEL_RING_SLOTS];
+	public:
+		TunnelRing();
+
+		/// Queue a voice packet. Returns false if it was dropped
+		/// because the ring is full. Thread-safe.
+		bool push(const char *data, int len);
+		/// Append all queued records to out, except those queued more
+		/// than maxage microseconds ago, which are discarded. Returns
+		/// the number of discarded records. Main thread only.
+		int drain(QByteArray &out, quint64 maxage);
+};
+
+#endif
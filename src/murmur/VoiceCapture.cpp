@@ -0,0 +1,569 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "VoiceCapture.h"
+
+#include "Channel.h"
+#include "Message.h"
+#include "Meta.h"
+#include "QAtomicIntCompat.h"
+#include "Server.h"
+#include "ServerDB.h"
+#include "ServerUser.h"
+
+VoiceCapture::VoiceCapture(Server *srv) : QObject(srv), s(srv), qfFile(NULL), aiActive(0), uiLastRecord(0), uiDropped(0) {
+	qtFlush = new QTimer(this);
+	connect(qtFlush, SIGNAL(timeout()), this, SLOT(flush()));
+}
+
+VoiceCapture::~VoiceCapture() {
+	stop();
+}
+
+bool VoiceCapture::isActive() const {
+	return QAtomicIntLoad(aiActive) != 0;
+}
+
+bool VoiceCapture::start(const QString &path) {
+	stop();
+
+	QString file = path;
+	file.replace(QLatin1String("%1"), QString::number(s->iServerNum));
+
+	qfFile = new QFile(file);
+	if (! qfFile->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		s->log(QString("Failed to open voice capture file %1: %2").arg(file, qfFile->errorString()));
+		delete qfFile;
+		qfFile = NULL;
+		return false;
+	}
+
+	char header[32];
+	qToBigEndian<quint32>(VOICE_CAPTURE_MAGIC, reinterpret_cast<uchar *>(header));
+	PacketDataStream pds(header + 4, sizeof(header) - 4);
+	pds << VOICE_CAPTURE_VERSION << static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+	qfFile->write(header, pds.size() + 4);
+
+	{
+		QMutexLocker l(&qmPending);
+		qbaPending.clear();
+		tClock.restart();
+		uiLastRecord = 0;
+		uiDropped = 0;
+	}
+
+	aiActive.fetchAndStoreOrdered(1);
+	topology();
+	qtFlush->start(VOICE_CAPTURE_FLUSH_INTERVAL);
+
+	s->log(QString("Capturing voice traffic to %1").arg(file));
+	return true;
+}
+
+void VoiceCapture::stop() {
+	if (! qfFile)
+		return;
+
+	aiActive.fetchAndStoreOrdered(0);
+	qtFlush->stop();
+	flush();
+
+	s->log(QString("Stopped capturing voice traffic to %1, %2 records dropped").arg(qfFile->fileName(), QString::number(uiDropped)));
+
+	delete qfFile;
+	qfFile = NULL;
+}
+
+void VoiceCapture::flush() {
+	QByteArray data;
+	{
+		QMutexLocker l(&qmPending);
+		data = qbaPending;
+		qbaPending = QByteArray();
+	}
+
+	if (! qfFile || data.isEmpty())
+		return;
+
+	if (qfFile->write(data) != data.size())
+		s->log(QString("Failed to write voice capture file %1: %2").arg(qfFile->fileName(), qfFile->errorString()));
+	qfFile->flush();
+}
+
+void VoiceCapture::append(RecordType type, const char *payload, int len) {
+	char head[16];
+
+	QMutexLocker l(&qmPending);
+
+	if (qbaPending.size() + len + static_cast<int>(sizeof(head)) > VOICE_CAPTURE_MAX_PENDING) {
+		++uiDropped;
+		return;
+	}
+
+	const quint64 now = tClock.elapsed();
+	PacketDataStream pds(head, sizeof(head));
+	pds << static_cast<int>(type) << (now - uiLastRecord);
+	uiLastRecord = now;
+
+	qbaPending.append(head, pds.size());
+	qbaPending.append(payload, len);
+}
+
+/// Write the topology record of s to pds.
+static void writeTopology(Server *s, PacketDataStream &pds) {
+	pds << s->qhChannels.count();
+	foreach(Channel *c, s->qhChannels) {
+		pds << c->iId << (c->cParent ? c->cParent->iId : -1) << c->qhLinks.count();
+		foreach(Channel *l, c->qhLinks.keys())
+			pds << l->iId;
+	}
+
+	// Only whether users share a context matters for routing, so
+	// contexts are numbered instead of recorded.
+	QHash<QByteArray, int> contexts;
+
+	pds << s->qhUsers.count();
+	foreach(ServerUser *u, s->qhUsers) {
+		int flags = 0;
+		if ((u->sState == ServerUser::Authenticated) && ! u->bMute && ! u->bSuppress && ! u->bSelfMute)
+			flags |= VoiceCapture::Speak;
+		if (! u->bDeaf && ! u->bSelfDeaf)
+			flags |= VoiceCapture::Listen;
+		if (u->bPrioritySpeaker)
+			flags |= VoiceCapture::PrioritySpeaker;
+
+		const QByteArray context(u->ssContext.data(), static_cast<int>(u->ssContext.size()));
+		const int ctx = contexts.value(context, contexts.count());
+		contexts.insert(context, ctx);
+
+		pds << u->uiSession << (u->cChannel ? u->cChannel->iId : -1) << flags << ctx;
+	}
+}
+
+void VoiceCapture::topology() {
+	if (! isActive())
+		return;
+
+	QByteArray buffer(1024, 0);
+	forever {
+		PacketDataStream pds(buffer.data(), buffer.size());
+		writeTopology(s, pds);
+		if (pds.isValid()) {
+			append(Topology, buffer.constData(), pds.size());
+			return;
+		}
+		buffer.resize(pds.size() + pds.undersize());
+	}
+}
+
+void VoiceCapture::packet(unsigned int session, const char *data, int len) {
+	if (len < 1)
+		return;
+
+	// Find the end of the audio data like Server::processMsg().
+	PacketDataStream pdi(data + 1, len - 1);
+	unsigned int counter;
+	int audiolen = 0;
+	bool terminator = false;
+
+	pdi >> counter;
+
+	if (((data[0] >> 5) & 0x7) != MessageHandler::UDPVoiceOpus) {
+		do {
+			counter = pdi.next8();
+			pdi.skip(counter & 0x7f);
+			audiolen += counter & 0x7f;
+		} while ((counter & 0x80) && pdi.isValid());
+		terminator = ((counter & 0x7f) == 0);
+	} else {
+		int size;
+		pdi >> size;
+		pdi.skip(size & 0x1fff);
+		audiolen = size & 0x1fff;
+		terminator = ((size & 0x2000) != 0);
+	}
+
+	int flags = 0;
+	if (terminator)
+		flags |= Terminator;
+	if (pdi.isValid() && (pdi.left() > 0))
+		flags |= Positional;
+
+	char payload[32];
+	PacketDataStream pds(payload, sizeof(payload));
+	pds << session << static_cast<unsigned char>(data[0]) << len << audiolen << flags;
+	append(Packet, payload, pds.size());
+}
+
+#ifdef Q_OS_UNIX
+
+/// Largest voice packet murmur accepts (UDP_PACKET_SIZE in Server.cpp).
+#define VOICE_REPLAY_PACKET_SIZE 1024
+
+VoiceReplay::VoiceReplay(Server *srv, const QByteArray &capture, double speed, int sock, const sockaddr_storage &sink) : QObject(), s(srv), dSpeed(speed), iSocket(sock), ssSink(sink), qbaCapture(capture), pdsCapture(qbaCapture.constData(), qbaCapture.size()), bPending(false), iPendingType(0), uiRecordTime(0), uiLatencyTotal(0), uiMaxLag(0), iTopologies(0), iUnknown(0), iInvalid(0) {
+}
+
+VoiceReplay::~VoiceReplay() {
+	foreach(unsigned int session, qhStands.keys())
+		removeStand(session);
+	s->publishVoiceSnapshot();
+}
+
+bool VoiceReplay::readHeader() {
+	if ((qbaCapture.size() < 4) || (qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(qbaCapture.constData())) != VOICE_CAPTURE_MAGIC))
+		return false;
+
+	int version;
+	quint64 started;
+
+	pdsCapture.skip(4);
+	pdsCapture >> version >> started;
+	if (! pdsCapture.isValid() || (version != VOICE_CAPTURE_VERSION))
+		return false;
+
+	qWarning("Replaying voice capture started %s", qPrintable(QDateTime::fromMSecsSinceEpoch(static_cast<qint64>(started)).toString(Qt::ISODate)));
+	return true;
+}
+
+ServerUser *VoiceReplay::addStand(unsigned int session) {
+	if (s->qqIds.isEmpty())
+		return NULL;
+
+	ServerUser *u = new ServerUser(s, new QSslSocket());
+	u->uiSession = s->qqIds.dequeue();
+	u->sState = ServerUser::Authenticated;
+	u->qsName = QString::fromLatin1("Replay%1").arg(session);
+	u->csCrypt.genKey();
+	u->sUdpSocket = iSocket;
+	memcpy(&u->saiUdpAddress, &ssSink, sizeof(ssSink));
+	memcpy(&u->saiTcpLocalAddress, &ssSink, sizeof(ssSink));
+	u->haAddress = HostAddress(ssSink);
+
+	{
+		QWriteLocker wl(&s->qrwlVoiceThread);
+		s->qhUsers.insert(u->uiSession, u);
+	}
+
+	Stand st;
+	st.su = u;
+	st.uiSequence = 0;
+	qhStands.insert(session, st);
+	return u;
+}
+
+void VoiceReplay::removeStand(unsigned int session) {
+	ServerUser *u = qhStands.take(session).su;
+
+	{
+		QWriteLocker wl(&s->qrwlVoiceThread);
+		s->qhUsers.remove(u->uiSession);
+		if (u->cChannel)
+			u->cChannel->removeUser(u);
+	}
+
+	s->qqIds.enqueue(u->uiSession);
+	s->qlVoiceRetiredUsers << u;
+}
+
+void VoiceReplay::applyTopology() {
+	Channel *root = s->qhChannels.value(0);
+
+	int count;
+	pdsCapture >> count;
+
+	QList<QPair<int, int> > missing;
+	QList<QPair<int, int> > links;
+	for (int i=0;(i<count) && pdsCapture.isValid();++i) {
+		int id, parent, nlinks;
+		pdsCapture >> id >> parent >> nlinks;
+		if (! s->qhChannels.contains(id))
+			missing << qMakePair(id, parent);
+		for (int j=0;(j<nlinks) && pdsCapture.isValid();++j) {
+			int link;
+			pdsCapture >> link;
+			links << qMakePair(id, link);
+		}
+	}
+
+	// Channels and links are walked by whispers on the voice threads,
+	// as in Server::addChannel() and Server::addLink().
+	{
+		QWriteLocker wl(&s->qrwlVoiceThread);
+
+		// Create missing channels below their parents where possible,
+		// which may themselves be missing.
+		bool progress = true;
+		while (! missing.isEmpty()) {
+			QList<QPair<int, int> > later;
+			typedef QPair<int, int> ChannelParent;
+			foreach(const ChannelParent &cp, missing) {
+				Channel *p = s->qhChannels.value(cp.second);
+				if (! p && progress) {
+					later << cp;
+					continue;
+				}
+				Channel *c = new Channel(cp.first, QString::fromLatin1("Replay%1").arg(cp.first), p ? p : root);
+				s->qhChannels.insert(c->iId, c);
+			}
+			progress = (later.count() < missing.count());
+			missing = later;
+		}
+
+		typedef QPair<int, int> ChannelLink;
+		foreach(const ChannelLink &cl, links) {
+			Channel *c = s->qhChannels.value(cl.first);
+			Channel *l = s->qhChannels.value(cl.second);
+			if (c && l && ! c->qhLinks.contains(l))
+				c->link(l);
+		}
+	}
+
+	QSet<unsigned int> seen;
+	pdsCapture >> count;
+	for (int i=0;(i<count) && pdsCapture.isValid();++i) {
+		unsigned int session;
+		int channel, flags, context;
+		pdsCapture >> session >> channel >> flags >> context;
+
+		ServerUser *u = qhStands.contains(session) ? qhStands.value(session).su : addStand(session);
+		if (! u)
+			continue;
+		seen.insert(session);
+
+		u->bMute = ! (flags & VoiceCapture::Speak);
+		u->bDeaf = ! (flags & VoiceCapture::Listen);
+		u->bPrioritySpeaker = ((flags & VoiceCapture::PrioritySpeaker) != 0);
+		const QByteArray ctx = QByteArray::number(context);
+		u->ssContext.assign(ctx.constData(), static_cast<size_t>(ctx.size()));
+
+		Channel *c = s->qhChannels.value(channel, root);
+		if (u->cChannel != c) {
+			QWriteLocker wl(&s->qrwlVoiceThread);
+			if (u->cChannel)
+				u->cChannel->removeUser(u);
+			c->addUser(u);
+		}
+	}
+
+	foreach(unsigned int session, qhStands.keys())
+		if (! seen.contains(session))
+			removeStand(session);
+
+	// Like the live paths, but published right away rather than
+	// through updateVoiceSnapshot(), as the next record may be a
+	// packet that has to see the new topology.
+	s->clearACLCache();
+	s->publishVoiceSnapshot();
+	++iTopologies;
+}
+
+void VoiceReplay::applyPacket() {
+	static const char silence[VOICE_REPLAY_PACKET_SIZE] = { 0 };
+
+	unsigned int session, header;
+	int size, audiolen, flags;
+	pdsCapture >> session >> header >> size >> audiolen >> flags;
+	if (! pdsCapture.isValid())
+		return;
+
+	QHash<unsigned int, Stand>::iterator i = qhStands.find(session);
+	if (i == qhStands.end()) {
+		++iUnknown;
+		return;
+	}
+
+	// Rebuild a packet with the captured layout and silent audio.
+	char buffer[VOICE_REPLAY_PACKET_SIZE];
+	buffer[0] = static_cast<char>(header);
+	PacketDataStream pds(buffer + 1, sizeof(buffer) - 1);
+	pds << i->uiSequence++;
+
+	if (((header >> 5) & 0x7) == MessageHandler::UDPVoiceOpus) {
+		pds << (audiolen | ((flags & VoiceCapture::Terminator) ? 0x2000 : 0));
+		pds.append(silence, static_cast<quint32>(qMax(audiolen, 0)));
+	} else {
+		int left = qMax(audiolen, 0);
+		bool more;
+		do {
+			const int n = qMin(left, 0x7f);
+			left -= n;
+			// Transmissions end with an empty frame.
+			more = (left > 0) || ((flags & VoiceCapture::Terminator) && (n > 0));
+			pds.append(static_cast<quint64>(n | (more ? 0x80 : 0)));
+			pds.append(silence, static_cast<quint32>(n));
+		} while (more);
+	}
+
+	if (flags & VoiceCapture::Positional)
+		pds << 0.0f << 0.0f << 0.0f;
+
+	if (! pds.isValid()) {
+		++iInvalid;
+		return;
+	}
+
+	QElapsedTimer t;
+	t.start();
+	s->processMsg(i->su, buffer, static_cast<int>(pds.size()) + 1);
+	const qint64 ns = t.nsecsElapsed();
+
+	qvLatency << static_cast<quint32>(qMin<qint64>(ns, 0xffffffffLL));
+	uiLatencyTotal += static_cast<quint64>(ns);
+}
+
+void VoiceReplay::step() {
+	for (int n=0;n<VOICE_REPLAY_BATCH;++n) {
+		if (! bPending) {
+			if (pdsCapture.left() == 0) {
+				QCoreApplication::exit(0);
+				return;
+			}
+
+			quint64 delta;
+			pdsCapture >> iPendingType >> delta;
+			if (! pdsCapture.isValid()) {
+				qWarning("VoiceReplay: Capture is truncated, stopping");
+				QCoreApplication::exit(0);
+				return;
+			}
+			uiRecordTime += delta;
+			bPending = true;
+		}
+
+		if (dSpeed > 0.0) {
+			const quint64 due = static_cast<quint64>(static_cast<double>(uiRecordTime) / dSpeed);
+			const quint64 now = tReplay.elapsed();
+			if (due > now) {
+				QTimer::singleShot(static_cast<int>((due - now) / 1000), this, SLOT(step()));
+				return;
+			}
+			uiMaxLag = qMax(uiMaxLag, now - due);
+		}
+
+		bPending = false;
+		if (iPendingType == VoiceCapture::Topology) {
+			applyTopology();
+		} else if (iPendingType == VoiceCapture::Packet) {
+			applyPacket();
+		} else {
+			qWarning("VoiceReplay: Unknown record type %d, stopping", iPendingType);
+			QCoreApplication::exit(0);
+			return;
+		}
+
+		if (! pdsCapture.isValid()) {
+			qWarning("VoiceReplay: Capture is truncated, stopping");
+			QCoreApplication::exit(0);
+			return;
+		}
+	}
+
+	QTimer::singleShot(0, this, SLOT(step()));
+}
+
+/// The latency, in microseconds, below which fraction p of the
+/// sorted latencies lie.
+static double percentile(const QVector<quint32> &sorted, double p) {
+	if (sorted.isEmpty())
+		return 0.0;
+	const int idx = qMin(sorted.count() - 1, static_cast<int>(p * sorted.count()));
+	return sorted.at(idx) / 1000.0;
+}
+
+void VoiceReplay::report() {
+	const quint64 wall = tReplay.elapsed();
+	const int packets = qvLatency.count();
+
+	qSort(qvLatency);
+
+	qWarning("Replayed %d packets and %d topology changes in %.3f s", packets, iTopologies, wall / 1000000.0);
+	if (packets == 0)
+		return;
+
+	qWarning("Throughput: %.0f packets/s overall, %.0f packets/s in processMsg()",
+	         packets * 1000000.0 / qMax<quint64>(wall, 1ULL),
+	         packets * 1000000000.0 / qMax<quint64>(uiLatencyTotal, 1ULL));
+	qWarning("processMsg() latency (us): mean %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f",
+	         uiLatencyTotal / 1000.0 / packets,
+	         percentile(qvLatency, 0.5), percentile(qvLatency, 0.9), percentile(qvLatency, 0.99), percentile(qvLatency, 0.999),
+	         qvLatency.last() / 1000.0);
+	if (dSpeed > 0.0)
+		qWarning("Largest delay behind the capture's schedule: %.3f ms", uiMaxLag / 1000.0);
+	if (iUnknown || iInvalid)
+		qWarning("Skipped %d packets from unknown sessions and %d that could not be rebuilt", iUnknown, iInvalid);
+}
+
+int VoiceReplay::replay(QCoreApplication &a, const QString &path, double speed, int srv) {
+	QFile f(path);
+	if (! f.open(QIODevice::ReadOnly)) {
+		qCritical("Failed to open voice capture %s: %s", qPrintable(path), qPrintable(f.errorString()));
+		return 1;
+	}
+	const QByteArray capture = f.readAll();
+	f.close();
+
+	if (! ServerDB::serverExists(srv)) {
+		qCritical("Server %d does not exist", srv);
+		return 1;
+	}
+
+	// The server would start capturing as it boots, possibly
+	// over the very file being replayed.
+	if (! ServerDB::getConf(srv, "voicecapture", Meta::mp.qsVoiceCapture).toString().isEmpty()) {
+		qCritical("Server %d has voicecapture set, which must be disabled for the replay", srv);
+		return 1;
+	}
+
+	Server *s = new Server(srv, meta);
+	if (! s->bValid) {
+		qCritical("Failed to start server %d for the replay", srv);
+		delete s;
+		return 1;
+	}
+	// The bandwidth limit assumes packets arrive in real time.
+	if (speed != 1.0)
+		s->iMaxBandwidth = 0x7fffffff;
+
+	// Voice goes to a local socket that is never read, where it is
+	// dropped once the receive buffer is full.
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sockaddr_storage sink;
+	memset(&sink, 0, sizeof(sink));
+	socklen_t len = sizeof(sink);
+
+	int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+	if ((sock < 0) || (::bind(sock, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) != 0) || (::getsockname(sock, reinterpret_cast<sockaddr *>(&sink), &len) != 0)) {
+		qCritical("Failed to create the replay socket: %s", strerror(errno));
+		if (sock >= 0)
+			::close(sock);
+		delete s;
+		return 1;
+	}
+
+	int res = 1;
+	{
+		VoiceReplay vr(s, capture, speed, sock, sink);
+		if (! vr.readHeader()) {
+			qCritical("%s is not a voice capture", qPrintable(path));
+		} else {
+			vr.tReplay.restart();
+			QTimer::singleShot(0, &vr, SLOT(step()));
+			res = a.exec();
+			vr.report();
+		}
+	}
+
+	delete s;
+	::close(sock);
+	return res;
+}
+
+#endif
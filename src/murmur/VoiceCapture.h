@@ -0,0 +1,157 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_VOICECAPTURE_H_
+#define MUMBLE_MURMUR_VOICECAPTURE_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QVector>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#endif
+
+#include "PacketDataStream.h"
+#include "Timer.h"
+
+class QCoreApplication;
+class QFile;
+class QTimer;
+class Server;
+class ServerUser;
+
+/// First four bytes of a voice capture file ("MVCF").
+#define VOICE_CAPTURE_MAGIC 0x4d564346
+#define VOICE_CAPTURE_VERSION 1
+/// Milliseconds between writes of captured records to the file.
+#define VOICE_CAPTURE_FLUSH_INTERVAL 1000
+/// Records are dropped while this many bytes wait to be written,
+/// so that a slow disk never holds up the voice threads.
+#define VOICE_CAPTURE_MAX_PENDING (16 * 1024 * 1024)
+
+/// Records the voice traffic of a Server for VoiceReplay.
+///
+/// A capture file holds a header followed by records. Each record
+/// starts with its type and the microseconds since the previous record.
+/// Topology records hold the channel tree with its links, and each
+/// user's channel, mute and deaf state and positional audio context.
+/// One is written whenever the voice routing state changes. Packet
+/// records describe one voice packet received from a client: session,
+/// codec and target, size, audio length and flags. Audio and positions
+/// are not recorded.
+///
+/// The voice threads append records to a buffer in memory, which the
+/// main thread writes to the file once per VOICE_CAPTURE_FLUSH_INTERVAL.
+class VoiceCapture : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(VoiceCapture);
+	public:
+		enum RecordType { Topology = 0, Packet = 1 };
+		enum PacketFlag { Positional = 0x1, Terminator = 0x2 };
+		enum UserFlag { Speak = 0x1, Listen = 0x2, PrioritySpeaker = 0x4 };
+	protected:
+		Server *s;
+		QFile *qfFile;
+		QTimer *qtFlush;
+		/// Nonzero while capturing. Read by the voice threads
+		/// without holding qmPending.
+		QAtomicInt aiActive;
+		/// Guards the members below.
+		QMutex qmPending;
+		QByteArray qbaPending;
+		Timer tClock;
+		quint64 uiLastRecord;
+		quint64 uiDropped;
+
+		/// Append a record of type with len bytes of payload.
+		void append(RecordType type, const char *payload, int len);
+	public:
+		VoiceCapture(Server *srv);
+		~VoiceCapture();
+
+		bool isActive() const;
+		/// Start capturing to path, replacing the file. "%1" in
+		/// path is replaced by the server ID. Main thread only.
+		bool start(const QString &path);
+		/// Stop capturing and close the file. Main thread only.
+		void stop();
+		/// Record the channel tree and the users. Main thread only.
+		void topology();
+		/// Record the len bytes of decrypted voice packet data
+		/// received from session. Thread-safe.
+		void packet(unsigned int session, const char *data, int len);
+	public slots:
+		void flush();
+};
+
+#ifdef Q_OS_UNIX
+/// Records VoiceReplay applies between returns to the event loop.
+#define VOICE_REPLAY_BATCH 256
+
+/// Replays a voice capture through Server::processMsg() of a Server
+/// populated with users standing in for the captured ones, and reports
+/// throughput and per-packet routing latency. Started with murmurd's
+/// -replay option.
+///
+/// The replay runs on the main thread. Voice is sent, encrypted, to a
+/// local socket nobody reads.
+class VoiceReplay : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(VoiceReplay);
+	protected:
+		struct Stand {
+			ServerUser *su;
+			unsigned int uiSequence;
+		};
+
+		Server *s;
+		/// Replay speed relative to the capture, or 0 to replay
+		/// as fast as possible.
+		double dSpeed;
+		int iSocket;
+		sockaddr_storage ssSink;
+		QByteArray qbaCapture;
+		PacketDataStream pdsCapture;
+		/// Whether the record at pdsCapture has been started but not
+		/// applied, because it isn't due yet.
+		bool bPending;
+		int iPendingType;
+		quint64 uiRecordTime;
+		Timer tReplay;
+		/// Stand-in users by captured session.
+		QHash<unsigned int, Stand> qhStands;
+		/// Time spent in processMsg() for each packet, in nanoseconds.
+		QVector<quint32> qvLatency;
+		quint64 uiLatencyTotal;
+		quint64 uiMaxLag;
+		int iTopologies;
+		int iUnknown;
+		int iInvalid;
+
+		bool readHeader();
+		void applyTopology();
+		void applyPacket();
+		ServerUser *addStand(unsigned int session);
+		void removeStand(unsigned int session);
+		void report();
+	public:
+		VoiceReplay(Server *srv, const QByteArray &capture, double speed, int sock, const sockaddr_storage &sink);
+		~VoiceReplay();
+
+		/// Replay the capture in path on server srv, at speed.
+		/// Returns the exit code for murmurd.
+		static int replay(QCoreApplication &a, const QString &path, double speed, int srv);
+	public slots:
+		void step();
+};
+#endif
+
+#endif
@@ -0,0 +1,160 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include "VoiceSnapshot.h"
+
+#include "QAtomicIntCompat.h"
+#include "ServerUser.h"
+
+VoiceSnapshot::VoiceSnapshot() : fAudibleRadius(0.0f) {
+}
+
+VoiceSnapshot::~VoiceSnapshot() {
+	foreach(const Member &m, qvMembers)
+		delete QAtomicPointerLoadAcquire(m.qapFanOut);
+}
+
+VoiceSnapshot *VoiceSnapshot::clone() const {
+	VoiceSnapshot *vs = new VoiceSnapshot();
+	vs->qvMembers = qvMembers;
+	for (int i=0;i<vs->qvMembers.count();++i)
+		vs->qvMembers[i].qapFanOut = NULL;
+	vs->qvChannels = qvChannels;
+	vs->qvSelections = qvSelections;
+	vs->qvChannelIds = qvChannelIds;
+	vs->qhChannelIds = qhChannelIds;
+	vs->qvRelayPeers = qvRelayPeers;
+	vs->qhSessions = qhSessions;
+	vs->qhPeers = qhPeers;
+	vs->qhRelayUsers = qhRelayUsers;
+	vs->fAudibleRadius = fAudibleRadius;
+	return vs;
+}
+
+const VoiceSnapshot::Member *VoiceSnapshot::member(unsigned int session) const {
+	QHash<unsigned int, int>::const_iterator i = qhSessions.constFind(session);
+	if (i == qhSessions.constEnd())
+		return NULL;
+	return &qvMembers.at(i.value());
+}
+
+const VoiceSnapshot::Member *VoiceSnapshot::peer(const QPair<HostAddress, quint16> &key) const {
+	QHash<QPair<HostAddress, quint16>, int>::const_iterator i = qhPeers.constFind(key);
+	if (i == qhPeers.constEnd())
+		return NULL;
+	return &qvMembers.at(i.value());
+}
+
+const VoiceSnapshot::Member *VoiceSnapshot::relayed(const QPair<quint32, unsigned int> &key) const {
+	QHash<QPair<quint32, unsigned int>, int>::const_iterator i = qhRelayUsers.constFind(key);
+	if (i == qhRelayUsers.constEnd())
+		return NULL;
+	return &qvMembers.at(i.value());
+}
+
+const VoiceSnapshot::FanOut *VoiceSnapshot::fanOut(const Member &m) const {
+	FanOut *fo = QAtomicPointerLoadAcquire(m.qapFanOut);
+	if (fo)
+		return fo;
+
+	QVector<ServerUser *> same, other;
+	QVector<bool> sameAggregate, otherAggregate;
+
+	if (m.iChannel >= 0) {
+		QVector<int> channels = m.qvLinks;
+		channels.prepend(m.iChannel);
+
+		foreach(int c, channels) {
+			foreach(int idx, qvChannels.at(c)) {
+				const Member &dst = qvMembers.at(idx);
+				if (&dst == &m)
+					continue;
+				if (dst.iContext == m.iContext) {
+					same.append(dst.su);
+					sameAggregate.append(dst.bUdpAggregate);
+				} else {
+					other.append(dst.su);
+					otherAggregate.append(dst.bUdpAggregate);
+				}
+			}
+		}
+	}
+
+	fo = new FanOut();
+	fo->iSameContext = same.count();
+	fo->qvTargets.reserve(same.count() + other.count());
+	fo->qvTargets << same << other;
+	fo->qvAggregate.reserve(same.count() + other.count());
+	fo->qvAggregate << sameAggregate << otherAggregate;
+	fo->aiAudible = new QAtomicInt[same.count()];
+	for (int i=0;i<same.count();++i)
+		fo->aiAudible[i] = 1;
+
+	// Another voice thread may have built the same list meanwhile.
+	if (! m.qapFanOut.testAndSetOrdered(NULL, fo)) {
+		delete fo;
+		fo = QAtomicPointerLoadAcquire(m.qapFanOut);
+	}
+	return fo;
+}
+
+VoiceSnapshotDomain::VoiceSnapshotDomain() : qapCurrent(new VoiceSnapshot()), aiEpoch(1) {
+	for (int i=0;i<VOICE_MAX_READERS;++i)
+		rReaders[i].aiEpoch = 0;
+}
+
+VoiceSnapshotDomain::~VoiceSnapshotDomain() {
+	// Retired users are children of the Server, which deletes them.
+	foreach(const Retired &r, qlRetired)
+		delete r.vs;
+	delete qapCurrent.fetchAndStoreOrdered(NULL);
+}
+
+void VoiceSnapshotDomain::enter(int reader) {
+	// The ordered store makes the epoch visible before this thread
+	// loads the current snapshot.
+	rReaders[reader].aiEpoch.fetchAndStoreOrdered(QAtomicIntLoad(aiEpoch));
+}
+
+void VoiceSnapshotDomain::leave(int reader) {
+	rReaders[reader].aiEpoch.fetchAndStoreRelease(0);
+}
+
+const VoiceSnapshot *VoiceSnapshotDomain::current() const {
+	return QAtomicPointerLoadAcquire(qapCurrent);
+}
+
+void VoiceSnapshotDomain::publish(VoiceSnapshot *vs, const QList<ServerUser *> &retired) {
+	Retired r;
+	r.vs = qapCurrent.fetchAndStoreOrdered(vs);
+	r.iEpoch = aiEpoch.fetchAndAddOrdered(1) + 1;
+	r.qlUsers = retired;
+	qlRetired << r;
+
+	reclaim();
+}
+
+void VoiceSnapshotDomain::reclaim() {
+	if (qlRetired.isEmpty())
+		return;
+
+	// A reader that entered in epoch e may be using any snapshot
+	// retired after e; everything retired up to e is unreachable.
+	int oldest = qlRetired.last().iEpoch;
+	for (int i=0;i<VOICE_MAX_READERS;++i) {
+		int e = QAtomicIntLoad(rReaders[i].aiEpoch);
+		if ((e != 0) && (e < oldest))
+			oldest = e;
+	}
+
+	while (! qlRetired.isEmpty() && (qlRetired.first().iEpoch <= oldest)) {
+		Retired r = qlRetired.takeFirst();
+		delete r.vs;
+		foreach(ServerUser *u, r.qlUsers)
+			u->deleteLater();
+	}
+}
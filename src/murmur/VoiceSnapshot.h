@@ -0,0 +1,196 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#ifndef MUMBLE_MURMUR_VOICESNAPSHOT_H_
+#define MUMBLE_MURMUR_VOICESNAPSHOT_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicPointer>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QVector>
+
+#include "HostAddress.h"
+
+class ServerUser;
+class SpeakerSelection;
+
+/// Maximum number of voice threads that can read snapshots
+/// of a single Server at the same time.
+#define VOICE_MAX_READERS 64
+
+/// An immutable copy of the parts of a Server's state that are needed
+/// to route a voice packet: who is connected, which UDP address they
+/// use, which channel they are in, whether they may speak or hear, and
+/// which linked channels they may speak into.
+///
+/// Snapshots are built by the main thread whenever that state changes
+/// (see Server::publishVoiceSnapshot()), or patched for a single
+/// user's mute, deaf, priority speaker, aggregation, channel move or
+/// removal (see Server::patchVoiceSnapshot()), and are read by the
+/// voice threads without holding qrwlVoiceThread. A published snapshot
+/// is never modified.
+class VoiceSnapshot {
+	private:
+		Q_DISABLE_COPY(VoiceSnapshot);
+	public:
+		/// Recipients of normal speech from one member: the listeners in
+		/// its channel and in the linked channels it may speak into, as
+		/// one flat array. Recipients sharing the speaker's positional
+		/// context come first.
+		struct FanOut {
+			private:
+				Q_DISABLE_COPY(FanOut);
+			public:
+				QVector<ServerUser *> qvTargets;
+				/// Whether each of qvTargets accepts
+				/// UDPVoiceAggregate datagrams.
+				QVector<bool> qvAggregate;
+				/// Number of leading entries of qvTargets that
+				/// should receive positional data.
+				int iSameContext;
+				/// Whether each of those was within the audible
+				/// radius for the speaker's last packet. Used by
+				/// positional culling for hysteresis.
+				QAtomicInt *aiAudible;
+
+				FanOut() : iSameContext(0), aiAudible(NULL) {}
+				~FanOut() {
+					delete [] aiAudible;
+				}
+		};
+
+		struct Member {
+			ServerUser *su;
+			unsigned int uiSession;
+			/// Index of the member's channel in qvChannels, or -1.
+			int iChannel;
+			/// Authenticated, and neither muted, suppressed nor self-muted.
+			bool bSpeak;
+			/// Neither deafened nor self-deafened.
+			bool bListen;
+			/// Priority speaker, for limited channels.
+			bool bPrioritySpeaker;
+			/// The client accepts UDPVoiceAggregate datagrams.
+			bool bUdpAggregate;
+			/// A remote user of the relay link, whose speech came from
+			/// another node.
+			bool bRelayed;
+			/// Positional audio context. Members with the same
+			/// context have the same number.
+			int iContext;
+			/// Linked channels (indices into qvChannels) the member
+			/// has permission to speak into, not including iChannel.
+			QVector<int> qvLinks;
+			/// Built by fanOut() when the member first speaks.
+			mutable QAtomicPointer<FanOut> qapFanOut;
+		};
+
+		QVector<Member> qvMembers;
+		/// Listening members of each channel, as indices into qvMembers.
+		QVector<QVector<int> > qvChannels;
+		/// Speaker selection of each channel in qvChannels, or NULL
+		/// if the channel has no speaker limit. Owned by the Server.
+		QVector<SpeakerSelection *> qvSelections;
+		/// ID of each channel in qvChannels, and the reverse mapping.
+		QVector<int> qvChannelIds;
+		QHash<int, int> qhChannelIds;
+		/// Relay peers with listeners in each channel of qvChannels,
+		/// as indices into the Server's Relay peer list.
+		QVector<QVector<int> > qvRelayPeers;
+		QHash<unsigned int, int> qhSessions;
+		QHash<QPair<HostAddress, quint16>, int> qhPeers;
+		/// Remote users by node and their session ID on that node.
+		QHash<QPair<quint32, unsigned int>, int> qhRelayUsers;
+		/// Server::fAudibleRadius, for the voice threads.
+		float fAudibleRadius;
+
+		VoiceSnapshot();
+		~VoiceSnapshot();
+
+		/// A copy of this snapshot to patch and publish in its place.
+		/// The copy builds its own fan-out lists. Main thread only.
+		VoiceSnapshot *clone() const;
+
+		const Member *member(unsigned int session) const;
+		const Member *peer(const QPair<HostAddress, quint16> &key) const;
+		const Member *relayed(const QPair<quint32, unsigned int> &key) const;
+		/// The recipients of normal speech from m. Built on first use,
+		/// which makes the snapshot the version counter: any change to
+		/// membership, links, ACLs or deaf state publishes a new
+		/// snapshot, and with it new fan-out lists. Thread-safe.
+		const FanOut *fanOut(const Member &m) const;
+};
+
+/// Publishes VoiceSnapshots to the voice threads of a Server, and frees
+/// old ones once no voice thread can still be using them.
+///
+/// This is epoch based reclamation: a voice thread announces the epoch
+/// it saw when it starts reading (enter()) and withdraws it when it is
+/// done (leave()). A snapshot replaced in epoch E can be freed as soon
+/// as every reader is either outside or has entered in epoch E or later.
+///
+/// Users removed from the Server are retired along with the snapshot,
+/// since the voice threads may still hold pointers to them.
+class VoiceSnapshotDomain {
+	private:
+		Q_DISABLE_COPY(VoiceSnapshotDomain);
+	protected:
+		struct Reader {
+			QAtomicInt aiEpoch;
+			// Keep readers on separate cache lines.
+			char cPad[64 - sizeof(QAtomicInt)];
+		};
+
+		struct Retired {
+			int iEpoch;
+			VoiceSnapshot *vs;
+			QList<ServerUser *> qlUsers;
+		};
+
+		QAtomicPointer<VoiceSnapshot> qapCurrent;
+		QAtomicInt aiEpoch;
+		Reader rReaders[VOICE_MAX_READERS];
+		QList<Retired> qlRetired;
+	public:
+		VoiceSnapshotDomain();
+		~VoiceSnapshotDomain();
+
+		/// Start a read-side section for voice thread reader.
+		void enter(int reader);
+		/// End the read-side section of voice thread reader.
+		void leave(int reader);
+		/// The current snapshot. Voice threads may only call this
+		/// between enter() and leave(), and may not use the result
+		/// after leave().
+		const VoiceSnapshot *current() const;
+
+		/// Make vs the current snapshot. The previous snapshot and the
+		/// users in retired are freed once no reader can see them.
+		/// Main thread only.
+		void publish(VoiceSnapshot *vs, const QList<ServerUser *> &retired);
+		/// Free retired snapshots and users no reader can see anymore.
+		/// Main thread only.
+		void reclaim();
+};
+
+/// Holds a read-side section of a VoiceSnapshotDomain for its lifetime.
+class VoiceSnapshotReader {
+	private:
+		Q_DISABLE_COPY(VoiceSnapshotReader);
+	protected:
+		VoiceSnapshotDomain &vsd;
+		int iReader;
+	public:
+		VoiceSnapshotReader(VoiceSnapshotDomain &domain, int reader) : vsd(domain), iReader(reader) {
+			vsd.enter(iReader);
+		}
+		~VoiceSnapshotReader() {
+			vsd.leave(iReader);
+		}
+};
+
+#endif
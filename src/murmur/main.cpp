@@ -22,6 +22,7 @@
 
 #ifdef Q_OS_UNIX
 #include "UnixMurmur.h"
+#include "VoiceCapture.h"
 #endif
 
 QFile *qfLog = NULL;
@@ -230,6 +231,8 @@ int main(int argc, char **argv) {
 	int sunum = 1;
 #ifdef Q_OS_UNIX
 	bool readPw = false;
+	QString replayFile;
+	double replaySpeed = 1.0;
 #endif
 
 	qsrand(QDateTime::currentDateTime().toTime_t());
@@ -333,6 +336,11 @@ int main(int argc, char **argv) {
 			       "  -limits                Tests and shows how many file descriptors and threads can be created.\n"
 			       "                         The purpose of this option is to test how many clients Murmur can handle.\n"
 			       "                         Murmur will exit after this test.\n"
+			       "  -replay <file> [speed [srv]]\n"
+			       "                         Replays a voice capture (see voicecapture in the ini file) on\n"
+			       "                         server srv, speed times as fast as it was captured, or as fast\n"
+			       "                         as possible if speed is 0. Reports throughput and latency,\n"
+			       "                         then exits. Use a copy of the database and a free port.\n"
 #endif
 			       "  -v                     Add verbose output.\n"
 #ifdef Q_OS_UNIX
@@ -357,6 +365,18 @@ int main(int argc, char **argv) {
 			unixhandler.setuid();
 			unixhandler.finalcap();
 			LimitTest::testLimits(a);
+		} else if ((arg == "-replay") && (i+1 < args.size())) {
+			detach = false;
+			i++;
+			replayFile = args.at(i);
+			if ((i+1 < args.size()) && ! args.at(i+1).startsWith(QLatin1Char('-'))) {
+				i++;
+				replaySpeed = args.at(i).toDouble();
+				if ((i+1 < args.size()) && ! args.at(i+1).startsWith(QLatin1Char('-'))) {
+					i++;
+					sunum = args.at(i).toInt();
+				}
+			}
 #endif
 		} else {
 			detach = false;
@@ -474,6 +494,15 @@ int main(int argc, char **argv) {
 		ServerDB::wipeLogs();
 	}
 
+#ifdef Q_OS_UNIX
+	if (! replayFile.isEmpty()) {
+		unixhandler.finalcap();
+		res = VoiceReplay::replay(a, replayFile, replaySpeed, sunum);
+		delete meta;
+		return res;
+	}
+#endif
+
 #ifdef Q_OS_UNIX
 	if (detach) {
 		if (fork() != 0) {
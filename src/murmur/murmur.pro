@@ -16,8 +16,8 @@ TARGET = murmur
 DBFILE = murmur.db
 LANGUAGE = C++
 FORMS =
-HEADERS *= Server.h ServerUser.h Meta.h PBKDF2.h
-SOURCES *= main.cpp Server.cpp ServerUser.cpp ServerDB.cpp Register.cpp Cert.cpp Messages.cpp Meta.cpp RPC.cpp PBKDF2.cpp
+HEADERS *= Server.h ServerUser.h Meta.h PBKDF2.h VoiceSnapshot.h TunnelRing.h SpeakerSelection.h Relay.h RelayCodec.h VoiceCapture.h SslWorker.h SslSessions.h PasswordHasher.h ACLCache.h ChannelIndex.h BanIndex.h
+SOURCES *= main.cpp Server.cpp ServerUser.cpp ServerDB.cpp Register.cpp Cert.cpp Messages.cpp Meta.cpp RPC.cpp PBKDF2.cpp VoiceSnapshot.cpp TunnelRing.cpp SpeakerSelection.cpp Relay.cpp RelayCodec.cpp VoiceCapture.cpp SslWorker.cpp SslSessions.cpp PasswordHasher.cpp ACLCache.cpp ChannelIndex.cpp BanIndex.cpp
 
 PRECOMPILED_HEADER = murmur_pch.h
 
@@ -0,0 +1,126 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+/**
+ * Benchmark of UDP voice packet aggregation; one datagram per voice
+ * packet and listener versus one UDPVoiceAggregate per listener for
+ * all voice packets the server handles in one batch.
+ *
+ * Speakers send a 20ms Opus packet each, at random offsets. The server
+ * is modelled as handling everything that arrived within a window of
+ * a few milliseconds as one batch, like a voice thread reading a batch
+ * of datagrams with recvmmsg(). The aggregates are built with the
+ * VoiceAggregate the server uses.
+ */
+
+#include <QtCore>
+
+#include "PacketDataStream.h"
+#include "Timer.h"
+#include "VoiceAggregate.h"
+
+#define UDP_PACKET_SIZE 1024
+// IPv4 + UDP + OCB crypt header.
+#define OVERHEAD (20 + 8 + 4)
+#define SECONDS 60
+#define FRAME_MS 20
+
+struct Result {
+	quint64 uiPackets;
+	quint64 uiBytes;
+};
+
+// A voice packet as forwarded by the server: header, session,
+// sequence number, Opus length and payload.
+static QByteArray voicePacket(unsigned int session, unsigned int seq, int payload) {
+	char buffer[UDP_PACKET_SIZE];
+	PacketDataStream pds(buffer + 1, UDP_PACKET_SIZE - 1);
+	const QByteArray data(payload, 0x55);
+
+	buffer[0] = static_cast<char>(4 << 5);
+	pds << session;
+	pds << seq;
+	pds << payload;
+	pds.append(data.constData(), data.size());
+
+	return QByteArray(buffer, pds.size() + 1);
+}
+
+// Datagrams for one listener, given the voice packets of a batch, as
+// Server::aggregateBatch() and Server::flushAggregates() send them.
+static void aggregate(const QList<QByteArray> &packets, Result &r) {
+	VoiceAggregate va;
+	va.clear();
+
+	foreach(const QByteArray &qba, packets) {
+		if (! va.add(qba.constData(), qba.size())) {
+			++r.uiPackets;
+			r.uiBytes += OVERHEAD + va.datagramLength();
+			va.clear();
+			va.add(qba.constData(), qba.size());
+		}
+	}
+
+	if (va.iFrames) {
+		++r.uiPackets;
+		r.uiBytes += OVERHEAD + va.datagramLength();
+	}
+}
+
+static void run(int speakers, int listeners, int window, int payload) {
+	QVector<int> offsets;
+	for (int i=0;i<speakers;++i)
+		offsets << (qrand() % (FRAME_MS * 1000));
+
+	Result plain = { 0, 0 };
+	Result aggr = { 0, 0 };
+	Timer t;
+
+	// Step through time one window (batch) at a time.
+	for (int usec=0;usec<SECONDS * 1000000;usec+=window * 1000) {
+		QList<QByteArray> packets;
+
+		for (int s=0;s<speakers;++s) {
+			// Time from the start of the window to the speaker's next packet.
+			const int due = ((offsets[s] - usec) % (FRAME_MS * 1000) + FRAME_MS * 1000) % (FRAME_MS * 1000);
+			if (due < window * 1000)
+				packets << voicePacket(s + 1, usec / (FRAME_MS * 1000), payload);
+		}
+
+		if (packets.isEmpty())
+			continue;
+
+		for (int l=0;l<listeners;++l) {
+			foreach(const QByteArray &qba, packets) {
+				++plain.uiPackets;
+				plain.uiBytes += OVERHEAD + qba.size();
+			}
+			aggregate(packets, aggr);
+		}
+	}
+
+	quint64 elapsed = t.elapsed();
+
+	qWarning("%2d speakers, %3d listeners, %2dms batches: %7llu -> %7llu packets/s (-%4.1f%%), %6.1f -> %6.1f kB/s (-%4.1f%%) [%llums]",
+	         speakers, listeners, window,
+	         plain.uiPackets / SECONDS, aggr.uiPackets / SECONDS,
+	         100.0 - 100.0 * static_cast<double>(aggr.uiPackets) / static_cast<double>(plain.uiPackets),
+	         static_cast<double>(plain.uiBytes) / SECONDS / 1000.0, static_cast<double>(aggr.uiBytes) / SECONDS / 1000.0,
+	         100.0 - 100.0 * static_cast<double>(aggr.uiBytes) / static_cast<double>(plain.uiBytes),
+	         elapsed / 1000ULL);
+}
+
+int main(int, char **) {
+	const int speakers[] = { 1, 5, 10 };
+	const int windows[] = { 1, 5, 10, 20 };
+
+	qsrand(1);
+
+	for (unsigned int i=0;i<sizeof(speakers)/sizeof(speakers[0]);++i)
+		for (unsigned int j=0;j<sizeof(windows)/sizeof(windows[0]);++j)
+			run(speakers[i], 50, windows[j], 60);
+
+	return 0;
+}
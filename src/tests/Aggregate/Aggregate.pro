@@ -0,0 +1,13 @@
+# Copyright 2005-2018 The Mumble Developers. All rights reserved.
+# Use of this source code is governed by a BSD-style license
+# that can be found in the LICENSE file at the root of the
+# Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+include(../test.pri)
+
+# A benchmark; built with the tests, but not run by 'make check'.
+CONFIG -= testcase
+
+TARGET = Aggregate
+HEADERS *= Timer.h PacketDataStream.h VoiceAggregate.h Message.h
+SOURCES *= Aggregate.cpp Timer.cpp
@@ -1,395 +1,1087 @@
 /**
- * Provided a target address spawns a specified number of senders/speakers,
- * UDP-listeners and TCP-listeners.
+ * Load generator for murmur.
+ *
+ * Connects a number of simulated clients, spread over a few threads that
+ * each run an event loop, and has them talk in Opus-sized bursts, whisper,
+ * hop between channels and reconnect in storms. Every voice packet carries
+ * the time it was sent, so the listening clients measure forwarding
+ * latency, loss and reordering. Results are printed at the end of the run,
+ * and optionally written as JSON.
+ *
+ * Loss is counted per talk burst the way RTP does: a listener expects every
+ * frame between the first and the last one it got. Frames lost at the very
+ * start or end of a burst, or while the listener was in another channel,
+ * don't count.
+ *
+ * Run "Benchmark --help" for the options.
  */
 
 #include <QtCore>
 #include <QtNetwork>
 
-#ifndef Q_OS_WIN
-#include <unistd.h>
-#endif
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#ifndef Q_OS_WIN
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netinet/ip.h>
-#include <sys/utsname.h>
-#endif
-#include <errno.h>
+#include <math.h>
 
 #include "PacketDataStream.h"
+#include "QAtomicIntCompat.h"
 #include "Timer.h"
 #include "Message.h"
 #include "CryptState.h"
 #include "Mumble.pb.h"
 
-class Client : public QThread {
+/// Buckets per power of two in a Histogram.
+#define HISTOGRAM_SUB 16
+/// Histogram values are clamped below 2^HISTOGRAM_BITS.
+#define HISTOGRAM_BITS 40
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB + (HISTOGRAM_BITS - 4) * HISTOGRAM_SUB)
+
+/// A talk burst is forgotten by its listeners after this
+/// many microseconds without a frame, and added to the loss count.
+#define STREAM_TIMEOUT 2000000ULL
+
+struct Options {
+	QString qsHost;
+	quint16 usPort;
+	QString qsPassword;
+	int iClients;
+	int iThreads;
+	int iRate;
+	double dTalk;
+	double dBurst;
+	int iBitrate;
+	int iFrame;
+	double dWhisper;
+	int iWhisperTargets;
+	double dHop;
+	double dTcpOnly;
+	int iStormInterval;
+	double dStormFraction;
+	bool bAggregate;
+	int iWarmup;
+	int iDuration;
+	QString qsJson;
+
+	Options();
+	bool parse(const QStringList &args);
+};
+
+Options::Options() {
+	usPort = 64738;
+	iClients = 100;
+	iThreads = qMax(1, QThread::idealThreadCount());
+	iRate = 200;
+	dTalk = 0.1;
+	dBurst = 1.5;
+	iBitrate = 40000;
+	iFrame = 20;
+	dWhisper = 0.0;
+	iWhisperTargets = 3;
+	dHop = 0.0;
+	dTcpOnly = 0.0;
+	iStormInterval = 0;
+	dStormFraction = 0.1;
+	bAggregate = false;
+	iWarmup = 5;
+	iDuration = 60;
+}
+
+static void usage() {
+	qWarning("Usage: Benchmark <host> <port> [options]\n"
+	         "  --clients N          simulated clients (100)\n"
+	         "  --threads N          event loop threads (one per core)\n"
+	         "  --rate N             connections per second while spawning (200)\n"
+	         "  --password S         server password\n"
+	         "  --talk R             fraction of time each client talks (0.1)\n"
+	         "  --burst S            mean length of a talk burst in seconds (1.5)\n"
+	         "  --bitrate N          Opus bitrate in bits per second (40000)\n"
+	         "  --frame N            milliseconds of audio per packet (20)\n"
+	         "  --whisper R          fraction of talk bursts that whisper (0)\n"
+	         "  --whisper-targets N  users whispered to (3)\n"
+	         "  --hop N              channel changes per client per minute (0)\n"
+	         "  --tcponly R          fraction of clients without UDP (0)\n"
+	         "  --storm-interval S   seconds between reconnect storms, 0 for none (0)\n"
+	         "  --storm-fraction R   fraction of clients reconnecting in a storm (0.1)\n"
+	         "  --aggregate          accept aggregated UDP voice packets\n"
+	         "  --warmup S           seconds between the last join and measuring (5)\n"
+	         "  --duration S         seconds to measure (60)\n"
+	         "  --json FILE          write the results to FILE");
+}
+
+bool Options::parse(const QStringList &args) {
+	if ((args.count() < 3) || args.contains(QLatin1String("--help")))
+		return false;
+
+	qsHost = args.at(1);
+	usPort = static_cast<quint16>(args.at(2).toUInt());
+
+	for (int i = 3; i < args.count(); ++i) {
+		const QString &arg = args.at(i);
+		if (arg == QLatin1String("--aggregate")) {
+			bAggregate = true;
+			continue;
+		}
+		if (i + 1 >= args.count()) {
+			qWarning("Missing value for %s", qPrintable(arg));
+			return false;
+		}
+
+		const QString value = args.at(++i);
+		bool ok = true;
+		if (arg == QLatin1String("--clients"))
+			iClients = value.toInt(&ok);
+		else if (arg == QLatin1String("--threads"))
+			iThreads = value.toInt(&ok);
+		else if (arg == QLatin1String("--rate"))
+			iRate = value.toInt(&ok);
+		else if (arg == QLatin1String("--password"))
+			qsPassword = value;
+		else if (arg == QLatin1String("--talk"))
+			dTalk = value.toDouble(&ok);
+		else if (arg == QLatin1String("--burst"))
+			dBurst = value.toDouble(&ok);
+		else if (arg == QLatin1String("--bitrate"))
+			iBitrate = value.toInt(&ok);
+		else if (arg == QLatin1String("--frame"))
+			iFrame = value.toInt(&ok);
+		else if (arg == QLatin1String("--whisper"))
+			dWhisper = value.toDouble(&ok);
+		else if (arg == QLatin1String("--whisper-targets"))
+			iWhisperTargets = value.toInt(&ok);
+		else if (arg == QLatin1String("--hop"))
+			dHop = value.toDouble(&ok);
+		else if (arg == QLatin1String("--tcponly"))
+			dTcpOnly = value.toDouble(&ok);
+		else if (arg == QLatin1String("--storm-interval"))
+			iStormInterval = value.toInt(&ok);
+		else if (arg == QLatin1String("--storm-fraction"))
+			dStormFraction = value.toDouble(&ok);
+		else if (arg == QLatin1String("--warmup"))
+			iWarmup = value.toInt(&ok);
+		else if (arg == QLatin1String("--duration"))
+			iDuration = value.toInt(&ok);
+		else if (arg == QLatin1String("--json"))
+			qsJson = value;
+		else
+			ok = false;
+
+		if (! ok) {
+			qWarning("Invalid option %s %s", qPrintable(arg), qPrintable(value));
+			return false;
+		}
+	}
+
+	return (usPort != 0) && (iClients > 0) && (iThreads > 0) && (iRate > 0) && (iFrame >= 10) && (iBitrate > 0) && (dBurst > 0.0);
+}
+
+/// Log-linear histogram of microsecond values, HISTOGRAM_SUB buckets per
+/// power of two, so percentiles are accurate to about 6%.
+class Histogram {
+	public:
+		QVector<quint64> qvBuckets;
+		quint64 uiCount;
+		quint64 uiSum;
+		quint64 uiMax;
+
+		Histogram() : qvBuckets(HISTOGRAM_BUCKETS, 0), uiCount(0), uiSum(0), uiMax(0) {}
+
+		static int bucket(quint64 v) {
+			if (v < HISTOGRAM_SUB)
+				return static_cast<int>(v);
+			v = qMin(v, static_cast<quint64>((1ULL << HISTOGRAM_BITS) - 1));
+			int e = 4;
+			while ((v >> (e + 1)) != 0)
+				++e;
+			return HISTOGRAM_SUB + (e - 4) * HISTOGRAM_SUB + static_cast<int>((v >> (e - 4)) & (HISTOGRAM_SUB - 1));
+		}
+
+		static quint64 value(int b) {
+			if (b < HISTOGRAM_SUB)
+				return b;
+			const int e = (b - HISTOGRAM_SUB) / HISTOGRAM_SUB + 4;
+			return static_cast<quint64>(HISTOGRAM_SUB + (b % HISTOGRAM_SUB)) << (e - 4);
+		}
+
+		void add(quint64 v) {
+			++qvBuckets[bucket(v)];
+			++uiCount;
+			uiSum += v;
+			uiMax = qMax(uiMax, v);
+		}
+
+		void merge(const Histogram &other) {
+			for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+				qvBuckets[i] += other.qvBuckets.at(i);
+			uiCount += other.uiCount;
+			uiSum += other.uiSum;
+			uiMax = qMax(uiMax, other.uiMax);
+		}
+
+		/// The value below which the fraction p of the samples are.
+		quint64 percentile(double p) const {
+			if (uiCount == 0)
+				return 0;
+			const quint64 rank = static_cast<quint64>(ceil(p * static_cast<double>(uiCount)));
+			quint64 seen = 0;
+			for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+				seen += qvBuckets.at(i);
+				if (seen >= qMax(rank, static_cast<quint64>(1)))
+					return qMin(value(i), uiMax);
+			}
+			return uiMax;
+		}
+
+		double mean() const {
+			return uiCount ? static_cast<double>(uiSum) / static_cast<double>(uiCount) : 0.0;
+		}
+};
+
+struct Stats {
+	quint64 uiSent;
+	quint64 uiSentBytes;
+	quint64 uiReceived;
+	quint64 uiReceivedBytes;
+	/// Frames expected and received in finished talk bursts.
+	quint64 uiExpected;
+	quint64 uiDelivered;
+	quint64 uiReordered;
+	quint64 uiJoins;
+	quint64 uiRejects;
+	quint64 uiDisconnects;
+	/// Server to listener forwarding latency.
+	Histogram hLatency;
+	/// Connect to ServerSync.
+	Histogram hJoin;
+	/// How late the worker's ticks ran. If this grows to the frame
+	/// length, the generator rather than the server is the bottleneck.
+	Histogram hTickLag;
+
+	Stats() {
+		clear();
+	}
+
+	void clear() {
+		uiSent = uiSentBytes = uiReceived = uiReceivedBytes = 0;
+		uiExpected = uiDelivered = uiReordered = 0;
+		uiJoins = uiRejects = uiDisconnects = 0;
+		hLatency = Histogram();
+		hJoin = Histogram();
+		hTickLag = Histogram();
+	}
+
+	void merge(const Stats &other) {
+		uiSent += other.uiSent;
+		uiSentBytes += other.uiSentBytes;
+		uiReceived += other.uiReceived;
+		uiReceivedBytes += other.uiReceivedBytes;
+		uiExpected += other.uiExpected;
+		uiDelivered += other.uiDelivered;
+		uiReordered += other.uiReordered;
+		uiJoins += other.uiJoins;
+		uiRejects += other.uiRejects;
+		uiDisconnects += other.uiDisconnects;
+		hLatency.merge(other.hLatency);
+		hJoin.merge(other.hJoin);
+		hTickLag.merge(other.hTickLag);
+	}
+};
+
+/// Sessions and channels seen by the clients, shared between the
+/// worker threads to pick whisper targets and channels to hop to.
+class Registry {
+	protected:
+		QMutex qm;
+		QVector<unsigned int> qvSessions;
+		QVector<int> qvChannels;
+	public:
+		QAtomicInt aiJoined;
+
+		void addSession(unsigned int session) {
+			QMutexLocker l(&qm);
+			qvSessions.append(session);
+			aiJoined.fetchAndAddRelaxed(1);
+		}
+
+		void removeSession(unsigned int session) {
+			QMutexLocker l(&qm);
+			const int i = qvSessions.indexOf(session);
+			if (i >= 0) {
+				qvSessions[i] = qvSessions.last();
+				qvSessions.pop_back();
+				aiJoined.fetchAndAddRelaxed(-1);
+			}
+		}
+
+		QList<unsigned int> sessions(int n, unsigned int self, quint32 random) {
+			QMutexLocker l(&qm);
+			QList<unsigned int> ql;
+			for (int i = 0; (i < qvSessions.count()) && (ql.count() < n); ++i) {
+				const unsigned int s = qvSessions.at((random + static_cast<quint32>(i) * 7919U) % static_cast<quint32>(qvSessions.count()));
+				if ((s != self) && ! ql.contains(s))
+					ql << s;
+			}
+			return ql;
+		}
+
+		void addChannel(int id) {
+			QMutexLocker l(&qm);
+			if (! qvChannels.contains(id))
+				qvChannels.append(id);
+		}
+
+		void removeChannel(int id) {
+			QMutexLocker l(&qm);
+			const int i = qvChannels.indexOf(id);
+			if (i >= 0)
+				qvChannels.remove(i);
+		}
+
+		int channel(quint32 random) {
+			QMutexLocker l(&qm);
+			return qvChannels.isEmpty() ? 0 : qvChannels.at(random % static_cast<quint32>(qvChannels.count()));
+		}
+};
+
+static Registry registry;
+
+/// Start of the Opus payload of every voice packet sent.
+struct Stamp {
+	quint32 uiClient;
+	quint32 uiBurst;
+	quint32 uiFrame;
+	quint64 uiSent;
+};
+
+class Worker;
+
+class Client : public QObject {
 		Q_OBJECT
 	public:
-		bool udp;
-		bool sender;
-		struct sockaddr_in srv;
+		struct Stream {
+			quint32 uiMin;
+			quint32 uiMax;
+			quint32 uiCount;
+			quint64 uiLast;
+		};
+
+		Worker *w;
+		quint32 uiId;
+		bool bTcpOnly;
+		QHostAddress qhaServer;
+		QSslSocket *qssSocket;
+		QUdpSocket *qusSocket;
+		CryptState csCrypt;
+		QByteArray qbaToken;
+		bool bUdp;
+		bool bJoined;
+		bool bReconnecting;
 		unsigned int uiSession;
-		CryptState crypt;
-		int rcvd;
-		int socket;
-		int seq;
-		void run();
-		void ping();
-		void sendVoice();
-		int numbytes;
-		int ptype;
-		QSslSocket *ssl;
-		Client(QObject *parent, QHostAddress srvaddr, unsigned short prt, bool send, bool tcponly);
-		void doUdp(const unsigned char *buffer, int size);
+		quint64 uiConnected;
+		int iNeed;
+		unsigned int uiType;
+
+		bool bTalking;
+		bool bWhisper;
+		unsigned int uiSeq;
+		quint32 uiBurst;
+		quint32 uiFrame;
+		quint64 uiNextChange;
+		quint64 uiNextFrame;
+		quint64 uiNextHop;
+		quint64 uiNextPing;
+
+		/// Talk bursts being received, by sender and burst.
+		QHash<QPair<quint32, quint32>, Stream> qhStreams;
+
+		Client(Worker *worker, quint32 id, bool tcponly);
+		void tick(quint64 now);
+		/// Add received talk bursts older than STREAM_TIMEOUT, or all
+		/// if all is set, to the loss count.
+		void flushStreams(quint64 now, bool all);
 		void sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType);
-		~Client();
+		void sendVoiceData(const char *data, int len);
+		void sendVoice(quint64 now, bool last);
+		void sendPing();
+		void startBurst(quint64 now);
+		void handleMessage(unsigned int type, const QByteArray &qba);
+		void handleVoice(const char *data, int len, quint64 now);
+		void reconnect();
 	public slots:
+		void connectToServer();
+		void encrypted();
+		void sslErrors(const QList<QSslError> &);
 		void readyRead();
+		void udpReadyRead();
 		void disconnected();
 };
 
-Client::Client(QObject *p, QHostAddress qha, unsigned short prt, bool send, bool tcponly) : QThread(p) {
-	srv.sin_family = AF_INET;
-	srv.sin_addr.s_addr = htonl(qha.toIPv4Address());
-	srv.sin_port = htons(prt);
-
-	udp = ! tcponly;
-	sender = send;
-
-	ssl = new QSslSocket(this);
+class Worker : public QObject {
+		Q_OBJECT
+	public:
+		const Options &o;
+		QList<Client *> qlClients;
+		QTimer *qtTick;
+		quint64 uiNextTick;
+		quint64 uiNextFlush;
+		quint32 uiRandom;
+		Stats sStats;
+
+		Worker(const Options &opts, quint32 seed);
+
+		quint32 random() {
+			// xorshift32
+			uiRandom ^= uiRandom << 13;
+			uiRandom ^= uiRandom >> 17;
+			uiRandom ^= uiRandom << 5;
+			return uiRandom;
+		}
+		double uniform() {
+			return static_cast<double>(random()) / 4294967296.0;
+		}
+		/// Exponentially distributed delay in microseconds.
+		quint64 exponential(double mean) {
+			return static_cast<quint64>(-log(1.0 - uniform()) * mean * 1000000.0);
+		}
+	public slots:
+		void start();
+		void spawn(int id, bool tcponly);
+		void storm();
+		void resetStats();
+		void collect();
+		void stop();
+		void tick();
+};
 
-	connect(ssl, SIGNAL(readyRead()), this, SLOT(readyRead()));
-	connect(ssl, SIGNAL(disconnected()), this, SLOT(disconnected()));
+Client::Client(Worker *worker, quint32 id, bool tcponly) : QObject(worker), w(worker), uiId(id), bTcpOnly(tcponly) {
+	qssSocket = new QSslSocket(this);
+	qusSocket = NULL;
+	qhaServer = QHostAddress(w->o.qsHost);
 
-	ssl->setProtocol(QSsl::TlsV1);
-	ssl->connectToHostEncrypted(qha.toString(), prt);
-	ssl->ignoreSslErrors();
-	if (! ssl->waitForEncrypted())
-		qFatal("Connection failure");
+	connect(qssSocket, SIGNAL(encrypted()), this, SLOT(encrypted()));
+	connect(qssSocket, SIGNAL(sslErrors(const QList<QSslError> &)), this, SLOT(sslErrors(const QList<QSslError> &)));
+	connect(qssSocket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+	connect(qssSocket, SIGNAL(disconnected()), this, SLOT(disconnected()));
 
-	static int ctr = 1;
+	if (! bTcpOnly) {
+		qusSocket = new QUdpSocket(this);
+		qusSocket->bind();
+		connect(qusSocket, SIGNAL(readyRead()), this, SLOT(udpReadyRead()));
+	}
 
-#ifdef Q_OS_WIN
-	DWORD pid = GetCurrentProcessId();
-	wchar_t buf[64];
-	DWORD bufsize = 64;
-	GetComputerName(buf, &bufsize);
+	bJoined = false;
+	bReconnecting = false;
+	uiBurst = 0;
+	uiSeq = 0;
+	connectToServer();
+}
 
-	QString name = QString("%1.%2").arg(QString::fromWCharArray(buf)).arg(pid * 1000 + ctr);
-#else
-	struct utsname uts;
-	uname(&uts);
+void Client::connectToServer() {
+	bUdp = false;
+	bJoined = false;
+	bTalking = false;
+	uiSession = 0;
+	iNeed = -1;
+	qbaToken.clear();
+	uiConnected = Timer::now();
+
+	qssSocket->setPeerVerifyMode(QSslSocket::VerifyNone);
+	qssSocket->connectToHostEncrypted(w->o.qsHost, w->o.usPort);
+}
 
-	QString name = QString("%1.%2").arg(uts.nodename).arg(getpid() * 1000 + ctr);
-#endif
+void Client::reconnect() {
+	bReconnecting = true;
+	qssSocket->abort();
+	bReconnecting = false;
+	connectToServer();
+}
 
-	ctr++;
+void Client::sslErrors(const QList<QSslError> &) {
+	qssSocket->ignoreSslErrors();
+}
 
+void Client::encrypted() {
 	MumbleProto::Version mpv;
-	mpv.set_release(u8(QLatin1String("1.2.1 Benchmark")));
-	mpv.set_version(0x010203);
-
+	mpv.set_release(u8(QLatin1String("Benchmark")));
+	mpv.set_version(0x010300);
+	if (w->o.bAggregate)
+		mpv.set_udp_aggregate(true);
 	sendMessage(mpv, MessageHandler::Version);
 
 	MumbleProto::Authenticate mpa;
-	mpa.set_username(u8(name));
-
+	mpa.set_username(u8(QString::fromLatin1("bench%1.%2").arg(QCoreApplication::applicationPid()).arg(uiId)));
+	if (! w->o.qsPassword.isEmpty())
+		mpa.set_password(u8(w->o.qsPassword));
+	mpa.set_opus(true);
+	mpa.set_udp_token(true);
 	sendMessage(mpa, MessageHandler::Authenticate);
-
-	if (udp)
-		socket = ::socket(PF_INET, SOCK_DGRAM, 0);
-
-	seq = 0;
-	rcvd = 0;
-	numbytes = -1;
 }
 
-Client::~Client() {
-	terminate();
-	wait();
+void Client::disconnected() {
+	if (bJoined)
+		registry.removeSession(uiSession);
+	bJoined = false;
+	flushStreams(0, true);
+
+	if (! bReconnecting) {
+		++w->sStats.uiDisconnects;
+		QTimer::singleShot(1000, this, SLOT(connectToServer()));
+	}
 }
 
 void Client::sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType) {
-	unsigned char uc[4096];
-	int len = msg.ByteSize();
+	char buffer[4096];
+	const int len = msg.ByteSize();
 	Q_ASSERT(len < 4090);
 
-	* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(msgType));
-	* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
-
-	msg.SerializeToArray(uc + 6, len);
+	qToBigEndian<quint16>(static_cast<quint16>(msgType), reinterpret_cast<uchar *>(buffer));
+	qToBigEndian<quint32>(static_cast<quint32>(len), reinterpret_cast<uchar *>(buffer + 2));
+	msg.SerializeToArray(buffer + 6, len);
 
-	ssl->write(reinterpret_cast<const char *>(uc), len + 6);
+	qssSocket->write(buffer, len + 6);
 }
 
-void Client::ping() {
-	unsigned char buffer[256];
-	buffer[0] = MessageHandler::UDPPing << 5;
-	PacketDataStream pds(buffer + 1, 255);
-	pds << 123;
-
-	doUdp(buffer, pds.size() + 1);
+void Client::sendVoiceData(const char *data, int len) {
+	if (bUdp) {
+		unsigned char crypted[2048];
+		csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), crypted, len);
+		qusSocket->writeDatagram(reinterpret_cast<const char *>(crypted), len + 4, qhaServer, w->o.usPort);
+	} else {
+		char buffer[2048];
+		qToBigEndian<quint16>(static_cast<quint16>(MessageHandler::UDPTunnel), reinterpret_cast<uchar *>(buffer));
+		qToBigEndian<quint32>(static_cast<quint32>(len), reinterpret_cast<uchar *>(buffer + 2));
+		memcpy(buffer + 6, data, len);
+		qssSocket->write(buffer, len + 6);
+	}
+}
 
+void Client::sendPing() {
 	MumbleProto::Ping mpp;
-	mpp.set_timestamp(123);
+	mpp.set_timestamp(Timer::now());
 	sendMessage(mpp, MessageHandler::Ping);
-}
-
-void Client::sendVoice() {
-	unsigned char buffer[1024];
-	int len = 32 + (qrand() & 0x3f);
 
-	// Regular voice, nothing special
-	buffer[0] = 0;
+	if (! qusSocket || ! csCrypt.isValid())
+		return;
 
-	PacketDataStream ods(buffer + 1, 1024);
-	ods << 1;
-	ods.append(len);
-	ods.skip(len);
+	if (qbaToken.size() == UDP_TOKEN_SIZE) {
+		char buffer[UDP_ASSOCIATE_SIZE];
+		memset(buffer, 0, 4);
+		qToBigEndian<quint32>(UDP_ASSOCIATE_MAGIC, reinterpret_cast<uchar *>(buffer + 4));
+		memcpy(buffer + 8, qbaToken.constData(), UDP_TOKEN_SIZE);
+		qusSocket->writeDatagram(buffer, UDP_ASSOCIATE_SIZE, qhaServer, w->o.usPort);
+	}
 
-	doUdp(buffer, ods.size() + 1);
+	unsigned char buffer[64];
+	unsigned char crypted[64];
+	buffer[0] = MessageHandler::UDPPing << 5;
+	PacketDataStream pds(buffer + 1, 63);
+	pds << Timer::now();
+	csCrypt.encrypt(buffer, crypted, pds.size() + 1);
+	qusSocket->writeDatagram(reinterpret_cast<const char *>(crypted), pds.size() + 5, qhaServer, w->o.usPort);
 }
 
-void Client::doUdp(const unsigned char *buffer, int size) {
-	if (! udp || ! crypt.isValid())
-		return;
-
-	unsigned char crypted[2048];
+void Client::startBurst(quint64 now) {
+	bTalking = true;
+	bWhisper = false;
+	++uiBurst;
+	uiFrame = 0;
+	uiNextFrame = now;
+	uiNextChange = now + w->exponential(w->o.dBurst);
+
+	if ((w->o.dWhisper > 0.0) && (w->uniform() < w->o.dWhisper)) {
+		const QList<unsigned int> targets = registry.sessions(w->o.iWhisperTargets, uiSession, w->random());
+		if (! targets.isEmpty()) {
+			MumbleProto::VoiceTarget mpvt;
+			mpvt.set_id(1);
+			MumbleProto::VoiceTarget_Target *t = mpvt.add_targets();
+			foreach(unsigned int s, targets)
+				t->add_session(s);
+			sendMessage(mpvt, MessageHandler::VoiceTarget);
+			bWhisper = true;
+		}
+	}
+}
 
-	crypt.encrypt(reinterpret_cast<const unsigned char *>(buffer), crypted, size);
-	::sendto(socket, reinterpret_cast<const char *>(crypted), size+4, 0, reinterpret_cast<struct sockaddr *>(&srv), sizeof(srv));
+void Client::sendVoice(quint64 now, bool last) {
+	char buffer[1024];
+	char payload[512];
+	const int nominal = w->o.iBitrate * w->o.iFrame / 8000;
+	const int size = qBound(static_cast<int>(sizeof(Stamp)), nominal * (90 + static_cast<int>(w->random() % 21)) / 100, 512);
+
+	Stamp st;
+	st.uiClient = uiId;
+	st.uiBurst = uiBurst;
+	st.uiFrame = uiFrame++;
+	st.uiSent = now;
+	memset(payload, 0, size);
+	memcpy(payload, &st, sizeof(st));
+
+	buffer[0] = static_cast<char>((MessageHandler::UDPVoiceOpus << 5) | (bWhisper ? 1 : 0));
+	PacketDataStream pds(buffer + 1, 1023);
+	pds << uiSeq;
+	pds << static_cast<unsigned int>(size | (last ? 0x2000 : 0));
+	pds.append(payload, size);
+	uiSeq += static_cast<unsigned int>(w->o.iFrame / 10);
+
+	sendVoiceData(buffer, pds.size() + 1);
+	++w->sStats.uiSent;
+	w->sStats.uiSentBytes += pds.size() + 1;
 }
 
+void Client::tick(quint64 now) {
+	if (! bJoined)
+		return;
 
-void Client::run() {
-	unsigned char buffer[1024];
-	struct sockaddr_in addr;
-	socklen_t sz;
-	int len;
+	if (now >= uiNextPing) {
+		sendPing();
+		// Retry quickly until the server answers on UDP.
+		uiNextPing = now + ((bUdp || ! qusSocket) ? 5000000ULL : 1000000ULL);
+	}
 
-	if (! udp)
-		return;
+	if (bTalking) {
+		const quint64 frame = static_cast<quint64>(w->o.iFrame) * 1000ULL;
+		// Don't catch up on a backlog of frames after a stall.
+		if (now > uiNextFrame + 4 * frame)
+			uiNextFrame = now;
+		while (bTalking && (now >= uiNextFrame)) {
+			const bool last = (now >= uiNextChange);
+			sendVoice(now, last);
+			uiNextFrame += frame;
+			if (last) {
+				bTalking = false;
+				uiNextChange = now + w->exponential(w->o.dBurst * (1.0 - w->o.dTalk) / w->o.dTalk);
+			}
+		}
+	} else if ((w->o.dTalk > 0.0) && (now >= uiNextChange)) {
+		startBurst(now);
+	}
 
-	forever {
-		sz = sizeof(addr);
-		len = ::recvfrom(socket, reinterpret_cast<char *>(buffer), 1024, 0, reinterpret_cast<struct sockaddr *>(&addr), &sz);
-		if (len <= 0)
-			break;
-		if (len >= 32)
-			rcvd++;
+	if ((w->o.dHop > 0.0) && (now >= uiNextHop) && ! bTalking) {
+		MumbleProto::UserState mpus;
+		mpus.set_session(uiSession);
+		mpus.set_channel_id(registry.channel(w->random()));
+		sendMessage(mpus, MessageHandler::UserState);
+		uiNextHop = now + w->exponential(60.0 / w->o.dHop);
 	}
 }
 
 void Client::readyRead() {
 	forever {
-		int avail = ssl->bytesAvailable();
-		if (numbytes == -1) {
-			if (avail < 6)
-				break;
-			unsigned char b[6];
-			ssl->read(reinterpret_cast<char *>(b), 6);
+		if (iNeed < 0) {
+			if (qssSocket->bytesAvailable() < 6)
+				return;
+			uchar header[6];
+			qssSocket->read(reinterpret_cast<char *>(header), 6);
+			uiType = qFromBigEndian<quint16>(header);
+			iNeed = static_cast<int>(qFromBigEndian<quint32>(header + 2));
+		}
+		if (qssSocket->bytesAvailable() < iNeed)
+			return;
 
-			ptype = qFromBigEndian(* reinterpret_cast<quint16 *>(& b[0]));
-			numbytes = qFromBigEndian(* reinterpret_cast<quint32 *>(& b[2]));
+		const QByteArray qba = qssSocket->read(iNeed);
+		iNeed = -1;
+		handleMessage(uiType, qba);
+	}
+}
 
-			avail = ssl->bytesAvailable();
-		}
-		if ((numbytes >= 0) && (avail >= numbytes)) {
-			int want = numbytes;
-			numbytes = -1;
-			unsigned char buff[65536];
-			Q_ASSERT(want < 65536);
-			ssl->read(reinterpret_cast<char *>(buff), want);
-
-
-			avail = ssl->bytesAvailable();
-
-			switch (ptype) {
-				case MessageHandler::CryptSetup: {
-						MumbleProto::CryptSetup msg;
-						if (! msg.ParseFromArray(buff, want))
-							qFatal("Failed parse crypt");
-
-						if (msg.has_key() && msg.has_client_nonce() && msg.has_server_nonce()) {
-							const std::string &key = msg.key();
-							const std::string &client_nonce = msg.client_nonce();
-							const std::string &server_nonce = msg.server_nonce();
-							if (key.size() == AES_BLOCK_SIZE && client_nonce.size() == AES_BLOCK_SIZE && server_nonce.size() == AES_BLOCK_SIZE)
-								crypt.setKey(reinterpret_cast<const unsigned char *>(key.data()), reinterpret_cast<const unsigned char *>(client_nonce.data()), reinterpret_cast<const unsigned char *>(server_nonce.data()));
-						} else if (msg.has_server_nonce()) {
-							const std::string &server_nonce = msg.server_nonce();
-							if (server_nonce.size() == AES_BLOCK_SIZE) {
-								crypt.uiResync++;
-								memcpy(crypt.decrypt_iv, server_nonce.data(), AES_BLOCK_SIZE);
-							}
-						} else {
-							MumbleProto::CryptSetup mpcs;
-							mpcs.set_client_nonce(std::string(reinterpret_cast<const char *>(crypt.encrypt_iv), AES_BLOCK_SIZE));
-							sendMessage(mpcs, MessageHandler::CryptSetup);
-						}
-						break;
-					}
-				case MessageHandler::ServerSync: {
-						MumbleProto::ServerSync msg;
-						if (! msg.ParseFromArray(buff, want))
-							qFatal("Failed parse sync");
-						uiSession = msg.session();
-						break;
-					}
-				case MessageHandler::UDPTunnel: {
-						unsigned int msgUDPType = (buff[0] >> 5) & 0x7;
-						if (msgUDPType == MessageHandler::UDPVoiceCELTAlpha)
-							rcvd++;
-						break;
+void Client::handleMessage(unsigned int type, const QByteArray &qba) {
+	switch (type) {
+		case MessageHandler::CryptSetup: {
+				MumbleProto::CryptSetup msg;
+				if (! msg.ParseFromArray(qba.constData(), qba.size()))
+					return;
+				if (msg.has_key() && msg.has_client_nonce() && msg.has_server_nonce()) {
+					const std::string &key = msg.key();
+					const std::string &client_nonce = msg.client_nonce();
+					const std::string &server_nonce = msg.server_nonce();
+					if ((key.size() == AES_BLOCK_SIZE) && (client_nonce.size() == AES_BLOCK_SIZE) && (server_nonce.size() == AES_BLOCK_SIZE))
+						csCrypt.setKey(reinterpret_cast<const unsigned char *>(key.data()), reinterpret_cast<const unsigned char *>(client_nonce.data()), reinterpret_cast<const unsigned char *>(server_nonce.data()));
+					if (msg.has_udp_token() && (msg.udp_token().size() == UDP_TOKEN_SIZE))
+						qbaToken = QByteArray(msg.udp_token().data(), UDP_TOKEN_SIZE);
+				} else if (msg.has_server_nonce()) {
+					const std::string &server_nonce = msg.server_nonce();
+					if (server_nonce.size() == AES_BLOCK_SIZE) {
+						csCrypt.uiResync++;
+						memcpy(csCrypt.decrypt_iv, server_nonce.data(), AES_BLOCK_SIZE);
 					}
+				} else {
+					MumbleProto::CryptSetup mpcs;
+					mpcs.set_client_nonce(std::string(reinterpret_cast<const char *>(csCrypt.encrypt_iv), AES_BLOCK_SIZE));
+					sendMessage(mpcs, MessageHandler::CryptSetup);
+				}
+				break;
 			}
-		} else {
+		case MessageHandler::ChannelState: {
+				MumbleProto::ChannelState msg;
+				if (msg.ParseFromArray(qba.constData(), qba.size()) && msg.has_channel_id())
+					registry.addChannel(static_cast<int>(msg.channel_id()));
+				break;
+			}
+		case MessageHandler::ChannelRemove: {
+				MumbleProto::ChannelRemove msg;
+				if (msg.ParseFromArray(qba.constData(), qba.size()))
+					registry.removeChannel(static_cast<int>(msg.channel_id()));
+				break;
+			}
+		case MessageHandler::ServerSync: {
+				MumbleProto::ServerSync msg;
+				if (! msg.ParseFromArray(qba.constData(), qba.size()))
+					return;
+				const quint64 now = Timer::now();
+				uiSession = msg.session();
+				bJoined = true;
+				registry.addSession(uiSession);
+				++w->sStats.uiJoins;
+				w->sStats.hJoin.add(now - uiConnected);
+
+				uiNextPing = now;
+				uiNextChange = now + (((w->o.dTalk > 0.0) && (w->o.dTalk < 1.0)) ? w->exponential(w->o.dBurst * (1.0 - w->o.dTalk) / w->o.dTalk) : 0);
+				uiNextHop = (w->o.dHop > 0.0) ? now + w->exponential(60.0 / w->o.dHop) : 0;
+				break;
+			}
+		case MessageHandler::Reject: {
+				MumbleProto::Reject msg;
+				msg.ParseFromArray(qba.constData(), qba.size());
+				++w->sStats.uiRejects;
+				qWarning("Client %u rejected: %s", uiId, msg.reason().c_str());
+				break;
+			}
+		case MessageHandler::UDPTunnel:
+			handleVoice(qba.constData(), qba.size(), Timer::now());
 			break;
+	}
+}
+
+void Client::udpReadyRead() {
+	char crypted[2048];
+	unsigned char plain[2048];
+
+	while (qusSocket->hasPendingDatagrams()) {
+		const qint64 len = qusSocket->readDatagram(crypted, sizeof(crypted));
+		const quint64 now = Timer::now();
+		if ((len < 5) || ! csCrypt.isValid())
+			continue;
+		if (! csCrypt.decrypt(reinterpret_cast<const unsigned char *>(crypted), plain, static_cast<unsigned int>(len)))
+			continue;
+
+		if (((plain[0] >> 5) & 0x7) == MessageHandler::UDPPing)
+			bUdp = true;
+		else
+			handleVoice(reinterpret_cast<const char *>(plain), static_cast<int>(len - 4), now);
+	}
+}
+
+void Client::handleVoice(const char *data, int len, quint64 now) {
+	if (len < 1)
+		return;
+
+	const unsigned int type = (static_cast<unsigned char>(data[0]) >> 5) & 0x7;
+	if (type == MessageHandler::UDPVoiceAggregate) {
+		PacketDataStream pds(data + 1, len - 1);
+		while (pds.left() > 0) {
+			unsigned int plen;
+			pds >> plen;
+			if (! pds.isValid() || (plen < 1) || (plen > pds.left()))
+				return;
+			const char *packet = pds.charPtr();
+			pds.skip(plen);
+			handleVoice(packet, static_cast<int>(plen), now);
 		}
+		return;
 	}
+	if (type != MessageHandler::UDPVoiceOpus)
+		return;
+
+	PacketDataStream pds(data + 1, len - 1);
+	unsigned int session, seq, size;
+	pds >> session >> seq >> size;
+	size &= 0x1fff;
+	if (! pds.isValid() || (size < sizeof(Stamp)) || (pds.left() < size))
+		return;
+
+	Stamp st;
+	memcpy(&st, pds.charPtr(), sizeof(st));
+
+	Stats &s = w->sStats;
+	++s.uiReceived;
+	s.uiReceivedBytes += len;
+	s.hLatency.add((now > st.uiSent) ? now - st.uiSent : 0);
+
+	const QPair<quint32, quint32> key(st.uiClient, st.uiBurst);
+	QHash<QPair<quint32, quint32>, Stream>::iterator i = qhStreams.find(key);
+	if (i == qhStreams.end()) {
+		Stream str;
+		str.uiMin = str.uiMax = st.uiFrame;
+		str.uiCount = 1;
+		str.uiLast = now;
+		qhStreams.insert(key, str);
+		return;
+	}
+
+	Stream &str = i.value();
+	if (st.uiFrame < str.uiMax)
+		++s.uiReordered;
+	str.uiMin = qMin(str.uiMin, st.uiFrame);
+	str.uiMax = qMax(str.uiMax, st.uiFrame);
+	++str.uiCount;
+	str.uiLast = now;
 }
 
-void Client::disconnected() {
-	qWarning("SSL Socket disconnected");
-	QCoreApplication::instance()->quit();
+void Client::flushStreams(quint64 now, bool all) {
+	Stats &s = w->sStats;
+	QHash<QPair<quint32, quint32>, Stream>::iterator i = qhStreams.begin();
+	while (i != qhStreams.end()) {
+		const Stream &str = i.value();
+		if (all || (now - str.uiLast > STREAM_TIMEOUT)) {
+			const quint64 expected = str.uiMax - str.uiMin + 1;
+			s.uiExpected += expected;
+			// Duplicates don't make up for lost frames.
+			s.uiDelivered += qMin(static_cast<quint64>(str.uiCount), expected);
+			i = qhStreams.erase(i);
+		} else {
+			++i;
+		}
+	}
 }
 
-class Container : public QObject {
-		Q_OBJECT
-	public:
-		int sent;
-		int numsender, numudplistener, numtcplistener;
-		int isender, iudplistener, itcplistener;
-		bool live, forceping;
-		QHostAddress qha;
-		unsigned short port;
-		QTimer qtTick;
-		Timer tickPing, tickVoice, tickGo, tickSpawn;
-		QList<Client *> speakers;
-		QList<Client *> clients;
-		Container(QHostAddress srvaddr, unsigned short port, int nsend, int nudp, int ntcp);
-	public slots:
-		void tick();
-		void go();
-};
+Worker::Worker(const Options &opts, quint32 seed) : o(opts), qtTick(NULL), uiNextTick(0), uiNextFlush(0), uiRandom(seed | 1) {
+}
 
-Container::Container(QHostAddress qha, unsigned short port, int numsend, int numudp, int numtcp) {
-	isender = iudplistener = itcplistener = 0;
-	live = false;
-	forceping = false;
-	sent = 0;
+void Worker::start() {
+	qtTick = new QTimer(this);
+	connect(qtTick, SIGNAL(timeout()), this, SLOT(tick()));
+	qtTick->start(qMax(1, o.iFrame / 4));
+	uiNextTick = Timer::now();
+}
 
-	Timer t;
+void Worker::spawn(int id, bool tcponly) {
+	qlClients << new Client(this, static_cast<quint32>(id), tcponly);
+}
 
-	qWarning("Spawning %d speakers and %d listeners (%d UDP, %d TCP)", numsend, numudp+numtcp, numudp, numtcp);
+void Worker::storm() {
+	foreach(Client *c, qlClients)
+		if (uniform() < o.dStormFraction)
+			c->reconnect();
+}
 
-	this->qha = qha;
-	this->port = port;
+void Worker::resetStats() {
+	foreach(Client *c, qlClients)
+		c->qhStreams.clear();
+	sStats.clear();
+}
 
-	numsender = numsend;
-	numudplistener = numudp;
-	numtcplistener = numtcp;
+void Worker::collect() {
+	foreach(Client *c, qlClients)
+		c->flushStreams(0, true);
+}
 
+void Worker::stop() {
+	qtTick->stop();
+	foreach(Client *c, qlClients) {
+		c->bReconnecting = true;
+		c->qssSocket->abort();
+	}
+	qDeleteAll(qlClients);
+	qlClients.clear();
+}
 
-	connect(&qtTick, SIGNAL(timeout()), this, SLOT(tick()));
-	qtTick.start(0);
+void Worker::tick() {
+	const quint64 now = Timer::now();
+	const quint64 interval = static_cast<quint64>(qMax(1, o.iFrame / 4)) * 1000ULL;
 
-	tickSpawn.restart();
+	sStats.hTickLag.add((now > uiNextTick) ? now - uiNextTick : 0);
+	uiNextTick = qMax(now, uiNextTick) + interval;
+
+	foreach(Client *c, qlClients)
+		c->tick(now);
+
+	if (now >= uiNextFlush) {
+		foreach(Client *c, qlClients)
+			c->flushStreams(now, false);
+		uiNextFlush = now + 1000000ULL;
+	}
 }
 
-void Container::tick() {
-	if (forceping || tickPing.isElapsed(5000000ULL)) {
-		forceping = false;
+class Generator : public QObject {
+		Q_OBJECT
+	public:
+		Options o;
+		QList<QThread *> qlThreads;
+		QList<Worker *> qlWorkers;
+		QTimer qtTick;
+		Timer tPhase;
+		Timer tStorm;
+		enum Phase { Spawning, Joining, Warmup, Measuring } pPhase;
+		int iSpawned;
+		quint64 uiMeasured;
+
+		Generator(const Options &opts);
+		~Generator();
+		void report(const Stats &s);
+		bool writeJson(const Stats &s);
+	public slots:
+		void tick();
+};
+
+Generator::Generator(const Options &opts) : o(opts), pPhase(Spawning), iSpawned(0), uiMeasured(0) {
+	for (int i = 0; i < o.iThreads; ++i) {
+		QThread *t = new QThread(this);
+		Worker *w = new Worker(o, static_cast<quint32>(Timer::now()) * 2654435761U + static_cast<quint32>(i));
+		w->moveToThread(t);
+		t->start();
+		QMetaObject::invokeMethod(w, "start", Qt::QueuedConnection);
+		qlThreads << t;
+		qlWorkers << w;
+	}
+
+	qWarning("Spawning %d clients (%d TCP-only) on %d threads", o.iClients, static_cast<int>(o.iClients * o.dTcpOnly), o.iThreads);
 
-		foreach(Client *c, clients)
-			c->ping();
+	connect(&qtTick, SIGNAL(timeout()), this, SLOT(tick()));
+	qtTick.start(10);
+	tPhase.restart();
+}
 
-		if (live) {
+Generator::~Generator() {
+	foreach(Worker *w, qlWorkers)
+		QMetaObject::invokeMethod(w, "stop", Qt::BlockingQueuedConnection);
+	foreach(QThread *t, qlThreads) {
+		t->quit();
+		t->wait();
+	}
+	qDeleteAll(qlWorkers);
+}
 
-			int lost = 0;
-			quint64 totrcv = 0;
-			int nrcv = 0;
-			foreach(Client *c, clients) {
-				if (! c->sender) {
-					totrcv += c->rcvd;
-					lost += sent - c->rcvd;
-					nrcv++;
+void Generator::tick() {
+	switch (pPhase) {
+		case Spawning: {
+				// Spread the connections evenly over each second.
+				const int due = qMin(o.iClients, static_cast<int>(tPhase.elapsed() * static_cast<quint64>(o.iRate) / 1000000ULL) + 1);
+				for (; iSpawned < due; ++iSpawned) {
+					const bool tcponly = floor((iSpawned + 1) * o.dTcpOnly) > floor(iSpawned * o.dTcpOnly);
+					QMetaObject::invokeMethod(qlWorkers.at(iSpawned % qlWorkers.count()), "spawn", Qt::QueuedConnection, Q_ARG(int, iSpawned), Q_ARG(bool, tcponly));
+				}
+				if (iSpawned == o.iClients) {
+					pPhase = Joining;
+					tStorm.restart();
 				}
+				break;
 			}
-			qWarning("Sent: %8d  Rcvd: %8lld  Lost: %8d   BW: %6.1fMbit/s", sent, totrcv / nrcv, (lost + nrcv - 1) / nrcv, (totrcv * 8.0 * 123.0) / (tickGo.elapsed() * 1.0));
-		} else {
-			qWarning("Spawned %3d/%3d", isender + iudplistener + itcplistener, numsender + numudplistener + numtcplistener);
-		}
+		case Joining:
+			if (QAtomicIntLoad(registry.aiJoined) >= o.iClients) {
+				qWarning("All %d clients joined after %.1fs", o.iClients, static_cast<double>(tPhase.elapsed()) / 1000000.0);
+				pPhase = Warmup;
+				tPhase.restart();
+			} else if (tPhase.isElapsed(30000000ULL)) {
+				qWarning("Only %d of %d clients joined within 30s, continuing", QAtomicIntLoad(registry.aiJoined), o.iClients);
+				pPhase = Warmup;
+				tPhase.restart();
+			}
+			break;
+		case Warmup:
+			if (tPhase.elapsed() >= static_cast<quint64>(o.iWarmup) * 1000000ULL) {
+				foreach(Worker *w, qlWorkers)
+					QMetaObject::invokeMethod(w, "resetStats", Qt::BlockingQueuedConnection);
+				qWarning("Measuring for %ds", o.iDuration);
+				pPhase = Measuring;
+				tPhase.restart();
+				tStorm.restart();
+			}
+			break;
+		case Measuring:
+			if (tPhase.elapsed() >= static_cast<quint64>(o.iDuration) * 1000000ULL) {
+				Stats s;
+				uiMeasured = tPhase.elapsed();
+				foreach(Worker *w, qlWorkers) {
+					// The blocking call also makes the worker's
+					// stats safe to read from here.
+					QMetaObject::invokeMethod(w, "collect", Qt::BlockingQueuedConnection);
+					s.merge(w->sStats);
+				}
+				qtTick.stop();
+				report(s);
+				if (! o.qsJson.isEmpty() && ! writeJson(s))
+					qWarning("Failed to write %s", qPrintable(o.qsJson));
+				QCoreApplication::quit();
+				return;
+			}
+			break;
 	}
 
-	if (live && tickVoice.isElapsed(10000ULL)) {
-		foreach(Client *c, speakers) {
-			sent++;
-			c->sendVoice();
-		}
-	}
-	if (! live) {
-		if (isender < numsender) {
-			// Spawn a sender
-			Client *c = new Client(this, qha, port, true, false);
-			speakers << c;
-			c->start();
-			clients << c;
-			isender++;
-		} else if (iudplistener < numudplistener) {
-			// Spawn a listener which uses UDP
-			Client *c = new Client(this, qha, port, false, false);
-			c->start();
-			clients << c;
-			iudplistener++;
-		} else if (itcplistener < numtcplistener) {
-			// Spawn a listener which uses TCP-only
-			Client *c = new Client(this, qha, port, false, true);
-			c->start();
-			clients << c;
-			itcplistener++;
-		} else {
-			live = true;
-			quint64 elapsed = tickSpawn.elapsed();
-			qWarning("Spawning took %lld ms (%lld us per client)", elapsed / 1000ULL, elapsed / (numsender+numudplistener+numtcplistener));
-			foreach(Client *c, clients)
-				c->rcvd = 0;
-			sent = 0;
-			forceping = true;
-			qtTick.start(10);
-		}
+	if ((o.iStormInterval > 0) && (pPhase >= Warmup) && tStorm.isElapsed(static_cast<quint64>(o.iStormInterval) * 1000000ULL)) {
+		qWarning("Reconnect storm");
+		foreach(Worker *w, qlWorkers)
+			QMetaObject::invokeMethod(w, "storm", Qt::QueuedConnection);
 	}
 }
 
-void Container::go() {
-	foreach(Client *c, clients)
-		c->start();
-	qtTick.start(10);
-	tickGo.restart();
+static double ratio(quint64 a, quint64 b) {
+	return b ? static_cast<double>(a) / static_cast<double>(b) : 0.0;
 }
 
-int main(int argc, char **argv) {
-	QCoreApplication a(argc, argv);
+void Generator::report(const Stats &s) {
+	const double secs = static_cast<double>(uiMeasured) / 1000000.0;
+	const quint64 lost = s.uiExpected - s.uiDelivered;
+
+	qWarning("Sent:      %llu packets (%.0f/s, %.2f Mbit/s)", s.uiSent, s.uiSent / secs, s.uiSentBytes * 8.0 / secs / 1000000.0);
+	qWarning("Received:  %llu packets (%.0f/s, %.2f Mbit/s)", s.uiReceived, s.uiReceived / secs, s.uiReceivedBytes * 8.0 / secs / 1000000.0);
+	qWarning("Latency:   p50 %.2fms  p90 %.2fms  p99 %.2fms  p99.9 %.2fms  max %.2fms",
+	         s.hLatency.percentile(0.5) / 1000.0, s.hLatency.percentile(0.9) / 1000.0, s.hLatency.percentile(0.99) / 1000.0,
+	         s.hLatency.percentile(0.999) / 1000.0, s.hLatency.uiMax / 1000.0);
+	qWarning("Loss:      %llu of %llu frames (%.3f%%), %llu reordered (%.3f%%)",
+	         lost, s.uiExpected, 100.0 * ratio(lost, s.uiExpected), s.uiReordered, 100.0 * ratio(s.uiReordered, s.uiReceived));
+	qWarning("Joins:     %llu (p50 %.1fms, p99 %.1fms), %llu rejected, %llu disconnected",
+	         s.uiJoins, s.hJoin.percentile(0.5) / 1000.0, s.hJoin.percentile(0.99) / 1000.0, s.uiRejects, s.uiDisconnects);
+	qWarning("Tick lag:  p99 %.2fms, max %.2fms", s.hTickLag.percentile(0.99) / 1000.0, s.hTickLag.uiMax / 1000.0);
+	if (s.hTickLag.percentile(0.99) > static_cast<quint64>(o.iFrame) * 1000ULL)
+		qWarning("The generator couldn't keep up; use more threads or fewer clients per host.");
+}
 
-	qWarning("Maximum # sockets is %d", FD_SETSIZE);
+static QString jsonHistogram(const Histogram &h) {
+	return QString::fromLatin1("{\"count\": %1, \"mean\": %2, \"p50\": %3, \"p90\": %4, \"p99\": %5, \"p999\": %6, \"max\": %7}")
+	       .arg(h.uiCount).arg(h.mean(), 0, 'f', 1).arg(h.percentile(0.5)).arg(h.percentile(0.9))
+	       .arg(h.percentile(0.99)).arg(h.percentile(0.999)).arg(h.uiMax);
+}
+
+bool Generator::writeJson(const Stats &s) {
+	QFile f(o.qsJson);
+	if (! f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+
+	QString host = o.qsHost;
+	host.replace(QLatin1Char('\\'), QLatin1String("\\\\")).replace(QLatin1Char('"'), QLatin1String("\\\""));
+
+	QTextStream ts(&f);
+	ts << "{\n";
+	ts << "  \"options\": {\"host\": \"" << host << "\", \"port\": " << o.usPort
+	   << ", \"clients\": " << o.iClients << ", \"threads\": " << o.iThreads
+	   << ", \"talk\": " << o.dTalk << ", \"burst\": " << o.dBurst
+	   << ", \"bitrate\": " << o.iBitrate << ", \"frame\": " << o.iFrame
+	   << ", \"whisper\": " << o.dWhisper << ", \"whisper_targets\": " << o.iWhisperTargets
+	   << ", \"hop\": " << o.dHop << ", \"tcponly\": " << o.dTcpOnly
+	   << ", \"storm_interval\": " << o.iStormInterval << ", \"storm_fraction\": " << o.dStormFraction
+	   << ", \"aggregate\": " << (o.bAggregate ? "true" : "false")
+	   << ", \"duration\": " << o.iDuration << "},\n";
+	ts << "  \"seconds\": " << static_cast<double>(uiMeasured) / 1000000.0 << ",\n";
+	ts << "  \"sent\": {\"packets\": " << s.uiSent << ", \"bytes\": " << s.uiSentBytes << "},\n";
+	ts << "  \"received\": {\"packets\": " << s.uiReceived << ", \"bytes\": " << s.uiReceivedBytes << "},\n";
+	ts << "  \"frames\": {\"expected\": " << s.uiExpected << ", \"lost\": " << (s.uiExpected - s.uiDelivered)
+	   << ", \"reordered\": " << s.uiReordered << "},\n";
+	ts << "  \"joins\": {\"count\": " << s.uiJoins << ", \"rejected\": " << s.uiRejects << ", \"disconnected\": " << s.uiDisconnects << "},\n";
+	ts << "  \"latency_us\": " << jsonHistogram(s.hLatency) << ",\n";
+	ts << "  \"join_us\": " << jsonHistogram(s.hJoin) << ",\n";
+	ts << "  \"tick_lag_us\": " << jsonHistogram(s.hTickLag) << "\n";
+	ts << "}\n";
+	return ts.status() == QTextStream::Ok;
+}
 
-	if (argc != 6)
-		qFatal("Invalid number of arguments. These need to be passed: <host address> <port> <numsend> <numudp> <numtcp>");
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
 
-	QHostAddress qha = QHostAddress(argv[1]);
-	int port = atoi(argv[2]);
-	int numsender = atoi(argv[3]);
-	int numudplistener = atoi(argv[4]);
-	int numtcplistener = atoi(argv[5]);
+	Options o;
+	if (! o.parse(a.arguments())) {
+		usage();
+		return 1;
+	}
 
-	Container c(qha, port, numsender, numudplistener, numtcplistener);
-	c.go();
-	a.exec();
+	Generator g(o);
+	return a.exec();
 }
 
 #include "Benchmark.moc"
@@ -1,13 +1,13 @@
 include(../mumble.pri)
 
 TEMPLATE = app
-CONFIG *= qt thread warn_on network qtestlib debug
+CONFIG *= qt thread warn_on network release
 CONFIG -= app_bundle
 QT *= network xml
 LANGUAGE = C++
 TARGET = Benchmark
 SOURCES *= Benchmark.cpp Timer.cpp CryptState.cpp
-HEADERS *= Timer.h CryptState.h
+HEADERS *= Timer.h CryptState.h PacketDataStream.h QAtomicIntCompat.h
 VPATH *= ..
 INCLUDEPATH *= .. ../murmur ../mumble
 !win32 {
@@ -0,0 +1,157 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+/**
+ * Throughput of CryptState's OCB-AES128 with AES-NI and with the
+ * portable OpenSSL implementation, for typical voice packet sizes
+ * and larger buffers, and the cost of encrypting one voice packet for
+ * many listeners. Run with e.g. -iterations 100000.
+ */
+
+#include "murmur_pch.h"
+
+#include <QtCore>
+#include <QtTest>
+
+#include "SSL.h"
+#include "Timer.h"
+#include "CryptState.h"
+
+class CryptBenchmark : public QObject {
+		Q_OBJECT
+	protected:
+		bool bHaveAESNI;
+		void addRows();
+	private slots:
+		void initTestCase();
+		void cleanupTestCase();
+		void encrypt_data();
+		void encrypt();
+		void decrypt_data();
+		void decrypt();
+		void fanout_data();
+		void fanout();
+};
+
+void CryptBenchmark::initTestCase() {
+	MumbleSSL::initialize();
+	bHaveAESNI = CryptState::bAESNI;
+}
+
+void CryptBenchmark::cleanupTestCase() {
+	CryptState::bAESNI = bHaveAESNI;
+	MumbleSSL::destroy();
+}
+
+void CryptBenchmark::addRows() {
+	QTest::addColumn<bool>("aesni");
+	QTest::addColumn<int>("len");
+
+	const int sizes[] = { 16, 64, 128, 256, 1024, 4096 };
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("portable %1").arg(sizes[i]))) << false << sizes[i];
+		if (bHaveAESNI)
+			QTest::newRow(qPrintable(QString::fromLatin1("aesni %1").arg(sizes[i]))) << true << sizes[i];
+	}
+}
+
+void CryptBenchmark::encrypt_data() {
+	addRows();
+}
+
+void CryptBenchmark::encrypt() {
+	QFETCH(bool, aesni);
+	QFETCH(int, len);
+
+	CryptState cs;
+	cs.genKey();
+	CryptState::bAESNI = aesni;
+
+	QByteArray src(len, 0x55);
+	QByteArray dst(len + 4, 0);
+
+	QBENCHMARK {
+		cs.encrypt(reinterpret_cast<const unsigned char *>(src.constData()), reinterpret_cast<unsigned char *>(dst.data()), len);
+	}
+}
+
+void CryptBenchmark::decrypt_data() {
+	addRows();
+}
+
+void CryptBenchmark::decrypt() {
+	QFETCH(bool, aesni);
+	QFETCH(int, len);
+
+	CryptState enc, dec;
+	enc.genKey();
+	dec.setKey(enc.raw_key, enc.decrypt_iv, enc.encrypt_iv);
+	CryptState::bAESNI = aesni;
+
+	QByteArray src(len, 0x55);
+	QByteArray crypted(len + 4, 0);
+	QByteArray dst(len, 0);
+	unsigned char tag[AES_BLOCK_SIZE];
+
+	enc.encrypt(reinterpret_cast<const unsigned char *>(src.constData()), reinterpret_cast<unsigned char *>(crypted.data()), len);
+
+	// Decrypt the OCB payload directly; CryptState::decrypt()
+	// would reject the repeated IV.
+	QBENCHMARK {
+		dec.ocb_decrypt(reinterpret_cast<const unsigned char *>(crypted.constData()) + 4, reinterpret_cast<unsigned char *>(dst.data()), len, dec.decrypt_iv, tag);
+	}
+}
+
+void CryptBenchmark::fanout_data() {
+	QTest::addColumn<bool>("aesni");
+	QTest::addColumn<bool>("multi");
+	QTest::addColumn<int>("len");
+
+	const int sizes[] = { 40, 80, 128 };
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("portable %1").arg(sizes[i]))) << false << false << sizes[i];
+		if (bHaveAESNI) {
+			QTest::newRow(qPrintable(QString::fromLatin1("aesni %1").arg(sizes[i]))) << true << false << sizes[i];
+			QTest::newRow(qPrintable(QString::fromLatin1("aesni multi %1").arg(sizes[i]))) << true << true << sizes[i];
+		}
+	}
+}
+
+// One voice packet encrypted for 64 listeners, one at a time or with
+// the multi-buffer CryptState::encrypt().
+void CryptBenchmark::fanout() {
+	QFETCH(bool, aesni);
+	QFETCH(bool, multi);
+	QFETCH(int, len);
+
+	const int listeners = 64;
+	CryptState cs[listeners];
+	CryptState *states[listeners];
+	unsigned char *dst[listeners];
+	QByteArray src(len, 0x55);
+	QByteArray out(listeners * (len + 4), 0);
+
+	for (int i=0;i<listeners;++i) {
+		cs[i].genKey();
+		states[i] = &cs[i];
+		dst[i] = reinterpret_cast<unsigned char *>(out.data()) + i * (len + 4);
+	}
+	CryptState::bAESNI = aesni;
+
+	const unsigned char *plain = reinterpret_cast<const unsigned char *>(src.constData());
+	if (multi) {
+		QBENCHMARK {
+			CryptState::encrypt(states, plain, dst, len, listeners);
+		}
+	} else {
+		QBENCHMARK {
+			for (int i=0;i<listeners;++i)
+				cs[i].encrypt(plain, dst[i], len);
+		}
+	}
+}
+
+QTEST_MAIN(CryptBenchmark)
+#include "CryptBenchmark.moc"
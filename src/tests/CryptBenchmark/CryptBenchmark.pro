@@ -0,0 +1,15 @@
+# Copyright 2005-2018 The Mumble Developers. All rights reserved.
+# Use of this source code is governed by a BSD-style license
+# that can be found in the LICENSE file at the root of the
+# Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+include(../test.pri)
+
+# A benchmark; built with the tests, but not run by 'make check'.
+CONFIG -= testcase
+
+QT *= network
+
+TARGET = CryptBenchmark
+HEADERS *= SSL.h SSLLocks.h Timer.h CryptState.h
+SOURCES *= SSL.cpp SSLLocks.cpp CryptBenchmark.cpp CryptState.cpp Timer.cpp
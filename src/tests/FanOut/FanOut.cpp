@@ -0,0 +1,213 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+/**
+ * Benchmark of voice fan-out for normal speech; the SENDTO loop over
+ * channel members and linked channels versus the flat array of
+ * recipients built by VoiceSnapshot::fanOut().
+ *
+ * Both run on real Channels, ServerUsers and a VoiceSnapshot built the
+ * way Server::publishVoiceSnapshot() builds it. Only the send itself
+ * is replaced, by an out of line call that counts the packet.
+ */
+
+#include "murmur_pch.h"
+
+#include <QtCore>
+
+#include "ACL.h"
+#include "ACLCache.h"
+#include "Channel.h"
+#include "ServerUser.h"
+#include "SSL.h"
+#include "Timer.h"
+#include "VoiceSnapshot.h"
+
+#define PACKETS 20000
+
+static QMutex qmCache;
+static ACLCache acCache;
+static quint64 uiBytes;
+
+// Stand-in for Server::sendMessage(); kept out of line so the
+// compiler can't optimize the loops away.
+static Q_DECL_NOINLINE void sendMessage(ServerUser *u, const char *, int len) {
+	++u->uiUDPPackets;
+	uiBytes += len;
+}
+
+#define SENDTO \
+		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u)) { \
+			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) \
+				sendMessage(pDst, buffer, len); \
+			else \
+				sendMessage(pDst, buffer, len - poslen); \
+		}
+
+// Server::processMsg() before VoiceSnapshot.
+static void sendLegacy(ServerUser *u, const char *buffer, int len, int poslen) {
+	Channel *c = u->cChannel;
+
+	foreach(User *p, c->qlUsers) {
+		ServerUser *pDst = static_cast<ServerUser *>(p);
+		SENDTO;
+	}
+
+	if (! c->qhLinks.isEmpty()) {
+		QSet<Channel *> chans = c->allLinks();
+		chans.remove(c);
+
+		QMutexLocker qml(&qmCache);
+
+		foreach(Channel *l, chans) {
+			if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache)) {
+				foreach(User *p, l->qlUsers) {
+					ServerUser *pDst = static_cast<ServerUser *>(p);
+					SENDTO;
+				}
+			}
+		}
+	}
+}
+
+// The normal speech path of Server::processMsg().
+static void sendFanOut(const VoiceSnapshot &vs, const VoiceSnapshot::Member &m, const char *buffer, int len, int poslen) {
+	const VoiceSnapshot::FanOut *fo = vs.fanOut(m);
+	ServerUser * const *targets = fo->qvTargets.constData();
+	const int count = fo->qvTargets.count();
+	int i = 0;
+
+	if (poslen > 0) {
+		for (;i<fo->iSameContext;++i)
+			sendMessage(targets[i], buffer, len);
+	}
+	for (;i<count;++i)
+		sendMessage(targets[i], buffer, len - poslen);
+}
+
+// The parts of Server::publishVoiceSnapshot() that fan-out depends on.
+static void buildSnapshot(VoiceSnapshot &vs, const QList<ServerUser *> &users) {
+	QHash<Channel *, int> channels;
+	QHash<QByteArray, int> contexts;
+
+	foreach(ServerUser *u, users) {
+		if (! channels.contains(u->cChannel)) {
+			channels.insert(u->cChannel, vs.qvChannels.count());
+			vs.qvChannels.append(QVector<int>());
+		}
+
+		VoiceSnapshot::Member m;
+		m.su = u;
+		m.uiSession = u->uiSession;
+		m.iChannel = channels.value(u->cChannel);
+		m.bSpeak = true;
+		m.bListen = ! u->bDeaf && ! u->bSelfDeaf;
+		m.bPrioritySpeaker = false;
+		m.bUdpAggregate = false;
+		m.bRelayed = false;
+		m.qapFanOut = NULL;
+
+		const QByteArray context(u->ssContext.data(), static_cast<int>(u->ssContext.size()));
+		m.iContext = contexts.value(context, contexts.count());
+		contexts.insert(context, m.iContext);
+
+		QSet<Channel *> chans = u->cChannel->allLinks();
+		chans.remove(u->cChannel);
+		foreach(Channel *l, chans) {
+			if (! channels.contains(l)) {
+				channels.insert(l, vs.qvChannels.count());
+				vs.qvChannels.append(QVector<int>());
+			}
+			if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache))
+				m.qvLinks.append(channels.value(l));
+		}
+
+		const int idx = vs.qvMembers.count();
+		if (m.bListen)
+			vs.qvChannels[m.iChannel].append(idx);
+		vs.qvMembers.append(m);
+		vs.qhSessions.insert(m.uiSession, idx);
+	}
+}
+
+static void run(int listeners, bool linked) {
+	Channel *root = new Channel(0, QLatin1String("Root"));
+	Channel *a = new Channel(1, QLatin1String("A"), root);
+	Channel *b = new Channel(2, QLatin1String("B"), root);
+
+	ChanACL *acl = new ChanACL(root);
+	acl->qsGroup = QLatin1String("all");
+	acl->pAllow = ChanACL::Enter | ChanACL::Speak;
+	acl->pDeny = ChanACL::None;
+
+	if (linked)
+		a->link(b);
+
+	QList<ServerUser *> users;
+	for (int i=0;i<listeners+1;++i) {
+		ServerUser *u = new ServerUser(NULL, new QSslSocket());
+		u->uiSession = i + 1;
+		u->sState = ServerUser::Authenticated;
+		u->bDeaf = (i % 20) == 19;
+		u->ssContext = (i % 2) ? "game" : "";
+		((linked && (i % 2)) ? b : a)->addUser(u);
+		users << u;
+	}
+
+	ServerUser *speaker = users.first();
+	char buffer[128];
+	memset(buffer, 0, sizeof(buffer));
+	Timer t;
+
+	t.restart();
+	for (int i=0;i<PACKETS;++i)
+		sendLegacy(speaker, buffer, 80, 12);
+	const quint64 uslegacy = t.restart();
+	const quint64 legacybytes = uiBytes;
+
+	VoiceSnapshot vs;
+	buildSnapshot(vs, users);
+	const VoiceSnapshot::Member *m = vs.member(speaker->uiSession);
+	t.restart();
+	vs.fanOut(*m);
+	const quint64 usbuild = t.restart();
+
+	uiBytes = 0;
+	for (int i=0;i<PACKETS;++i)
+		sendFanOut(vs, *m, buffer, 80, 12);
+	const quint64 usfanout = t.restart();
+
+	if (uiBytes != legacybytes)
+		qFatal("FanOut: SENDTO sent %llu bytes, fan-out %llu", legacybytes, uiBytes);
+	uiBytes = 0;
+
+	qWarning("%4d listeners%s: SENDTO %6.3fus/packet, flat %6.3fus/packet (%.1fx), build %lluus, %llu bytes",
+	         listeners, linked ? " (linked)" : "         ",
+	         static_cast<double>(uslegacy) / PACKETS, static_cast<double>(usfanout) / PACKETS,
+	         static_cast<double>(uslegacy) / static_cast<double>(usfanout ? usfanout : 1),
+	         usbuild, legacybytes);
+
+	foreach(ServerUser *u, users) {
+		acCache.forgetUser(u);
+		delete u;
+	}
+	acCache.clear();
+	delete root;
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication app(argc, argv);
+	MumbleSSL::initialize();
+
+	const int sizes[] = { 10, 100, 1000 };
+
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		run(sizes[i], false);
+		run(sizes[i], true);
+	}
+
+	MumbleSSL::destroy();
+	return 0;
+}
@@ -0,0 +1,23 @@
+# Copyright 2005-2018 The Mumble Developers. All rights reserved.
+# Use of this source code is governed by a BSD-style license
+# that can be found in the LICENSE file at the root of the
+# Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+include(../test.pri)
+include(../../../qmake/protobuf.pri)
+
+# A benchmark; built with the tests, but not run by 'make check'.
+CONFIG -= testcase
+
+QT *= network
+DEFINES *= MURMUR
+
+# The generated protobuf sources are in the build directory,
+# and the library next to the other build products.
+INCLUDEPATH *= ../../mumble_proto
+QMAKE_LIBDIR = $$DESTDIR/.. $$QMAKE_LIBDIR
+LIBS *= -lmumble_proto
+
+TARGET = FanOut
+HEADERS *= ACL.h ACLCache.h Channel.h ChannelIndex.h Connection.h CryptState.h Group.h HostAddress.h PacketDataStream.h QAtomicIntCompat.h SSL.h SSLLocks.h ServerUser.h Timer.h TunnelRing.h User.h VoiceSnapshot.h
+SOURCES *= FanOut.cpp ACL.cpp ACLCache.cpp Channel.cpp ChannelIndex.cpp Connection.cpp CryptState.cpp Group.cpp HostAddress.cpp SSL.cpp SSLLocks.cpp ServerUser.cpp Timer.cpp TunnelRing.cpp User.cpp VoiceSnapshot.cpp
@@ -0,0 +1,657 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+/**
+ * Micro-benchmarks of murmur's per-packet and per-message hot paths:
+ * voice encryption, varint coding, voice fan-out, permission checks on
+ * deep channel trees, channel tree queries, and control message
+ * serialization.
+ *
+ * Every benchmark runs once in the "time" row, reporting nanoseconds
+ * per operation, and once in the "allocations" row, reporting heap
+ * allocations per operation (glibc only). Use -csv, -xml or
+ * -o results.xml,xml for machine readable output.
+ */
+
+#include "murmur_pch.h"
+
+#include <QtCore>
+#include <QtTest>
+
+#ifdef __GLIBC__
+#include <stdlib.h>
+#endif
+
+#include "ACL.h"
+#include "ACLCache.h"
+#include "BanIndex.h"
+#include "Channel.h"
+#include "ChannelIndex.h"
+#include "CryptState.h"
+#include "Group.h"
+#include "Message.h"
+#include "Mumble.pb.h"
+#include "PacketDataStream.h"
+#include "ServerUser.h"
+#include "SSL.h"
+#include "Timer.h"
+#include "VoiceSnapshot.h"
+
+/// Minimum wall time of the measured runs of an operation, in microseconds.
+#define MEASURE_USECS 200000
+/// Runs of an operation over which allocations are counted.
+#define ALLOCATION_RUNS 1000
+
+static QBasicAtomicInt aiAllocations = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+#ifdef __GLIBC__
+// Count heap allocations by interposing the allocator entry points.
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t n, size_t size);
+	void *__libc_realloc(void *ptr, size_t size);
+
+	void *malloc(size_t size) __THROW {
+		aiAllocations.fetchAndAddRelaxed(1);
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t n, size_t size) __THROW {
+		aiAllocations.fetchAndAddRelaxed(1);
+		return __libc_calloc(n, size);
+	}
+
+	void *realloc(void *ptr, size_t size) __THROW {
+		aiAllocations.fetchAndAddRelaxed(1);
+		return __libc_realloc(ptr, size);
+	}
+}
+#endif
+
+/// Run op repeatedly and report its cost per run as the result of
+/// the current test function.
+template <class Op>
+static void measure(Op &op) {
+	QFETCH_GLOBAL(bool, allocations);
+
+	// Leave one-time setup, such as building a fan-out list or
+	// filling a cache, out of the results.
+	op();
+
+	if (allocations) {
+		const int before = aiAllocations.fetchAndAddRelaxed(0);
+		for (int i=0;i<ALLOCATION_RUNS;++i)
+			op();
+		const int after = aiAllocations.fetchAndAddRelaxed(0);
+		QTest::setBenchmarkResult(static_cast<qreal>(after - before) / ALLOCATION_RUNS, QTest::Events);
+		return;
+	}
+
+	quint64 runs = 1;
+	forever {
+		Timer t;
+		for (quint64 i=0;i<runs;++i)
+			op();
+		const quint64 elapsed = t.elapsed();
+		if (elapsed >= MEASURE_USECS) {
+			const qreal ns = static_cast<qreal>(elapsed) * 1000.0 / static_cast<qreal>(runs);
+#if QT_VERSION >= 0x050200
+			QTest::setBenchmarkResult(ns, QTest::WalltimeNanoseconds);
+#else
+			QTest::setBenchmarkResult(ns / 1000000.0, QTest::WalltimeMilliseconds);
+#endif
+			return;
+		}
+		runs *= 2;
+	}
+}
+
+/// Encrypts a voice packet, and optionally decrypts it again with
+/// a second CryptState as a client would.
+struct CryptOp {
+	CryptState csEncrypt, csDecrypt;
+	bool bRoundtrip;
+	int iLen;
+	QByteArray qbaPlain, qbaCrypted, qbaDecrypted;
+
+	CryptOp(bool roundtrip, int len) : bRoundtrip(roundtrip), iLen(len), qbaPlain(len, 0x55), qbaCrypted(len + 4, 0), qbaDecrypted(len, 0) {
+		csEncrypt.genKey();
+		csDecrypt.setKey(csEncrypt.raw_key, csEncrypt.decrypt_iv, csEncrypt.encrypt_iv);
+	}
+
+	void operator()() {
+		csEncrypt.encrypt(reinterpret_cast<const unsigned char *>(qbaPlain.constData()), reinterpret_cast<unsigned char *>(qbaCrypted.data()), iLen);
+		if (bRoundtrip && ! csDecrypt.decrypt(reinterpret_cast<const unsigned char *>(qbaCrypted.constData()), reinterpret_cast<unsigned char *>(qbaDecrypted.data()), iLen + 4))
+			qFatal("MurmurBenchmark: decrypt failed");
+	}
+};
+
+/// Writes or reads the varints of a voice packet header and a
+/// position, with values of all encoded lengths.
+struct VarintOp {
+	bool bDecode;
+	QVector<quint64> qvValues;
+	char cBuffer[256];
+	quint64 uiSink;
+
+	VarintOp(bool decode) : bDecode(decode), uiSink(0) {
+		qvValues << 1 << 100 << 300 << 16000 << 1000000 << 200000000ULL << 0x123456789ULL << 0x7fffffffffffffffULL;
+
+		PacketDataStream pds(cBuffer, sizeof(cBuffer));
+		foreach(quint64 v, qvValues)
+			pds << v;
+	}
+
+	void operator()() {
+		PacketDataStream pds(cBuffer, sizeof(cBuffer));
+		if (bDecode) {
+			quint64 v;
+			for (int i=0;i<qvValues.count();++i) {
+				pds >> v;
+				uiSink += v;
+			}
+		} else {
+			for (int i=0;i<qvValues.count();++i)
+				pds << qvValues.at(i);
+			uiSink += pds.size();
+		}
+	}
+};
+
+/// Routes one normal speech packet through a VoiceSnapshot the way
+/// Server::processMsg() does, with the send to each listener replaced
+/// by a cheap call that still touches the listener.
+struct FanOutOp {
+	VoiceSnapshot vs;
+	QList<ServerUser *> qlUsers;
+	bool bRebuild;
+	unsigned int uiSpeaker;
+	quint64 uiSink;
+
+	FanOutOp(int listeners, bool rebuild) : bRebuild(rebuild), uiSpeaker(1), uiSink(0) {
+		// The speaker's channel and two linked channels.
+		vs.qvChannels.resize(3);
+
+		for (int i=0;i<=listeners;++i) {
+			ServerUser *u = new ServerUser(NULL, new QSslSocket());
+			u->uiSession = i + 1;
+			qlUsers << u;
+
+			VoiceSnapshot::Member m;
+			m.su = u;
+			m.uiSession = u->uiSession;
+			m.iChannel = i % 3;
+			m.bSpeak = true;
+			m.bListen = ((i % 20) != 19);
+			m.bPrioritySpeaker = false;
+			m.bUdpAggregate = false;
+			m.iContext = i % 2;
+			m.bRelayed = false;
+			if (i == 0)
+				m.qvLinks << 1 << 2;
+			m.qapFanOut = NULL;
+
+			vs.qhSessions.insert(m.uiSession, vs.qvMembers.count());
+			if (m.bListen)
+				vs.qvChannels[m.iChannel].append(vs.qvMembers.count());
+			vs.qvMembers.append(m);
+		}
+	}
+
+	~FanOutOp() {
+		qDeleteAll(qlUsers);
+	}
+
+	// Reads the listener's state and counts the packet, as
+	// Server::sendMessage() does before encrypting.
+	static Q_DECL_NOINLINE void send(ServerUser *u, quint64 &sink) {
+		++u->uiUDPPackets;
+		sink += u->uiSession;
+	}
+
+	void operator()() {
+		const VoiceSnapshot::Member *m = vs.member(uiSpeaker);
+		if (bRebuild)
+			delete m->qapFanOut.fetchAndStoreOrdered(NULL);
+
+		const VoiceSnapshot::FanOut *fo = vs.fanOut(*m);
+		const int count = fo->qvTargets.count();
+		ServerUser * const *targets = fo->qvTargets.constData();
+		for (int i=0;i<count;++i)
+			send(targets[i], uiSink);
+	}
+};
+
+enum AclMode {
+	/// Compile and evaluate the ACLs on every check.
+	AclUncached,
+	/// Evaluate a program compiled up front.
+	AclCompiled,
+	/// Look the result up in the cache.
+	AclCached,
+	/// Parse and match the group of every ACL on the path, as the
+	/// walk did before group references were compiled.
+	AclGroups
+};
+
+/// Computes the permissions of a registered user in the deepest
+/// channel of a chain of channels, each with its own ACLs and groups.
+/// Every level refers to a group defined only at the root, which is
+/// what makes deep trees expensive.
+struct AclOp {
+	Channel *cRoot, *cLeaf;
+	ServerUser *suUser;
+	ACLCache acCache;
+	ACLProgram *apProgram;
+	int iMode;
+	int iSink;
+
+	AclOp(int depth, int mode) : apProgram(NULL), iMode(mode), iSink(0) {
+		cRoot = new Channel(0, QLatin1String("Root"));
+		Group *admin = new Group(cRoot, QLatin1String("admin"));
+		admin->qsAdd.insert(2);
+
+		Channel *c = cRoot;
+		for (int i=1;i<depth;++i)
+			c = new Channel(i, QString::fromLatin1("Level %1").arg(i), c);
+		cLeaf = c;
+
+		int level = 0;
+		for (c = cLeaf; c; c = c->cParent, ++level) {
+			Group *g = new Group(c, QString::fromLatin1("level%1").arg(level));
+			g->qsAdd.insert(5);
+
+			ChanACL *acl = new ChanACL(c);
+			acl->qsGroup = QLatin1String("all");
+			acl->pAllow = ChanACL::Enter | ChanACL::Speak;
+			acl->pDeny = ChanACL::None;
+
+			acl = new ChanACL(c);
+			acl->qsGroup = QLatin1String("admin");
+			acl->pAllow = ChanACL::Write;
+			acl->pDeny = ChanACL::None;
+
+			acl = new ChanACL(c);
+			acl->qsGroup = g->qsName;
+			acl->pAllow = ChanACL::MakeChannel;
+			acl->pDeny = ChanACL::None;
+
+			if ((level % 4) == 0) {
+				acl = new ChanACL(c);
+				acl->iUserId = 5;
+				acl->pAllow = ChanACL::None;
+				acl->pDeny = ChanACL::Whisper;
+			} else if ((level % 4) == 1) {
+				acl = new ChanACL(c);
+				acl->qsGroup = QLatin1String("#token");
+				acl->pAllow = ChanACL::TextMessage;
+				acl->pDeny = ChanACL::None;
+			} else if ((level % 4) == 2) {
+				acl = new ChanACL(c);
+				acl->qsGroup = QLatin1String("!~sub,0,2");
+				acl->pAllow = ChanACL::None;
+				acl->pDeny = ChanACL::LinkChannel;
+			}
+		}
+
+		suUser = new ServerUser(NULL, new QSslSocket());
+		suUser->iId = 5;
+		suUser->qsName = QLatin1String("user");
+		suUser->cChannel = cLeaf;
+		suUser->qslAccessTokens << QLatin1String("token");
+
+		if (iMode == AclCompiled)
+			apProgram = new ACLProgram(cLeaf);
+	}
+
+	~AclOp() {
+		delete apProgram;
+		delete suUser;
+		delete cRoot;
+	}
+
+	void operator()() {
+		switch (iMode) {
+			case AclUncached:
+				iSink += static_cast<int>(ChanACL::effectivePermissions(suUser, cLeaf, NULL));
+				break;
+			case AclCompiled:
+				iSink += static_cast<int>(apProgram->evaluate(suUser));
+				break;
+			case AclCached:
+				iSink += static_cast<int>(ChanACL::effectivePermissions(suUser, cLeaf, &acCache));
+				break;
+			case AclGroups:
+				for (Channel *c = cLeaf; c; c = c->cParent)
+					foreach(ChanACL *acl, c->qlACL)
+						if (Group::isMember(cLeaf, c, acl->qsGroup, suUser))
+							++iSink;
+				break;
+		}
+	}
+};
+
+enum TreeQuery {
+	/// All subchannels of the root, as for a whisper to a tree.
+	TreeChildren,
+	/// All channels linked to a channel.
+	TreeLinks,
+	/// Move a user between two crowded channels.
+	TreeMoveUser
+};
+
+/// Queries and changes on a channel tree with four subchannels per
+/// channel, with or without a ChannelIndex. Every eighth channel is
+/// linked to the next one.
+struct TreeOp {
+	Channel *cRoot;
+	QList<Channel *> qlChannels;
+	QList<ServerUser *> qlUsers;
+	int iQuery;
+	int iSink;
+
+	TreeOp(int channels, int query, bool indexed) : iQuery(query), iSink(0) {
+		cRoot = new Channel(0, QLatin1String("Root"));
+		if (indexed)
+			cRoot->ciIndex = new ChannelIndex(cRoot);
+
+		qlChannels << cRoot;
+		for (int i=1;i<channels;++i)
+			qlChannels << new Channel(i, QString::fromLatin1("Channel %1").arg(i), qlChannels.at((i - 1) / 4));
+
+		for (int i=8;i+1<channels;i+=8)
+			qlChannels.at(i)->link(qlChannels.at(i+1));
+		for (int i=9;i+8<channels;i+=8)
+			qlChannels.at(i)->link(qlChannels.at(i+7));
+
+		if (iQuery == TreeMoveUser) {
+			for (int i=0;i<channels;++i) {
+				ServerUser *u = new ServerUser(NULL, new QSslSocket());
+				qlChannels.at(1 + (i % 2))->addUser(u);
+				qlUsers << u;
+			}
+		}
+	}
+
+	~TreeOp() {
+		qDeleteAll(qlUsers);
+		delete cRoot;
+	}
+
+	void operator()() {
+		switch (iQuery) {
+			case TreeChildren:
+				iSink += cRoot->allChildren().count();
+				break;
+			case TreeLinks:
+				iSink += qlChannels.at(8)->allLinks().count();
+				break;
+			case TreeMoveUser: {
+					ServerUser *u = qlUsers.at(iSink++ % qlUsers.count());
+					(u->cChannel == qlChannels.at(1) ? qlChannels.at(2) : qlChannels.at(1))->addUser(u);
+				}
+				break;
+		}
+	}
+};
+
+/// Checks a connecting address that isn't banned against a list of
+/// IPv4 host and /24 bans, as Server::newClient() does, either with a
+/// BanIndex or by matching every ban.
+struct BanOp {
+	QList<Ban> qlBans;
+	BanIndex biBans;
+	bool bIndexed;
+	HostAddress haPeer;
+	int iSink;
+
+	BanOp(int bans, bool indexed) : bIndexed(indexed), iSink(0) {
+		for (int i=0;i<bans;++i) {
+			Ban b;
+			b.haAddress = HostAddress(QHostAddress(0x0a000000U + static_cast<quint32>(i) * 256U + ((i % 2) ? 1U : 0U)));
+			b.iMask = (i % 2) ? 128 : 120;
+			b.qdtStart = QDateTime::currentDateTime().toUTC();
+			b.iDuration = (i % 3) ? 3600 : 0;
+			qlBans << b;
+		}
+		biBans.rebuild(qlBans);
+		haPeer = HostAddress(QHostAddress(QLatin1String("192.0.2.1")));
+	}
+
+	void operator()() {
+		if (bIndexed) {
+			iSink += biBans.find(qlBans, haPeer);
+			return;
+		}
+		foreach(const Ban &b, qlBans) {
+			if (! b.isExpired() && b.haAddress.match(haPeer, b.iMask))
+				++iSink;
+		}
+	}
+};
+
+/// Serializes or parses a UserState or ChannelState as sent to each
+/// client on connect and on every state change.
+struct ProtoOp {
+	MumbleProto::UserState msgUser;
+	MumbleProto::ChannelState msgChannel;
+	bool bUser;
+	bool bParse;
+	QByteArray qbaBuffer;
+	int iLen;
+
+	ProtoOp(bool user, bool parse) : bUser(user), bParse(parse) {
+		msgUser.set_session(42);
+		msgUser.set_name(u8(QLatin1String("Some User Name")));
+		msgUser.set_user_id(1234);
+		msgUser.set_channel_id(17);
+		msgUser.set_self_mute(true);
+		msgUser.set_hash(std::string(40, 'a'));
+		msgUser.set_comment_hash(std::string(20, '\x11'));
+		msgUser.set_texture_hash(std::string(20, '\x22'));
+
+		msgChannel.set_channel_id(17);
+		msgChannel.set_parent(3);
+		msgChannel.set_name(u8(QLatin1String("Some Channel Name")));
+		msgChannel.set_description(u8(QLatin1String("A short channel description.")));
+		msgChannel.add_links(4);
+		msgChannel.add_links(5);
+		msgChannel.add_links(9);
+		msgChannel.set_position(2);
+		msgChannel.set_max_users(20);
+
+		const ::google::protobuf::Message &msg = bUser ? static_cast<const ::google::protobuf::Message &>(msgUser) : static_cast<const ::google::protobuf::Message &>(msgChannel);
+		iLen = msg.ByteSize();
+		qbaBuffer.resize(iLen);
+		msg.SerializeToArray(qbaBuffer.data(), iLen);
+	}
+
+	void operator()() {
+		::google::protobuf::Message &msg = bUser ? static_cast< ::google::protobuf::Message &>(msgUser) : static_cast< ::google::protobuf::Message &>(msgChannel);
+		if (bParse) {
+			if (! msg.ParseFromArray(qbaBuffer.constData(), iLen))
+				qFatal("MurmurBenchmark: parse failed");
+		} else {
+			iLen = msg.ByteSize();
+			msg.SerializeToArray(qbaBuffer.data(), iLen);
+		}
+	}
+};
+
+class MurmurBenchmark : public QObject {
+		Q_OBJECT
+	private slots:
+		void initTestCase_data();
+		void initTestCase();
+		void cleanupTestCase();
+		void crypt_data();
+		void crypt();
+		void varint_data();
+		void varint();
+		void fanout_data();
+		void fanout();
+		void acl_data();
+		void acl();
+		void tree_data();
+		void tree();
+		void bans_data();
+		void bans();
+		void proto_data();
+		void proto();
+};
+
+void MurmurBenchmark::initTestCase_data() {
+	QTest::addColumn<bool>("allocations");
+
+	QTest::newRow("time") << false;
+#ifdef __GLIBC__
+	QTest::newRow("allocations") << true;
+#endif
+}
+
+void MurmurBenchmark::initTestCase() {
+	MumbleSSL::initialize();
+}
+
+void MurmurBenchmark::cleanupTestCase() {
+	MumbleSSL::destroy();
+}
+
+void MurmurBenchmark::crypt_data() {
+	QTest::addColumn<bool>("roundtrip");
+	QTest::addColumn<int>("len");
+
+	const int sizes[] = { 40, 80, 128 };
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("encrypt %1").arg(sizes[i]))) << false << sizes[i];
+		QTest::newRow(qPrintable(QString::fromLatin1("roundtrip %1").arg(sizes[i]))) << true << sizes[i];
+	}
+}
+
+void MurmurBenchmark::crypt() {
+	QFETCH(bool, roundtrip);
+	QFETCH(int, len);
+
+	CryptOp op(roundtrip, len);
+	measure(op);
+}
+
+void MurmurBenchmark::varint_data() {
+	QTest::addColumn<bool>("decode");
+
+	QTest::newRow("encode") << false;
+	QTest::newRow("decode") << true;
+}
+
+void MurmurBenchmark::varint() {
+	QFETCH(bool, decode);
+
+	VarintOp op(decode);
+	measure(op);
+}
+
+void MurmurBenchmark::fanout_data() {
+	QTest::addColumn<int>("listeners");
+	QTest::addColumn<bool>("rebuild");
+
+	const int sizes[] = { 10, 100, 1000 };
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("cached %1").arg(sizes[i]))) << sizes[i] << false;
+		QTest::newRow(qPrintable(QString::fromLatin1("rebuild %1").arg(sizes[i]))) << sizes[i] << true;
+	}
+}
+
+void MurmurBenchmark::fanout() {
+	QFETCH(int, listeners);
+	QFETCH(bool, rebuild);
+
+	FanOutOp op(listeners, rebuild);
+	measure(op);
+}
+
+void MurmurBenchmark::acl_data() {
+	QTest::addColumn<int>("depth");
+	QTest::addColumn<int>("mode");
+
+	const int depths[] = { 8, 32, 128 };
+	for (unsigned int i=0;i<sizeof(depths)/sizeof(depths[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("groups %1").arg(depths[i]))) << depths[i] << static_cast<int>(AclGroups);
+		QTest::newRow(qPrintable(QString::fromLatin1("uncached %1").arg(depths[i]))) << depths[i] << static_cast<int>(AclUncached);
+		QTest::newRow(qPrintable(QString::fromLatin1("compiled %1").arg(depths[i]))) << depths[i] << static_cast<int>(AclCompiled);
+		QTest::newRow(qPrintable(QString::fromLatin1("cached %1").arg(depths[i]))) << depths[i] << static_cast<int>(AclCached);
+	}
+}
+
+void MurmurBenchmark::acl() {
+	QFETCH(int, depth);
+	QFETCH(int, mode);
+
+	AclOp op(depth, mode);
+	measure(op);
+}
+
+void MurmurBenchmark::tree_data() {
+	QTest::addColumn<int>("channels");
+	QTest::addColumn<int>("query");
+	QTest::addColumn<bool>("indexed");
+
+	const int sizes[] = { 100, 1000, 5000 };
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("children %1").arg(sizes[i]))) << sizes[i] << static_cast<int>(TreeChildren) << false;
+		QTest::newRow(qPrintable(QString::fromLatin1("children indexed %1").arg(sizes[i]))) << sizes[i] << static_cast<int>(TreeChildren) << true;
+		QTest::newRow(qPrintable(QString::fromLatin1("links %1").arg(sizes[i]))) << sizes[i] << static_cast<int>(TreeLinks) << false;
+		QTest::newRow(qPrintable(QString::fromLatin1("links indexed %1").arg(sizes[i]))) << sizes[i] << static_cast<int>(TreeLinks) << true;
+		QTest::newRow(qPrintable(QString::fromLatin1("move user %1").arg(sizes[i]))) << sizes[i] << static_cast<int>(TreeMoveUser) << false;
+	}
+}
+
+void MurmurBenchmark::tree() {
+	QFETCH(int, channels);
+	QFETCH(int, query);
+	QFETCH(bool, indexed);
+
+	TreeOp op(channels, query, indexed);
+	measure(op);
+}
+
+void MurmurBenchmark::bans_data() {
+	QTest::addColumn<int>("bans");
+	QTest::addColumn<bool>("indexed");
+
+	const int sizes[] = { 10, 1000, 100000 };
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+		QTest::newRow(qPrintable(QString::fromLatin1("linear %1").arg(sizes[i]))) << sizes[i] << false;
+		QTest::newRow(qPrintable(QString::fromLatin1("indexed %1").arg(sizes[i]))) << sizes[i] << true;
+	}
+}
+
+void MurmurBenchmark::bans() {
+	QFETCH(int, bans);
+	QFETCH(bool, indexed);
+
+	BanOp op(bans, indexed);
+	measure(op);
+}
+
+void MurmurBenchmark::proto_data() {
+	QTest::addColumn<bool>("user");
+	QTest::addColumn<bool>("parse");
+
+	QTest::newRow("UserState serialize") << true << false;
+	QTest::newRow("UserState parse") << true << true;
+	QTest::newRow("ChannelState serialize") << false << false;
+	QTest::newRow("ChannelState parse") << false << true;
+}
+
+void MurmurBenchmark::proto() {
+	QFETCH(bool, user);
+	QFETCH(bool, parse);
+
+	ProtoOp op(user, parse);
+	measure(op);
+}
+
+QTEST_MAIN(MurmurBenchmark)
+#include "MurmurBenchmark.moc"
@@ -0,0 +1,155 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include <QtCore>
+#include <QtNetwork>
+#include <QtTest>
+
+#include "ACL.h"
+#include "ACLCache.h"
+#include "Channel.h"
+#include "Group.h"
+#include "SSL.h"
+#include "ServerUser.h"
+
+/// A registered user is unregistered the way Server::unregisterUser()
+/// does it, and the next user registered gets the same ID, as
+/// ServerDB::registerUser() hands out MAX(user_id)+1.
+class TestACLCache : public QObject {
+		Q_OBJECT
+	protected:
+		Channel *root, *sub;
+		ACLCache acCache;
+
+		ServerUser *user(unsigned int session, int id);
+		/// What Server::unregisterUser() does to the channels and
+		/// the cache.
+		void unregister(int id);
+	private slots:
+		void initTestCase();
+		void cleanupTestCase();
+		void init();
+		void cleanup();
+		void userGrant();
+		void groupGrant();
+};
+
+ServerUser *TestACLCache::user(unsigned int session, int id) {
+	ServerUser *u = new ServerUser(NULL, new QSslSocket());
+	u->uiSession = session;
+	u->iId = id;
+	u->sState = ServerUser::Authenticated;
+	sub->addUser(u);
+	return u;
+}
+
+void TestACLCache::unregister(int id) {
+	QList<Channel *> changed;
+	foreach(Channel *c, QList<Channel *>() << root << sub) {
+		bool write = false;
+		foreach(ChanACL *acl, QList<ChanACL *>(c->qlACL)) {
+			if (acl->iUserId == id) {
+				c->qlACL.removeAll(acl);
+				write = true;
+			}
+		}
+		foreach(Group *g, c->qhGroups) {
+			bool addrem = g->qsAdd.remove(id);
+			bool remrem = g->qsRemove.remove(id);
+			write = write || addrem || remrem;
+		}
+		if (write)
+			changed << c;
+	}
+
+	acCache.removeUserId(id);
+	foreach(Channel *c, changed) {
+		QSet<Channel *> channels = c->allChildren();
+		channels.insert(c);
+		acCache.clearChannels(channels);
+	}
+}
+
+void TestACLCache::initTestCase() {
+	MumbleSSL::initialize();
+}
+
+void TestACLCache::cleanupTestCase() {
+	MumbleSSL::destroy();
+}
+
+void TestACLCache::init() {
+	root = new Channel(0, QLatin1String("Root"));
+	sub = new Channel(1, QLatin1String("Sub"), root);
+}
+
+void TestACLCache::cleanup() {
+	acCache.clear();
+	delete root;
+}
+
+void TestACLCache::userGrant() {
+	ChanACL *acl = new ChanACL(root);
+	acl->iUserId = 5;
+	acl->pAllow = ChanACL::MuteDeafen;
+	acl->pDeny = ChanACL::None;
+
+	ServerUser *old = user(1, 5);
+	QVERIFY(ChanACL::hasPermission(old, sub, ChanACL::MuteDeafen, &acCache));
+
+	unregister(5);
+	QVERIFY(! ChanACL::hasPermission(old, sub, ChanACL::MuteDeafen, &acCache));
+
+	// Offline when unregistered: the cache only knows the ID.
+	acCache.forgetUser(old);
+	sub->removeUser(old);
+	delete old;
+
+	ServerUser *next = user(2, 5);
+	QVERIFY(! ChanACL::hasPermission(next, sub, ChanACL::MuteDeafen, &acCache));
+	QVERIFY(! ChanACL::hasPermission(next, root, ChanACL::MuteDeafen, &acCache));
+
+	acCache.forgetUser(next);
+	sub->removeUser(next);
+	delete next;
+}
+
+void TestACLCache::groupGrant() {
+	Group *g = new Group(root, QLatin1String("mods"));
+	g->qsAdd.insert(5);
+
+	ChanACL *acl = new ChanACL(root);
+	acl->qsGroup = QLatin1String("mods");
+	acl->pAllow = ChanACL::Move;
+	acl->pDeny = ChanACL::None;
+
+	ServerUser *old = user(1, 5);
+	QVERIFY(ChanACL::hasPermission(old, sub, ChanACL::Move, &acCache));
+	acCache.forgetUser(old);
+	sub->removeUser(old);
+	delete old;
+
+	unregister(5);
+
+	ServerUser *next = user(2, 5);
+	QVERIFY(! ChanACL::hasPermission(next, sub, ChanACL::Move, &acCache));
+
+	// Other members keep the grant.
+	g->qsAdd.insert(6);
+	acCache.clearChannels(QSet<Channel *>() << root << sub);
+	ServerUser *other = user(3, 6);
+	QVERIFY(ChanACL::hasPermission(other, sub, ChanACL::Move, &acCache));
+
+	foreach(ServerUser *u, QList<ServerUser *>() << next << other) {
+		acCache.forgetUser(u);
+		sub->removeUser(u);
+		delete u;
+	}
+}
+
+QTEST_MAIN(TestACLCache)
+#include "TestACLCache.moc"
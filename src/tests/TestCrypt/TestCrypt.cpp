@@ -20,6 +20,8 @@ class TestCrypt : public QObject {
 		void cleanupTestCase();
 		void testvectors();
 		void authcrypt();
+		void aesni();
+		void multiencrypt();
 		void ivrecovery();
 		void reverserecovery();
 		void tamper();
@@ -200,6 +202,96 @@ void TestCrypt::authcrypt() {
 	}
 }
 
+void TestCrypt::aesni() {
+	// Without AES-NI there is only one implementation.
+	if (! CryptState::bAESNI)
+		return;
+
+	const unsigned char rawkey[AES_BLOCK_SIZE] = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+	const unsigned char nonce[AES_BLOCK_SIZE] = {0xff, 0xee, 0xdd, 0xcc, 0xbb, 0xaa, 0x99, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0x00};
+	CryptState cs;
+	cs.setKey(rawkey, nonce, nonce);
+
+	// Long enough for several rounds of parallel blocks.
+	for (int len=0;len<300;len++) {
+		STACKVAR(unsigned char, src, len);
+		for (int i=0;i<len;i++)
+			src[i] = (i * 7 + len);
+
+		unsigned char tag[2][AES_BLOCK_SIZE];
+		unsigned char dectag[2][AES_BLOCK_SIZE];
+		STACKVAR(unsigned char, encrypted0, len);
+		STACKVAR(unsigned char, encrypted1, len);
+		STACKVAR(unsigned char, decrypted0, len);
+		STACKVAR(unsigned char, decrypted1, len);
+
+		CryptState::bAESNI = false;
+		cs.ocb_encrypt(src, encrypted0, len, nonce, tag[0]);
+		cs.ocb_decrypt(encrypted0, decrypted0, len, nonce, dectag[0]);
+		CryptState::bAESNI = true;
+		cs.ocb_encrypt(src, encrypted1, len, nonce, tag[1]);
+		cs.ocb_decrypt(encrypted0, decrypted1, len, nonce, dectag[1]);
+
+		for (int i=0;i<AES_BLOCK_SIZE;i++) {
+			QCOMPARE(tag[0][i], tag[1][i]);
+			QCOMPARE(dectag[0][i], dectag[1][i]);
+		}
+
+		for (int i=0;i<len;i++) {
+			QCOMPARE(encrypted0[i], encrypted1[i]);
+			QCOMPARE(decrypted0[i], decrypted1[i]);
+			QCOMPARE(src[i], decrypted1[i]);
+		}
+	}
+}
+
+void TestCrypt::multiencrypt() {
+	// More states than are encrypted at once, with different keys and IVs.
+	const int count = CRYPT_MULTI_BUFFERS * 2 + 3;
+
+	for (int len=0;len<100;len+=3) {
+		CryptState multi[count], single[count], dec[count];
+		CryptState *states[count];
+		unsigned char *dst[count];
+		unsigned char crypted[count][100 + 4];
+		unsigned char expected[100 + 4];
+		unsigned char decrypted[100];
+
+		STACKVAR(unsigned char, src, len);
+		for (int i=0;i<len;i++)
+			src[i] = (i + len);
+
+		for (int i=0;i<count;i++) {
+			unsigned char rawkey[AES_BLOCK_SIZE];
+			unsigned char iv[AES_BLOCK_SIZE];
+			for (int j=0;j<AES_BLOCK_SIZE;j++) {
+				rawkey[j] = (i * 31 + j);
+				// Exercise the carry when the IV is incremented.
+				iv[j] = (i % 3) ? (i + j) : 0xff;
+			}
+			multi[i].setKey(rawkey, iv, iv);
+			single[i].setKey(rawkey, iv, iv);
+			dec[i].setKey(rawkey, iv, iv);
+			states[i] = &multi[i];
+			dst[i] = crypted[i];
+		}
+
+		CryptState::encrypt(states, src, dst, len, count);
+
+		for (int i=0;i<count;i++) {
+			single[i].encrypt(src, expected, len);
+			for (int j=0;j<len+4;j++)
+				QCOMPARE(crypted[i][j], expected[j]);
+			for (int j=0;j<AES_BLOCK_SIZE;j++)
+				QCOMPARE(multi[i].encrypt_iv[j], single[i].encrypt_iv[j]);
+
+			QVERIFY(dec[i].decrypt(crypted[i], decrypted, len + 4));
+			for (int j=0;j<len;j++)
+				QCOMPARE(decrypted[j], src[j]);
+		}
+	}
+}
+
 void TestCrypt::tamper() {
 	const unsigned char rawkey[AES_BLOCK_SIZE] = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
 	const unsigned char nonce[AES_BLOCK_SIZE] = {0xff, 0xee, 0xdd, 0xcc, 0xbb, 0xaa, 0x99, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0x00};
@@ -0,0 +1,169 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include "murmur_pch.h"
+
+#include <QtCore>
+#include <QtNetwork>
+#include <QtTest>
+
+#include "PacketDataStream.h"
+#include "RelayCodec.h"
+
+/// Two relay nodes on localhost: datagrams sealed by one are sent over
+/// UDP and opened by the other.
+class TestRelay : public QObject {
+		Q_OBJECT
+	protected:
+		QUdpSocket qusA, qusB;
+		quint64 uiNow;
+
+		static QByteArray seal(const RelayCodec &rc, RelayCodec::Type t, quint64 now, const QByteArray &payload);
+		QByteArray exchange(const QByteArray &datagram);
+	private slots:
+		void initTestCase();
+		void roundtrip();
+		void replay();
+		void reorder();
+		void window();
+		void tamper();
+		void secret();
+		void skew();
+		void ownNode();
+};
+
+QByteArray TestRelay::seal(const RelayCodec &rc, RelayCodec::Type t, quint64 now, const QByteArray &payload) {
+	char buffer[RELAY_MAX_DATAGRAM];
+	PacketDataStream pds(buffer, RELAY_MAX_DATAGRAM - RELAY_TAG_LENGTH);
+	rc.begin(pds, t, now);
+	pds.append(payload.constData(), payload.size());
+	return QByteArray(buffer, rc.seal(buffer, pds.size()));
+}
+
+QByteArray TestRelay::exchange(const QByteArray &datagram) {
+	if (qusA.writeDatagram(datagram, QHostAddress(QHostAddress::LocalHost), qusB.localPort()) != datagram.size())
+		return QByteArray();
+	if (! qusB.hasPendingDatagrams() && ! qusB.waitForReadyRead(2000))
+		return QByteArray();
+
+	QByteArray qba;
+	qba.resize(static_cast<int>(qusB.pendingDatagramSize()));
+	qusB.readDatagram(qba.data(), qba.size());
+	return qba;
+}
+
+void TestRelay::initTestCase() {
+	QVERIFY(qusA.bind(QHostAddress(QHostAddress::LocalHost), 0));
+	QVERIFY(qusB.bind(QHostAddress(QHostAddress::LocalHost), 0));
+	uiNow = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch() / 1000);
+}
+
+void TestRelay::roundtrip() {
+	RelayCodec a("secret"), b("secret");
+	const QByteArray payload("voice packet");
+
+	const QByteArray qba = exchange(seal(a, RelayCodec::Voice, uiNow, payload));
+	QVERIFY(! qba.isEmpty());
+
+	RelayCodec::Type type = RelayCodec::Announce;
+	quint32 node = 0;
+	const int offset = b.open(qba.constData(), qba.size(), uiNow, type, node);
+	QVERIFY(offset > 0);
+	QCOMPARE(type, RelayCodec::Voice);
+	QCOMPARE(node, a.node());
+	QCOMPARE(qba.mid(offset, qba.size() - RELAY_TAG_LENGTH - offset), payload);
+}
+
+void TestRelay::replay() {
+	RelayCodec a("secret"), b("secret");
+	RelayCodec::Type type;
+	quint32 node;
+
+	const QByteArray qba = exchange(seal(a, RelayCodec::Voice, uiNow, "x"));
+	QVERIFY(b.open(qba.constData(), qba.size(), uiNow, type, node) > 0);
+	QCOMPARE(b.open(qba.constData(), qba.size(), uiNow, type, node), -1);
+	QCOMPARE(b.open(qba.constData(), qba.size(), uiNow + 1, type, node), -1);
+}
+
+void TestRelay::reorder() {
+	RelayCodec a("secret"), b("secret");
+	RelayCodec::Type type;
+	quint32 node;
+
+	QList<QByteArray> ql;
+	for (int i = 0; i < 3; ++i)
+		ql << exchange(seal(a, RelayCodec::Voice, uiNow, "x"));
+
+	QVERIFY(b.open(ql.at(2).constData(), ql.at(2).size(), uiNow, type, node) > 0);
+	QVERIFY(b.open(ql.at(0).constData(), ql.at(0).size(), uiNow, type, node) > 0);
+	QVERIFY(b.open(ql.at(1).constData(), ql.at(1).size(), uiNow, type, node) > 0);
+	QCOMPARE(b.open(ql.at(0).constData(), ql.at(0).size(), uiNow, type, node), -1);
+}
+
+void TestRelay::window() {
+	RelayCodec a("secret"), b("secret");
+	RelayCodec::Type type;
+	quint32 node;
+
+	const QByteArray first = exchange(seal(a, RelayCodec::Voice, uiNow, "x"));
+	QByteArray last;
+	for (int i = 0; i < RELAY_REPLAY_WINDOW; ++i)
+		last = seal(a, RelayCodec::Voice, uiNow, "x");
+	last = exchange(last);
+
+	QVERIFY(b.open(last.constData(), last.size(), uiNow, type, node) > 0);
+	QCOMPARE(b.open(first.constData(), first.size(), uiNow, type, node), -1);
+}
+
+void TestRelay::tamper() {
+	RelayCodec a("secret"), b("secret");
+	RelayCodec::Type type;
+	quint32 node;
+
+	const QByteArray qba = exchange(seal(a, RelayCodec::Voice, uiNow, "voice packet"));
+	for (int i = 0; i < qba.size(); ++i) {
+		QByteArray bad = qba;
+		bad[i] = static_cast<char>(bad.at(i) ^ 0x01);
+		QCOMPARE(b.open(bad.constData(), bad.size(), uiNow, type, node), -1);
+	}
+	QCOMPARE(b.open(qba.constData(), qba.size() - 1, uiNow, type, node), -1);
+	QVERIFY(b.open(qba.constData(), qba.size(), uiNow, type, node) > 0);
+}
+
+void TestRelay::secret() {
+	RelayCodec a("secret"), b("other");
+	RelayCodec::Type type;
+	quint32 node;
+
+	const QByteArray qba = exchange(seal(a, RelayCodec::Announce, uiNow, "x"));
+	QCOMPARE(b.open(qba.constData(), qba.size(), uiNow, type, node), -1);
+}
+
+void TestRelay::skew() {
+	RelayCodec a("secret"), b("secret");
+	RelayCodec::Type type;
+	quint32 node;
+
+	const QByteArray late = exchange(seal(a, RelayCodec::Voice, uiNow - RELAY_MAX_SKEW - 1, "x"));
+	QCOMPARE(b.open(late.constData(), late.size(), uiNow, type, node), -1);
+
+	const QByteArray early = exchange(seal(a, RelayCodec::Voice, uiNow + RELAY_MAX_SKEW + 1, "x"));
+	QCOMPARE(b.open(early.constData(), early.size(), uiNow, type, node), -1);
+
+	const QByteArray ok = exchange(seal(a, RelayCodec::Voice, uiNow - RELAY_MAX_SKEW, "x"));
+	QVERIFY(b.open(ok.constData(), ok.size(), uiNow, type, node) > 0);
+}
+
+void TestRelay::ownNode() {
+	RelayCodec a("secret");
+	RelayCodec::Type type;
+	quint32 node;
+
+	const QByteArray qba = exchange(seal(a, RelayCodec::Voice, uiNow, "x"));
+	QCOMPARE(a.open(qba.constData(), qba.size(), uiNow, type, node), -1);
+}
+
+QTEST_MAIN(TestRelay)
+#include "TestRelay.moc"
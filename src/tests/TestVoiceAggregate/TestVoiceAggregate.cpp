@@ -0,0 +1,132 @@
+// Copyright 2005-2018 The Mumble Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file at the root of the
+// Mumble source tree or at <https://www.mumble.info/LICENSE>.
+
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+#include "PacketDataStream.h"
+#include "Message.h"
+#include "VoiceAggregate.h"
+
+class TestVoiceAggregate : public QObject {
+		Q_OBJECT
+	protected:
+		static QByteArray voicePacket(unsigned int session, unsigned int seq, int payload);
+		static QList<QByteArray> split(const char *data, int len);
+	private slots:
+		void single();
+		void roundtrip();
+		void full();
+		void oversize();
+		void malformed();
+};
+
+// A voice packet as the server forwards it: header, session, sequence
+// number, Opus length and payload.
+QByteArray TestVoiceAggregate::voicePacket(unsigned int session, unsigned int seq, int payload) {
+	char buffer[VOICE_AGGREGATE_SIZE];
+	PacketDataStream pds(buffer + 1, VOICE_AGGREGATE_SIZE - 1);
+	const QByteArray data(payload, static_cast<char>(session));
+
+	buffer[0] = static_cast<char>(MessageHandler::UDPVoiceOpus << 5);
+	pds << session << seq << payload;
+	pds.append(data.constData(), data.size());
+
+	return QByteArray(buffer, pds.size() + 1);
+}
+
+QList<QByteArray> TestVoiceAggregate::split(const char *data, int len) {
+	QList<QByteArray> ql;
+	PacketDataStream pds(data + 1, len - 1);
+	const char *packet;
+	int plen;
+
+	while ((plen = VoiceAggregate::next(pds, packet)) > 0)
+		ql << QByteArray(packet, plen);
+	return ql;
+}
+
+void TestVoiceAggregate::single() {
+	VoiceAggregate va;
+	va.clear();
+
+	const QByteArray qba = voicePacket(1, 0, 60);
+	QVERIFY(va.add(qba.constData(), qba.size()));
+	QCOMPARE(QByteArray(va.datagram(), va.datagramLength()), qba);
+}
+
+void TestVoiceAggregate::roundtrip() {
+	VoiceAggregate va;
+	va.clear();
+
+	QList<QByteArray> in;
+	for (unsigned int i = 1; i <= 8; ++i) {
+		// Both one and two byte lengths.
+		in << voicePacket(i, i * 3, (i % 2) ? 20 : 130);
+		QVERIFY(va.add(in.last().constData(), in.last().size()));
+	}
+
+	QCOMPARE(va.iFrames, in.count());
+	QCOMPARE(static_cast<MessageHandler::UDPMessageType>((va.datagram()[0] >> 5) & 0x7), MessageHandler::UDPVoiceAggregate);
+	QCOMPARE(split(va.datagram(), va.datagramLength()), in);
+}
+
+void TestVoiceAggregate::full() {
+	VoiceAggregate va;
+	va.clear();
+
+	QList<QByteArray> in;
+	QByteArray qba;
+	for (unsigned int i = 1; ; ++i) {
+		qba = voicePacket(i, i, 100);
+		if (! va.add(qba.constData(), qba.size()))
+			break;
+		in << qba;
+	}
+
+	// The packet that didn't fit left the aggregate alone.
+	QVERIFY(va.datagramLength() <= VOICE_AGGREGATE_SIZE);
+	QVERIFY(va.datagramLength() + qba.size() + 2 > VOICE_AGGREGATE_SIZE);
+	QCOMPARE(split(va.datagram(), va.datagramLength()), in);
+
+	// It starts the next one.
+	va.clear();
+	QVERIFY(va.add(qba.constData(), qba.size()));
+	QCOMPARE(QByteArray(va.datagram(), va.datagramLength()), qba);
+}
+
+void TestVoiceAggregate::oversize() {
+	VoiceAggregate va;
+	va.clear();
+
+	QVERIFY(VoiceAggregate::fits(VOICE_AGGREGATE_SIZE - 3));
+	QVERIFY(! VoiceAggregate::fits(VOICE_AGGREGATE_SIZE - 2));
+
+	const QByteArray qba(VOICE_AGGREGATE_SIZE - 3, 'x');
+	QVERIFY(va.add(qba.constData(), qba.size()));
+	QVERIFY(! va.add("y", 1));
+}
+
+void TestVoiceAggregate::malformed() {
+	VoiceAggregate va;
+	va.clear();
+
+	const QByteArray a = voicePacket(1, 1, 40);
+	const QByteArray b = voicePacket(2, 1, 40);
+	QVERIFY(va.add(a.constData(), a.size()));
+	QVERIFY(va.add(b.constData(), b.size()));
+
+	// Cut off in the middle of the second packet.
+	QList<QByteArray> ql = split(va.datagram(), va.datagramLength() - 10);
+	QCOMPARE(ql.count(), 1);
+	QCOMPARE(ql.first(), a);
+
+	// A zero length stops the split.
+	char zero[3] = { static_cast<char>(MessageHandler::UDPVoiceAggregate << 5), 0, 0 };
+	QVERIFY(split(zero, sizeof(zero)).isEmpty());
+}
+
+QTEST_MAIN(TestVoiceAggregate)
+#include "TestVoiceAggregate.moc"
@@ -7,6 +7,11 @@ TEMPLATE = subdirs
 
 SUBDIRS += \
   TestCrypt \
+  CryptBenchmark \
+  MurmurBenchmark \
+  FanOut \
+  Aggregate \
+  TestACLCache \
   TestCryptographicHash \
   TestCryptographicRandom \
   TestPacketDataStream \
@@ -19,4 +24,6 @@ SUBDIRS += \
   TestSelfSignedCertificate \
   TestSSLLocks \
   TestFFDHE \
+  TestRelay \
+  TestVoiceAggregate \
   TestStdAbs